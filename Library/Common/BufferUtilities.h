@@ -0,0 +1,61 @@
+#ifndef LIBRARY_BUFFERUTILITIES_H
+#define LIBRARY_BUFFERUTILITIES_H
+
+#include <algorithm>
+#include <vector>
+
+#include "tbb/enumerable_thread_specific.h"
+
+#include "Common.h"
+
+///////////////////////////////////
+//
+// BufferUtilities.h
+// Ryan Goldade 2017
+//
+// Helpers for std::vector buffers that
+// are emptied and refilled every timestep
+// so they stop reallocating once they've
+// grown to fit the scene.
+//
+////////////////////////////////////
+
+// Makes room for size elements in a buffer that's refilled every timestep. Assigning to or
+// inserting into an emptied vector only allocates exactly what's needed, so a buffer that creeps
+// up a little every timestep would reallocate every time. Growing to twice the size avoids that.
+template<typename T>
+void reserveWithHeadroom(std::vector<T>& buffer, std::size_t size)
+{
+	if (buffer.capacity() < size)
+		buffer.reserve(2 * size);
+}
+
+// Appends the thread-local lists to the list and empties them. How the work is split over the
+// threads changes from call to call, so each local list is given room for twice the largest one
+// and they stop growing once they've seen a few splits.
+template<typename T>
+void gatherLocalLists(tbb::enumerable_thread_specific<std::vector<T>>& localLists, std::vector<T>& list)
+{
+	std::size_t listSize = list.size();
+	std::size_t largestList = 0;
+
+	for (auto& localList : localLists)
+	{
+		listSize += localList.size();
+		largestList = std::max(largestList, localList.size());
+	}
+
+	reserveWithHeadroom(list, listSize);
+
+	for (auto& localList : localLists)
+		list.insert(list.end(), localList.begin(), localList.end());
+
+	for (auto& localList : localLists)
+	{
+		localList.clear();
+		if (localList.capacity() < largestList)
+			localList.reserve(2 * largestList);
+	}
+}
+
+#endif
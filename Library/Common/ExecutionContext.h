@@ -0,0 +1,250 @@
+#ifndef LIBRARY_EXECUTIONCONTEXT_H
+#define LIBRARY_EXECUTIONCONTEXT_H
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "tbb/tbb.h"
+
+#include "Common.h"
+
+///////////////////////////////////
+//
+// ExecutionContext.h
+// Ryan Goldade 2017
+//
+// The threads a simulation runs on. Every
+// parallel kernel in the library is a
+// tbb::parallel_for/reduce, and those
+// always run in the task arena of the
+// thread that calls them. Running a
+// simulator inside execute() therefore
+// keeps all of its kernels on the
+// context's threads. Eigen's OpenMP loops
+// are limited to the same thread count.
+//
+// Several contexts with thread counts that
+// add up to the machine let simulations
+// share it without oversubscription. A
+// context can also be pinned to a list of
+// CPUs (Linux only) or bound to a NUMA node.
+// NUMA binding needs TBB's hwloc support
+// (tbbbind). Without it the node isn't
+// listed by TBB, so the request is reported
+// and ignored.
+//
+// Grid storage is first touched in parallel
+// by the calling arena (see UniformGrid), so
+// grids allocated inside execute() have
+// their pages on the context's NUMA node.
+//
+////////////////////////////////////
+
+class ExecutionContext
+{
+public:
+
+	// A thread count of 0 uses one thread per listed CPU, or every hardware thread if there is no
+	// CPU list. A NUMA node of -1 and an empty CPU list leave thread placement to the OS.
+	explicit ExecutionContext(unsigned threadCount = 0, int numaNode = -1, const std::vector<unsigned>& cpus = std::vector<unsigned>())
+		: myNumaNode(-1)
+	{
+		if (threadCount == 0)
+			threadCount = cpus.empty() ? unsigned(tbb::this_task_arena::max_concurrency()) : unsigned(cpus.size());
+
+		myThreadCount = std::max(threadCount, 1u);
+
+		if (numaNode >= 0)
+		{
+#if TBB_VERSION_MAJOR >= 2021
+			std::vector<tbb::numa_node_id> nodes = tbb::info::numa_nodes();
+			if (std::find(nodes.begin(), nodes.end(), numaNode) != nodes.end())
+				myNumaNode = numaNode;
+			else
+#endif
+				std::cerr << "NUMA node " << numaNode << " is not available to TBB. Threads are not bound to a node." << std::endl;
+		}
+
+#if TBB_VERSION_MAJOR >= 2021
+		if (myNumaNode >= 0)
+			myArena.initialize(tbb::task_arena::constraints(myNumaNode, int(myThreadCount)));
+		else
+#endif
+			myArena.initialize(int(myThreadCount));
+
+		if (!cpus.empty())
+		{
+#if defined(__linux__) && TBB_VERSION_MAJOR >= 2021
+			myPinner = std::make_unique<CPUPinner>(myArena, cpus);
+			if (myPinner->isPinning())
+				myCPUs = cpus;
+			else
+			{
+				myPinner.reset();
+				std::cerr << "None of the requested CPUs are available. Threads are not pinned." << std::endl;
+			}
+#else
+			std::cerr << "CPU pinning is not supported on this platform. Threads are not pinned." << std::endl;
+#endif
+		}
+	}
+
+	ExecutionContext(const ExecutionContext&) = delete;
+	ExecutionContext& operator=(const ExecutionContext&) = delete;
+
+	// Runs func inside the context and returns its result. The caller blocks until it's done.
+	// Any thread can call this, including several at once (e.g. a simulation and its frame writers),
+	// and they share the context's threads.
+	template<typename Func>
+	auto execute(const Func& func) -> decltype(func())
+	{
+		unsigned threadCount = myThreadCount;
+		return myArena.execute([&]() -> decltype(func())
+		{
+			// The arena may hand func to one of its workers, so the OpenMP limit is set on whichever
+			// thread runs it
+			OpenMPThreadLimit ompLimit(threadCount);
+			return func();
+		});
+	}
+
+	unsigned threadCount() const { return myThreadCount; }
+
+	// -1 if the context isn't bound to a node
+	int numaNode() const { return myNumaNode; }
+
+	// Empty if the threads aren't pinned
+	const std::vector<unsigned>& cpus() const { return myCPUs; }
+
+	// Parses a Linux style CPU list, e.g. "0-15,32-47". Returns an empty list if it's malformed.
+	static std::vector<unsigned> parseCPUList(const std::string& list)
+	{
+		std::vector<unsigned> cpus;
+
+		std::stringstream stream(list);
+		std::string token;
+		while (std::getline(stream, token, ','))
+		{
+			if (token.empty() || !std::isdigit(static_cast<unsigned char>(token[0])))
+				return std::vector<unsigned>();
+
+			unsigned first, last;
+			char dash, extra;
+			std::stringstream range(token);
+
+			if (range >> first)
+			{
+				last = first;
+				if (range >> dash && (dash != '-' || !(range >> last) || last < first))
+					return std::vector<unsigned>();
+				if (range >> extra || last >= MAXCPUS)
+					return std::vector<unsigned>();
+			}
+			else return std::vector<unsigned>();
+
+			for (unsigned cpu = first; cpu <= last; ++cpu)
+				cpus.push_back(cpu);
+		}
+
+		std::sort(cpus.begin(), cpus.end());
+		cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+
+		return cpus;
+	}
+
+private:
+
+	static constexpr unsigned MAXCPUS = 1 << 16;
+
+	// Sets the OpenMP thread count of the current thread, which Eigen reads unless Eigen::setNbThreads
+	// has been called, and restores it afterwards
+	class OpenMPThreadLimit
+	{
+	public:
+#ifdef _OPENMP
+		OpenMPThreadLimit(unsigned threadCount) : myPreviousCount(omp_get_max_threads()) { omp_set_num_threads(int(threadCount)); }
+		~OpenMPThreadLimit() { omp_set_num_threads(myPreviousCount); }
+	private:
+		int myPreviousCount;
+#else
+		OpenMPThreadLimit(unsigned) {}
+#endif
+	};
+
+#if defined(__linux__) && TBB_VERSION_MAJOR >= 2021
+	// Pins every thread that joins the arena to the CPU set and puts its old mask back when it leaves.
+	// Worker threads move between arenas, so they must not keep the pinning.
+	class CPUPinner : public tbb::task_scheduler_observer
+	{
+	public:
+		CPUPinner(tbb::task_arena& arena, const std::vector<unsigned>& cpus)
+			: tbb::task_scheduler_observer(arena)
+			, myIsPinning(false)
+		{
+			cpu_set_t allowed;
+			CPU_ZERO(&allowed);
+			sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+
+			CPU_ZERO(&myMask);
+			for (unsigned cpu : cpus)
+			{
+				if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+				{
+					CPU_SET(cpu, &myMask);
+					myIsPinning = true;
+				}
+			}
+
+			if (myIsPinning)
+				observe(true);
+		}
+
+		~CPUPinner() { observe(false); }
+
+		bool isPinning() const { return myIsPinning; }
+
+		void on_scheduler_entry(bool) override
+		{
+			sched_getaffinity(0, sizeof(cpu_set_t), &myPreviousMasks.local());
+			sched_setaffinity(0, sizeof(cpu_set_t), &myMask);
+		}
+
+		void on_scheduler_exit(bool) override
+		{
+			sched_setaffinity(0, sizeof(cpu_set_t), &myPreviousMasks.local());
+		}
+
+	private:
+		cpu_set_t myMask;
+		bool myIsPinning;
+
+		tbb::enumerable_thread_specific<cpu_set_t> myPreviousMasks;
+	};
+#else
+	class CPUPinner {};
+#endif
+
+	unsigned myThreadCount;
+	int myNumaNode;
+	std::vector<unsigned> myCPUs;
+
+	tbb::task_arena myArena;
+
+	// Declared after the arena so it stops observing before the arena goes away
+	std::unique_ptr<CPUPinner> myPinner;
+};
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef LIBRARY_GRIDSNAPSHOT_H
+#define LIBRARY_GRIDSNAPSHOT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+	// Keeps Windows.h from defining min and max macros over std::min and std::max
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <Windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include "Common.h"
+#include "Transform.h"
+#include "Vec.h"
+
+///////////////////////////////////
+//
+// GridSnapshot.h
+// Ryan Goldade 2017
+//
+// Binary snapshot format for grids and
+// particles. A fixed size header holds
+// the transform, sample type and sizes,
+// followed by up to two raw blocks of
+// samples in UniformGrid storage order.
+// Blocks are aligned so that a mapped
+// file can be read in place.
+//
+// Files are written with one write per
+// block and read back through mmap, so
+// post-processing can read the samples
+// straight from the page cache without
+// a copy.
+//
+////////////////////////////////////
+
+namespace SnapshotSettings
+{
+	enum class Kind : uint32_t { SCALARGRID, VECTORGRID, LEVELSET, PARTICLES, VALUES };
+
+	static constexpr unsigned MAXBLOCKS = 2;
+
+	// Block alignment in bytes
+	static constexpr uint64_t ALIGNMENT = 64;
+
+	static constexpr uint32_t VERSION = 1;
+}
+
+struct SnapshotHeader
+{
+	SnapshotHeader()
+	{
+		std::memset(static_cast<void*>(this), 0, sizeof(SnapshotHeader));
+		std::memcpy(magic, "2DFSNAP", 8);
+		version = SnapshotSettings::VERSION;
+	}
+
+	char magic[8];
+	uint32_t version;
+
+	SnapshotSettings::Kind kind;
+
+	// Sample and border type of the grid, cast from the grid's enums
+	uint32_t sampleType;
+	uint32_t borderType;
+
+	// Size in bytes of one sample, to catch reading a block as the wrong type
+	uint32_t valueBytes;
+
+	// Grid size in cells
+	uint32_t gridSize[2];
+
+	// Keeps dx aligned without implicit padding
+	uint32_t pad;
+
+	double dx;
+	double offset[2];
+
+	// Per kind state: narrow band and inversion for level sets, radius, count per cell and
+	// oversampling for particles
+	double parameters[4];
+
+	uint32_t blockCount;
+
+	// Storage size of each block. Particle blocks are (count, 1).
+	uint32_t blockSize[SnapshotSettings::MAXBLOCKS][2];
+
+	// Keeps the offsets aligned without implicit padding
+	uint32_t reserved;
+
+	uint64_t blockOffset[SnapshotSettings::MAXBLOCKS];
+
+	Transform xform() const { return Transform(dx, Vec2R(offset[0], offset[1])); }
+
+	void setXform(const Transform& xform)
+	{
+		dx = xform.dx();
+		offset[0] = xform.offset()[0];
+		offset[1] = xform.offset()[1];
+	}
+};
+
+struct SnapshotBlock
+{
+	const void* data;
+	Vec2ui size;
+};
+
+// Writes the header followed by the blocks. The block sizes and offsets in the header are filled in here.
+inline bool writeSnapshot(const std::string& filename, SnapshotHeader header, const std::vector<SnapshotBlock>& blocks)
+{
+	assert(blocks.size() <= SnapshotSettings::MAXBLOCKS);
+
+	auto alignOffset = [](uint64_t offset) { return (offset + SnapshotSettings::ALIGNMENT - 1) / SnapshotSettings::ALIGNMENT * SnapshotSettings::ALIGNMENT; };
+
+	header.blockCount = uint32_t(blocks.size());
+
+	uint64_t offset = alignOffset(sizeof(SnapshotHeader));
+	for (unsigned block = 0; block < blocks.size(); ++block)
+	{
+		header.blockSize[block][0] = blocks[block].size[0];
+		header.blockSize[block][1] = blocks[block].size[1];
+		header.blockOffset[block] = offset;
+
+		offset = alignOffset(offset + uint64_t(blocks[block].size[0]) * blocks[block].size[1] * header.valueBytes);
+	}
+
+	std::FILE* file = std::fopen(filename.c_str(), "wb");
+	if (!file)
+	{
+		std::cerr << "Failed to write to file: " << filename << std::endl;
+		return false;
+	}
+
+	static const char padding[SnapshotSettings::ALIGNMENT] = {};
+
+	bool success = std::fwrite(&header, sizeof(SnapshotHeader), 1, file) == 1;
+	uint64_t written = sizeof(SnapshotHeader);
+
+	for (unsigned block = 0; block < blocks.size() && success; ++block)
+	{
+		uint64_t paddingBytes = header.blockOffset[block] - written;
+		success &= std::fwrite(padding, 1, paddingBytes, file) == paddingBytes;
+
+		uint64_t bytes = uint64_t(blocks[block].size[0]) * blocks[block].size[1] * header.valueBytes;
+		if (bytes > 0)
+			success &= std::fwrite(blocks[block].data, 1, bytes, file) == bytes;
+
+		written = header.blockOffset[block] + bytes;
+	}
+
+	success &= std::fclose(file) == 0;
+
+	if (!success)
+		std::cerr << "Failed to write to file: " << filename << std::endl;
+
+	return success;
+}
+
+// Read-only memory map of a snapshot file. The blocks point into the mapping and are only valid
+// while the snapshot is alive.
+class MappedSnapshot
+{
+public:
+	MappedSnapshot(const std::string& filename)
+		: myData(nullptr)
+		, myBytes(0)
+	{
+#ifdef _MSC_VER
+		myFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		myMapping = nullptr;
+		if (myFile != INVALID_HANDLE_VALUE)
+		{
+			LARGE_INTEGER fileSize;
+			if (GetFileSizeEx(myFile, &fileSize) && fileSize.QuadPart > 0)
+			{
+				myMapping = CreateFileMappingA(myFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (myMapping)
+				{
+					myData = static_cast<const char*>(MapViewOfFile(myMapping, FILE_MAP_READ, 0, 0, 0));
+					myBytes = uint64_t(fileSize.QuadPart);
+				}
+			}
+		}
+#else
+		int file = open(filename.c_str(), O_RDONLY);
+		if (file >= 0)
+		{
+			struct stat fileStat;
+			if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0)
+			{
+				void* mapping = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+				if (mapping != MAP_FAILED)
+				{
+					myData = static_cast<const char*>(mapping);
+					myBytes = uint64_t(fileStat.st_size);
+				}
+			}
+			// The mapping stays valid after the descriptor is closed
+			close(file);
+		}
+#endif
+
+		if (!isValid())
+			std::cerr << "Failed to read snapshot: " << filename << std::endl;
+	}
+
+	~MappedSnapshot()
+	{
+#ifdef _MSC_VER
+		if (myData) UnmapViewOfFile(myData);
+		if (myMapping) CloseHandle(myMapping);
+		if (myFile != INVALID_HANDLE_VALUE) CloseHandle(myFile);
+#else
+		if (myData) munmap(const_cast<char*>(myData), myBytes);
+#endif
+	}
+
+	MappedSnapshot(const MappedSnapshot&) = delete;
+	MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+	// Checks the magic string and version and that every block is inside of the file. The sizes come
+	// from the file so the block extents are checked without overflowing.
+	bool isValid() const
+	{
+		if (!myData || myBytes < sizeof(SnapshotHeader)) return false;
+
+		const SnapshotHeader& snapshotHeader = header();
+		if (std::memcmp(snapshotHeader.magic, "2DFSNAP", 8) != 0) return false;
+		if (snapshotHeader.version != SnapshotSettings::VERSION) return false;
+		if (snapshotHeader.blockCount > SnapshotSettings::MAXBLOCKS) return false;
+
+		for (unsigned block = 0; block < snapshotHeader.blockCount; ++block)
+		{
+			uint64_t samples = uint64_t(snapshotHeader.blockSize[block][0]) * snapshotHeader.blockSize[block][1];
+			if (snapshotHeader.valueBytes > 0 && samples > std::numeric_limits<uint64_t>::max() / snapshotHeader.valueBytes)
+				return false;
+
+			uint64_t offset = snapshotHeader.blockOffset[block];
+			if (offset > myBytes || blockBytes(block) > myBytes - offset)
+				return false;
+		}
+
+		return true;
+	}
+
+	const SnapshotHeader& header() const { return *reinterpret_cast<const SnapshotHeader*>(myData); }
+
+	Vec2ui blockSize(unsigned block) const
+	{
+		assert(block < header().blockCount);
+		return Vec2ui(header().blockSize[block][0], header().blockSize[block][1]);
+	}
+
+	// Samples of a block in UniformGrid order, i.e. sample (i, j) is at j + size[1] * i
+	template<typename T>
+	const T* block(unsigned block) const
+	{
+		assert(block < header().blockCount);
+		assert(header().valueBytes == sizeof(T));
+		return reinterpret_cast<const T*>(myData + header().blockOffset[block]);
+	}
+
+	uint64_t blockBytes(unsigned block) const
+	{
+		return uint64_t(header().blockSize[block][0]) * header().blockSize[block][1] * header().valueBytes;
+	}
+
+	// Copies a block into storage that was already sized to match it
+	template<typename T>
+	bool copyBlock(unsigned blockIndex, T* destination, const Vec2ui& size) const
+	{
+		if (blockIndex >= header().blockCount || header().valueBytes != sizeof(T) || !(blockSize(blockIndex) == size))
+			return false;
+
+		if (blockBytes(blockIndex) > 0)
+			std::memcpy(destination, block<T>(blockIndex), blockBytes(blockIndex));
+		return true;
+	}
+
+private:
+
+	const char* myData;
+	uint64_t myBytes;
+
+#ifdef _MSC_VER
+	HANDLE myFile;
+	HANDLE myMapping;
+#endif
+};
+
+#endif
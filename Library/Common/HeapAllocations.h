@@ -0,0 +1,88 @@
+#ifndef LIBRARY_HEAPALLOCATIONS_H
+#define LIBRARY_HEAPALLOCATIONS_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "Common.h"
+
+///////////////////////////////////
+//
+// HeapAllocations.h
+// Ryan Goldade 2017
+//
+// Counts every allocation made through
+// the global operator new, which covers
+// the grids, meshes, std containers and
+// solver storage of the library. Unlike
+// the grid allocation count this shows
+// whether a whole timestep runs out of
+// persistent buffers.
+//
+// The counting operators replace the
+// default ones, so they're only compiled
+// into the one source file of an
+// executable that defines
+// COUNT_HEAP_ALLOCATIONS before including
+// anything. Everywhere else the count
+// stays at zero and isCountingHeapAllocations
+// returns false.
+//
+////////////////////////////////////
+
+inline std::atomic<unsigned long long>& heapAllocationCounter()
+{
+	static std::atomic<unsigned long long> counter(0);
+	return counter;
+}
+
+inline std::atomic<bool>& heapAllocationCountingFlag()
+{
+	static std::atomic<bool> isCounting(false);
+	return isCounting;
+}
+
+inline unsigned long long heapAllocationCount() { return heapAllocationCounter().load(); }
+
+inline bool isCountingHeapAllocations() { return heapAllocationCountingFlag().load(); }
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+
+// Flags the count as live before main runs
+static const bool heapAllocationCountingEnabled = (heapAllocationCountingFlag() = true);
+
+inline void* countedHeapAllocation(std::size_t size)
+{
+	++heapAllocationCounter();
+
+	void* pointer = std::malloc(size > 0 ? size : 1);
+	if (pointer == nullptr) throw std::bad_alloc();
+	return pointer;
+}
+
+void* operator new(std::size_t size) { return countedHeapAllocation(size); }
+void* operator new[](std::size_t size) { return countedHeapAllocation(size); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	try { return countedHeapAllocation(size); }
+	catch (...) { return nullptr; }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	try { return countedHeapAllocation(size); }
+	catch (...) { return nullptr; }
+}
+
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete[](void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, const std::nothrow_t&) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept { std::free(pointer); }
+
+#endif
+
+#endif
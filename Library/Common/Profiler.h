@@ -0,0 +1,295 @@
+#ifndef LIBRARY_PROFILER_H
+#define LIBRARY_PROFILER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+
+///////////////////////////////////
+//
+// Profiler.h
+// Ryan Goldade 2017
+//
+// Scoped profiling zones. PROFILE_ZONE
+// times the rest of the enclosing scope
+// with steady_clock and records it in a
+// ring buffer owned by the calling
+// thread, so recording never takes a
+// lock. Zones nest per thread.
+//
+// Between frames, collect() drains every
+// thread's buffer. The events can then be
+// written as a Chrome trace (load it in
+// chrome://tracing) or as a JSON summary
+// with the time spent in every zone path.
+//
+// Zones only exist when the build
+// defines PROFILING (the PROFILING CMake
+// option). Otherwise PROFILE_ZONE expands
+// to nothing.
+//
+////////////////////////////////////
+
+namespace ProfilerSettings
+{
+	// Events kept per thread between collections. Older events are overwritten.
+	static constexpr unsigned RINGSIZE = 1 << 14;
+}
+
+struct ProfileEvent
+{
+	// Zone names must be string literals (or otherwise outlive the profiler)
+	const char* name;
+
+	// Nanoseconds since the profiler started
+	int64_t start;
+	int64_t duration;
+
+	unsigned thread;
+
+	// Number of zones the event is nested in on its thread
+	unsigned depth;
+};
+
+class Profiler
+{
+public:
+
+	static constexpr bool isEnabled()
+	{
+#ifdef PROFILING
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	static int64_t now()
+	{
+		static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	// Nesting depth of the zones open on the calling thread
+	static unsigned& threadDepth()
+	{
+		static thread_local unsigned depth = 0;
+		return depth;
+	}
+
+	static void record(const char* name, int64_t start, int64_t end, unsigned depth)
+	{
+		ThreadBuffer& buffer = threadBuffer();
+
+		uint64_t written = buffer.myWritten.load(std::memory_order_relaxed);
+		buffer.myEvents[written % ProfilerSettings::RINGSIZE] = ProfileEvent{ name, start, end - start, buffer.myThread, depth };
+		buffer.myWritten.store(written + 1, std::memory_order_release);
+	}
+
+	// Drains every thread's events since the last collection, sorted by start time. Call it
+	// while no zones are being recorded, e.g. between frames.
+	static std::vector<ProfileEvent> collect()
+	{
+		std::vector<ProfileEvent> events;
+
+		std::lock_guard<std::mutex> lock(registryMutex());
+		for (const std::unique_ptr<ThreadBuffer>& buffer : registry())
+		{
+			uint64_t written = buffer->myWritten.load(std::memory_order_acquire);
+			uint64_t read = std::max(buffer->myRead, written > ProfilerSettings::RINGSIZE ? written - ProfilerSettings::RINGSIZE : 0);
+
+			for (; read < written; ++read)
+				events.push_back(buffer->myEvents[read % ProfilerSettings::RINGSIZE]);
+
+			buffer->myRead = written;
+		}
+
+		std::sort(events.begin(), events.end(), [](const ProfileEvent& a, const ProfileEvent& b)
+		{
+			return a.start < b.start || (a.start == b.start && a.depth < b.depth);
+		});
+
+		return events;
+	}
+
+	static bool writeChromeTrace(const std::string& filename, const std::vector<ProfileEvent>& events)
+	{
+		std::ofstream writer(filename);
+
+		if (!writer)
+		{
+			std::cerr << "Failed to write to file: " << filename << std::endl;
+			return false;
+		}
+
+		// Chrome traces are in microseconds
+		writer << std::fixed << std::setprecision(3);
+		writer << "{\"traceEvents\":[";
+		for (unsigned eventIndex = 0; eventIndex < events.size(); ++eventIndex)
+		{
+			const ProfileEvent& event = events[eventIndex];
+			writer << (eventIndex > 0 ? ",\n" : "\n");
+			writer << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread
+					<< ",\"ts\":" << 1E-3 * double(event.start) << ",\"dur\":" << 1E-3 * double(event.duration) << "}";
+		}
+		writer << "\n]}\n";
+
+		return bool(writer);
+	}
+
+	// Totals for every zone path (e.g. "EulerianLiquid::runTimestep/PressureProjection::project").
+	// Self time excludes the time spent in nested zones on the same thread.
+	static bool writeSummary(const std::string& filename, unsigned frame, const std::vector<ProfileEvent>& events)
+	{
+		std::ofstream writer(filename);
+
+		if (!writer)
+		{
+			std::cerr << "Failed to write to file: " << filename << std::endl;
+			return false;
+		}
+
+		struct ZoneTotals
+		{
+			unsigned calls = 0;
+			int64_t total = 0;
+			int64_t self = 0;
+			int64_t max = 0;
+		};
+
+		std::map<std::string, ZoneTotals> zones;
+
+		// Events are sorted by start so the parents of an event are the open zones on its thread
+		std::map<unsigned, std::vector<std::pair<std::string, const ProfileEvent*>>> openZones;
+		for (const ProfileEvent& event : events)
+		{
+			auto& stack = openZones[event.thread];
+			while (!stack.empty() && (stack.back().second->depth >= event.depth ||
+					stack.back().second->start + stack.back().second->duration <= event.start))
+				stack.pop_back();
+
+			std::string path = stack.empty() ? std::string(event.name) : stack.back().first + "/" + event.name;
+
+			ZoneTotals& totals = zones[path];
+			++totals.calls;
+			totals.total += event.duration;
+			totals.self += event.duration;
+			totals.max = std::max(totals.max, event.duration);
+
+			if (!stack.empty())
+				zones[stack.back().first].self -= event.duration;
+
+			stack.emplace_back(path, &event);
+		}
+
+		writer << std::fixed << std::setprecision(6);
+		writer << "{\n\"frame\": " << frame << ",\n\"zones\": [";
+
+		bool isFirst = true;
+		for (const auto& zone : zones)
+		{
+			writer << (isFirst ? "\n" : ",\n");
+			writer << "{\"path\": \"" << zone.first << "\", \"calls\": " << zone.second.calls
+					<< ", \"total_ms\": " << 1E-6 * double(zone.second.total)
+					<< ", \"self_ms\": " << 1E-6 * double(zone.second.self)
+					<< ", \"max_ms\": " << 1E-6 * double(zone.second.max) << "}";
+			isFirst = false;
+		}
+		writer << "\n]\n}\n";
+
+		return bool(writer);
+	}
+
+private:
+
+	struct ThreadBuffer
+	{
+		ThreadBuffer(unsigned thread)
+			: myEvents(ProfilerSettings::RINGSIZE)
+			, myWritten(0)
+			, myRead(0)
+			, myThread(thread)
+		{}
+
+		std::vector<ProfileEvent> myEvents;
+		std::atomic<uint64_t> myWritten;
+
+		// Only touched by collect under the registry lock
+		uint64_t myRead;
+
+		unsigned myThread;
+	};
+
+	// Buffers outlive their threads so events from finished threads can still be collected
+	static std::vector<std::unique_ptr<ThreadBuffer>>& registry()
+	{
+		static std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+		return buffers;
+	}
+
+	static std::mutex& registryMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	static ThreadBuffer& threadBuffer()
+	{
+		static thread_local ThreadBuffer* buffer = nullptr;
+		if (!buffer)
+		{
+			std::lock_guard<std::mutex> lock(registryMutex());
+			registry().push_back(std::make_unique<ThreadBuffer>(unsigned(registry().size())));
+			buffer = registry().back().get();
+		}
+
+		return *buffer;
+	}
+};
+
+class ProfileZone
+{
+public:
+	ProfileZone(const char* name)
+		: myName(name)
+		, myDepth(Profiler::threadDepth()++)
+		, myStart(Profiler::now())
+	{}
+
+	~ProfileZone()
+	{
+		int64_t end = Profiler::now();
+		--Profiler::threadDepth();
+		Profiler::record(myName, myStart, end, myDepth);
+	}
+
+	ProfileZone(const ProfileZone&) = delete;
+	ProfileZone& operator=(const ProfileZone&) = delete;
+
+private:
+	const char* myName;
+	unsigned myDepth;
+	int64_t myStart;
+};
+
+#define PROFILE_ZONE_JOIN(a, b) PROFILE_ZONE_JOIN_INNER(a, b)
+#define PROFILE_ZONE_JOIN_INNER(a, b) a##b
+
+#ifdef PROFILING
+	#define PROFILE_ZONE(name) ProfileZone PROFILE_ZONE_JOIN(profileZone, __LINE__)(name)
+#else
+	#define PROFILE_ZONE(name)
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef LIBRARY_REDUCTION_H
+#define LIBRARY_REDUCTION_H
+
+#include <atomic>
+
+#include "tbb/tbb.h"
+
+#include "Common.h"
+
+///////////////////////////////////
+//
+// Reduction.h
+// Ryan Goldade 2017
+//
+// Parallel sums with a switch between
+// speed and reproducibility. A plain
+// tbb::parallel_reduce splits the range
+// differently depending on the thread
+// count and on timing, so floating point
+// sums change in the last bits from run
+// to run.
+//
+// In REPRODUCIBLE mode the range is cut
+// into fixed size tiles that only depend
+// on the element count. Each tile is
+// summed by one thread with Kahan
+// compensation and the tiles are combined
+// pairwise in a fixed tree
+// (tbb::parallel_deterministic_reduce), so
+// the result is the same bit for bit at
+// any thread count. FAST mode keeps the
+// plain reduction.
+//
+// The default is FAST unless the build
+// defines REPRODUCIBLE_REDUCTIONS (the
+// REPRODUCIBLE CMake option). Min and max reductions
+// are exact in any order so they don't
+// need this.
+//
+////////////////////////////////////
+
+enum class ReductionMode { FAST, REPRODUCIBLE };
+
+namespace ReductionSettings
+{
+	// Elements per tile in REPRODUCIBLE mode
+	static constexpr unsigned TILESIZE = 4096;
+}
+
+// Compensated running sum. Carries the low order bits lost by each addition.
+class KahanSum
+{
+public:
+	KahanSum() : mySum(0), myCompensation(0) {}
+
+	KahanSum& operator+=(double value)
+	{
+		double correctedValue = value - myCompensation;
+		double newSum = mySum + correctedValue;
+		myCompensation = (newSum - mySum) - correctedValue;
+		mySum = newSum;
+		return *this;
+	}
+
+	double value() const { return mySum; }
+
+private:
+	double mySum, myCompensation;
+};
+
+// Same interface as KahanSum for the FAST path
+class PlainSum
+{
+public:
+	PlainSum() : mySum(0) {}
+
+	PlainSum& operator+=(double value) { mySum += value; return *this; }
+
+	double value() const { return mySum; }
+
+private:
+	double mySum;
+};
+
+class Reduction
+{
+public:
+
+	static ReductionMode mode() { return modeStorage().load(std::memory_order_relaxed); }
+	static void setMode(ReductionMode mode) { modeStorage().store(mode, std::memory_order_relaxed); }
+
+	// Sums over [0, count). The sumRange functor has the form f(unsigned begin, unsigned end, auto& sum)
+	// and adds the terms for its range into sum with +=. It may also write to the elements of its range
+	// (e.g. a fused vector update). The tile size sets how many indices make a tile in REPRODUCIBLE
+	// mode; it must only depend on the problem size (e.g. rows of a grid).
+	template<typename SumRange>
+	static double sum(unsigned count, const SumRange& sumRange, unsigned tileSize = ReductionSettings::TILESIZE)
+	{
+		if (mode() == ReductionMode::REPRODUCIBLE)
+		{
+			return tbb::parallel_deterministic_reduce(tbb::blocked_range<unsigned>(0, count, std::max(tileSize, 1u)), double(0),
+				[&](const tbb::blocked_range<unsigned>& range, double partialSum) -> double
+			{
+				KahanSum tileSum;
+				sumRange(range.begin(), range.end(), tileSum);
+				return partialSum + tileSum.value();
+			},
+				[](double a, double b) -> double { return a + b; },
+				tbb::simple_partitioner());
+		}
+
+		return tbb::parallel_reduce(tbb::blocked_range<unsigned>(0, count), double(0),
+			[&](const tbb::blocked_range<unsigned>& range, double partialSum) -> double
+		{
+			PlainSum rangeSum;
+			sumRange(range.begin(), range.end(), rangeSum);
+			return partialSum + rangeSum.value();
+		},
+			[](double a, double b) -> double { return a + b; });
+	}
+
+private:
+
+	static std::atomic<ReductionMode>& modeStorage()
+	{
+#ifdef REPRODUCIBLE_REDUCTIONS
+		static std::atomic<ReductionMode> mode(ReductionMode::REPRODUCIBLE);
+#else
+		static std::atomic<ReductionMode> mode(ReductionMode::FAST);
+#endif
+		return mode;
+	}
+};
+
+#endif
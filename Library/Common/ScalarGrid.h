@@ -2,16 +2,23 @@
 #define LIBRARY_SCALARGRID_H
 
 #include <algorithm>
+#include <array>
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <type_traits>
+#include <utility>
 
 #include "Common.h"
+#include "GridSnapshot.h"
 #include "Renderer.h"
 #include "Transform.h"
 #include "UniformGrid.h"
 #include "Util.h"
 #include "Vec.h"
 
+#include "tbb/tbb.h"
+
 ///////////////////////////////////
 //
 // ScalarGrid.h
@@ -91,6 +98,23 @@ public:
 	}
 
 	SampleType sampleType() const { return mySampleType; }
+	BorderType borderType() const { return myBorderType; }
+
+	// Size of the sample storage for a grid of gridSize cells
+	static Vec2ui sampleSize(const Vec2ui& gridSize, SampleType sampleType)
+	{
+		switch (sampleType)
+		{
+		case SampleType::XFACE:
+			return gridSize + Vec2ui(1, 0);
+		case SampleType::YFACE:
+			return gridSize + Vec2ui(0, 1);
+		case SampleType::NODE:
+			return gridSize + Vec2ui(1);
+		default:
+			return gridSize;
+		}
+	}
 
 	// Check that the two grids are of the same size, 
 	// positioned at the same spot, have the same grid
@@ -174,9 +198,24 @@ public:
 	void drawSampleGradients(Renderer& renderer, const Vec3f& colour = Vec3f(0, 0, 1), Real length = .25) const;
 	void drawVolumetric(Renderer& renderer, const Vec3f& minColour, const Vec3f& maxColour, T minVal, T maxVal) const;
 
+	// Maps every sample to a colour between minColour and maxColour and hands the renderer a
+	// single image with one texel per sample, drawn with bilinear filtering between samples.
+	// Much cheaper than drawVolumetric for large grids since no per cell primitives are built.
+	void drawColourMap(Renderer& renderer, const Vec3f& minColour, const Vec3f& maxColour, T minVal, T maxVal) const;
+
 	void printAsCSV(std::string filename) const;
 	void printAsOBJ(std::string filename) const;
 
+	// Binary snapshot of the grid (see GridSnapshot.h). Reading replaces the grid, including its
+	// transform and sample type. Returns false if the file isn't a scalar grid of this type, in
+	// which case the grid is left untouched.
+	bool writeSnapshot(const std::string& filename) const;
+	bool readSnapshot(const std::string& filename);
+
+	// Reads the first block of an already mapped snapshot. Classes that wrap a single grid
+	// (e.g. LevelSet2D) store their own kind and parameters in the same header.
+	bool readSnapshot(const MappedSnapshot& snapshot);
+
 private:
 
 	// The main interpolation call after the template specialized clamping passes
@@ -480,6 +519,53 @@ void ScalarGrid<T>::drawVolumetric(Renderer& renderer, const Vec3f& minColour, c
 	renderer.addQuads(quadVertices, pixelQuads, colours);
 }
 
+template<typename T>
+void ScalarGrid<T>::drawColourMap(Renderer& renderer, const Vec3f& minColour, const Vec3f& maxColour, T minVal, T maxVal) const
+{
+	Vec2ui size = this->mySize;
+	RasterImage image(size[0], size[1]);
+
+	unsigned char* texels = image.data();
+
+	// The colour ramp is quantized to bytes anyway so look the colours up in a table
+	static constexpr unsigned RAMPSIZE = 1024;
+	std::vector<std::array<unsigned char, 4>> ramp(RAMPSIZE);
+	for (unsigned entry = 0; entry < RAMPSIZE; ++entry)
+	{
+		float s = float(entry) / float(RAMPSIZE - 1);
+		Vec3f colour = minColour * (1.f - s) + maxColour * s;
+		for (unsigned channel = 0; channel < 3; ++channel)
+			ramp[entry][channel] = (unsigned char)(Util::clamp(colour[channel], 0.f, 1.f) * 255.f + .5f);
+		ramp[entry][3] = 255;
+	}
+
+	Real rampScale = maxVal > minVal ? Real(RAMPSIZE - 1) / Real(maxVal - minVal) : 0;
+
+	// Texel centers sit on the samples. Image rows run from the top so row 0 is the largest j.
+	// The grid is stored by column and the image by row so the transpose is done in tiles.
+	tbb::parallel_for(tbb::blocked_range2d<unsigned>(0, size[0], 64, 0, size[1], 64), [&](const tbb::blocked_range2d<unsigned> &range)
+	{
+		for (unsigned i = range.rows().begin(); i != range.rows().end(); ++i)
+		{
+			const T* column = &this->myGrid[this->flatten(Vec2ui(i, 0))];
+			for (unsigned j = range.cols().begin(); j != range.cols().end(); ++j)
+			{
+				// NaN passes through the clamp so non-finite samples are pinned to the ends of the ramp
+				Real s = Real(column[j] - minVal) * rampScale;
+				if (std::isfinite(s))
+					s = Util::clamp(s, Real(0), Real(RAMPSIZE - 1));
+				else
+					s = s > 0 ? Real(RAMPSIZE - 1) : Real(0);
+
+				unsigned char* texel = texels + 4 * (std::size_t(size[0]) * (size[1] - 1 - j) + i);
+				std::copy(ramp[unsigned(s + .5)].begin(), ramp[unsigned(s + .5)].end(), texel);
+			}
+		}
+	});
+
+	renderer.addImage(std::move(image), indexToWorld(Vec2R(-.5)), indexToWorld(Vec2R(size) - Vec2R(.5)));
+}
+
 template<typename T>
 void ScalarGrid<T>::printAsCSV(std::string filename) const
 {
@@ -548,4 +634,56 @@ void ScalarGrid<T>::printAsOBJ(std::string filename) const
 		std::cerr << "Failed to write to file: " << filename << std::endl;
 }
 
-#endif
\ No newline at end of file
+template<typename T>
+bool ScalarGrid<T>::writeSnapshot(const std::string& filename) const
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Snapshots are raw copies of the samples");
+
+	SnapshotHeader header;
+	header.kind = SnapshotSettings::Kind::SCALARGRID;
+	header.sampleType = uint32_t(mySampleType);
+	header.borderType = uint32_t(myBorderType);
+	header.valueBytes = sizeof(T);
+	header.gridSize[0] = myGridSize[0];
+	header.gridSize[1] = myGridSize[1];
+	header.setXform(myXform);
+
+	return ::writeSnapshot(filename, header, { SnapshotBlock{ this->data(), this->size() } });
+}
+
+template<typename T>
+bool ScalarGrid<T>::readSnapshot(const std::string& filename)
+{
+	MappedSnapshot snapshot(filename);
+	if (!snapshot.isValid() || snapshot.header().kind != SnapshotSettings::Kind::SCALARGRID)
+		return false;
+
+	return readSnapshot(snapshot);
+}
+
+template<typename T>
+bool ScalarGrid<T>::readSnapshot(const MappedSnapshot& snapshot)
+{
+	const SnapshotHeader& header = snapshot.header();
+	if (header.valueBytes != sizeof(T) || header.blockCount != 1)
+		return false;
+
+	// Everything is checked against the header before the grid is replaced
+	if (header.sampleType > uint32_t(SampleType::NODE) || header.borderType > uint32_t(BorderType::ASSERT))
+		return false;
+
+	SampleType sampleType = SampleType(header.sampleType);
+	Vec2ui gridSize(header.gridSize[0], header.gridSize[1]);
+
+	if (!(snapshot.blockSize(0) == sampleSize(gridSize, sampleType)))
+		return false;
+
+	ScalarGrid<T> grid(header.xform(), gridSize, sampleType, BorderType(header.borderType));
+	if (!snapshot.copyBlock(0, grid.data(), grid.size()))
+		return false;
+
+	*this = std::move(grid);
+	return true;
+}
+
+#endif
@@ -1,8 +1,14 @@
 #ifndef LIBRARY_UNIFORMGRID_H
 #define LIBRARY_UNIFORMGRID_H
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <utility>
 #include <vector>
 
+#include "tbb/tbb.h"
+
 #include "Common.h"
 #include "Util.h"
 #include "Vec.h"
@@ -15,8 +21,41 @@
 // Uniform grid class that stores templated values at grid centers
 // Any positioned-based storage here must be accounted for by the caller.
 //
+// Storage is filled in parallel when it's sized or copied, so on a NUMA
+// machine each page is first touched, and placed, near the threads of the
+// calling arena (see ExecutionContext.h).
+//
 ////////////////////////////////////
 
+// Running count of grid storage allocations across every grid type. Grids that are
+// reused at the same size don't allocate, so sampling the count before and after a
+// loop shows whether the buffers inside of it persist.
+inline std::atomic<unsigned long long>& gridAllocationCounter()
+{
+	static std::atomic<unsigned long long> counter(0);
+	return counter;
+}
+
+inline unsigned long long gridAllocationCount() { return gridAllocationCounter().load(); }
+
+// Default-initializes instead of value-initializing, so resizing a vector of trivial
+// types doesn't write to the new buffer from the allocating thread
+template<typename T>
+class FirstTouchAllocator : public std::allocator<T>
+{
+public:
+	template<typename U> struct rebind { using other = FirstTouchAllocator<U>; };
+
+	FirstTouchAllocator() = default;
+	template<typename U> FirstTouchAllocator(const FirstTouchAllocator<U>&) {}
+
+	template<typename U>
+	void construct(U* pointer) { ::new(static_cast<void*>(pointer)) U; }
+
+	template<typename U, typename... Args>
+	void construct(U* pointer, Args&&... args) { ::new(static_cast<void*>(pointer)) U(std::forward<Args>(args)...); }
+};
+
 template <typename T>
 class UniformGrid
 {
@@ -26,13 +65,37 @@ public:
 
 	UniformGrid(const Vec2ui& size) : mySize(size)
 	{
-		myGrid.resize(mySize[0] * mySize[1]);
+		recordAllocation(mySize[0] * mySize[1]);
+		fill(mySize[0] * mySize[1], T());
 	}
 
 	UniformGrid(const Vec2ui& size, const T& val) : mySize(size)
 	{
-		myGrid.resize(mySize[0] * mySize[1], val);
+		recordAllocation(mySize[0] * mySize[1]);
+		fill(mySize[0] * mySize[1], val);
+	}
+
+	UniformGrid(const UniformGrid& grid) : mySize(grid.mySize)
+	{
+		recordAllocation(grid.myGrid.size());
+		copy(grid.myGrid);
+	}
+
+	UniformGrid(UniformGrid&& grid) = default;
+
+	// Copying into a grid of the same size reuses the existing storage
+	UniformGrid& operator=(const UniformGrid& grid)
+	{
+		if (this != &grid)
+		{
+			recordAllocation(grid.myGrid.size());
+			copy(grid.myGrid);
+			mySize = grid.mySize;
+		}
+		return *this;
 	}
+
+	UniformGrid& operator=(UniformGrid&& grid) = default;
 	
 	// Accessor is y-major because the inside loop for most processes is naturally y. Should give better cache coherence.
 	// Clamping should only occur for interpolation. Direct index access that's outside of the grid should
@@ -64,19 +127,23 @@ public:
 	void resize(const Vec2ui& size)
 	{
 		mySize = size;
-		myGrid.clear();
-		myGrid.resize(mySize[0] * mySize[1]);
+		recordAllocation(mySize[0] * mySize[1]);
+		fill(mySize[0] * mySize[1], T());
 	}
 
 	void resize(const Vec2ui& size, const T& val)
 	{
 		mySize = size;
-		myGrid.clear();
-		myGrid.resize(mySize[0] * mySize[1], val);
+		recordAllocation(mySize[0] * mySize[1]);
+		fill(mySize[0] * mySize[1], val);
 	}
 
 	const Vec2ui& size() const { return mySize; }
-		
+
+	// Raw storage in flattened order for kernels that stream through whole rows
+	T* data() { return myGrid.data(); }
+	const T* data() const { return myGrid.data(); }
+
 	unsigned flatten(const Vec2ui& coord) const
 	{
 		assert(coord[0] < mySize[0] && coord[1] < mySize[1]);
@@ -93,8 +160,39 @@ public:
 
 protected:
 
+	void recordAllocation(std::size_t count) const
+	{
+		if (count > myGrid.capacity())
+			++gridAllocationCounter();
+	}
+
+	// Storage is cleared first so a reallocation doesn't move the old values into the new buffer
+	// from this thread. Both keep the existing buffer if it's big enough.
+	void fill(std::size_t count, const T& val)
+	{
+		myGrid.clear();
+		myGrid.resize(count);
+
+		tbb::parallel_for(tbb::blocked_range<std::size_t>(0, count), [&](const tbb::blocked_range<std::size_t> &range)
+		{
+			std::fill(myGrid.begin() + range.begin(), myGrid.begin() + range.end(), val);
+		});
+	}
+
+	template<typename Storage>
+	void copy(const Storage& source)
+	{
+		myGrid.clear();
+		myGrid.resize(source.size());
+
+		tbb::parallel_for(tbb::blocked_range<std::size_t>(0, source.size()), [&](const tbb::blocked_range<std::size_t> &range)
+		{
+			std::copy(source.begin() + range.begin(), source.begin() + range.end(), myGrid.begin() + range.begin());
+		});
+	}
+
 	//Grid center container
-	std::vector<T> myGrid;
+	std::vector<T, FirstTouchAllocator<T>> myGrid;
 	Vec2ui mySize;
 };
 
@@ -1,6 +1,11 @@
 #ifndef LIBRARY_VECTORGRID_H
 #define LIBRARY_VECTORGRID_H
 
+#include <algorithm>
+#include <limits>
+
+#include "tbb/tbb.h"
+
 #include "Common.h"
 #include "ScalarGrid.h"
 #include "Transform.h"
@@ -163,6 +168,12 @@ public:
 	void drawSupersampledValues(Renderer& renderer, Real radius = .5, unsigned samples = 5, unsigned size = 1) const;
 	void drawSamplePointVectors(Renderer& renderer, const Vec3f& colour = Vec3f(0,0,1), Real length = .25) const;
 
+	// Binary snapshot with one block per axis (see GridSnapshot.h). Reading replaces the grid,
+	// including its transform and sample type. A file that isn't a vector grid of this type
+	// leaves the grid untouched.
+	bool writeSnapshot(const std::string& filename) const;
+	bool readSnapshot(const std::string& filename);
+
 private:
 
 	// This method is private to prevent future mistakes between this transform
@@ -284,40 +295,40 @@ void VectorGrid<T>::drawSamplePointVectors(Renderer& renderer, const Vec3f& colo
 	renderer.addLines(startPoints, endPoints, colour);
 }
 
-// Magnitude is useful for CFL conditions
+// Magnitude is useful for CFL conditions. The samples are reduced in parallel over rows.
 template<typename T>
 T VectorGrid<T>::maxMagnitude() const
 {
-	Real max = std::numeric_limits<Real>::min();
-	switch (mySampleType)
+	auto reduceRows = [&](const auto& magnitude2) -> Real
 	{
-	case SampleType::CENTER:
-		
-		forEachVoxelRange(Vec2ui(0), mySize, [&](const Vec2ui& cell)
+		return tbb::parallel_reduce(tbb::blocked_range<unsigned>(0, mySize[0]), std::numeric_limits<Real>::min(),
+			[&](const tbb::blocked_range<unsigned>& range, Real max) -> Real
 		{
-			Real tempmag2 = mag2(Vec<T, 2>(myGrids[0](cell), myGrids[1](cell)));
-				
-			if (max < tempmag2) max = tempmag2;
-		});
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < mySize[1]; ++j)
+				{
+					Real tempmag2 = magnitude2(Vec2ui(i, j));
+					if (max < tempmag2) max = tempmag2;
+				}
 
-		return sqrt(max);
-		break;
+			return max;
+		},
+			[](Real a, Real b) -> Real { return std::max(a, b); });
+	};
 
+	switch (mySampleType)
+	{
+	case SampleType::CENTER:
 	case SampleType::NODE:
 
-		forEachVoxelRange(Vec2ui(0), mySize, [&](const Vec2ui& node)
+		return sqrt(reduceRows([&](const Vec2ui& sample) -> Real
 		{
-			Real tempmag2 = mag2(Vec<T, 2>(myGrids[0](node), myGrids[1](node)));
-
-			if (max < tempmag2) max = tempmag2;
-		});
-
-		return sqrt(max);
-		break;
+			return mag2(Vec<T, 2>(myGrids[0](sample), myGrids[1](sample)));
+		}));
 
 	case SampleType::STAGGERED:
 
-		forEachVoxelRange(Vec2ui(0), mySize, [&](const Vec2ui& cell)
+		return sqrt(reduceRows([&](const Vec2ui& cell) -> Real
 		{
 			Vec2R avgVec(0);
 
@@ -328,16 +339,73 @@ T VectorGrid<T>::maxMagnitude() const
 					avgVec[axis] += .5 * myGrids[axis](face);
 				}
 
-			Real tempmag2 = mag2(avgVec);
-			if (max < tempmag2) max = tempmag2;
-		});
-		
-		return sqrt(max);
-		break;
+			return mag2(avgVec);
+		}));
+
 	default:
 		assert(false);
 	}
 	return T(0);
 }
 
+template<typename T>
+bool VectorGrid<T>::writeSnapshot(const std::string& filename) const
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Snapshots are raw copies of the samples");
+
+	SnapshotHeader header;
+	header.kind = SnapshotSettings::Kind::VECTORGRID;
+	header.sampleType = uint32_t(mySampleType);
+	header.borderType = uint32_t(myGrids[0].borderType());
+	header.valueBytes = sizeof(T);
+	header.gridSize[0] = mySize[0];
+	header.gridSize[1] = mySize[1];
+	header.setXform(myXform);
+
+	return ::writeSnapshot(filename, header, { SnapshotBlock{ myGrids[0].data(), myGrids[0].size() },
+												SnapshotBlock{ myGrids[1].data(), myGrids[1].size() } });
+}
+
+template<typename T>
+bool VectorGrid<T>::readSnapshot(const std::string& filename)
+{
+	MappedSnapshot snapshot(filename);
+	if (!snapshot.isValid())
+		return false;
+
+	const SnapshotHeader& header = snapshot.header();
+	if (header.kind != SnapshotSettings::Kind::VECTORGRID || header.valueBytes != sizeof(T) || header.blockCount != 2)
+		return false;
+
+	// Everything is checked against the header before the grid is replaced
+	if (header.sampleType > uint32_t(SampleType::NODE) || header.borderType > uint32_t(BorderType::ASSERT))
+		return false;
+
+	SampleType sampleType = SampleType(header.sampleType);
+	Vec2ui gridSize(header.gridSize[0], header.gridSize[1]);
+
+	for (unsigned axis : {0, 1})
+	{
+		ScalarSampleType axisSampleType = ScalarSampleType::CENTER;
+		if (sampleType == SampleType::STAGGERED)
+			axisSampleType = axis == 0 ? ScalarSampleType::XFACE : ScalarSampleType::YFACE;
+		else if (sampleType == SampleType::NODE)
+			axisSampleType = ScalarSampleType::NODE;
+
+		if (!(snapshot.blockSize(axis) == ScalarGridT::sampleSize(gridSize, axisSampleType)))
+			return false;
+	}
+
+	VectorGrid<T> grid(header.xform(), gridSize, sampleType, BorderType(header.borderType));
+
+	for (unsigned axis : {0, 1})
+	{
+		if (!snapshot.copyBlock(axis, grid.myGrids[axis].data(), grid.myGrids[axis].size()))
+			return false;
+	}
+
+	*this = std::move(grid);
+	return true;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,331 @@
+#include "RasterImage.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+
+RasterImage::RasterImage(unsigned width, unsigned height, const Vec3f& background)
+	: myWidth(width)
+	, myHeight(height)
+	, myPixels(4 * std::size_t(width) * height)
+{
+	unsigned char backgroundPixel[4] = { 0, 0, 0, 255 };
+	for (unsigned channel = 0; channel < 3; ++channel)
+		backgroundPixel[channel] = (unsigned char)(Util::clamp(background[channel], 0.f, 1.f) * 255.f + .5f);
+
+	for (std::size_t pixel = 0; pixel < std::size_t(width) * height; ++pixel)
+		std::copy(backgroundPixel, backgroundPixel + 4, &myPixels[4 * pixel]);
+}
+
+// Range of pixel indices whose centers (index + .5) are in [min, max], clamped to [0, limit)
+static inline void pixelRange(Real min, Real max, int limit, int& first, int& last)
+{
+	first = std::max(int(std::ceil(min - .5)), 0);
+	last = std::min(int(std::floor(max - .5)), limit - 1);
+}
+
+void RasterImage::fillTriangle(const Vec2R& v0, const Vec2R& v1, const Vec2R& v2, const Vec3f& colour,
+								unsigned rowBegin, unsigned rowEnd)
+{
+	Real area = (v1[0] - v0[0]) * (v2[1] - v0[1]) - (v1[1] - v0[1]) * (v2[0] - v0[0]);
+	if (area == 0) return;
+
+	int firstRow, lastRow;
+	pixelRange(std::min({ v0[1], v1[1], v2[1] }), std::max({ v0[1], v1[1], v2[1] }), myHeight, firstRow, lastRow);
+	firstRow = std::max(firstRow, int(rowBegin));
+	lastRow = std::min(lastRow, int(rowEnd) - 1);
+
+	int firstColumn, lastColumn;
+	pixelRange(std::min({ v0[0], v1[0], v2[0] }), std::max({ v0[0], v1[0], v2[0] }), myWidth, firstColumn, lastColumn);
+
+	// Orient the edge functions so the inside of the triangle is positive
+	Real sign = area > 0 ? 1 : -1;
+
+	auto edge = [sign](const Vec2R& a, const Vec2R& b, const Vec2R& point)
+	{
+		return sign * ((b[0] - a[0]) * (point[1] - a[1]) - (b[1] - a[1]) * (point[0] - a[0]));
+	};
+
+	for (int y = firstRow; y <= lastRow; ++y)
+		for (int x = firstColumn; x <= lastColumn; ++x)
+		{
+			Vec2R center(x + .5, y + .5);
+			if (edge(v0, v1, center) >= 0 && edge(v1, v2, center) >= 0 && edge(v2, v0, center) >= 0)
+				setPixel(x, y, colour);
+		}
+}
+
+void RasterImage::drawLine(const Vec2R& start, const Vec2R& end, const Vec3f& colour, Real width,
+							unsigned rowBegin, unsigned rowEnd)
+{
+	// Coverage falls off linearly over one pixel at the edges of the line
+	Real halfWidth = .5 * std::max(width, Real(1.));
+	Real reach = halfWidth + .5;
+
+	int firstRow, lastRow;
+	pixelRange(std::min(start[1], end[1]) - reach, std::max(start[1], end[1]) + reach, myHeight, firstRow, lastRow);
+	firstRow = std::max(firstRow, int(rowBegin));
+	lastRow = std::min(lastRow, int(rowEnd) - 1);
+
+	int firstColumn, lastColumn;
+	pixelRange(std::min(start[0], end[0]) - reach, std::max(start[0], end[0]) + reach, myWidth, firstColumn, lastColumn);
+
+	Vec2R direction = end - start;
+	Real length2 = mag2(direction);
+
+	for (int y = firstRow; y <= lastRow; ++y)
+		for (int x = firstColumn; x <= lastColumn; ++x)
+		{
+			Vec2R center(x + .5, y + .5);
+
+			Real s = length2 > 0 ? Util::clamp(dot(center - start, direction) / length2, Real(0), Real(1)) : 0;
+			Real distance = mag(center - (start + s * direction));
+
+			Real coverage = Util::clamp(reach - distance, Real(0), Real(1));
+			if (coverage > 0)
+				blend(x, y, colour, float(coverage));
+		}
+}
+
+void RasterImage::drawPoint(const Vec2R& point, const Vec3f& colour, Real size,
+							unsigned rowBegin, unsigned rowEnd)
+{
+	Real reach = .5 * std::max(size, Real(1.)) + .5;
+
+	int firstRow, lastRow;
+	pixelRange(point[1] - reach, point[1] + reach, myHeight, firstRow, lastRow);
+	firstRow = std::max(firstRow, int(rowBegin));
+	lastRow = std::min(lastRow, int(rowEnd) - 1);
+
+	int firstColumn, lastColumn;
+	pixelRange(point[0] - reach, point[0] + reach, myWidth, firstColumn, lastColumn);
+
+	for (int y = firstRow; y <= lastRow; ++y)
+		for (int x = firstColumn; x <= lastColumn; ++x)
+		{
+			Real distance = mag(Vec2R(x + .5, y + .5) - point);
+
+			Real coverage = Util::clamp(reach - distance, Real(0), Real(1));
+			if (coverage > 0)
+				blend(x, y, colour, float(coverage));
+		}
+}
+
+void RasterImage::drawImage(const RasterImage& source, const Vec2R& topLeft, const Vec2R& bottomRight,
+							unsigned rowBegin, unsigned rowEnd)
+{
+	if (source.myWidth == 0 || source.myHeight == 0) return;
+
+	int firstRow, lastRow;
+	pixelRange(std::min(topLeft[1], bottomRight[1]), std::max(topLeft[1], bottomRight[1]), myHeight, firstRow, lastRow);
+	firstRow = std::max(firstRow, int(rowBegin));
+	lastRow = std::min(lastRow, int(rowEnd) - 1);
+
+	int firstColumn, lastColumn;
+	pixelRange(std::min(topLeft[0], bottomRight[0]), std::max(topLeft[0], bottomRight[0]), myWidth, firstColumn, lastColumn);
+
+	if (firstColumn > lastColumn) return;
+
+	// Source texels per destination pixel
+	Real scaleX = Real(source.myWidth) / (bottomRight[0] - topLeft[0]);
+	Real scaleY = Real(source.myHeight) / (bottomRight[1] - topLeft[1]);
+
+	// Bilinear weights for every column are the same on every row
+	std::vector<unsigned> columnTexels(lastColumn - firstColumn + 1);
+	std::vector<float> columnWeights(lastColumn - firstColumn + 1);
+
+	auto texelLookup = [](Real texel, unsigned size, unsigned& index, float& weight)
+	{
+		texel = Util::clamp(texel, Real(0), Real(size - 1));
+		index = std::min(unsigned(texel), size > 1 ? size - 2 : 0);
+		weight = size > 1 ? float(texel - index) : 0.f;
+	};
+
+	for (int x = firstColumn; x <= lastColumn; ++x)
+		texelLookup((x + .5 - topLeft[0]) * scaleX - .5, source.myWidth, columnTexels[x - firstColumn], columnWeights[x - firstColumn]);
+
+	unsigned nextColumn = source.myWidth > 1 ? 4 : 0;
+	std::size_t nextRow = source.myHeight > 1 ? 4 * std::size_t(source.myWidth) : 0;
+
+	for (int y = firstRow; y <= lastRow; ++y)
+	{
+		unsigned row;
+		float rowWeight;
+		texelLookup((y + .5 - topLeft[1]) * scaleY - .5, source.myHeight, row, rowWeight);
+
+		const unsigned char* sourceRow = &source.myPixels[4 * std::size_t(source.myWidth) * row];
+		unsigned char* pixels = &myPixels[4 * std::size_t(myWidth) * y];
+
+		for (int x = firstColumn; x <= lastColumn; ++x)
+		{
+			const unsigned char* texel = sourceRow + 4 * std::size_t(columnTexels[x - firstColumn]);
+			float columnWeight = columnWeights[x - firstColumn];
+
+			for (unsigned channel = 0; channel < 3; ++channel)
+			{
+				float top = (1.f - columnWeight) * texel[channel] + columnWeight * texel[nextColumn + channel];
+				float bottom = (1.f - columnWeight) * texel[nextRow + channel] + columnWeight * texel[nextRow + nextColumn + channel];
+				pixels[4 * x + channel] = (unsigned char)((1.f - rowWeight) * top + rowWeight * bottom + .5f);
+			}
+		}
+	}
+}
+
+bool RasterImage::writePPM(const std::string& filename) const
+{
+	std::ofstream writer(filename, std::ios::binary);
+
+	if (!writer)
+	{
+		std::cerr << "Failed to write to file: " << filename << std::endl;
+		return false;
+	}
+
+	writer << "P6\n" << myWidth << " " << myHeight << "\n255\n";
+
+	std::vector<unsigned char> row(3 * myWidth);
+	for (unsigned y = 0; y < myHeight; ++y)
+	{
+		const unsigned char* pixels = &myPixels[4 * std::size_t(myWidth) * y];
+		for (unsigned x = 0; x < myWidth; ++x)
+			for (unsigned channel = 0; channel < 3; ++channel)
+				row[3 * x + channel] = pixels[4 * x + channel];
+
+		writer.write(reinterpret_cast<const char*>(row.data()), row.size());
+	}
+
+	return bool(writer);
+}
+
+static uint32_t crc32(const unsigned char* data, std::size_t length, uint32_t crc = 0)
+{
+	// Function local statics are initialized once even if images are written from several threads
+	static const std::array<uint32_t, 256> table = []()
+	{
+		std::array<uint32_t, 256> table;
+		for (uint32_t entry = 0; entry < 256; ++entry)
+		{
+			uint32_t value = entry;
+			for (unsigned bit = 0; bit < 8; ++bit)
+				value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+			table[entry] = value;
+		}
+		return table;
+	}();
+
+	crc = ~crc;
+	for (std::size_t index = 0; index < length; ++index)
+		crc = table[(crc ^ data[index]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void appendBigEndian(std::vector<unsigned char>& buffer, uint32_t value)
+{
+	buffer.push_back((unsigned char)(value >> 24));
+	buffer.push_back((unsigned char)(value >> 16));
+	buffer.push_back((unsigned char)(value >> 8));
+	buffer.push_back((unsigned char)(value));
+}
+
+static void writeChunk(std::ofstream& writer, const char* type, const std::vector<unsigned char>& data)
+{
+	std::vector<unsigned char> chunk;
+	chunk.reserve(data.size() + 12);
+
+	appendBigEndian(chunk, uint32_t(data.size()));
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+
+	// The CRC covers the type and the data
+	appendBigEndian(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+
+	writer.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+}
+
+bool RasterImage::writePNG(const std::string& filename) const
+{
+	std::ofstream writer(filename, std::ios::binary);
+
+	if (!writer)
+	{
+		std::cerr << "Failed to write to file: " << filename << std::endl;
+		return false;
+	}
+
+	static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	writer.write(reinterpret_cast<const char*>(signature), 8);
+
+	// 8 bits per channel RGBA, no interlacing
+	std::vector<unsigned char> header;
+	appendBigEndian(header, myWidth);
+	appendBigEndian(header, myHeight);
+	header.insert(header.end(), { 8, 6, 0, 0, 0 });
+	writeChunk(writer, "IHDR", header);
+
+	// Every row starts with a filter byte of zero (no filter)
+	std::size_t rowBytes = 4 * std::size_t(myWidth);
+	std::vector<unsigned char> raw;
+	raw.reserve((rowBytes + 1) * myHeight);
+	for (unsigned y = 0; y < myHeight; ++y)
+	{
+		raw.push_back(0);
+		raw.insert(raw.end(), myPixels.begin() + rowBytes * y, myPixels.begin() + rowBytes * (y + 1));
+	}
+
+	// zlib stream made of stored (uncompressed) deflate blocks
+	static constexpr std::size_t MAXSTOREDBLOCK = 65535;
+
+	std::vector<unsigned char> compressed;
+	compressed.reserve(raw.size() + raw.size() / MAXSTOREDBLOCK * 5 + 16);
+	compressed.push_back(0x78);
+	compressed.push_back(0x01);
+
+	std::size_t offset = 0;
+	do
+	{
+		std::size_t blockSize = std::min(MAXSTOREDBLOCK, raw.size() - offset);
+		bool isFinal = offset + blockSize == raw.size();
+
+		compressed.push_back(isFinal ? 1 : 0);
+		compressed.push_back((unsigned char)(blockSize & 0xFF));
+		compressed.push_back((unsigned char)(blockSize >> 8));
+		compressed.push_back((unsigned char)(~blockSize & 0xFF));
+		compressed.push_back((unsigned char)((~blockSize >> 8) & 0xFF));
+		compressed.insert(compressed.end(), raw.begin() + offset, raw.begin() + offset + blockSize);
+
+		offset += blockSize;
+	} while (offset < raw.size());
+
+	uint32_t adlerA = 1, adlerB = 0;
+	for (unsigned char value : raw)
+	{
+		adlerA = (adlerA + value) % 65521;
+		adlerB = (adlerB + adlerA) % 65521;
+	}
+	appendBigEndian(compressed, (adlerB << 16) | adlerA);
+
+	writeChunk(writer, "IDAT", compressed);
+	writeChunk(writer, "IEND", std::vector<unsigned char>());
+
+	return bool(writer);
+}
+
+bool RasterImage::write(const std::string& filename) const
+{
+	auto hasExtension = [&](const std::string& extension)
+	{
+		return filename.size() >= extension.size() &&
+				filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+	};
+
+	if (hasExtension(".png"))
+		return writePNG(filename);
+	else if (hasExtension(".ppm"))
+		return writePPM(filename);
+
+	std::cerr << "Unknown image format: " << filename << std::endl;
+	return false;
+}
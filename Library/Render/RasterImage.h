@@ -0,0 +1,101 @@
+#ifndef LIBRARY_RASTERIMAGE_H
+#define LIBRARY_RASTERIMAGE_H
+
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "Util.h"
+#include "Vec.h"
+
+///////////////////////////////////
+//
+// RasterImage.h/cpp
+// Ryan Goldade 2017
+//
+// Offscreen RGBA image with a small CPU
+// rasterizer for the primitives that
+// Renderer collects (filled triangles,
+// anti-aliased lines, points and
+// resampled images). Every
+// draw call takes a range of rows so the
+// caller can split the image into bands
+// of scanlines and render the bands in
+// parallel without any locking.
+//
+// Images are written as binary PPM or
+// as PNG with uncompressed deflate
+// blocks, so no image library is needed.
+//
+////////////////////////////////////
+
+class RasterImage
+{
+public:
+	RasterImage(unsigned width, unsigned height, const Vec3f& background = Vec3f(1));
+
+	unsigned width() const { return myWidth; }
+	unsigned height() const { return myHeight; }
+
+	// Pixel coordinates have the origin at the top left corner of the image
+	// and pixel (x, y) covers [x, x + 1] x [y, y + 1].
+
+	// Blends the colour over pixel (x, y) with the given coverage in [0, 1]
+	void blend(unsigned x, unsigned y, const Vec3f& colour, float coverage)
+	{
+		assert(x < myWidth && y < myHeight);
+		unsigned char* pixel = &myPixels[4 * (x + myWidth * y)];
+		for (unsigned channel = 0; channel < 3; ++channel)
+		{
+			float value = (1.f - coverage) * float(pixel[channel]) + coverage * 255.f * colour[channel];
+			pixel[channel] = (unsigned char)(Util::clamp(value, 0.f, 255.f) + .5f);
+		}
+	}
+
+	void setPixel(unsigned x, unsigned y, const Vec3f& colour) { blend(x, y, colour, 1.f); }
+
+	Vec3f pixel(unsigned x, unsigned y) const
+	{
+		assert(x < myWidth && y < myHeight);
+		const unsigned char* pixel = &myPixels[4 * (x + myWidth * y)];
+		return Vec3f(pixel[0], pixel[1], pixel[2]) / 255.f;
+	}
+
+	// Raw RGBA storage, row by row from the top of the image
+	unsigned char* data() { return myPixels.data(); }
+	const unsigned char* data() const { return myPixels.data(); }
+
+	// Only the rows in [rowBegin, rowEnd) are touched by the draw methods.
+
+	// Fills the pixels whose centers are inside of the triangle
+	void fillTriangle(const Vec2R& v0, const Vec2R& v1, const Vec2R& v2, const Vec3f& colour,
+						unsigned rowBegin, unsigned rowEnd);
+
+	// Anti-aliased line segment of the given width in pixels
+	void drawLine(const Vec2R& start, const Vec2R& end, const Vec3f& colour, Real width,
+					unsigned rowBegin, unsigned rowEnd);
+
+	// Anti-aliased disc with the given diameter in pixels
+	void drawPoint(const Vec2R& point, const Vec3f& colour, Real size,
+					unsigned rowBegin, unsigned rowEnd);
+
+	// Bilinearly resamples the source image into the rectangle between the two pixel
+	// space corners. Source texel centers sit at the centers of an even subdivision
+	// of the rectangle and lookups past the outer texel centers are clamped.
+	void drawImage(const RasterImage& source, const Vec2R& topLeft, const Vec2R& bottomRight,
+					unsigned rowBegin, unsigned rowEnd);
+
+	bool writePPM(const std::string& filename) const;
+	bool writePNG(const std::string& filename) const;
+
+	// Picks the format from the file extension (.png or .ppm)
+	bool write(const std::string& filename) const;
+
+private:
+
+	unsigned myWidth, myHeight;
+
+	std::vector<unsigned char> myPixels;
+};
+
+#endif
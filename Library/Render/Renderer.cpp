@@ -1,9 +1,26 @@
 #include "Renderer.h"
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <iostream>
+#include <utility>
+
+#include "tbb/tbb.h"
 
 #include "simple_svg_1.0.0.hpp"
 
+// Bands of rows per thread when rasterizing. Primitives are binned into the bands
+// they overlap, so more bands only cost the primitives that straddle them.
+static constexpr unsigned RASTERBANDSPERTHREAD = 4;
+
+#if !defined(HEADLESS) && !defined(GL_CLAMP_TO_EDGE)
+// Missing from the OpenGL 1.1 headers on Windows
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+
+#ifndef HEADLESS
+
 // Helper struct because glut is a pain.
 // This is probably a very bad design choice
 // but glut doesn't make life easy.
@@ -55,7 +72,8 @@ Renderer* GlutHelper::myRender;
 
 Renderer::Renderer(const char *title, Vec2ui windowSize, Vec2R screenOrigin,
 						Real screenHeight, int *argc, char **argv)
-	: myWindowSize(windowSize)
+	: myArePackedPrimitivesStale(true)
+	, myWindowSize(windowSize)
 	, myCurrentScreenOrigin(screenOrigin)
 	, myCurrentScreenHeight(screenHeight)
 	, myDefaultScreenOrigin(screenOrigin)
@@ -73,26 +91,6 @@ Renderer::Renderer(const char *title, Vec2ui windowSize, Vec2R screenOrigin,
 	GlutHelper::init(this);
 }
 
-void Renderer::setUserKeyboard(std::function<void(unsigned char, int, int)> keyFunction)
-{
-	myUserKeyboardFunction = keyFunction;
-}
-
-void Renderer::setUserMouseClick(std::function<void(int, int, int, int)> clickFunction)
-{
-	myUserMouseClickFunction = clickFunction;
-} 
-
-void Renderer::setUserMouseDrag(std::function<void(int, int)> dragFunction)
-{
-	myUserMouseDragFunction = dragFunction;
-}
-
-void Renderer::setUserDisplay(std::function<void()> displayFunction)
-{
-	myUserDisplayFunction = displayFunction;
-}
-
 void Renderer::display()
 {
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -211,6 +209,80 @@ void Renderer::reshape(int w, int h)
 	glutPostRedisplay();
 }
 
+#else
+
+// Without OpenGL there is no window or event loop. The renderer only collects
+// primitives so they can still be written out with printImage.
+
+Renderer::Renderer(const char *title, Vec2ui windowSize, Vec2R screenOrigin,
+						Real screenHeight, int *argc, char **argv)
+	: myArePackedPrimitivesStale(true)
+	, myWindowSize(windowSize)
+	, myCurrentScreenOrigin(screenOrigin)
+	, myCurrentScreenHeight(screenHeight)
+	, myDefaultScreenOrigin(screenOrigin)
+	, myDefaultScreenHeight(screenHeight)
+	, myMouseAction(MouseAction::INACTIVE)
+{}
+
+void Renderer::display()
+{
+	if (myUserDisplayFunction) myUserDisplayFunction();
+}
+
+void Renderer::mouse(int button, int state, int x, int y)
+{
+	if (myUserMouseClickFunction) myUserMouseClickFunction(button, state, x, y);
+}
+
+void Renderer::drag(int x, int y)
+{
+	if (myUserMouseDragFunction) myUserMouseDragFunction(x, y);
+}
+
+void Renderer::keyboard(unsigned char key, int x, int y)
+{
+	if (myUserKeyboardFunction) myUserKeyboardFunction(key, x, y);
+}
+
+void Renderer::reshape(int w, int h)
+{
+	myWindowSize[0] = w;
+	myWindowSize[1] = h;
+}
+
+#endif
+
+Renderer::Renderer(Vec2ui imageSize, Vec2R screenOrigin, Real screenHeight)
+	: myArePackedPrimitivesStale(true)
+	, myWindowSize(imageSize)
+	, myCurrentScreenOrigin(screenOrigin)
+	, myCurrentScreenHeight(screenHeight)
+	, myDefaultScreenOrigin(screenOrigin)
+	, myDefaultScreenHeight(screenHeight)
+	, myMouseAction(MouseAction::INACTIVE)
+{}
+
+void Renderer::setUserKeyboard(std::function<void(unsigned char, int, int)> keyFunction)
+{
+	myUserKeyboardFunction = keyFunction;
+}
+
+void Renderer::setUserMouseClick(std::function<void(int, int, int, int)> clickFunction)
+{
+	myUserMouseClickFunction = clickFunction;
+} 
+
+void Renderer::setUserMouseDrag(std::function<void(int, int)> dragFunction)
+{
+	myUserMouseDragFunction = dragFunction;
+}
+
+void Renderer::setUserDisplay(std::function<void()> displayFunction)
+{
+	myUserDisplayFunction = displayFunction;
+}
+
 // These helpers make it easy to render out basic primitives without having to write
 // a custom loop outside of this class
 void Renderer::addPoint(const Vec2R& point, const Vec3f& colour, Real size)
@@ -219,6 +291,8 @@ void Renderer::addPoint(const Vec2R& point, const Vec3f& colour, Real size)
 	myPoints.push_back(temp);
 	myPointColours.push_back(colour);
 	myPointSize.push_back(size);
+
+	myArePackedPrimitivesStale = true;
 }
 
 void Renderer::addPoints(const std::vector<Vec2R>& points, const Vec3f& colour, Real size)
@@ -226,6 +300,8 @@ void Renderer::addPoints(const std::vector<Vec2R>& points, const Vec3f& colour,
 	myPoints.push_back(points);
 	myPointColours.push_back(colour);
 	myPointSize.push_back(size);
+
+	myArePackedPrimitivesStale = true;
 }
 
 void Renderer::addLine(const Vec2R& start, const Vec2R& end, const Vec3f& colour, const Real width)
@@ -237,6 +313,8 @@ void Renderer::addLine(const Vec2R& start, const Vec2R& end, const Vec3f& colour
 
 	myLineColours.push_back(colour);
 	myLineSizes.push_back(width);
+
+	myArePackedPrimitivesStale = true;
 }
 
 void Renderer::addLines(const std::vector<Vec2R>& start, const std::vector<Vec2R>& end, const Vec3f& colour, const Real width)
@@ -246,6 +324,8 @@ void Renderer::addLines(const std::vector<Vec2R>& start, const std::vector<Vec2R
 	myEndLines.push_back(end);
 	myLineColours.push_back(colour);
 	myLineSizes.push_back(width);
+
+	myArePackedPrimitivesStale = true;
 }
 
 void Renderer::addTris(const std::vector<Vec2R>& verts, const std::vector<Vec3ui>& faces, const std::vector<Vec3f>& colour)
@@ -253,6 +333,8 @@ void Renderer::addTris(const std::vector<Vec2R>& verts, const std::vector<Vec3ui
 	myTriVerts.push_back(verts);
 	myTriFaces.push_back(faces);
 	myTriColours.push_back(colour);
+
+	myArePackedPrimitivesStale = true;
 }
 
 void Renderer::addQuads(const std::vector<Vec2R>& verts, const std::vector<Vec4ui>& faces, const std::vector<Vec3f>& colours)
@@ -260,6 +342,15 @@ void Renderer::addQuads(const std::vector<Vec2R>& verts, const std::vector<Vec4u
 	myQuadVerts.push_back(verts);
 	myQuadFaces.push_back(faces);
 	myQuadColours.push_back(colours);
+
+	myArePackedPrimitivesStale = true;
+}
+
+void Renderer::addImage(RasterImage image, const Vec2R& worldMin, const Vec2R& worldMax)
+{
+	myImages.push_back(std::move(image));
+	myImageMin.push_back(worldMin);
+	myImageMax.push_back(worldMax);
 }
 
 void Renderer::clear()
@@ -280,102 +371,248 @@ void Renderer::clear()
 	myQuadVerts.clear();
 	myQuadFaces.clear();
 	myQuadColours.clear();
+
+	myImages.clear();
+	myImageMin.clear();
+	myImageMax.clear();
+
+#ifndef HEADLESS
+	if (!myImageTextures.empty())
+		glDeleteTextures(GLsizei(myImageTextures.size()), myImageTextures.data());
+#endif
+	myImageTextures.clear();
+
+	myArePackedPrimitivesStale = true;
 }
 
 void Renderer::drawPrimitives() const
 {
-	// Render quads
-	glBegin(GL_QUADS);
+#ifndef HEADLESS
+	// Upload any images added since the last draw
+	unsigned imageListSize = myImages.size();
+	for (unsigned imageIndex = unsigned(myImageTextures.size()); imageIndex < imageListSize; ++imageIndex)
+	{
+		const RasterImage& image = myImages[imageIndex];
+
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, GLsizei(image.width()), GLsizei(image.height()), 0, GL_RGBA, GL_UNSIGNED_BYTE, image.data());
+
+		myImageTextures.push_back(texture);
+	}
 
-	unsigned quadListSize = myQuadFaces.size();
-	for (unsigned quadListIndex = 0; quadListIndex < quadListSize; ++quadListIndex)
+	// Render images. Texture row 0 is the first image row, which is the top of the box.
+	if (imageListSize > 0)
 	{
-		unsigned quadSublistSize = myQuadFaces[quadListIndex].size();
-		for (unsigned quadIndex = 0; quadIndex < quadSublistSize; ++quadIndex)
+		glEnable(GL_TEXTURE_2D);
+		glColor3f(1, 1, 1);
+
+		for (unsigned imageIndex = 0; imageIndex < imageListSize; ++imageIndex)
 		{
-			Vec3f quadColour = myQuadColours[quadListIndex][quadIndex];
-			glColor3f(quadColour[0], quadColour[1], quadColour[2]);
-			
-			for (unsigned quadVertexIndex = 0; quadVertexIndex < 4; ++quadVertexIndex)
-			{
-				unsigned meshVertexIndex = myQuadFaces[quadListIndex][quadIndex][quadVertexIndex];
-				Vec2R vertex = myQuadVerts[quadListIndex][meshVertexIndex];
-				glVertex2d(vertex[0], vertex[1]);
-			}
+			const Vec2R& min = myImageMin[imageIndex];
+			const Vec2R& max = myImageMax[imageIndex];
+
+			glBindTexture(GL_TEXTURE_2D, myImageTextures[imageIndex]);
+
+			glBegin(GL_QUADS);
+			glTexCoord2f(0, 1); glVertex2d(min[0], min[1]);
+			glTexCoord2f(1, 1); glVertex2d(max[0], min[1]);
+			glTexCoord2f(1, 0); glVertex2d(max[0], max[1]);
+			glTexCoord2f(0, 0); glVertex2d(min[0], max[1]);
+			glEnd();
 		}
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glDisable(GL_TEXTURE_2D);
 	}
 
-	glEnd();
+	if (myArePackedPrimitivesStale)
+	{
+		packPrimitives();
+		myArePackedPrimitivesStale = false;
+	}
 
-	// Render tris
-	glBegin(GL_TRIANGLES);
+	glEnableClientState(GL_VERTEX_ARRAY);
 
-	unsigned triListSize = myTriFaces.size();
-	for (unsigned triListIndex = 0; triListIndex < triListSize; ++triListIndex)
+	// Render quads and tris
+	if (!myPackedTriVerts.empty())
 	{
-		unsigned triSublistSize = myTriFaces[triListIndex].size();
-		for (unsigned triIndex = 0; triIndex < triSublistSize; ++triIndex)
+		glEnableClientState(GL_COLOR_ARRAY);
+
+		glVertexPointer(2, GL_FLOAT, 0, myPackedTriVerts.data());
+		glColorPointer(3, GL_FLOAT, 0, myPackedTriColours.data());
+		glDrawArrays(GL_TRIANGLES, 0, GLsizei(myPackedTriVerts.size() / 2));
+
+		glDisableClientState(GL_COLOR_ARRAY);
+	}
+
+	if (!myPackedLineVerts.empty())
+	{
+		glVertexPointer(2, GL_FLOAT, 0, myPackedLineVerts.data());
+
+		unsigned lineListSize = myPackedLineRanges.size();
+		for (unsigned lineListIndex = 0; lineListIndex < lineListSize; ++lineListIndex)
 		{
-			Vec3f triColour = myTriColours[triListIndex][triIndex];
-			glColor3f(triColour[0], triColour[1], triColour[2]);
+			Vec3f lineColour = myLineColours[lineListIndex];
 
-			for (unsigned triVertexIndex = 0; triVertexIndex < 3; ++triVertexIndex)
-			{
-				unsigned meshVertexIndex = myTriFaces[triListIndex][triIndex][triVertexIndex];
-				Vec2R vertex = myTriVerts[triListIndex][meshVertexIndex];
-				glVertex2d(vertex[0], vertex[1]);
-			}
+			glColor3f(lineColour[0], lineColour[1], lineColour[2]);
+			glLineWidth(myLineSizes[lineListIndex]);
+
+			const Vec2ui& range = myPackedLineRanges[lineListIndex];
+			if (range[1] > 0)
+				glDrawArrays(GL_LINES, GLint(range[0]), GLsizei(range[1]));
 		}
 	}
 
-	glEnd();
-
-	unsigned lineListSize = myStartLines.size();
-	for (unsigned lineListIndex = 0; lineListIndex < lineListSize; ++lineListIndex)
+	if (!myPackedPointVerts.empty())
 	{
-		Vec3f lineColour = myLineColours[lineListIndex];
-		
-		glColor3f(lineColour[0], lineColour[1], lineColour[2]);
-		glLineWidth(myLineSizes[lineListIndex]);
-		
-		glBegin(GL_LINES);
+		glVertexPointer(2, GL_FLOAT, 0, myPackedPointVerts.data());
 
-		unsigned lineSublistSize = myStartLines[lineListIndex].size();
-		for (unsigned lineIndex = 0; lineIndex < lineSublistSize; ++lineIndex)
+		unsigned pointListSize = myPackedPointRanges.size();
+		for (unsigned pointListIndex = 0; pointListIndex < pointListSize; ++pointListIndex)
 		{
-			Vec2R startPoint = myStartLines[lineListIndex][lineIndex];
-			Vec2R endPoint = myEndLines[lineListIndex][lineIndex];
+			Vec3f pointColour = myPointColours[pointListIndex];
+
+			glColor3f(pointColour[0], pointColour[1], pointColour[2]);
+			glPointSize(myPointSize[pointListIndex]);
 
-			glVertex2d(startPoint[0], startPoint[1]);
-			glVertex2d(endPoint[0], endPoint[1]);
+			const Vec2ui& range = myPackedPointRanges[pointListIndex];
+			if (range[1] > 0)
+				glDrawArrays(GL_POINTS, GLint(range[0]), GLsizei(range[1]));
 		}
+	}
+
+	glDisableClientState(GL_VERTEX_ARRAY);
+#endif
+}
+
+void Renderer::packPrimitives() const
+{
+	// Offsets of each list into the packed arrays so the lists can be packed in parallel
+	auto packOffsets = [](const auto& lists, unsigned verticesPerItem)
+	{
+		std::vector<unsigned> offsets(lists.size() + 1, 0);
+		for (unsigned listIndex = 0; listIndex < lists.size(); ++listIndex)
+			offsets[listIndex + 1] = offsets[listIndex] + verticesPerItem * unsigned(lists[listIndex].size());
+		return offsets;
+	};
 
-		glEnd();
+	auto packVertex = [](float* packed, const Vec2R& vertex)
+	{
+		packed[0] = float(vertex[0]);
+		packed[1] = float(vertex[1]);
+	};
+
+	auto packColour = [](float* packed, const Vec3f& colour)
+	{
+		packed[0] = colour[0];
+		packed[1] = colour[1];
+		packed[2] = colour[2];
+	};
+
+	// Quads are split into two triangles and go first to keep the drawing order
+	std::vector<unsigned> quadOffsets = packOffsets(myQuadFaces, 6);
+	std::vector<unsigned> triOffsets = packOffsets(myTriFaces, 3);
+
+	unsigned triVertexCount = quadOffsets.back() + triOffsets.back();
+	myPackedTriVerts.resize(2 * std::size_t(triVertexCount));
+	myPackedTriColours.resize(3 * std::size_t(triVertexCount));
+
+	for (unsigned quadListIndex = 0; quadListIndex < myQuadFaces.size(); ++quadListIndex)
+	{
+		const std::vector<Vec2R>& verts = myQuadVerts[quadListIndex];
+		const std::vector<Vec4ui>& faces = myQuadFaces[quadListIndex];
+		const std::vector<Vec3f>& colours = myQuadColours[quadListIndex];
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, faces.size()), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			static constexpr unsigned quadTriVertices[6] = { 0, 1, 2, 0, 2, 3 };
+
+			for (unsigned quadIndex = range.begin(); quadIndex != range.end(); ++quadIndex)
+			{
+				std::size_t vertexIndex = quadOffsets[quadListIndex] + 6 * std::size_t(quadIndex);
+				for (unsigned quadVertexIndex = 0; quadVertexIndex < 6; ++quadVertexIndex, ++vertexIndex)
+				{
+					packVertex(&myPackedTriVerts[2 * vertexIndex], verts[faces[quadIndex][quadTriVertices[quadVertexIndex]]]);
+					packColour(&myPackedTriColours[3 * vertexIndex], colours[quadIndex]);
+				}
+			}
+		});
 	}
-		
-	unsigned pointListSize = myPoints.size();
-	for (unsigned pointListIndex = 0; pointListIndex < pointListSize; ++pointListIndex)
+
+	for (unsigned triListIndex = 0; triListIndex < myTriFaces.size(); ++triListIndex)
 	{
-		Vec3f pointColour = myPointColours[pointListIndex];
-		glColor3f(pointColour[0], pointColour[1], pointColour[2]);
-		glPointSize(myPointSize[pointListIndex]);
-		
-		glBegin(GL_POINTS);
+		const std::vector<Vec2R>& verts = myTriVerts[triListIndex];
+		const std::vector<Vec3ui>& faces = myTriFaces[triListIndex];
+		const std::vector<Vec3f>& colours = myTriColours[triListIndex];
 
-		unsigned pointSublistSize = myPoints[pointListIndex].size();
-		for (unsigned pointIndex = 0; pointIndex < pointSublistSize; ++pointIndex)
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, faces.size()), [&](const tbb::blocked_range<unsigned> &range)
 		{
-			Vec2R point = myPoints[pointListIndex][pointIndex];
-			glVertex2d(point[0], point[1]);
-		}
+			for (unsigned triIndex = range.begin(); triIndex != range.end(); ++triIndex)
+			{
+				std::size_t vertexIndex = quadOffsets.back() + triOffsets[triListIndex] + 3 * std::size_t(triIndex);
+				for (unsigned triVertexIndex = 0; triVertexIndex < 3; ++triVertexIndex, ++vertexIndex)
+				{
+					packVertex(&myPackedTriVerts[2 * vertexIndex], verts[faces[triIndex][triVertexIndex]]);
+					packColour(&myPackedTriColours[3 * vertexIndex], colours[triIndex]);
+				}
+			}
+		});
+	}
+
+	std::vector<unsigned> lineOffsets = packOffsets(myStartLines, 2);
+	myPackedLineVerts.resize(2 * std::size_t(lineOffsets.back()));
+	myPackedLineRanges.resize(myStartLines.size());
+
+	for (unsigned lineListIndex = 0; lineListIndex < myStartLines.size(); ++lineListIndex)
+	{
+		const std::vector<Vec2R>& startLines = myStartLines[lineListIndex];
+		const std::vector<Vec2R>& endLines = myEndLines[lineListIndex];
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, startLines.size()), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned lineIndex = range.begin(); lineIndex != range.end(); ++lineIndex)
+			{
+				std::size_t vertexIndex = lineOffsets[lineListIndex] + 2 * std::size_t(lineIndex);
+				packVertex(&myPackedLineVerts[2 * vertexIndex], startLines[lineIndex]);
+				packVertex(&myPackedLineVerts[2 * (vertexIndex + 1)], endLines[lineIndex]);
+			}
+		});
+
+		myPackedLineRanges[lineListIndex] = Vec2ui(lineOffsets[lineListIndex], lineOffsets[lineListIndex + 1] - lineOffsets[lineListIndex]);
+	}
+
+	std::vector<unsigned> pointOffsets = packOffsets(myPoints, 1);
+	myPackedPointVerts.resize(2 * std::size_t(pointOffsets.back()));
+	myPackedPointRanges.resize(myPoints.size());
+
+	for (unsigned pointListIndex = 0; pointListIndex < myPoints.size(); ++pointListIndex)
+	{
+		const std::vector<Vec2R>& points = myPoints[pointListIndex];
 
-		glEnd();
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, points.size()), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned pointIndex = range.begin(); pointIndex != range.end(); ++pointIndex)
+				packVertex(&myPackedPointVerts[2 * (pointOffsets[pointListIndex] + std::size_t(pointIndex))], points[pointIndex]);
+		});
+
+		myPackedPointRanges[pointListIndex] = Vec2ui(pointOffsets[pointListIndex], pointOffsets[pointListIndex + 1] - pointOffsets[pointListIndex]);
 	}
 }
 
 void Renderer::run()
 {
+#ifndef HEADLESS
 	glutMainLoop();
+#else
+	std::cout << "Renderer::run() has no window to run in a headless build" << std::endl;
+#endif
 }
 
 Real Renderer::pixelScale() const
@@ -392,7 +629,38 @@ void Renderer::printImage(const std::string &filename) const
 		svg::Layout(svg::Dimensions(myWindowSize[0], myWindowSize[1]),
 			svg::Layout::BottomLeft,
 			scale, originOffset));
-	
+
+	// SVG has no bilinear image primitive so images are drawn as flat texels. Texels of the same
+	// colour next to each other in a row are merged into one rectangle to keep the file small.
+	for (unsigned imageIndex = 0; imageIndex < myImages.size(); ++imageIndex)
+	{
+		const RasterImage& image = myImages[imageIndex];
+		Vec2R texelSize = (myImageMax[imageIndex] - myImageMin[imageIndex]) / Vec2R(image.width(), image.height());
+
+		for (unsigned y = 0; y < image.height(); ++y)
+		{
+			const unsigned char* row = image.data() + 4 * std::size_t(image.width()) * y;
+
+			// Row 0 is the top of the image. The layout flips y so a rectangle is placed by its top edge.
+			Real rowTop = myImageMax[imageIndex][1] - Real(y) * texelSize[1];
+
+			for (unsigned runBegin = 0; runBegin < image.width();)
+			{
+				const unsigned char* texel = row + 4 * runBegin;
+
+				unsigned runEnd = runBegin + 1;
+				while (runEnd < image.width() && std::equal(texel, texel + 3, row + 4 * runEnd))
+					++runEnd;
+
+				svgDocument << svg::Rectangle(svg::Point(myImageMin[imageIndex][0] + Real(runBegin) * texelSize[0], rowTop),
+					Real(runEnd - runBegin) * texelSize[0], texelSize[1],
+					svg::Color(texel[0], texel[1], texel[2]));
+
+				runBegin = runEnd;
+			}
+		}
+	}
+
 	// Draw rectangles
 	unsigned quadListSize = myQuadFaces.size();
 	for (unsigned quadListIndex = 0; quadListIndex < quadListSize; ++quadListIndex)
@@ -478,4 +746,221 @@ void Renderer::printImage(const std::string &filename) const
 	}
 
 	svgDocument.save();
-}
\ No newline at end of file
+}
+
+void Renderer::rasterize(RasterImage& image) const
+{
+	if (image.width() == 0 || image.height() == 0) return;
+
+	Real scale = Real(image.height()) / myCurrentScreenHeight;
+	Real imageHeight = image.height();
+
+	// Image rows run from the top down
+	auto toPixel = [&](const Vec2R& point)
+	{
+		return Vec2R((point[0] - myCurrentScreenOrigin[0]) * scale, imageHeight - (point[1] - myCurrentScreenOrigin[1]) * scale);
+	};
+
+	auto toPixelLists = [&](const std::vector<std::vector<Vec2R>>& lists)
+	{
+		std::vector<std::vector<Vec2R>> pixelLists(lists.size());
+		for (unsigned listIndex = 0; listIndex < lists.size(); ++listIndex)
+		{
+			const std::vector<Vec2R>& list = lists[listIndex];
+			pixelLists[listIndex].resize(list.size());
+
+			tbb::parallel_for(tbb::blocked_range<unsigned>(0, list.size()), [&](const tbb::blocked_range<unsigned> &range)
+			{
+				for (unsigned index = range.begin(); index != range.end(); ++index)
+					pixelLists[listIndex][index] = toPixel(list[index]);
+			});
+		}
+		return pixelLists;
+	};
+
+	std::vector<std::vector<Vec2R>> quadVerts = toPixelLists(myQuadVerts);
+	std::vector<std::vector<Vec2R>> triVerts = toPixelLists(myTriVerts);
+	std::vector<std::vector<Vec2R>> startLines = toPixelLists(myStartLines);
+	std::vector<std::vector<Vec2R>> endLines = toPixelLists(myEndLines);
+	std::vector<std::vector<Vec2R>> points = toPixelLists(myPoints);
+
+	unsigned bandCount = std::min(image.height(), RASTERBANDSPERTHREAD * unsigned(tbb::this_task_arena::max_concurrency()));
+	bandCount = std::max(bandCount, 1u);
+	unsigned bandRows = (image.height() + bandCount - 1) / bandCount;
+
+	// Every primitive in the same order as drawPrimitives. Quads are drawn as a pair of triangles.
+	enum class PrimitiveKind : unsigned char { IMAGE, QUAD, TRIANGLE, LINE, POINT };
+
+	struct RasterPrimitive
+	{
+		PrimitiveKind kind;
+		unsigned list, index;
+
+		// Bands whose rows the primitive can touch. Empty if it is off the image.
+		unsigned firstBand, lastBand;
+	};
+
+	std::vector<RasterPrimitive> primitives;
+
+	auto addPrimitives = [&](PrimitiveKind kind, unsigned list, std::size_t count)
+	{
+		for (unsigned index = 0; index < count; ++index)
+			primitives.push_back(RasterPrimitive{ kind, list, index, 1, 0 });
+	};
+
+	addPrimitives(PrimitiveKind::IMAGE, 0, myImages.size());
+	for (unsigned quadListIndex = 0; quadListIndex < myQuadFaces.size(); ++quadListIndex)
+		addPrimitives(PrimitiveKind::QUAD, quadListIndex, myQuadFaces[quadListIndex].size());
+	for (unsigned triListIndex = 0; triListIndex < myTriFaces.size(); ++triListIndex)
+		addPrimitives(PrimitiveKind::TRIANGLE, triListIndex, myTriFaces[triListIndex].size());
+	for (unsigned lineListIndex = 0; lineListIndex < startLines.size(); ++lineListIndex)
+		addPrimitives(PrimitiveKind::LINE, lineListIndex, startLines[lineListIndex].size());
+	for (unsigned pointListIndex = 0; pointListIndex < points.size(); ++pointListIndex)
+		addPrimitives(PrimitiveKind::POINT, pointListIndex, points[pointListIndex].size());
+
+	auto imageCorners = [&](unsigned imageIndex, Vec2R& topLeft, Vec2R& bottomRight)
+	{
+		topLeft = toPixel(Vec2R(myImageMin[imageIndex][0], myImageMax[imageIndex][1]));
+		bottomRight = toPixel(Vec2R(myImageMax[imageIndex][0], myImageMin[imageIndex][1]));
+	};
+
+	// The rows between the floor and ceiling of the vertical extent cover every row the draw
+	// calls can touch. Primitives with a non-finite extent fail the comparison and are dropped.
+	tbb::parallel_for(tbb::blocked_range<std::size_t>(0, primitives.size()), [&](const tbb::blocked_range<std::size_t> &range)
+	{
+		for (std::size_t primitiveIndex = range.begin(); primitiveIndex != range.end(); ++primitiveIndex)
+		{
+			RasterPrimitive& primitive = primitives[primitiveIndex];
+
+			Real minY, maxY;
+			switch (primitive.kind)
+			{
+			case PrimitiveKind::IMAGE:
+			{
+				Vec2R topLeft, bottomRight;
+				imageCorners(primitive.index, topLeft, bottomRight);
+				minY = std::min(topLeft[1], bottomRight[1]);
+				maxY = std::max(topLeft[1], bottomRight[1]);
+				break;
+			}
+			case PrimitiveKind::QUAD:
+			{
+				const std::vector<Vec2R>& verts = quadVerts[primitive.list];
+				const Vec4ui& quad = myQuadFaces[primitive.list][primitive.index];
+				minY = std::min({ verts[quad[0]][1], verts[quad[1]][1], verts[quad[2]][1], verts[quad[3]][1] });
+				maxY = std::max({ verts[quad[0]][1], verts[quad[1]][1], verts[quad[2]][1], verts[quad[3]][1] });
+				break;
+			}
+			case PrimitiveKind::TRIANGLE:
+			{
+				const std::vector<Vec2R>& verts = triVerts[primitive.list];
+				const Vec3ui& tri = myTriFaces[primitive.list][primitive.index];
+				minY = std::min({ verts[tri[0]][1], verts[tri[1]][1], verts[tri[2]][1] });
+				maxY = std::max({ verts[tri[0]][1], verts[tri[1]][1], verts[tri[2]][1] });
+				break;
+			}
+			case PrimitiveKind::LINE:
+			{
+				// Matches the reach of RasterImage::drawLine
+				Real reach = .5 * std::max(myLineSizes[primitive.list], Real(1.)) + .5;
+				Real startY = startLines[primitive.list][primitive.index][1];
+				Real endY = endLines[primitive.list][primitive.index][1];
+				minY = std::min(startY, endY) - reach;
+				maxY = std::max(startY, endY) + reach;
+				break;
+			}
+			default:
+			{
+				// Matches the reach of RasterImage::drawPoint
+				Real reach = .5 * std::max(myPointSize[primitive.list], Real(1.)) + .5;
+				Real pointY = points[primitive.list][primitive.index][1];
+				minY = pointY - reach;
+				maxY = pointY + reach;
+			}
+			}
+
+			if (!(minY <= maxY) || maxY < 0 || minY > imageHeight)
+				continue;
+
+			unsigned firstRow = unsigned(std::max(std::floor(minY), Real(0)));
+			unsigned lastRow = unsigned(std::min(std::ceil(maxY), imageHeight - 1));
+
+			primitive.firstBand = firstRow / bandRows;
+			primitive.lastBand = lastRow / bandRows;
+		}
+	});
+
+	// Bin the primitives into the bands they overlap with a counting sort. Each band keeps them in
+	// draw order so overlapping primitives blend the same way as drawing them all at once.
+	std::vector<std::size_t> bandStart(bandCount + 1, 0);
+	for (const RasterPrimitive& primitive : primitives)
+		for (unsigned band = primitive.firstBand; band <= primitive.lastBand; ++band)
+			++bandStart[band + 1];
+
+	for (unsigned band = 0; band < bandCount; ++band)
+		bandStart[band + 1] += bandStart[band];
+
+	std::vector<unsigned> bandPrimitives(bandStart[bandCount]);
+	std::vector<std::size_t> nextSlot(bandStart.begin(), bandStart.end() - 1);
+
+	for (unsigned primitiveIndex = 0; primitiveIndex < primitives.size(); ++primitiveIndex)
+		for (unsigned band = primitives[primitiveIndex].firstBand; band <= primitives[primitiveIndex].lastBand; ++band)
+			bandPrimitives[nextSlot[band]++] = primitiveIndex;
+
+	// Each band of rows draws the primitives binned into it, clipped to its rows
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, bandCount, 1), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned band = range.begin(); band != range.end(); ++band)
+		{
+			unsigned rowBegin = std::min(band * bandRows, image.height());
+			unsigned rowEnd = std::min((band + 1) * bandRows, image.height());
+
+			for (std::size_t slot = bandStart[band]; slot != bandStart[band + 1]; ++slot)
+			{
+				const RasterPrimitive& primitive = primitives[bandPrimitives[slot]];
+
+				switch (primitive.kind)
+				{
+				case PrimitiveKind::IMAGE:
+				{
+					Vec2R topLeft, bottomRight;
+					imageCorners(primitive.index, topLeft, bottomRight);
+					image.drawImage(myImages[primitive.index], topLeft, bottomRight, rowBegin, rowEnd);
+					break;
+				}
+				case PrimitiveKind::QUAD:
+				{
+					const std::vector<Vec2R>& verts = quadVerts[primitive.list];
+					const Vec4ui& quad = myQuadFaces[primitive.list][primitive.index];
+					const Vec3f& colour = myQuadColours[primitive.list][primitive.index];
+
+					image.fillTriangle(verts[quad[0]], verts[quad[1]], verts[quad[2]], colour, rowBegin, rowEnd);
+					image.fillTriangle(verts[quad[0]], verts[quad[2]], verts[quad[3]], colour, rowBegin, rowEnd);
+					break;
+				}
+				case PrimitiveKind::TRIANGLE:
+				{
+					const std::vector<Vec2R>& verts = triVerts[primitive.list];
+					const Vec3ui& tri = myTriFaces[primitive.list][primitive.index];
+					image.fillTriangle(verts[tri[0]], verts[tri[1]], verts[tri[2]], myTriColours[primitive.list][primitive.index], rowBegin, rowEnd);
+					break;
+				}
+				case PrimitiveKind::LINE:
+					image.drawLine(startLines[primitive.list][primitive.index], endLines[primitive.list][primitive.index],
+									myLineColours[primitive.list], myLineSizes[primitive.list], rowBegin, rowEnd);
+					break;
+				default:
+					image.drawPoint(points[primitive.list][primitive.index], myPointColours[primitive.list],
+									myPointSize[primitive.list], rowBegin, rowEnd);
+				}
+			}
+		}
+	}, tbb::simple_partitioner());
+}
+
+bool Renderer::printRasterImage(const std::string &filename) const
+{
+	RasterImage image(myWindowSize[0], myWindowSize[1]);
+	rasterize(image);
+	return image.write(filename);
+}
@@ -4,9 +4,12 @@
 #include <functional>
 #include <vector>
 
+#ifndef HEADLESS
 #include <GL/glut.h>
+#endif
 
 #include "Common.h"
+#include "RasterImage.h"
 #include "Vec.h"
 
 ///////////////////////////////////
@@ -27,6 +30,10 @@ public:
 	Renderer(const char *title, Vec2ui windowSize, Vec2R screenOrigin,
 				Real screenHeight, int *argc, char **argv);
 
+	// Offscreen renderer without a window. It only collects primitives for rasterize and the
+	// image writers, so it can be used from threads other than the GLUT thread.
+	Renderer(Vec2ui imageSize, Vec2R screenOrigin, Real screenHeight);
+
 	void display();
 	void mouse(int button, int state, int x, int y);
 	void drag(int x, int y);
@@ -45,10 +52,24 @@ public:
 	void addLines(const std::vector<Vec2R>& start, const std::vector<Vec2R>& end, const Vec3f& colour, const Real width = 1);
 	void addTris(const std::vector<Vec2R>& verts, const std::vector<Vec3ui>& faces, const std::vector<Vec3f>& colour);
 	void addQuads(const std::vector<Vec2R>& verts, const std::vector<Vec4ui>& faces, const std::vector<Vec3f>& colours);
+
+	// Stretches an image over the world space box between min and max with bilinear filtering.
+	// Row 0 of the image is the top of the box. Images are drawn before any other primitive,
+	// each as a single texture when there is a window. The SVG output draws them as unfiltered
+	// texels.
+	void addImage(RasterImage image, const Vec2R& worldMin, const Vec2R& worldMax);
 	
+	// Draws from packed vertex arrays. The arrays are only rebuilt after primitives are added or cleared.
 	void drawPrimitives() const;
 
 	void printImage(const std::string &filename) const;
+
+	// Renders the primitives on the CPU with the current view. The view height is
+	// scaled to the image height so images can be larger or smaller than the window.
+	void rasterize(RasterImage& image) const;
+
+	// Rasterizes at the window size and writes a PNG or PPM, picked by the file extension
+	bool printRasterImage(const std::string &filename) const;
 	void clear();
 	void run();
 
@@ -73,6 +94,30 @@ private:
 	std::vector<std::vector<Vec4ui>> myQuadFaces;
 	std::vector<std::vector<Vec3f>> myQuadColours;
 
+	std::vector<RasterImage> myImages;
+	std::vector<Vec2R> myImageMin;
+	std::vector<Vec2R> myImageMax;
+
+	// GL texture names for the images, uploaded on the first draw after they are added
+	mutable std::vector<unsigned> myImageTextures;
+
+	// Packs the primitive lists into contiguous arrays for drawPrimitives
+	void packPrimitives() const;
+
+	// Quads are split into triangles and packed with the triangles, with a colour per vertex.
+	// Lines and points keep one (first vertex, vertex count) range per list since the width,
+	// size and colour are set per list.
+	mutable std::vector<float> myPackedTriVerts;
+	mutable std::vector<float> myPackedTriColours;
+
+	mutable std::vector<float> myPackedLineVerts;
+	mutable std::vector<Vec2ui> myPackedLineRanges;
+
+	mutable std::vector<float> myPackedPointVerts;
+	mutable std::vector<Vec2ui> myPackedPointRanges;
+
+	mutable bool myArePackedPrimitivesStale;
+
 	// width, height
 	Vec2ui myWindowSize;
 
@@ -1,8 +1,13 @@
 #ifndef LIBRARY_ADVECTFIELD_H
 #define LIBRARY_ADVECTFIELD_H
 
+#include <limits>
+
+#include "tbb/tbb.h"
+
 #include "Common.h"
 #include "Integrator.h"
+#include "Profiler.h"
 #include "ScalarGrid.h"
 #include "Vec.h"
 #include "VectorGrid.h"
@@ -34,6 +39,10 @@ public:
 	template<typename VelocityField>
 	void advectField(Real dt, Field& field, const VelocityField& vel, const IntegrationOrder order, const InterpolationOrder interpOrder = InterpolationOrder::LINEAR);
 
+	// Traces a single point back through the velocity field and samples the source there
+	template<typename VelocityField>
+	Real advectSample(Real dt, const Vec2R& worldPoint, const VelocityField& vel, const IntegrationOrder order, const InterpolationOrder interpOrder) const;
+
 private:
 	const Field &myField;
 };
@@ -42,26 +51,96 @@ template<typename Field>
 template<typename VelocityField>
 void AdvectField<Field>::advectField(Real dt, Field& field, const VelocityField& vel, const IntegrationOrder order, const InterpolationOrder interpOrder)
 {
+	PROFILE_ZONE("AdvectField::advectField");
+
 	assert(&field != &myField);
 
 	forEachVoxelRange(Vec2ui(0), field.size(), [&](const Vec2ui& cell)
 	{
-		Vec2R pos = field.indexToWorld(Vec2R(cell));
-		pos = Integrator(-dt, pos, vel, order);
+		field(cell) = advectSample(dt, field.indexToWorld(Vec2R(cell)), vel, order, interpOrder);
+	});
+}
+
+template<typename Field>
+template<typename VelocityField>
+Real AdvectField<Field>::advectSample(Real dt, const Vec2R& worldPoint, const VelocityField& vel, const IntegrationOrder order, const InterpolationOrder interpOrder) const
+{
+	Vec2R pos = Integrator(-dt, worldPoint, vel, order);
+
+	switch (interpOrder)
+	{
+	case InterpolationOrder::LINEAR:
+		return myField.interp(pos);
+	case InterpolationOrder::CUBIC:
+		return myField.cubicInterp(pos, false, true);
+	default:
+		assert(false);
+		return 0;
+	}
+}
+
+// Advects a staggered velocity field into field and returns its largest cell-averaged speed,
+// the same value as field.maxMagnitude(). The x-faces are advected first. A cell's speed is then
+// taken as soon as its last y-face is written, while its faces are still in cache, so there is
+// no separate pass over the advected velocity. Rows are spread across threads.
+template<typename VelocityField>
+Real advectStaggeredVelocity(Real dt, const VectorGrid<Real>& source, VectorGrid<Real>& field, const VelocityField& vel,
+								const IntegrationOrder order, const InterpolationOrder interpOrder = InterpolationOrder::LINEAR)
+{
+	PROFILE_ZONE("advectStaggeredVelocity");
 
-		switch (interpOrder)
+	assert(&field != &source && field.isMatched(source));
+	assert(field.sampleType() == VectorGridSettings::SampleType::STAGGERED);
+
+	AdvectField<ScalarGrid<Real>> advectors[2] = { AdvectField<ScalarGrid<Real>>(source.grid(0)), AdvectField<ScalarGrid<Real>>(source.grid(1)) };
+
+	auto advectFace = [&](const Vec2ui& face, unsigned axis)
+	{
+		field(face, axis) = advectors[axis].advectSample(dt, field.indexToWorld(Vec2R(face), axis), vel, order, interpOrder);
+	};
+
+	const Vec2ui cellSize = field.gridSize();
+	const Vec2ui xFaceSize = field.size(0);
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, xFaceSize[0]), [&](const tbb::blocked_range<unsigned>& range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < xFaceSize[1]; ++j)
+				advectFace(Vec2ui(i, j), 0);
+	});
+
+	Real maxMagnitude2 = tbb::parallel_reduce(tbb::blocked_range<unsigned>(0, cellSize[0]), std::numeric_limits<Real>::min(),
+		[&](const tbb::blocked_range<unsigned>& range, Real max) -> Real
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
 		{
-		case InterpolationOrder::LINEAR:
-			field(cell) = myField.interp(pos);
-			break;
-		case InterpolationOrder::CUBIC:
-			field(cell) = myField.cubicInterp(pos, false, true);
-			break;
-		default:
-			assert(false);
-			break;
+			advectFace(Vec2ui(i, 0), 1);
+
+			for (unsigned j = 0; j < cellSize[1]; ++j)
+			{
+				advectFace(Vec2ui(i, j + 1), 1);
+
+				// Averaged in the same order as VectorGrid::maxMagnitude so the result matches it exactly
+				Vec2ui cell(i, j);
+				Vec2R avgVec(0);
+
+				for (unsigned axis : {0, 1})
+					for (unsigned direction : {0, 1})
+					{
+						Vec2ui face = cellToFace(cell, axis, direction);
+						avgVec[axis] += .5 * field(face, axis);
+					}
+
+				Real tempmag2 = mag2(avgVec);
+				if (max < tempmag2) max = tempmag2;
+			}
 		}
-	});
+
+		return max;
+	},
+		[](Real a, Real b) -> Real { return std::max(a, b); });
+
+	return sqrt(maxMagnitude2);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#ifndef LIBRARY_COMPACTINDEX_H
+#define LIBRARY_COMPACTINDEX_H
+
+#include <vector>
+
+#include "tbb/tbb.h"
+
+#include "Common.h"
+#include "UniformGrid.h"
+
+///////////////////////////////////
+//
+// CompactIndex.h
+// Ryan Goldade 2017
+//
+// Numbers the active voxels of a grid
+// with consecutive indices in parallel.
+// Each row counts its active voxels,
+// an exclusive scan over the row counts
+// gives every row its first index and
+// the rows are then numbered
+// independently. Voxels are numbered in
+// the same order as forEachVoxelRange
+// so the result is identical to a serial
+// count regardless of thread scheduling.
+//
+////////////////////////////////////
+
+// Assigns consecutive indices, starting at firstIndex, to the voxels in [start, end) for
+// which isActive(voxel) returns true. Inactive voxels are left untouched and must already
+// hold a negative label. isActive is called exactly once per voxel and is allowed to write
+// to other grids at that voxel. Returns the number of active voxels. The row counts are
+// scanned in rowStart, which a caller numbering every timestep can keep around.
+template<typename IsActive>
+unsigned buildCompactIndex(UniformGrid<int>& index, const Vec2ui& start, const Vec2ui& end,
+							const IsActive& isActive, unsigned firstIndex, std::vector<unsigned>& rowStart)
+{
+	assert(start[0] <= end[0] && start[1] <= end[1]);
+	assert(end[0] <= index.size()[0] && end[1] <= index.size()[1]);
+
+	unsigned rowCount = end[0] - start[0];
+	rowStart.assign(rowCount + 1, 0);
+
+	// Flag active voxels and count them per row. Flagged voxels hold zero until they're numbered.
+	tbb::parallel_for(tbb::blocked_range<unsigned>(start[0], end[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+		{
+			unsigned count = 0;
+			for (unsigned j = start[1]; j < end[1]; ++j)
+			{
+				Vec2ui voxel(i, j);
+				if (isActive(voxel))
+				{
+					index(voxel) = 0;
+					++count;
+				}
+				else assert(index(voxel) < 0);
+			}
+
+			rowStart[i - start[0] + 1] = count;
+		}
+	});
+
+	// Exclusive scan. There is one entry per row so this is cheap compared to the grid passes.
+	rowStart[0] = firstIndex;
+	for (unsigned row = 0; row < rowCount; ++row)
+		rowStart[row + 1] += rowStart[row];
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(start[0], end[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+		{
+			unsigned nextIndex = rowStart[i - start[0]];
+			for (unsigned j = start[1]; j < end[1]; ++j)
+			{
+				Vec2ui voxel(i, j);
+				if (index(voxel) >= 0)
+					index(voxel) = int(nextIndex++);
+			}
+
+			assert(nextIndex == rowStart[i - start[0] + 1]);
+		}
+	});
+
+	return rowStart[rowCount] - firstIndex;
+}
+
+template<typename IsActive>
+unsigned buildCompactIndex(UniformGrid<int>& index, const Vec2ui& start, const Vec2ui& end,
+							const IsActive& isActive, unsigned firstIndex = 0)
+{
+	std::vector<unsigned> rowStart;
+	return buildCompactIndex(index, start, end, isActive, firstIndex, rowStart);
+}
+
+template<typename IsActive>
+unsigned buildCompactIndex(UniformGrid<int>& index, const IsActive& isActive)
+{
+	return buildCompactIndex(index, Vec2ui(0), index.size(), isActive);
+}
+
+#endif
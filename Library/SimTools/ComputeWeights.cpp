@@ -1,5 +1,7 @@
 #include "ComputeWeights.h"
 
+#include "tbb/tbb.h"
+
 VectorGrid<Real> computeGhostFluidWeights(const LevelSet2D& surface)
 {
 	VectorGrid<Real> ghostFluidWeights(surface.xform(), surface.size(), 0, VectorGridSettings::SampleType::STAGGERED);
@@ -33,6 +35,15 @@ VectorGrid<Real> computeGhostFluidWeights(const LevelSet2D& surface)
 VectorGrid<Real> computeCutCellWeights(const LevelSet2D& surface, bool invert, Real minWeight)
 {
 	VectorGrid<Real> cutCellWeights(surface.xform(), surface.size(), 0, VectorGridSettings::SampleType::STAGGERED);
+	computeCutCellWeights(surface, cutCellWeights, invert, minWeight);
+	return cutCellWeights;
+}
+
+void computeCutCellWeights(const LevelSet2D& surface, VectorGrid<Real>& cutCellWeights, bool invert, Real minWeight)
+{
+	assert(cutCellWeights.sampleType() == VectorGridSettings::SampleType::STAGGERED &&
+			cutCellWeights.size(0)[0] == surface.size()[0] + 1 && cutCellWeights.size(0)[1] == surface.size()[1] &&
+			cutCellWeights.size(1)[0] == surface.size()[0] && cutCellWeights.size(1)[1] == surface.size()[1] + 1);
 
 	for (unsigned axis : {0, 1})
 	{
@@ -59,8 +70,6 @@ VectorGrid<Real> computeCutCellWeights(const LevelSet2D& surface, bool invert, R
 			cutCellWeights(face, axis) = weight;
 		});
 	}
-
-	return cutCellWeights;
 }
 
 // There is no assumption about grid alignment for this method because
@@ -138,4 +147,140 @@ VectorGrid<Real> computeSupersampledFaceAreas(const LevelSet2D& surface, unsigne
 	}
 
 	return volumes;
-}
\ No newline at end of file
+}
+
+// Fraction of a triangle inside the surface, assuming phi is linear over the triangle.
+static Real triangleAreaFraction(Real phi0, Real phi1, Real phi2)
+{
+	unsigned insideCount = (phi0 < 0.) + (phi1 < 0.) + (phi2 < 0.);
+
+	if (insideCount == 0) return 0.;
+	if (insideCount == 3) return 1.;
+
+	// Rotate so that phi0 is the vertex with a different sign from the other two
+	bool isCornerInside = insideCount == 1;
+	if ((phi1 < 0.) == isCornerInside) std::swap(phi0, phi1);
+	else if ((phi2 < 0.) == isCornerInside) std::swap(phi0, phi2);
+
+	// The sub-triangle cut off at phi0 has an area fraction of the product of the edge length fractions
+	Real cornerFraction = Util::sqr(phi0) / ((phi0 - phi1) * (phi0 - phi2));
+
+	return isCornerInside ? cornerFraction : 1. - cornerFraction;
+}
+
+// Fraction of a square inside the surface. The square is split into four triangles
+// around its center, where the bilinear value is the average of the corners.
+Real squareAreaFraction(Real phi00, Real phi10, Real phi01, Real phi11)
+{
+	if (phi00 < 0. && phi10 < 0. && phi01 < 0. && phi11 < 0.) return 1.;
+	if (phi00 >= 0. && phi10 >= 0. && phi01 >= 0. && phi11 >= 0.) return 0.;
+
+	Real phiCenter = .25 * (phi00 + phi10 + phi01 + phi11);
+
+	return .25 * (triangleAreaFraction(phi00, phi10, phiCenter) +
+					triangleAreaFraction(phi10, phi11, phiCenter) +
+					triangleAreaFraction(phi11, phi01, phiCenter) +
+					triangleAreaFraction(phi01, phi00, phiCenter));
+}
+
+// Quarter cell corner k lies between cell centers low and high, or on one if they're equal.
+// Indices are clamped to match interp.
+static std::pair<unsigned, unsigned> quarterCellCornerIndices(unsigned k, unsigned size)
+{
+	int low = (k % 2 == 0) ? int(k) / 2 - 1 : (int(k) - 3) / 2;
+	int high = (k % 2 == 0) ? low : (int(k) - 1) / 2;
+
+	return std::make_pair(unsigned(Util::clamp(low, 0, int(size) - 1)), unsigned(Util::clamp(high, 0, int(size) - 1)));
+}
+
+// The bilinear surface at an integer or half-integer point is the average of the nearest cell centers
+Real quarterCellCorner(const LevelSet2D& surface, unsigned k, unsigned l)
+{
+	auto xIndices = quarterCellCornerIndices(k, surface.size()[0]);
+	auto yIndices = quarterCellCornerIndices(l, surface.size()[1]);
+
+	return .25 * (surface(xIndices.first, yIndices.first) + surface(xIndices.second, yIndices.first) +
+					surface(xIndices.first, yIndices.second) + surface(xIndices.second, yIndices.second));
+}
+
+void sampleQuarterCellCorners(const LevelSet2D& surface, unsigned k, std::vector<Real>& corners)
+{
+	assert(corners.size() == quarterCellGridSize(surface.size())[1] + 1);
+
+	for (unsigned l = 0; l < corners.size(); ++l)
+		corners[l] = quarterCellCorner(surface, k, l);
+}
+
+void computeQuarterCellAreas(const std::vector<Real>& lowerCorners, const std::vector<Real>& upperCorners,
+								unsigned k, UniformGrid<Real>& quarterAreas)
+{
+	assert(lowerCorners.size() == quarterAreas.size()[1] + 1 && upperCorners.size() == lowerCorners.size());
+
+	// Each quarter cell is a quarter of a full control volume
+	for (unsigned l = 0; l < quarterAreas.size()[1]; ++l)
+		quarterAreas(k, l) = .25 * squareAreaFraction(lowerCorners[l], upperCorners[l], lowerCorners[l + 1], upperCorners[l + 1]);
+}
+
+void assembleAreaFractions(const UniformGrid<Real>& quarterAreas,
+							ScalarGrid<Real>& centerAreas,
+							ScalarGrid<Real>& nodeAreas,
+							VectorGrid<Real>& faceAreas)
+{
+	// Along each axis, a cell center i is covered by quarter cells 2i + 1 and 2i + 2 and a node i
+	// is covered by quarter cells 2i and 2i + 1.
+	auto assembleAreas = [&](ScalarGrid<Real>& areas, const Vec2ui& quarterOffset)
+	{
+		Vec2ui areaSize = areas.size();
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, areaSize[0]), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < areaSize[1]; ++j)
+				{
+					unsigned qi = 2 * i + quarterOffset[0];
+					unsigned qj = 2 * j + quarterOffset[1];
+
+					areas(i, j) = quarterAreas(qi, qj) + quarterAreas(qi + 1, qj) +
+									quarterAreas(qi, qj + 1) + quarterAreas(qi + 1, qj + 1);
+				}
+		});
+	};
+
+	assembleAreas(centerAreas, Vec2ui(1, 1));
+	assembleAreas(nodeAreas, Vec2ui(0, 0));
+	assembleAreas(faceAreas.grid(0), Vec2ui(0, 1));
+	assembleAreas(faceAreas.grid(1), Vec2ui(1, 0));
+}
+
+void computeAreaFractions(const LevelSet2D& surface,
+							ScalarGrid<Real>& centerAreas,
+							ScalarGrid<Real>& nodeAreas,
+							VectorGrid<Real>& faceAreas)
+{
+	assert(surface.isMatched(centerAreas) && centerAreas.sampleType() == ScalarGridSettings::SampleType::CENTER);
+	assert(nodeAreas.xform() == surface.xform() && nodeAreas.sampleType() == ScalarGridSettings::SampleType::NODE);
+	assert(nodeAreas.size() == surface.size() + Vec2ui(1));
+	assert(faceAreas.xform() == surface.xform() && faceAreas.sampleType() == VectorGridSettings::SampleType::STAGGERED);
+	assert(faceAreas.gridSize() == surface.size());
+
+	Vec2ui quarterSize = quarterCellGridSize(surface.size());
+
+	UniformGrid<Real> quarterAreas(quarterSize);
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, quarterSize[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		std::vector<Real> lowerCorners(quarterSize[1] + 1), upperCorners(quarterSize[1] + 1);
+
+		sampleQuarterCellCorners(surface, range.begin(), upperCorners);
+
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+		{
+			std::swap(lowerCorners, upperCorners);
+			sampleQuarterCellCorners(surface, i + 1, upperCorners);
+
+			computeQuarterCellAreas(lowerCorners, upperCorners, i, quarterAreas);
+		}
+	});
+
+	assembleAreaFractions(quarterAreas, centerAreas, nodeAreas, faceAreas);
+}
@@ -1,6 +1,8 @@
 #ifndef LIBRARY_COMPUTEWEIGHTS_H
 #define LIBRARY_COMPUTEWEIGHTS_H
 
+#include <vector>
+
 #include "Common.h"
 #include "LevelSet2D.h"
 #include "ScalarGrid.h"
@@ -19,9 +21,50 @@
 
 VectorGrid<Real> computeGhostFluidWeights(const LevelSet2D& surface);
 VectorGrid<Real> computeCutCellWeights(const LevelSet2D &surface, bool invert = false, Real minWeight = 0.01);
+
+// Fills an existing staggered grid that matches the surface so a caller computing weights
+// every timestep can keep reusing it
+void computeCutCellWeights(const LevelSet2D &surface, VectorGrid<Real>& cutCellWeights, bool invert = false, Real minWeight = 0.01);
 ScalarGrid<Real> computeSupersampledAreas(const LevelSet2D& surface,
 	ScalarGridSettings::SampleType sampleType,
 	unsigned samples);
 VectorGrid<Real> computeSupersampledFaceAreas(const LevelSet2D& surface, unsigned samples);
 
+// Fraction of a square inside the surface given the surface values at its corners.
+// The surface is treated as piecewise linear over four triangles around the square center.
+Real squareAreaFraction(Real phi00, Real phi10, Real phi01, Real phi11);
+
+// Exact area fractions of the piecewise-linear surface for the center, node and face control volumes.
+// The surface is sampled every half cell and the area inside each quarter cell is found from its
+// corner values. Every control volume is a union of four quarter cells so all of the areas come
+// out of one pass over the surface. The output grids must match the surface with the matching sample type.
+void computeAreaFractions(const LevelSet2D& surface,
+							ScalarGrid<Real>& centerAreas,
+							ScalarGrid<Real>& nodeAreas,
+							VectorGrid<Real>& faceAreas);
+
+// Building blocks of computeAreaFractions for callers that fuse it into their own traversal.
+// Quarter cells tile the domain from the lowest node control volume to the highest, which reaches
+// a half cell outside of the surface grid on every side. Quarter cell q covers [(q - 2) / 2, (q - 1) / 2]
+// in the cell center index space of the surface.
+inline Vec2ui quarterCellGridSize(const Vec2ui& size) { return 2 * size + Vec2ui(2); }
+
+// The bilinear surface at quarter cell corner (k, l), which sits at ((k - 2) / 2, (l - 2) / 2) in the cell
+// center index space. Node (i, j) of the surface grid is corner (2i + 1, 2j + 1).
+Real quarterCellCorner(const LevelSet2D& surface, unsigned k, unsigned l);
+
+// Samples the corners along column k of the quarter cell grid. Corners must have one more entry
+// than the quarter cell grid has rows.
+void sampleQuarterCellCorners(const LevelSet2D& surface, unsigned k, std::vector<Real>& corners);
+
+// Area fractions of the quarter cells in column k from the corners on either side of it
+void computeQuarterCellAreas(const std::vector<Real>& lowerCorners, const std::vector<Real>& upperCorners,
+								unsigned k, UniformGrid<Real>& quarterAreas);
+
+// Sums the four quarter cells that make up each control volume
+void assembleAreaFractions(const UniformGrid<Real>& quarterAreas,
+							ScalarGrid<Real>& centerAreas,
+							ScalarGrid<Real>& nodeAreas,
+							VectorGrid<Real>& faceAreas);
+
 #endif
\ No newline at end of file
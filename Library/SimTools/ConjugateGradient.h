@@ -0,0 +1,174 @@
+#ifndef LIBRARY_CONJUGATEGRADIENT_H
+#define LIBRARY_CONJUGATEGRADIENT_H
+
+#include <cmath>
+#include <vector>
+
+#include "tbb/tbb.h"
+
+#include "BufferUtilities.h"
+#include "Common.h"
+#include "Reduction.h"
+
+///////////////////////////////////
+//
+// ConjugateGradient.h
+// Ryan Goldade 2017
+//
+// Preconditioned conjugate gradient for
+// symmetric positive definite systems
+// that are only available through their
+// action on a vector. Nothing is
+// assembled so the caller is free to
+// apply the operator straight from grid
+// stencils. Vector operations run in
+// parallel. Dot products go through
+// Reduction so a REPRODUCIBLE build
+// converges identically at any thread
+// count.
+//
+////////////////////////////////////
+
+using SolveVector = std::vector<double>;
+
+// Work vectors of a solve. A caller that solves every timestep keeps these around so
+// they only reallocate when the system grows.
+struct ConjugateGradientBuffers
+{
+	SolveVector residual, direction, operatorDirection, preconditioned;
+};
+
+struct ConjugateGradientResult
+{
+	bool converged;
+	unsigned iterations;
+	// Relative residual |b - Ax| / |b| at exit
+	double residual;
+};
+
+inline double dotProduct(const SolveVector& a, const SolveVector& b)
+{
+	assert(a.size() == b.size());
+
+	return Reduction::sum(unsigned(a.size()), [&](unsigned begin, unsigned end, auto& sum)
+	{
+		for (unsigned i = begin; i != end; ++i)
+			sum += a[i] * b[i];
+	});
+}
+
+// y = x + a * y
+inline void scaleAndAddVector(SolveVector& y, const SolveVector& x, double a)
+{
+	assert(x.size() == y.size());
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, unsigned(y.size())), [&](const tbb::blocked_range<unsigned>& range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			y[i] = x[i] + a * y[i];
+	});
+}
+
+// The operator and the preconditioner are functors of the form f(const SolveVector& in, SolveVector& out)
+// that overwrite out. The solution vector is used as the initial guess. Convergence matches Eigen's
+// ConjugateGradient: the residual relative to the right hand side must fall below the tolerance.
+template<typename Operator, typename Preconditioner>
+ConjugateGradientResult solveConjugateGradient(const Operator& applyOperator,
+												const Preconditioner& applyPreconditioner,
+												const SolveVector& rhs,
+												SolveVector& solution,
+												double tolerance,
+												unsigned maxIterations,
+												ConjugateGradientBuffers& buffers)
+{
+	assert(rhs.size() == solution.size());
+
+	ConjugateGradientResult result;
+	result.converged = true;
+	result.iterations = 0;
+	result.residual = 0;
+
+	unsigned size = unsigned(rhs.size());
+
+	double rhsNorm2 = dotProduct(rhs, rhs);
+	if (rhsNorm2 == 0)
+	{
+		reserveWithHeadroom(solution, size);
+		solution.assign(size, 0);
+		return result;
+	}
+
+	double threshold = tolerance * tolerance * rhsNorm2;
+
+	SolveVector& residual = buffers.residual;
+	SolveVector& direction = buffers.direction;
+	SolveVector& operatorDirection = buffers.operatorDirection;
+	SolveVector& preconditioned = buffers.preconditioned;
+
+	residual.resize(size);
+	direction.resize(size);
+	operatorDirection.resize(size);
+	preconditioned.resize(size);
+
+	// r = b - Ax
+	applyOperator(solution, residual);
+	scaleAndAddVector(residual, rhs, -1.);
+
+	double residualNorm2 = dotProduct(residual, residual);
+
+	if (residualNorm2 > threshold)
+	{
+		applyPreconditioner(residual, direction);
+		double absNew = dotProduct(residual, direction);
+
+		while (result.iterations < maxIterations)
+		{
+			applyOperator(direction, operatorDirection);
+
+			double alpha = absNew / dotProduct(direction, operatorDirection);
+
+			// x = x + alpha * p and r = r - alpha * Ap in a single pass
+			residualNorm2 = Reduction::sum(size, [&](unsigned begin, unsigned end, auto& sum)
+			{
+				for (unsigned i = begin; i != end; ++i)
+				{
+					solution[i] += alpha * direction[i];
+					residual[i] -= alpha * operatorDirection[i];
+					sum += residual[i] * residual[i];
+				}
+			});
+
+			++result.iterations;
+
+			if (residualNorm2 < threshold)
+				break;
+
+			applyPreconditioner(residual, preconditioned);
+
+			double absOld = absNew;
+			absNew = dotProduct(residual, preconditioned);
+
+			// p = z + beta * p
+			scaleAndAddVector(direction, preconditioned, absNew / absOld);
+		}
+	}
+
+	result.residual = std::sqrt(residualNorm2 / rhsNorm2);
+	result.converged = residualNorm2 <= threshold;
+
+	return result;
+}
+
+template<typename Operator, typename Preconditioner>
+ConjugateGradientResult solveConjugateGradient(const Operator& applyOperator,
+												const Preconditioner& applyPreconditioner,
+												const SolveVector& rhs,
+												SolveVector& solution,
+												double tolerance,
+												unsigned maxIterations)
+{
+	ConjugateGradientBuffers buffers;
+	return solveConjugateGradient(applyOperator, applyPreconditioner, rhs, solution, tolerance, maxIterations, buffers);
+}
+
+#endif
@@ -1,10 +1,16 @@
 #ifndef LIBRARY_EXTRAPOLATEFIELD_H
 #define LIBRARY_EXTRAPOLATEFIELD_H
 
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
 
-#include <queue>
+#include "tbb/tbb.h"
 
+#include "BufferUtilities.h"
 #include "Common.h"
+#include "LevelSet2D.h"
 #include "VectorGrid.h"
 
 ///////////////////////////////////
@@ -16,139 +22,646 @@
 // of a mask outward based on a simple
 // BFS flood fill approach. Values
 // are averaged from FINISHED neighbours.
-// Note that because this process happens
-// "in order" there could be some bias
-// based on which boundary locations
-// are inserted into the queue first.
 //
+// The flood fill is layer-synchronous:
+// every cell in a BFS front only reads
+// from cells finished in previous fronts
+// so a whole front is updated in parallel
+// and the result doesn't depend on the
+// order cells are visited in.
+//
+// An optional PDE-based extrapolation
+// (Aslam 2004) relaxes the extrapolated
+// values along the surface normal.
+//
+// The closest-point extrapolation visits
+// cells in order of increasing distance
+// to the surface and takes values from
+// upwind neighbours along the normal so
+// values are carried out along the
+// normal in a single sweep.
 //
 ////////////////////////////////////
 
+// Scratch for extrapolating a field. The axes of a staggered field are extrapolated
+// at the same time so each gets its own set. A simulator that extrapolates every
+// timestep keeps one of these around so the work lists keep their storage.
+class ExtrapolationBuffers
+{
+	template<typename> friend class ExtrapolateField;
+
+	struct GridBuffers
+	{
+		using SortedCell = std::pair<Real, Vec2ui>;
+
+		UniformGrid<MarkedCells> markedCells;
+		UniformGrid<char> isKnown;
+
+		std::vector<SortedCell> targetList;
+		std::vector<Vec2R> normals;
+		std::vector<unsigned> remainingCells, unfinishedCells;
+
+		std::vector<Vec2ui> front, extrapolatedCells;
+		std::vector<char> isActive;
+		std::vector<Real> tempValues;
+
+		// The thread-local lists are emptied but never destroyed so they keep their storage too
+		tbb::enumerable_thread_specific<std::vector<SortedCell>> parallelTargetList;
+		tbb::enumerable_thread_specific<std::vector<Vec2ui>> parallelFrontList;
+	};
+
+	GridBuffers myGrids[2];
+};
+
 template<typename Field>
 class ExtrapolateField
 {
+	using GridBuffers = ExtrapolationBuffers::GridBuffers;
+
 public:
 	ExtrapolateField(Field& field)
 		: myField(field)
+		, myOwnedBuffers(new ExtrapolationBuffers)
+		, myBuffers(*myOwnedBuffers)
+		{}
+
+	// Works out of the caller's buffers, which must outlive the extrapolator
+	ExtrapolateField(Field& field, ExtrapolationBuffers& buffers)
+		: myField(field)
+		, myBuffers(buffers)
 		{}
 
 	void extrapolate(const ScalarGrid<MarkedCells>& mask, unsigned bandwidth = std::numeric_limits<unsigned>::max());
 
+	// Extrapolate both axes of a staggered field in one call. Only valid when the Field is a VectorGrid.
+	void extrapolate(const VectorGrid<MarkedCells>& mask, unsigned bandwidth = std::numeric_limits<unsigned>::max());
+
+	// Extrapolate using the flood fill above and then relax the extrapolated values
+	// by solving dq/dt + n * grad(q) = 0 outside of the surface, where n is the
+	// surface normal. Cells inside the surface keep their flood fill values.
+	void extrapolatePDE(const ScalarGrid<MarkedCells>& mask, const LevelSet2D& surface,
+						unsigned bandwidth, unsigned iterations);
+
+	void extrapolatePDE(const VectorGrid<MarkedCells>& mask, const LevelSet2D& surface,
+						unsigned bandwidth, unsigned iterations);
+
+	// Extrapolate along the surface normal to every cell within bandwidth grid cells of the surface.
+	// Cells are sorted by their distance to the surface so the result is independent of thread count.
+	void extrapolateAlongNormal(const ScalarGrid<MarkedCells>& mask, const LevelSet2D& surface, Real bandwidth);
+
+	void extrapolateAlongNormal(const VectorGrid<MarkedCells>& mask, const LevelSet2D& surface, Real bandwidth);
+
 private:
+
+	template<typename Grid>
+	static void extrapolateGridAlongNormal(Grid& field, const ScalarGrid<MarkedCells>& mask, const LevelSet2D& surface,
+											Real bandwidth, GridBuffers& buffers);
+
+	// The updated cells are left in the buffers' extrapolated cell list
+	template<typename Grid>
+	static void extrapolateGrid(Grid& field, const ScalarGrid<MarkedCells>& mask, unsigned bandwidth, GridBuffers& buffers);
+
+	template<typename Grid>
+	static void floodFill(Grid& field, UniformGrid<MarkedCells>& markedCells, unsigned bandwidth, GridBuffers& buffers);
+
+	template<typename Grid>
+	static void relaxGrid(Grid& field, const ScalarGrid<MarkedCells>& mask, const LevelSet2D& surface,
+							unsigned iterations, GridBuffers& buffers);
+
 	Field& myField;
-};
 
-//template<>
-//void ExtrapolateField<VectorGrid<Real>>::extrapolate(const VectorGrid<MarkedCells>& mask, unsigned bandwidth);
+	std::unique_ptr<ExtrapolationBuffers> myOwnedBuffers;
+	ExtrapolationBuffers& myBuffers;
+};
 
 template<typename Field>
 void ExtrapolateField<Field>::extrapolate(const ScalarGrid<MarkedCells>& mask, unsigned bandwidth)
 {
-	// Run a BFS flood outwards from masked cells and average the values of the neighbouring "finished" cells
-	// It could be made more accurate if we used the value of the "closer" cell (smaller SDF value)
-	// It could be made more efficient if we truncated the BFS after a large enough distance (max SDF value)
 	assert(myField.isMatched(mask));
+	extrapolateGrid(myField, mask, bandwidth, myBuffers.myGrids[0]);
+}
 
-	// Make local copy of mask
-	UniformGrid<MarkedCells> markedCells(myField.size(), MarkedCells::UNVISITED);
+template<typename Field>
+void ExtrapolateField<Field>::extrapolate(const VectorGrid<MarkedCells>& mask, unsigned bandwidth)
+{
+	assert(myField.isMatched(mask));
+
+	tbb::parallel_invoke([&] { extrapolateGrid(myField.grid(0), mask.grid(0), bandwidth, myBuffers.myGrids[0]); },
+							[&] { extrapolateGrid(myField.grid(1), mask.grid(1), bandwidth, myBuffers.myGrids[1]); });
+}
+
+template<typename Field>
+void ExtrapolateField<Field>::extrapolatePDE(const ScalarGrid<MarkedCells>& mask, const LevelSet2D& surface,
+												unsigned bandwidth, unsigned iterations)
+{
+	assert(myField.isMatched(mask));
+
+	extrapolateGrid(myField, mask, bandwidth, myBuffers.myGrids[0]);
+	relaxGrid(myField, mask, surface, iterations, myBuffers.myGrids[0]);
+}
+
+template<typename Field>
+void ExtrapolateField<Field>::extrapolatePDE(const VectorGrid<MarkedCells>& mask, const LevelSet2D& surface,
+												unsigned bandwidth, unsigned iterations)
+{
+	assert(myField.isMatched(mask));
+
+	tbb::parallel_invoke([&]
+	{
+		extrapolateGrid(myField.grid(0), mask.grid(0), bandwidth, myBuffers.myGrids[0]);
+		relaxGrid(myField.grid(0), mask.grid(0), surface, iterations, myBuffers.myGrids[0]);
+	},
+	[&]
+	{
+		extrapolateGrid(myField.grid(1), mask.grid(1), bandwidth, myBuffers.myGrids[1]);
+		relaxGrid(myField.grid(1), mask.grid(1), surface, iterations, myBuffers.myGrids[1]);
+	});
+}
+
+template<typename Field>
+void ExtrapolateField<Field>::extrapolateAlongNormal(const ScalarGrid<MarkedCells>& mask, const LevelSet2D& surface, Real bandwidth)
+{
+	assert(myField.isMatched(mask));
+	extrapolateGridAlongNormal(myField, mask, surface, bandwidth, myBuffers.myGrids[0]);
+}
+
+template<typename Field>
+void ExtrapolateField<Field>::extrapolateAlongNormal(const VectorGrid<MarkedCells>& mask, const LevelSet2D& surface, Real bandwidth)
+{
+	assert(myField.isMatched(mask));
 
-	forEachVoxelRange(Vec2ui(0), myField.size(), [&](const Vec2ui& cell)
+	tbb::parallel_invoke([&] { extrapolateGridAlongNormal(myField.grid(0), mask.grid(0), surface, bandwidth, myBuffers.myGrids[0]); },
+							[&] { extrapolateGridAlongNormal(myField.grid(1), mask.grid(1), surface, bandwidth, myBuffers.myGrids[1]); });
+}
+
+template<typename Field>
+template<typename Grid>
+void ExtrapolateField<Field>::extrapolateGridAlongNormal(Grid& field, const ScalarGrid<MarkedCells>& mask, const LevelSet2D& surface,
+															Real bandwidth, GridBuffers& buffers)
+{
+	assert(field.size() == mask.size());
+
+	Vec2ui size = field.size();
+
+	// Distances are clamped outside of the narrow band so they can't be used to order cells there
+	Real narrowBand = surface.narrowBand() * surface.dx();
+	Real phiBandwidth = std::min(bandwidth * surface.dx(), narrowBand);
+
+	using SortedCell = GridBuffers::SortedCell;
+
+	tbb::enumerable_thread_specific<std::vector<SortedCell>>& parallelTargetList = buffers.parallelTargetList;
+
+	UniformGrid<MarkedCells>& knownCells = buffers.markedCells;
+	knownCells.resize(size, MarkedCells::UNVISITED);
+
+	// Collect the cells inside the bandwidth that need a value along with their distance to the surface
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
 	{
-		if (mask(cell) == MarkedCells::FINISHED) markedCells(cell) = MarkedCells::FINISHED;
+		std::vector<SortedCell> &localTargetList = parallelTargetList.local();
+
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < size[1]; ++j)
+			{
+				if (mask(i, j) == MarkedCells::FINISHED)
+				{
+					knownCells(i, j) = MarkedCells::FINISHED;
+					continue;
+				}
+
+				Vec2R worldPoint = field.indexToWorld(Vec2R(i, j));
+
+				// Cheap rejection test using the closest surface sample. The distance function
+				// can't change by more than the distance to that sample and samples clamped to
+				// the narrow band are left to the flood fill below.
+				Vec2R surfaceIndex = surface.worldToIndex(worldPoint);
+				Vec2ui closestSample(std::min(unsigned(std::max(std::round(surfaceIndex[0]), Real(0))), surface.size()[0] - 1),
+										std::min(unsigned(std::max(std::round(surfaceIndex[1]), Real(0))), surface.size()[1] - 1));
+
+				Real samplePhi = surface(closestSample);
+				if (samplePhi >= phiBandwidth + surface.dx() || samplePhi >= narrowBand) continue;
+
+				Real phi = surface.interp(worldPoint);
+
+				if (phi < phiBandwidth)
+					localTargetList.push_back(SortedCell(phi, Vec2ui(i, j)));
+			}
 	});
 
-	using Voxel = std::pair<Vec2ui, unsigned>;
+	std::vector<SortedCell>& targetList = buffers.targetList;
+	targetList.clear();
 
-	// Initialize flood fill queue
-	std::queue<Voxel> markerQ;
+	gatherLocalLists(parallelTargetList, targetList);
 
-	// Load up neighbouring faces and push into queue
-	forEachVoxelRange(Vec2ui(0), myField.size(), [&](const Vec2ui& cell)
+	// Ties in distance are broken by the cell index so the order is unique
+	tbb::parallel_sort(targetList.begin(), targetList.end(), [](const SortedCell &a, const SortedCell &b) -> bool
 	{
-		if (markedCells(cell) == MarkedCells::FINISHED)
+		if (a.first < b.first) return true;
+		else if (a.first == b.first)
+		{
+			if (a.second[0] < b.second[0]) return true;
+			else if (a.second[0] == b.second[0] && a.second[1] < b.second[1]) return true;
+		}
+		return false;
+	});
+
+	unsigned targetCount = targetList.size();
+
+	std::vector<Vec2R>& normals = buffers.normals;
+	normals.resize(targetCount);
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, targetCount), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned r = range.begin(); r != range.end(); ++r)
+			normals[r] = surface.normal(field.indexToWorld(Vec2R(targetList[r].second)));
+	});
+
+	// Take the normal-weighted average of the known neighbours that are upwind (closer to the surface).
+	// If there are none, fall back to averaging all known neighbours.
+	auto extrapolateCell = [&](const Vec2ui& cell, const Vec2R& normal) -> bool
+	{
+		Real value = 0.;
+		Real weight = 0.;
+
+		for (unsigned axis : {0, 1})
+		{
+			Real normalWeight = std::fabs(normal[axis]);
+
+			if (normalWeight == 0) continue;
+
+			unsigned direction = normal[axis] > 0 ? 0 : 1;
+			Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
+
+			if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(size[axis])) continue;
+
+			if (knownCells(Vec2ui(adjacentCell)) == MarkedCells::FINISHED)
+			{
+				value += normalWeight * field(Vec2ui(adjacentCell));
+				weight += normalWeight;
+			}
+		}
+
+		if (weight == 0)
 		{
 			for (unsigned axis : {0, 1})
 				for (unsigned direction : {0, 1})
 				{
 					Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
 
-					// Boundary check
-					if (direction == 0 && adjacentCell[axis] < 0)
-						continue;
-					else if (direction == 1 && adjacentCell[axis] >= markedCells.size()[axis])
-						continue;
+					if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(size[axis])) continue;
 
-					if (markedCells(Vec2ui(adjacentCell)) == MarkedCells::UNVISITED)
+					if (knownCells(Vec2ui(adjacentCell)) == MarkedCells::FINISHED)
 					{
-						markerQ.push(Voxel(Vec2ui(adjacentCell), 1));
-						markedCells(Vec2ui(adjacentCell)) = MarkedCells::VISITED;
+						value += field(Vec2ui(adjacentCell));
+						++weight;
 					}
 				}
 		}
+
+		if (weight == 0) return false;
+
+		field(cell) = value / weight;
+		knownCells(cell) = MarkedCells::FINISHED;
+		return true;
+	};
+
+	// Single sweep in distance order. Cells that were not reachable in the sweep
+	// (e.g. no known neighbours yet) are revisited until no more progress can be made.
+	std::vector<unsigned>& remainingCells = buffers.remainingCells;
+	std::vector<unsigned>& unfinishedCells = buffers.unfinishedCells;
+
+	remainingCells.clear();
+
+	for (unsigned r = 0; r < targetCount; ++r)
+	{
+		if (!extrapolateCell(targetList[r].second, normals[r]))
+			remainingCells.push_back(r);
+	}
+
+	bool madeProgress = true;
+	while (madeProgress && !remainingCells.empty())
+	{
+		madeProgress = false;
+
+		unfinishedCells.clear();
+
+		for (unsigned r : remainingCells)
+		{
+			if (extrapolateCell(targetList[r].second, normals[r]))
+				madeProgress = true;
+			else
+				unfinishedCells.push_back(r);
+		}
+
+		std::swap(remainingCells, unfinishedCells);
+	}
+
+	// Flood fill the rest of the bandwidth that lies outside of the narrow band, starting
+	// from the neighbours of the swept cells.
+	if (bandwidth > surface.narrowBand())
+	{
+		std::vector<Vec2ui>& front = buffers.front;
+		front.clear();
+
+		for (unsigned r = 0; r < targetCount; ++r)
+		{
+			Vec2ui cell = targetList[r].second;
+
+			if (knownCells(cell) != MarkedCells::FINISHED) continue;
+
+			for (unsigned axis : {0, 1})
+				for (unsigned direction : {0, 1})
+				{
+					Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
+
+					if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(size[axis])) continue;
+
+					if (knownCells(Vec2ui(adjacentCell)) == MarkedCells::UNVISITED)
+					{
+						knownCells(Vec2ui(adjacentCell)) = MarkedCells::VISITED;
+						front.push_back(Vec2ui(adjacentCell));
+					}
+				}
+		}
+
+		for (const Vec2ui& cell : front)
+			knownCells(cell) = MarkedCells::UNVISITED;
+
+		floodFill(field, knownCells, unsigned(bandwidth - surface.narrowBand()) + 1, buffers);
+	}
+}
+
+template<typename Field>
+template<typename Grid>
+void ExtrapolateField<Field>::extrapolateGrid(Grid& field, const ScalarGrid<MarkedCells>& mask, unsigned bandwidth, GridBuffers& buffers)
+{
+	assert(field.size() == mask.size());
+
+	Vec2ui size = field.size();
+
+	// Make local copy of mask
+	UniformGrid<MarkedCells>& markedCells = buffers.markedCells;
+	markedCells.resize(size, MarkedCells::UNVISITED);
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < size[1]; ++j)
+			{
+				if (mask(i, j) == MarkedCells::FINISHED) markedCells(i, j) = MarkedCells::FINISHED;
+			}
 	});
 
-	while (!markerQ.empty())
+	tbb::enumerable_thread_specific<std::vector<Vec2ui>>& parallelFrontList = buffers.parallelFrontList;
+
+	// Load up the first layer of cells neighbouring the mask
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
 	{
-		// Store reference to updated faces to set as finished after
-		// this layer is completed
-		std::queue<Voxel> tempQ = markerQ;
-		// Store references to next layer of faces
-		std::queue<Voxel> newLayer;
+		std::vector<Vec2ui> &localFrontList = parallelFrontList.local();
 
-		while (!markerQ.empty())
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < size[1]; ++j)
+			{
+				if (markedCells(i, j) != MarkedCells::UNVISITED) continue;
+
+				if ((i > 0 && markedCells(i - 1, j) == MarkedCells::FINISHED) ||
+					(i < size[0] - 1 && markedCells(i + 1, j) == MarkedCells::FINISHED) ||
+					(j > 0 && markedCells(i, j - 1) == MarkedCells::FINISHED) ||
+					(j < size[1] - 1 && markedCells(i, j + 1) == MarkedCells::FINISHED))
+					localFrontList.push_back(Vec2ui(i, j));
+			}
+	});
+
+	std::vector<Vec2ui>& front = buffers.front;
+	front.clear();
+
+	gatherLocalLists(parallelFrontList, front);
+
+	floodFill(field, markedCells, bandwidth, buffers);
+}
+
+// Flood fill outwards from FINISHED cells, starting with the UNVISITED cells in the buffers' front.
+// The cells that were updated are left in the buffers' extrapolated cell list.
+template<typename Field>
+template<typename Grid>
+void ExtrapolateField<Field>::floodFill(Grid& field, UniformGrid<MarkedCells>& markedCells, unsigned bandwidth, GridBuffers& buffers)
+{
+	assert(field.size() == markedCells.size());
+
+	Vec2ui size = field.size();
+
+	auto setVisited = [&](const std::vector<Vec2ui>& cells)
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, cells.size()), [&](const tbb::blocked_range<unsigned> &range)
 		{
-			Voxel voxel = markerQ.front();
-			Vec2ui cell = voxel.first;
-			markerQ.pop();
+			for (unsigned r = range.begin(); r != range.end(); ++r)
+			{
+				assert(markedCells(cells[r]) == MarkedCells::UNVISITED);
+				markedCells(cells[r]) = MarkedCells::VISITED;
+			}
+		});
+	};
 
-			assert(markedCells(cell) == MarkedCells::VISITED);
+	// A neighbour of the front is only added to the next front by its first adjacent front cell
+	// so no cell is added twice.
+	auto firstFrontNeighbour = [&](const Vec2i& cell) -> Vec2i
+	{
+		for (unsigned axis : {0, 1})
+			for (unsigned direction : {0, 1})
+			{
+				Vec2i adjacentCell = cellToCell(cell, axis, direction);
 
-			Real value = 0.;
-			Real count = 0.;
+				if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(size[axis])) continue;
 
-			if (voxel.second < bandwidth)
+				if (markedCells(Vec2ui(adjacentCell)) == MarkedCells::VISITED)
+					return adjacentCell;
+			}
+
+		assert(false);
+		return cell;
+	};
+
+	std::vector<Vec2ui>& front = buffers.front;
+	setVisited(front);
+
+	tbb::enumerable_thread_specific<std::vector<Vec2ui>>& parallelFrontList = buffers.parallelFrontList;
+
+	std::vector<Vec2ui>& extrapolatedCells = buffers.extrapolatedCells;
+	extrapolatedCells.clear();
+
+	// Cells in the layer equal to the bandwidth and beyond are left untouched
+	for (unsigned layer = 1; layer < bandwidth && !front.empty(); ++layer)
+	{
+		unsigned frontCount = front.size();
+
+		// Every cell in the front only reads from FINISHED cells so the layer
+		// can be updated in any order.
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, frontCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned r = range.begin(); r != range.end(); ++r)
 			{
+				Vec2ui cell = front[r];
+
+				assert(markedCells(cell) == MarkedCells::VISITED);
+
+				Real value = 0.;
+				Real count = 0.;
+
 				for (unsigned axis : {0, 1})
 					for (unsigned direction : {0, 1})
 					{
 						Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
 
-						// Boundary check
-						if (direction == 0 && adjacentCell[axis] < 0)
-							continue;
-						else if (direction == 1 && adjacentCell[axis] >= markedCells.size()[axis])
-							continue;
+						if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(size[axis])) continue;
 
 						if (markedCells(Vec2ui(adjacentCell)) == MarkedCells::FINISHED)
 						{
-							value += myField(Vec2ui(adjacentCell));
+							value += field(Vec2ui(adjacentCell));
 							++count;
 						}
-						else if (markedCells(Vec2ui(adjacentCell)) == MarkedCells::UNVISITED)
-						{
-							newLayer.push(Voxel(Vec2ui(adjacentCell), voxel.second + 1));
-							markedCells(Vec2ui(adjacentCell)) = MarkedCells::VISITED;
-						}
 					}
 
 				assert(count > 0);
-				myField(cell) = value / count;
+				field(cell) = value / count;
 			}
+		});
+
+		extrapolatedCells.insert(extrapolatedCells.end(), front.begin(), front.end());
+
+		// Build the next layer from unvisited neighbours of the current front
+		if (layer + 1 < bandwidth)
+		{
+			tbb::parallel_for(tbb::blocked_range<unsigned>(0, frontCount), [&](const tbb::blocked_range<unsigned> &range)
+			{
+				std::vector<Vec2ui> &localFrontList = parallelFrontList.local();
+
+				for (unsigned r = range.begin(); r != range.end(); ++r)
+				{
+					Vec2ui cell = front[r];
+
+					for (unsigned axis : {0, 1})
+						for (unsigned direction : {0, 1})
+						{
+							Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
+
+							if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(size[axis])) continue;
+
+							if (markedCells(Vec2ui(adjacentCell)) != MarkedCells::UNVISITED) continue;
+
+							if (firstFrontNeighbour(adjacentCell) == Vec2i(cell))
+								localFrontList.push_back(Vec2ui(adjacentCell));
+						}
+				}
+			});
 		}
 
-		//Set update cells to finished
-		while (!tempQ.empty())
+		// Set updated cells to finished
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, frontCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned r = range.begin(); r != range.end(); ++r)
+				markedCells(front[r]) = MarkedCells::FINISHED;
+		});
+
+		front.clear();
+
+		gatherLocalLists(parallelFrontList, front);
+
+		setVisited(front);
+	}
+}
+
+template<typename Field>
+template<typename Grid>
+void ExtrapolateField<Field>::relaxGrid(Grid& field, const ScalarGrid<MarkedCells>& mask, const LevelSet2D& surface,
+										unsigned iterations, GridBuffers& buffers)
+{
+	Vec2ui size = field.size();
+
+	const std::vector<Vec2ui>& extrapolatedCells = buffers.extrapolatedCells;
+
+	// Cells that hold a meaningful value, either from the mask or from the flood fill
+	UniformGrid<char>& isKnown = buffers.isKnown;
+	isKnown.resize(size, 0);
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < size[1]; ++j)
+			{
+				if (mask(i, j) == MarkedCells::FINISHED) isKnown(i, j) = 1;
+			}
+	});
+
+	unsigned extrapolatedCount = extrapolatedCells.size();
+
+	// Only cells outside of the surface are relaxed. Upwind neighbours are the ones
+	// closer to the surface along the normal direction.
+	std::vector<Vec2R>& normals = buffers.normals;
+	std::vector<char>& isActive = buffers.isActive;
+
+	normals.resize(extrapolatedCount);
+	isActive.resize(extrapolatedCount);
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, extrapolatedCount), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned r = range.begin(); r != range.end(); ++r)
 		{
-			Voxel voxel = tempQ.front();
-			Vec2ui idx = voxel.first;
-			tempQ.pop();
-			assert(markedCells(idx) == MarkedCells::VISITED);
-			markedCells(idx) = MarkedCells::FINISHED;
+			Vec2R worldPoint = field.indexToWorld(Vec2R(extrapolatedCells[r]));
+
+			isActive[r] = surface.interp(worldPoint) > 0;
+			normals[r] = surface.normal(worldPoint);
+
+			if (normals[r] == Vec2R(0)) isActive[r] = 0;
+
+			isKnown(extrapolatedCells[r]) = 1;
 		}
+	});
+
+	std::vector<Real>& tempValues = buffers.tempValues;
+	tempValues.resize(extrapolatedCount);
+
+	for (unsigned iteration = 0; iteration < iterations; ++iteration)
+	{
+		// With the largest stable pseudo-timestep of 1 / (|nx| + |ny|) the explicit
+		// update collapses to a normal-weighted average of the upwind neighbours.
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, extrapolatedCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned r = range.begin(); r != range.end(); ++r)
+			{
+				Vec2ui cell = extrapolatedCells[r];
+
+				tempValues[r] = field(cell);
 
-		//Copy new queue
-		std::swap(markerQ, newLayer);
+				if (!isActive[r]) continue;
+
+				Real value = 0;
+				Real weight = 0;
+
+				for (unsigned axis : {0, 1})
+				{
+					Real normalWeight = std::fabs(normals[r][axis]);
+
+					if (normalWeight == 0) continue;
+
+					unsigned direction = normals[r][axis] > 0 ? 0 : 1;
+					Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
+
+					if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(size[axis])) continue;
+					if (!isKnown(Vec2ui(adjacentCell))) continue;
+
+					value += normalWeight * field(Vec2ui(adjacentCell));
+					weight += normalWeight;
+				}
+
+				if (weight > 0) tempValues[r] = value / weight;
+			}
+		});
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, extrapolatedCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned r = range.begin(); r != range.end(); ++r)
+				field(extrapolatedCells[r]) = tempValues[r];
+		});
 	}
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,249 @@
+#include <cmath>
+
+#include "tbb/tbb.h"
+
+#include "GridPoissonSolver.h"
+
+#include "Reduction.h"
+#include "Timer.h"
+
+// Fraction of the dropped fill-in that is added back to the diagonal
+static constexpr double MICTUNING = .97;
+
+// Fall back to the unmodified diagonal if the factored diagonal falls below this fraction of it
+static constexpr double MICSAFETY = .25;
+
+GridPoissonSolver::GridPoissonSolver(const UniformGrid<int>& cellIndex, unsigned unknownCount)
+	: myUnknownCount(unknownCount)
+	, myDiagonal(unknownCount, 0)
+	, myRhs(unknownCount, 0)
+	, mySolution(unknownCount, 0)
+	, myTolerance(1E-5)
+	, myMaxIterations(0)
+{
+	for (unsigned axis : {0, 1})
+	{
+		myCouplings[axis].assign(unknownCount, 0);
+
+		for (unsigned direction : {0, 1})
+			myNeighbours[axis][direction].assign(unknownCount, -1);
+	}
+
+	Vec2ui size = cellIndex.size();
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < size[1]; ++j)
+			{
+				Vec2ui cell(i, j);
+
+				int row = cellIndex(cell);
+				if (row < 0) continue;
+
+				assert(unsigned(row) < unknownCount);
+
+				for (unsigned axis : {0, 1})
+					for (unsigned direction : {0, 1})
+					{
+						Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
+
+						if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(size[axis])) continue;
+
+						int adjacentRow = cellIndex(Vec2ui(adjacentCell));
+
+						// The preconditioner relies on the lower neighbours being factored first
+						assert(adjacentRow < 0 || (direction == 0 ? adjacentRow < row : adjacentRow > row));
+
+						myNeighbours[axis][direction][row] = adjacentRow;
+					}
+			}
+	});
+}
+
+void GridPoissonSolver::applyMatrix(const SolveVector& input, SolveVector& output) const
+{
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, myUnknownCount), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned row = range.begin(); row != range.end(); ++row)
+		{
+			double value = myDiagonal[row] * input[row];
+
+			for (unsigned axis : {0, 1})
+			{
+				int lowerRow = myNeighbours[axis][0][row];
+				if (lowerRow >= 0)
+					value += myCouplings[axis][lowerRow] * input[lowerRow];
+
+				int upperRow = myNeighbours[axis][1][row];
+				if (upperRow >= 0)
+					value += myCouplings[axis][row] * input[upperRow];
+			}
+
+			output[row] = value;
+		}
+	});
+}
+
+// MIC(0) as in Bridson's "Fluid Simulation for Computer Graphics". The factorization and the
+// triangular solves run in the cell order, which is inherently serial.
+void GridPoissonSolver::buildPreconditioner()
+{
+	myPreconditioner.assign(myUnknownCount, 0);
+
+	for (unsigned row = 0; row < myUnknownCount; ++row)
+	{
+		double diagonal = myDiagonal[row];
+		double factor = diagonal;
+
+		for (unsigned axis : {0, 1})
+		{
+			int lowerRow = myNeighbours[axis][0][row];
+			if (lowerRow < 0) continue;
+
+			double coupling = myCouplings[axis][lowerRow] * myPreconditioner[lowerRow];
+			factor -= coupling * coupling;
+
+			unsigned otherAxis = (axis + 1) % 2;
+			factor -= MICTUNING * myCouplings[axis][lowerRow] * myCouplings[otherAxis][lowerRow] *
+						Util::sqr(myPreconditioner[lowerRow]);
+		}
+
+		if (factor < MICSAFETY * diagonal)
+			factor = diagonal;
+
+		assert(factor > 0);
+		myPreconditioner[row] = 1. / std::sqrt(factor);
+	}
+}
+
+void GridPoissonSolver::applyPreconditioner(const SolveVector& input, SolveVector& output) const
+{
+	// Solve Lq = r
+	for (unsigned row = 0; row < myUnknownCount; ++row)
+	{
+		double value = input[row];
+
+		for (unsigned axis : {0, 1})
+		{
+			int lowerRow = myNeighbours[axis][0][row];
+			if (lowerRow >= 0)
+				value -= myCouplings[axis][lowerRow] * myPreconditioner[lowerRow] * output[lowerRow];
+		}
+
+		output[row] = value * myPreconditioner[row];
+	}
+
+	// Solve L^T z = q
+	for (unsigned row = myUnknownCount; row-- > 0;)
+	{
+		double value = output[row];
+
+		for (unsigned axis : {0, 1})
+		{
+			int upperRow = myNeighbours[axis][1][row];
+			if (upperRow >= 0)
+				value -= myCouplings[axis][row] * myPreconditioner[row] * output[upperRow];
+		}
+
+		output[row] = value * myPreconditioner[row];
+	}
+}
+
+ConjugateGradientResult GridPoissonSolver::solve(bool removeNullSpace)
+{
+	ConjugateGradientBuffers buffers;
+	return solve(buffers, removeNullSpace);
+}
+
+ConjugateGradientResult GridPoissonSolver::solve(ConjugateGradientBuffers& buffers, bool removeNullSpace)
+{
+	auto removeAverage = [&](SolveVector& vector)
+	{
+		if (myUnknownCount == 0) return;
+
+		double average = Reduction::sum(myUnknownCount, [&](unsigned begin, unsigned end, auto& sum)
+		{
+			for (unsigned row = begin; row != end; ++row)
+				sum += vector[row];
+		});
+
+		average /= double(myUnknownCount);
+
+		for (double& value : vector)
+			value -= average;
+	};
+
+	if (removeNullSpace)
+		removeAverage(myRhs);
+
+	myStats = SolverStats();
+	myStats.solver = "GridPoissonSolver";
+	myStats.dofs = myUnknownCount;
+	myStats.nonZeros = nonZeros();
+
+	Timer timer;
+	buildPreconditioner();
+	myStats.preconditionerSeconds = timer.stop();
+
+	unsigned maxIterations = myMaxIterations > 0 ? myMaxIterations : 2 * myUnknownCount;
+
+	timer.reset();
+	ConjugateGradientResult result = solveConjugateGradient(
+		[&](const SolveVector& input, SolveVector& output) { applyMatrix(input, output); },
+		[&](const SolveVector& input, SolveVector& output) { applyPreconditioner(input, output); },
+		myRhs, mySolution, myTolerance, maxIterations, buffers);
+
+	if (removeNullSpace)
+		removeAverage(mySolution);
+
+	myStats.solveSeconds = timer.stop();
+	myStats.iterations = result.iterations;
+	myStats.residual = result.residual;
+	myStats.converged = result.converged;
+
+	return result;
+}
+
+std::size_t GridPoissonSolver::nonZeros() const
+{
+	std::size_t count = myUnknownCount;
+
+	// Each coupling is stored once but appears on both sides of the diagonal
+	for (unsigned axis : {0, 1})
+		for (unsigned row = 0; row < myUnknownCount; ++row)
+			if (myCouplings[axis][row] != 0) count += 2;
+
+	return count;
+}
+
+bool GridPoissonSolver::isSymmetric() const
+{
+	// Couplings are stored once per pair so the only way to break symmetry is
+	// a coupling to a cell outside of the solve.
+	for (unsigned axis : {0, 1})
+		for (unsigned row = 0; row < myUnknownCount; ++row)
+		{
+			if (myNeighbours[axis][1][row] < 0 && myCouplings[axis][row] != 0)
+				return false;
+		}
+
+	return true;
+}
+
+bool GridPoissonSolver::isFinite() const
+{
+	for (unsigned row = 0; row < myUnknownCount; ++row)
+	{
+		if (!std::isfinite(myDiagonal[row]) || !std::isfinite(myRhs[row]))
+			return false;
+
+		for (unsigned axis : {0, 1})
+		{
+			if (!std::isfinite(myCouplings[axis][row]))
+				return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,104 @@
+#ifndef LIBRARY_GRIDPOISSONSOLVER_H
+#define LIBRARY_GRIDPOISSONSOLVER_H
+
+#include <vector>
+
+#include "Common.h"
+#include "ConjugateGradient.h"
+#include "SolverStats.h"
+#include "UniformGrid.h"
+
+///////////////////////////////////
+//
+// GridPoissonSolver.h/cpp
+// Ryan Goldade 2017
+//
+// Conjugate gradient solver for 5-point
+// symmetric systems on the cells of a
+// grid (e.g. variable density pressure).
+// The matrix is stored per row as a
+// diagonal and the couplings to the
+// neighbouring cells. The preconditioner
+// is modified incomplete Cholesky, MIC(0),
+// built from the actual coefficients so
+// large jumps in density across material
+// boundaries are carried into the
+// preconditioner instead of stalling CG.
+//
+////////////////////////////////////
+
+class GridPoissonSolver
+{
+public:
+	// Unknowns are the cells with a non-negative index. The numbering must follow
+	// forEachVoxelRange order (e.g. from buildCompactIndex) so that the lower
+	// neighbours of a cell are numbered before it.
+	GridPoissonSolver(const UniformGrid<int>& cellIndex, unsigned unknownCount);
+
+	// Safe to call from multiple threads as long as each row is only built by one thread.
+	void addDiagonal(unsigned row, double value) { myDiagonal[row] += value; }
+
+	// Matrix entry between the cell at row and its neighbour in the positive axis direction.
+	// Each coupling must only be set once from the lower cell.
+	void setCoupling(unsigned row, unsigned axis, double value)
+	{
+		assert(myNeighbours[axis][1][row] >= 0 || value == 0);
+		myCouplings[axis][row] = value;
+	}
+
+	void addRhs(unsigned row, double value) { myRhs[row] += value; }
+	double rhs(unsigned row) const { return myRhs[row]; }
+
+	double solution(unsigned row) const { return mySolution[row]; }
+
+	void setTolerance(double tolerance) { myTolerance = tolerance; }
+
+	// Zero allows twice as many iterations as there are unknowns
+	void setMaxIterations(unsigned maxIterations) { myMaxIterations = maxIterations; }
+
+	// If the system has no Dirichlet condition (e.g. a fully enclosed domain), the constant null space
+	// is removed from the right hand side before solving and from the solution after.
+	ConjugateGradientResult solve(bool removeNullSpace = false);
+
+	// Same as above but the work vectors come from the caller so a solve every timestep
+	// only reallocates when the system grows.
+	ConjugateGradientResult solve(ConjugateGradientBuffers& buffers, bool removeNullSpace = false);
+
+	// Telemetry from the last solve. Assembly happens outside of the solver so
+	// its time is left for the caller to fill in.
+	const SolverStats& stats() const { return myStats; }
+
+	// Diagonal entries plus both sides of every non-zero coupling
+	std::size_t nonZeros() const;
+
+	bool isSymmetric() const;
+	bool isFinite() const;
+
+private:
+
+	void applyMatrix(const SolveVector& input, SolveVector& output) const;
+
+	void buildPreconditioner();
+	void applyPreconditioner(const SolveVector& input, SolveVector& output) const;
+
+	unsigned myUnknownCount;
+
+	SolveVector myDiagonal;
+
+	// Coupling entries indexed by the lower cell of each pair
+	SolveVector myCouplings[2];
+
+	// Row of the neighbour on each side of a row (axis, direction). -1 if the neighbour isn't solved.
+	std::vector<int> myNeighbours[2][2];
+
+	SolveVector myRhs, mySolution;
+
+	SolveVector myPreconditioner;
+
+	double myTolerance;
+	unsigned myMaxIterations;
+
+	SolverStats myStats;
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include <algorithm>
+
+#include "tbb/tbb.h"
+
+#include "PoissonStencil.h"
+
+#include "Reduction.h"
+
+// Rows per block in the red-black sweep. Small enough that a block of rows of each
+// grid stays in cache while both colours are relaxed.
+static constexpr unsigned REDBLACKBLOCK = 16;
+
+void PoissonStencil::build(const UniformGrid<int>& cellIndex,
+							const VectorGrid<Real>& cutCellWeights,
+							const VectorGrid<Real>& ghostFluidWeights)
+{
+	assert(cutCellWeights.isMatched(ghostFluidWeights));
+	assert(cutCellWeights.size(0)[0] - 1 == cellIndex.size()[0] &&
+			cutCellWeights.size(0)[1] == cellIndex.size()[1]);
+
+	if (myDiagonal.empty() || !(mySize == cellIndex.size()))
+	{
+		mySize = cellIndex.size();
+
+		myDiagonal.resize(mySize, 0);
+		myInverseDiagonal.resize(mySize, 0);
+
+		myXWeights.resize(mySize + Vec2ui(1, 0), 0);
+		myYWeights.resize(mySize + Vec2ui(1, 0), 0);
+	}
+
+	Vec2ui size = mySize;
+
+	auto isSolved = [&](const Vec2i& cell) -> bool
+	{
+		if (cell[0] < 0 || cell[1] < 0 || cell[0] >= int(size[0]) || cell[1] >= int(size[1]))
+			return false;
+
+		return cellIndex(Vec2ui(cell)) >= 0;
+	};
+
+	// Row i sets the weights on the lower faces of the cells in row i. The extra row
+	// at i = size[0] clears the padding.
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0] + 1), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < size[1]; ++j)
+			{
+				Vec2ui cell(i, j);
+
+				for (unsigned axis : {0, 1})
+				{
+					Real weight = 0;
+
+					if (isSolved(Vec2i(cell)) && isSolved(cellToCell(Vec2i(cell), axis, 0)))
+						weight = cutCellWeights(cellToFace(cell, axis, 0), axis);
+
+					if (axis == 0)
+						myXWeights(cell) = weight;
+					else
+						myYWeights(cell) = weight;
+				}
+
+				if (i == size[0]) continue;
+
+				double diagonal = 0;
+
+				if (isSolved(Vec2i(cell)))
+				{
+					for (unsigned axis : {0, 1})
+						for (unsigned direction : {0, 1})
+						{
+							Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
+
+							// Out-of-bounds is treated like a stationary grid-aligned solid
+							if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(size[axis])) continue;
+
+							Vec2ui face = cellToFace(cell, axis, direction);
+
+							double weight = cutCellWeights(face, axis);
+
+							if (weight > 0)
+							{
+								if (isSolved(adjacentCell))
+									diagonal += weight;
+								else
+								{
+									Real theta = Util::clamp(ghostFluidWeights(face, axis), MINTHETA, Real(1.));
+									diagonal += weight / theta;
+								}
+							}
+						}
+
+					assert(diagonal > 0);
+				}
+
+				myDiagonal(cell) = diagonal;
+				myInverseDiagonal(cell) = diagonal > 0 ? 1. / diagonal : 0;
+			}
+	});
+}
+
+// Calls kernel(j, neighbourSum) for every Stride-th cell in row i starting at first, where
+// neighbourSum is the weighted sum of the four neighbours of the cell. The first and last cells
+// of the row are peeled off so the interior loop runs without bounds checks.
+template<unsigned Stride, typename Kernel>
+static inline void forEachCellInRow(const double* x, const double* xWeights, const double* yWeights,
+									const Vec2ui& size, unsigned i, unsigned first, const Kernel& kernel)
+{
+	unsigned ny = size[1];
+
+	const double* row = x + i * ny;
+	const double* lowerRow = i > 0 ? row - ny : row;
+	const double* upperRow = i + 1 < size[0] ? row + ny : row;
+
+	const double* lowerWeights = xWeights + i * ny;
+	const double* upperWeights = lowerWeights + ny;
+	const double* sideWeights = yWeights + i * ny;
+
+	auto edgeSum = [&](unsigned j) -> double
+	{
+		double sum = lowerWeights[j] * lowerRow[j] + upperWeights[j] * upperRow[j];
+		if (j > 0) sum += sideWeights[j] * row[j - 1];
+		if (j + 1 < ny) sum += sideWeights[j + 1] * row[j + 1];
+		return sum;
+	};
+
+	unsigned j = first;
+	if (j == 0 && ny > 0)
+	{
+		kernel(j, edgeSum(j));
+		j += Stride;
+	}
+
+	for (; j + 1 < ny; j += Stride)
+	{
+		double sum = lowerWeights[j] * lowerRow[j] + upperWeights[j] * upperRow[j] +
+						sideWeights[j] * row[j - 1] + sideWeights[j + 1] * row[j + 1];
+		kernel(j, sum);
+	}
+
+	if (j + 1 == ny)
+		kernel(j, edgeSum(j));
+}
+
+template<typename RowKernel>
+void PoissonStencil::forEachRow(unsigned begin, unsigned end, const RowKernel& kernel) const
+{
+	tbb::parallel_for(tbb::blocked_range<unsigned>(begin, end), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			kernel(i);
+	});
+}
+
+void PoissonStencil::apply(const UniformGrid<double>& x, UniformGrid<double>& y) const
+{
+	assert(x.size() == mySize && y.size() == mySize);
+
+	const double* diagonal = myDiagonal.data();
+	double* output = y.data();
+
+	forEachRow(0, mySize[0], [&](unsigned i)
+	{
+		const double* row = x.data() + i * mySize[1];
+		double* outputRow = output + i * mySize[1];
+		const double* diagonalRow = diagonal + i * mySize[1];
+
+		forEachCellInRow<1>(x.data(), myXWeights.data(), myYWeights.data(), mySize, i, 0, [&](unsigned j, double sum)
+		{
+			outputRow[j] = diagonalRow[j] * row[j] - sum;
+		});
+	});
+}
+
+double PoissonStencil::residual(const UniformGrid<double>& b, const UniformGrid<double>& x, UniformGrid<double>& r) const
+{
+	assert(b.size() == mySize && x.size() == mySize && r.size() == mySize);
+
+	// Tiles are whole rows so their size only depends on the grid
+	unsigned tileRows = std::max(ReductionSettings::TILESIZE / std::max(mySize[1], 1u), 1u);
+
+	return Reduction::sum(mySize[0], [&](unsigned begin, unsigned end, auto& norm2)
+	{
+		for (unsigned i = begin; i != end; ++i)
+		{
+			unsigned offset = i * mySize[1];
+
+			const double* row = x.data() + offset;
+			const double* rhsRow = b.data() + offset;
+			const double* diagonalRow = myDiagonal.data() + offset;
+			double* residualRow = r.data() + offset;
+
+			forEachCellInRow<1>(x.data(), myXWeights.data(), myYWeights.data(), mySize, i, 0, [&](unsigned j, double sum)
+			{
+				double value = diagonalRow[j] > 0 ? rhsRow[j] - diagonalRow[j] * row[j] + sum : 0;
+				residualRow[j] = value;
+				norm2 += value * value;
+			});
+		}
+	}, tileRows);
+}
+
+void PoissonStencil::weightedJacobi(const UniformGrid<double>& b, const UniformGrid<double>& x,
+									UniformGrid<double>& xNew, double omega) const
+{
+	assert(b.size() == mySize && x.size() == mySize && xNew.size() == mySize);
+	assert(&x != &xNew);
+
+	forEachRow(0, mySize[0], [&](unsigned i)
+	{
+		unsigned offset = i * mySize[1];
+
+		const double* row = x.data() + offset;
+		const double* rhsRow = b.data() + offset;
+		const double* diagonalRow = myDiagonal.data() + offset;
+		const double* inverseDiagonalRow = myInverseDiagonal.data() + offset;
+		double* outputRow = xNew.data() + offset;
+
+		forEachCellInRow<1>(x.data(), myXWeights.data(), myYWeights.data(), mySize, i, 0, [&](unsigned j, double sum)
+		{
+			// Cells outside of the solve have a zero inverse diagonal and are held at zero
+			double correction = omega * inverseDiagonalRow[j] * (rhsRow[j] - diagonalRow[j] * row[j] + sum);
+			outputRow[j] = inverseDiagonalRow[j] > 0 ? row[j] + correction : 0;
+		});
+	});
+}
+
+void PoissonStencil::relaxRow(const double* b, double* x, unsigned i, unsigned colour) const
+{
+	unsigned offset = i * mySize[1];
+
+	const double* rhsRow = b + offset;
+	const double* inverseDiagonalRow = myInverseDiagonal.data() + offset;
+	double* row = x + offset;
+
+	// Only the other colour is read so the row can be updated in place
+	forEachCellInRow<2>(x, myXWeights.data(), myYWeights.data(), mySize, i, (i + colour) % 2, [&](unsigned j, double sum)
+	{
+		row[j] = inverseDiagonalRow[j] * (rhsRow[j] + sum);
+	});
+}
+
+void PoissonStencil::redBlackGaussSeidel(const UniformGrid<double>& b, UniformGrid<double>& x, bool reverse) const
+{
+	assert(b.size() == mySize && x.size() == mySize);
+
+	unsigned firstColour = reverse ? 1 : 0;
+	unsigned secondColour = 1 - firstColour;
+
+	unsigned rows = mySize[0];
+	unsigned blockCount = (rows + REDBLACKBLOCK - 1) / REDBLACKBLOCK;
+
+	const double* rhs = b.data();
+	double* solution = x.data();
+
+	// Within a block, row i - 1 of the second colour only depends on rows i - 2, i - 1 and i of the
+	// first colour so it's relaxed right behind them. The first and last rows of a block depend on
+	// the neighbouring blocks and are left for the second pass.
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, blockCount, 1), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned block = range.begin(); block != range.end(); ++block)
+		{
+			unsigned begin = block * REDBLACKBLOCK;
+			unsigned end = std::min(begin + REDBLACKBLOCK, rows);
+
+			for (unsigned i = begin; i != end; ++i)
+			{
+				relaxRow(rhs, solution, i, firstColour);
+				if (i >= begin + 2)
+					relaxRow(rhs, solution, i - 1, secondColour);
+			}
+		}
+	}, tbb::simple_partitioner());
+
+	// Second colour rows at block edges. Rows of one colour don't couple to each other so these
+	// are independent.
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, blockCount), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned block = range.begin(); block != range.end(); ++block)
+		{
+			unsigned begin = block * REDBLACKBLOCK;
+			unsigned end = std::min(begin + REDBLACKBLOCK, rows);
+
+			relaxRow(rhs, solution, begin, secondColour);
+			if (end - 1 > begin)
+				relaxRow(rhs, solution, end - 1, secondColour);
+		}
+	});
+}
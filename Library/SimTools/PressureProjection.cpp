@@ -1,21 +1,31 @@
 #include <iostream>
 
+#include "tbb/tbb.h"
+
 #include "PressureProjection.h"
-#include "Solver.h"
+
+#include "BufferUtilities.h"
+#include "CompactIndex.h"
+#include "Profiler.h"
+#include "Timer.h"
 
 void PressureProjection::drawPressure(Renderer& renderer) const
 {
 	myPressure.drawSupersampledValues(renderer, .25, 1, 2);
 }
 
-void PressureProjection::project(const VectorGrid<Real>& ghostFluidWeights, const VectorGrid<Real>& cutCellWeights)
+bool PressureProjection::project(const VectorGrid<Real>& ghostFluidWeights, const VectorGrid<Real>& cutCellWeights)
 {
+	PROFILE_ZONE("PressureProjection::project");
+
 	assert(ghostFluidWeights.isMatched(cutCellWeights) && ghostFluidWeights.isMatched(myFluidVelocity));
 
-	// This loop is dumb in serial but it's here as a placeholder for parallel later
-	Real dx = myFluidSurface.dx();
-	int liquidDOFCount = 0;
-	forEachVoxelRange(Vec2ui(0), myFluidCellIndex.size(), [&](const Vec2ui& cell)
+	Timer assemblyTimer;
+
+	// The projection can be reused across timesteps so clear out the previous numbering
+	myFluidCellIndex.resize(myFluidCellIndex.size(), UNSOLVED);
+
+	unsigned liquidDOFCount = buildCompactIndex(myFluidCellIndex, Vec2ui(0), myFluidCellIndex.size(), [&](const Vec2ui& cell) -> bool
 	{
 		if (myFluidSurface(cell) <= 0)
 		{
@@ -25,88 +35,162 @@ void PressureProjection::project(const VectorGrid<Real>& ghostFluidWeights, cons
 					Vec2ui face = cellToFace(cell, axis, direction);
 
 					if (cutCellWeights(face, axis) > 0)
-					{
-						myFluidCellIndex(cell) = liquidDOFCount++;
-						return;
-					}
+						return true;
 				}
 		}
-	});
 
-	Solver<true> solver(liquidDOFCount, liquidDOFCount * 5);
+		return false;
+	}, 0, myRowStart);
 
-	// Build linear system
-	forEachVoxelRange(Vec2ui(0), myFluidCellIndex.size(), [&](const Vec2ui& cell)
+	myStencils.resize(liquidDOFCount);
+	myRhs.resize(liquidDOFCount);
+
+	// The solve starts from zero pressure
+	reserveWithHeadroom(mySolution, liquidDOFCount);
+	mySolution.assign(liquidDOFCount, 0);
+
+	// Build linear system. Rows are spread across threads and each row is only built by one thread.
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, myFluidCellIndex.size()[0]), [&](const tbb::blocked_range<unsigned> &range)
 	{
-		int row = myFluidCellIndex(cell);
-		if (row >= 0)
-		{
-			// Build RHS divergence
-			double divergence = 0;
-			for (unsigned axis : {0, 1})
-				for (unsigned direction : {0, 1})
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < myFluidCellIndex.size()[1]; ++j)
+			{
+				Vec2ui cell(i, j);
+
+				int row = myFluidCellIndex(cell);
+				if (row >= 0)
 				{
-					Vec2ui face = cellToFace(cell, axis, direction);
+					// Build RHS divergence
+					double divergence = 0;
+					for (unsigned axis : {0, 1})
+						for (unsigned direction : {0, 1})
+						{
+							Vec2ui face = cellToFace(cell, axis, direction);
 
-					Real weight = cutCellWeights(face, axis);
+							Real weight = cutCellWeights(face, axis);
 
-					double sign = (direction == 0) ? 1 : -1;
+							double sign = (direction == 0) ? 1 : -1;
 
-					if (weight > 0)
-						divergence += sign * myFluidVelocity(face, axis) * weight;
-					if (weight < 1.)
-						divergence += sign * mySolidVelocity(face, axis) * (1. - weight);
-				}
+							if (weight > 0)
+								divergence += sign * myFluidVelocity(face, axis) * weight;
+							if (weight < 1.)
+								divergence += sign * mySolidVelocity(face, axis) * (1. - weight);
+						}
 
-			solver.addRhs(row, divergence);
+					myRhs[row] = divergence;
 
-			// Build row
-			double diagonal = 0.;
+					// Build row
+					PressureStencil& stencil = myStencils[row];
+					double diagonal = 0.;
 
-			for (unsigned axis : {0, 1})
-				for (unsigned direction : {0, 1})
-				{
-					Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
+					for (unsigned axis : {0, 1})
+						for (unsigned direction : {0, 1})
+						{
+							unsigned neighbour = 2 * axis + direction;
+
+							stencil.columns[neighbour] = -1;
+							stencil.weights[neighbour] = 0;
+
+							Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
 			
-					// Bounds check. If out-of-bounds, treat like a stationary grid-aligned solid.
-					if (adjacentCell[axis] < 0 || adjacentCell[axis] >= myFluidSurface.size()[axis]) continue;
+							// Bounds check. If out-of-bounds, treat like a stationary grid-aligned solid.
+							if (adjacentCell[axis] < 0 || adjacentCell[axis] >= myFluidSurface.size()[axis]) continue;
 
-					Vec2ui face = cellToFace(cell, axis, direction);
+							Vec2ui face = cellToFace(cell, axis, direction);
 				
-					double weight = cutCellWeights(face, axis);
-
-					if (weight > 0)
-					{
-						// If neighbouring cell is solvable, it should have an entry in the system
-						int adjacentRow = myFluidCellIndex(Vec2ui(adjacentCell));
-						if (adjacentRow >= 0)
-						{
-							solver.addElement(row, adjacentRow, -weight);
-							diagonal += weight;
+							double weight = cutCellWeights(face, axis);
+
+							if (weight > 0)
+							{
+								// If neighbouring cell is solvable, it should have an entry in the system
+								int adjacentRow = myFluidCellIndex(Vec2ui(adjacentCell));
+								if (adjacentRow >= 0)
+								{
+									stencil.columns[neighbour] = adjacentRow;
+									stencil.weights[neighbour] = weight;
+									diagonal += weight;
+								}
+								else
+								{
+									Real theta = ghostFluidWeights(face, axis);
+
+									theta = Util::clamp(theta, MINTHETA, Real(1.));
+									diagonal += weight / theta;
+
+									// TODO: add surface tension
+								}
+							}
 						}
-						else
-						{
-							Real theta = ghostFluidWeights(face, axis);
+					assert(diagonal > 0);
+					stencil.diagonal = diagonal;
+				}
+			}
+	});
 
-							theta = Util::clamp(theta, MINTHETA, Real(1.));
-							diagonal += weight / theta;
+	std::size_t nonZeros = 0;
+	for (const PressureStencil& stencil : myStencils)
+	{
+		++nonZeros;
+		for (int column : stencil.columns)
+			if (column >= 0) ++nonZeros;
+	}
 
-							// TODO: add surface tension
-						}
-					}
+	// y = Ax. Off-diagonal entries are the negated face weights.
+	auto applyOperator = [&](const SolveVector& input, SolveVector& output)
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, liquidDOFCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned row = range.begin(); row != range.end(); ++row)
+			{
+				const PressureStencil& stencil = myStencils[row];
+
+				double value = stencil.diagonal * input[row];
+				for (unsigned neighbour = 0; neighbour < 4; ++neighbour)
+				{
+					if (stencil.columns[neighbour] >= 0)
+						value -= stencil.weights[neighbour] * input[stencil.columns[neighbour]];
 				}
-			assert(diagonal > 0);
-			solver.addElement(row, row, diagonal);
-		}
-	});
 
-	
-	bool result = solver.solveIterative();
+				output[row] = value;
+			}
+		});
+	};
 
-	if (!result)
+	auto applyPreconditioner = [&](const SolveVector& input, SolveVector& output)
 	{
-		std::cout << "Pressure projection failed to solve" << std::endl;
-		return;
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, liquidDOFCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned row = range.begin(); row != range.end(); ++row)
+				output[row] = input[row] / myStencils[row].diagonal;
+		});
+	};
+
+	mySolverStats = SolverStats();
+	mySolverStats.solver = "PressureProjection";
+	mySolverStats.dofs = liquidDOFCount;
+	mySolverStats.nonZeros = nonZeros;
+	mySolverStats.assemblySeconds = assemblyTimer.stop();
+
+	// Same tolerance and iteration limit as the assembled solver it replaced
+	Timer solveTimer;
+	ConjugateGradientResult result = solveConjugateGradient(applyOperator, applyPreconditioner, myRhs, mySolution,
+															1E-5, 2 * liquidDOFCount, mySolverBuffers);
+
+	mySolverStats.solveSeconds = solveTimer.stop();
+	mySolverStats.iterations = result.iterations;
+	mySolverStats.residual = result.residual;
+	mySolverStats.converged = result.converged;
+
+	if (!result.converged)
+	{
+		std::cout << "Pressure projection failed to solve. Iterations: " << result.iterations << ", residual: " << result.residual << std::endl;
+
+		// The cells have already been renumbered so the previous pressures and valid faces don't apply
+		myPressure.resize(myPressure.size(), 0);
+		for (unsigned axis : {0, 1})
+			myValid.grid(axis).resize(myValid.size(axis), MarkedCells::UNVISITED);
+
+		return false;
 	}
 
 	// Load solution into pressure grid
@@ -114,7 +198,7 @@ void PressureProjection::project(const VectorGrid<Real>& ghostFluidWeights, cons
 	{
 		int row = myFluidCellIndex(cell);
 		if (row >= 0)
-			myPressure(cell) = solver.solution(row);
+			myPressure(cell) = mySolution[row];
 		else
 			myPressure(cell) = 0;
 	});
@@ -139,10 +223,37 @@ void PressureProjection::project(const VectorGrid<Real>& ghostFluidWeights, cons
 			else myValid(face, axis) = MarkedCells::UNVISITED;
 		});
 	}
+
+	return true;
+}
+
+Eigen::SparseMatrix<double> PressureProjection::assembledMatrix() const
+{
+	std::vector<Eigen::Triplet<double>> triplets;
+	triplets.reserve(5 * myStencils.size());
+
+	for (unsigned row = 0; row < myStencils.size(); ++row)
+	{
+		const PressureStencil& stencil = myStencils[row];
+
+		triplets.emplace_back(row, row, stencil.diagonal);
+		for (unsigned neighbour = 0; neighbour < 4; ++neighbour)
+		{
+			if (stencil.columns[neighbour] >= 0)
+				triplets.emplace_back(row, stencil.columns[neighbour], -stencil.weights[neighbour]);
+		}
+	}
+
+	Eigen::SparseMatrix<double> matrix(myStencils.size(), myStencils.size());
+	matrix.setFromTriplets(triplets.begin(), triplets.end());
+
+	return matrix;
 }
 
 void PressureProjection::applySolution(VectorGrid<Real>& velocity, const VectorGrid<Real>& liquidWeights)
 {
+	PROFILE_ZONE("PressureProjection::applySolution");
+
 	assert(liquidWeights.isMatched(myFluidVelocity));
 	
 	for (unsigned axis : {0, 1})
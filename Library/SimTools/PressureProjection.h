@@ -1,10 +1,16 @@
 #ifndef LIBRARY_PRESSUREPROJECTION_H
 #define LIBRARY_PRESSUREPROJECTION_H
 
+#include <vector>
+
+#include "Eigen/Sparse"
+
 #include "Common.h"
+#include "ConjugateGradient.h"
 #include "LevelSet2D.h"
 #include "Renderer.h"
 #include "ScalarGrid.h"
+#include "SolverStats.h"
 #include "VectorGrid.h"
 
 ///////////////////////////////////
@@ -13,7 +19,11 @@
 // Ryan Goldade 2017
 //
 // Variational pressure solve. Allows
-// for moving solids.
+// for moving solids. The system is solved
+// matrix-free with Jacobi preconditioned
+// CG out of buffers that are kept between
+// calls, so a projection that's reused
+// every timestep doesn't allocate.
 //
 ////////////////////////////////////
 
@@ -23,7 +33,9 @@ class PressureProjection
 {
 
 public:
-	// For variational solve, surface should be extrapolated into the solid boundary
+	// For variational solve, surface should be extrapolated into the solid boundary.
+	// The projection only holds references to its inputs so a simulator can keep one
+	// around and call project every timestep without reallocating its grids.
 	PressureProjection(const LevelSet2D& surface, const VectorGrid<Real>& liquidVelocity,
 			    const LevelSet2D& solidSurface, const VectorGrid<Real>& solidVelocity)
 		: myFluidSurface(surface)
@@ -55,7 +67,9 @@ public:
 	// weights. 
 	// The fluid weights refer to the cut-cell length of fluid (air and liquid) through a cell face.
 	// In both cases, 0 means "empty" and 1 means "full".
-	void project(const VectorGrid<Real>& ghostFluidWeights, const VectorGrid<Real>& cutCellWeights);
+	// Returns false if the solve failed. The pressure is then zero and no face is valid, so nothing
+	// from an earlier call is left to be applied, and the caller should keep its unprojected velocity.
+	bool project(const VectorGrid<Real>& ghostFluidWeights, const VectorGrid<Real>& cutCellWeights);
 
 	// Apply solution to a velocity field at solvable faces
 	void applySolution(VectorGrid<Real>& velocity, const VectorGrid<Real>& ghostFluidWeights);
@@ -63,6 +77,14 @@ public:
 
 	void drawPressure(Renderer& renderer) const;
 
+	// Telemetry from the last call to project
+	const SolverStats& solverStats() const { return mySolverStats; }
+
+	// The system of the last call to project, assembled so other solvers can be checked against it.
+	// Rows and columns are numbered by cellIndex(). Cells outside of the solve are UNSOLVED.
+	const UniformGrid<int>& cellIndex() const { return myFluidCellIndex; }
+	Eigen::SparseMatrix<double> assembledMatrix() const;
+
 private:
 
 	const VectorGrid<Real> &myFluidVelocity, &mySolidVelocity;
@@ -73,6 +95,21 @@ private:
 	
 	ScalarGrid<Real> myPressure;
 	UniformGrid<int> myFluidCellIndex;
+
+	// Row of the pressure system. Columns of -1 are neighbours outside of the solve.
+	struct PressureStencil
+	{
+		double diagonal;
+		int columns[4];
+		double weights[4];
+	};
+
+	std::vector<unsigned> myRowStart;
+	std::vector<PressureStencil> myStencils;
+	SolveVector myRhs, mySolution;
+	ConjugateGradientBuffers mySolverBuffers;
+
+	SolverStats mySolverStats;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "ProjectionWeights.h"
+
+#include "tbb/tbb.h"
+
+#include "ComputeWeights.h"
+
+void ProjectionWeights::resize(const Transform& xform, const Vec2ui& size)
+{
+	if (xform == myXform && size == mySize && !myQuarterVolumes.empty())
+		return;
+
+	myXform = xform;
+	mySize = size;
+
+	myGhostFluidWeights = VectorGrid<Real>(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+	myCutCellWeights = VectorGrid<Real>(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+
+	myCenterVolumes = ScalarGrid<Real>(xform, size, 0, ScalarGridSettings::SampleType::CENTER);
+	myNodeVolumes = ScalarGrid<Real>(xform, size, 0, ScalarGridSettings::SampleType::NODE);
+	myFaceVolumes = VectorGrid<Real>(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+
+	myQuarterVolumes.resize(quarterCellGridSize(size), 0);
+}
+
+void ProjectionWeights::compute(const LevelSet2D& liquidSurface, const LevelSet2D& solidSurface,
+								bool invertSolid, bool computeVolumes, Real minCutCellWeight)
+{
+	assert(liquidSurface.isMatched(solidSurface));
+
+	resize(liquidSurface.xform(), liquidSurface.size());
+
+	Vec2ui size = mySize;
+	Vec2ui quarterSize = myQuarterVolumes.size();
+
+	auto cutCellWeight = [&](Real phi0, Real phi1) -> Real
+	{
+		Real weight = lengthFraction(phi0, phi1);
+
+		if (invertSolid) weight = 1. - weight;
+
+		weight = Util::clamp(weight, 0., 1.);
+
+		if (weight > 0 && weight < minCutCellWeight)
+			weight = minCutCellWeight;
+
+		return weight;
+	};
+
+	// Each row i of the traversal handles the x-faces and the y-faces in column i, the solid nodes
+	// bounding them and the two quarter cell rows 2i and 2i + 1. The extra row at i = size[0]
+	// picks up the last column of x-faces and the last quarter cells.
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0] + 1), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		RowBuffers& rowBuffers = myRowBuffers.local();
+
+		std::vector<Real>& lowerSolidNodes = rowBuffers.lowerSolidNodes;
+		std::vector<Real>& upperSolidNodes = rowBuffers.upperSolidNodes;
+		std::vector<Real>* liquidCorners = rowBuffers.liquidCorners;
+
+		lowerSolidNodes.resize(size[1] + 1);
+		upperSolidNodes.resize(size[1] + 1);
+
+		if (computeVolumes)
+		{
+			for (unsigned k = 0; k < 3; ++k)
+				liquidCorners[k].resize(quarterSize[1] + 1);
+		}
+
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+		{
+			//
+			// Ghost fluid weights
+			//
+
+			for (unsigned j = 0; j < size[1]; ++j)
+			{
+				Real weight = 0;
+
+				if (i > 0 && i < size[0])
+					weight = lengthFraction(liquidSurface(i - 1, j), liquidSurface(i, j));
+
+				myGhostFluidWeights(Vec2ui(i, j), 0) = weight;
+			}
+
+			if (i < size[0])
+			{
+				for (unsigned j = 0; j <= size[1]; ++j)
+				{
+					Real weight = 0;
+
+					if (j > 0 && j < size[1])
+						weight = lengthFraction(liquidSurface(i, j - 1), liquidSurface(i, j));
+
+					myGhostFluidWeights(Vec2ui(i, j), 1) = weight;
+				}
+			}
+
+			//
+			// Cut-cell weights
+			//
+
+			for (unsigned j = 0; j <= size[1]; ++j)
+			{
+				lowerSolidNodes[j] = quarterCellCorner(solidSurface, 2 * i + 1, 2 * j + 1);
+				if (i < size[0])
+					upperSolidNodes[j] = quarterCellCorner(solidSurface, 2 * i + 3, 2 * j + 1);
+			}
+
+			for (unsigned j = 0; j < size[1]; ++j)
+				myCutCellWeights(Vec2ui(i, j), 0) = cutCellWeight(lowerSolidNodes[j], lowerSolidNodes[j + 1]);
+
+			if (i < size[0])
+			{
+				for (unsigned j = 0; j <= size[1]; ++j)
+					myCutCellWeights(Vec2ui(i, j), 1) = cutCellWeight(lowerSolidNodes[j], upperSolidNodes[j]);
+			}
+
+			//
+			// Quarter cell areas
+			//
+
+			if (computeVolumes)
+			{
+				for (unsigned k = 0; k < 3; ++k)
+					sampleQuarterCellCorners(liquidSurface, 2 * i + k, liquidCorners[k]);
+
+				for (unsigned k = 0; k < 2; ++k)
+					computeQuarterCellAreas(liquidCorners[k], liquidCorners[k + 1], 2 * i + k, myQuarterVolumes);
+			}
+		}
+	});
+
+	if (computeVolumes)
+		assembleAreaFractions(myQuarterVolumes, myCenterVolumes, myNodeVolumes, myFaceVolumes);
+}
@@ -0,0 +1,80 @@
+#ifndef LIBRARY_PROJECTIONWEIGHTS_H
+#define LIBRARY_PROJECTIONWEIGHTS_H
+
+#include <vector>
+
+#include "tbb/tbb.h"
+
+#include "Common.h"
+#include "LevelSet2D.h"
+#include "ScalarGrid.h"
+#include "UniformGrid.h"
+#include "VectorGrid.h"
+
+///////////////////////////////////
+//
+// ProjectionWeights.h/cpp
+// Ryan Goldade 2017
+//
+// Builds all of the weights used by
+// the pressure projection and viscosity
+// solves in a single traversal of the
+// liquid and solid surfaces. The weights
+// are stored in buffers that persist
+// between timesteps so repeated builds
+// don't allocate.
+//
+////////////////////////////////////
+
+class ProjectionWeights
+{
+public:
+	ProjectionWeights() {}
+
+	ProjectionWeights(const Transform& xform, const Vec2ui& size)
+	{
+		resize(xform, size);
+	}
+
+	// Buffers are only reallocated if the grid doesn't match the current one
+	void resize(const Transform& xform, const Vec2ui& size);
+
+	// Ghost fluid weights come from the liquid surface and cut-cell weights come from
+	// the solid surface, matching computeGhostFluidWeights and computeCutCellWeights. If
+	// requested, the exact liquid area fractions for the viscosity solve (matching
+	// computeAreaFractions) are computed in the same traversal.
+	void compute(const LevelSet2D& liquidSurface, const LevelSet2D& solidSurface,
+					bool invertSolid, bool computeVolumes, Real minCutCellWeight = 0.01);
+
+	const VectorGrid<Real>& ghostFluidWeights() const { return myGhostFluidWeights; }
+	const VectorGrid<Real>& cutCellWeights() const { return myCutCellWeights; }
+
+	// Liquid area fractions are only valid after a compute call that requested them
+	const ScalarGrid<Real>& centerVolumes() const { return myCenterVolumes; }
+	const ScalarGrid<Real>& nodeVolumes() const { return myNodeVolumes; }
+	const VectorGrid<Real>& faceVolumes() const { return myFaceVolumes; }
+
+private:
+
+	Transform myXform;
+	Vec2ui mySize;
+
+	VectorGrid<Real> myGhostFluidWeights, myCutCellWeights;
+
+	ScalarGrid<Real> myCenterVolumes, myNodeVolumes;
+	VectorGrid<Real> myFaceVolumes;
+
+	// Area fractions of the half-cell grid. Every control volume is a union of four quarter cells.
+	UniformGrid<Real> myQuarterVolumes;
+
+	// Samples along the rows of the traversal. Each thread keeps its own set between builds.
+	struct RowBuffers
+	{
+		std::vector<Real> lowerSolidNodes, upperSolidNodes;
+		std::vector<Real> liquidCorners[3];
+	};
+
+	tbb::enumerable_thread_specific<RowBuffers> myRowBuffers;
+};
+
+#endif
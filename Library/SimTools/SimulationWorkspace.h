@@ -0,0 +1,94 @@
+#ifndef LIBRARY_SIMULATIONWORKSPACE_H
+#define LIBRARY_SIMULATIONWORKSPACE_H
+
+#include "Common.h"
+#include "ExtrapolateField.h"
+#include "LevelSet2D.h"
+#include "ProjectionWeights.h"
+#include "ScalarGrid.h"
+#include "Transform.h"
+#include "UniformGrid.h"
+#include "VectorGrid.h"
+#include "ViscositySolver.h"
+
+///////////////////////////////////
+//
+// SimulationWorkspace.h
+// Ryan Goldade 2017
+//
+// Scratch buffers for a grid-based
+// simulator. The simulator owns one
+// workspace and pulls its per-timestep
+// temporaries from it so that, once the
+// grid size and the amount of surface
+// settle, a timestep doesn't allocate.
+// The solver and tracker buffers size
+// themselves on first use and only grow.
+//
+////////////////////////////////////
+
+class SimulationWorkspace
+{
+public:
+	SimulationWorkspace() {}
+
+	SimulationWorkspace(const Transform& xform, const Vec2ui& size)
+	{
+		resize(xform, size);
+	}
+
+	// Buffers are only reallocated if the grid doesn't match the current one
+	void resize(const Transform& xform, const Vec2ui& size)
+	{
+		if (xform == myXform && size == mySize && !myValidFaces.grid(0).empty())
+			return;
+
+		myXform = xform;
+		mySize = size;
+
+		mySurface = LevelSet2D(xform, size);
+		myValidFaces = VectorGrid<MarkedCells>(xform, size, MarkedCells::UNVISITED, VectorGridSettings::SampleType::STAGGERED);
+		myFaceGrid = VectorGrid<Real>(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+		myCenterGrid = ScalarGrid<Real>(xform, size, 0, ScalarGridSettings::SampleType::CENTER);
+
+		myWeights.resize(xform, size);
+	}
+
+	// Working copy of a center sampled surface (e.g. the liquid extrapolated into the solid)
+	LevelSet2D& surface() { return mySurface; }
+
+	// Marks faces that hold valid (i.e. solved) velocities
+	VectorGrid<MarkedCells>& validFaces() { return myValidFaces; }
+
+	// Temporary staggered and center sampled fields. Advection writes into these and then swaps
+	// them with the simulation field, which hands the old field back to the workspace.
+	VectorGrid<Real>& faceGrid() { return myFaceGrid; }
+	ScalarGrid<Real>& centerGrid() { return myCenterGrid; }
+
+	ProjectionWeights& weights() { return myWeights; }
+
+	// Mesh and redistancing storage for rebuilding level sets from their surface
+	LevelSetBuffers& levelSetBuffers() { return myLevelSetBuffers; }
+
+	ExtrapolationBuffers& extrapolationBuffers() { return myExtrapolationBuffers; }
+
+	ViscositySolverBuffers& viscosityBuffers() { return myViscosityBuffers; }
+
+private:
+
+	Transform myXform;
+	Vec2ui mySize;
+
+	LevelSet2D mySurface;
+	VectorGrid<MarkedCells> myValidFaces;
+	VectorGrid<Real> myFaceGrid;
+	ScalarGrid<Real> myCenterGrid;
+
+	ProjectionWeights myWeights;
+
+	LevelSetBuffers myLevelSetBuffers;
+	ExtrapolationBuffers myExtrapolationBuffers;
+	ViscositySolverBuffers myViscosityBuffers;
+};
+
+#endif
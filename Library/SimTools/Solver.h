@@ -1,9 +1,16 @@
 #ifndef LIBRARY_SOLVER_H
 #define LIBRARY_SOLVER_H
 
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
 #include "Eigen/Sparse"
+#include "tbb/tbb.h"
 
 #include "Common.h"
+#include "SolverStats.h"
+#include "Timer.h"
 
 ///////////////////////////////////
 //
@@ -13,7 +20,13 @@
 // Sparse matrix solver with support
 // for direct solve and iterative solve.
 // The iterative solve can set a "guess"
-// starting vector.
+// starting vector. The system can be
+// built in parallel: matrix elements go
+// into per-thread triplet lists that are
+// bucketed by row once before solving,
+// so the matrix doesn't depend on how
+// the rows were split across threads.
+// Every solve records its SolverStats.
 //
 ////////////////////////////////////
 
@@ -24,23 +37,31 @@ class Solver
 	using Vector = typename std::conditional<useDoublePrecision, Eigen::VectorXd, Eigen::VectorXf>::type;
 
 public:
+	// The non-zero count is an estimate used to reserve the triplet list of the constructing
+	// thread, which is the only list a serial build uses
 	Solver(unsigned rowcount, unsigned nonzeros = 0)
 	{
 		Eigen::initParallel();
 
-		myMatrix.reserve(nonzeros);
+		myMatrix.local().reserve(nonzeros);
+
+		myStats.solver = "Solver";
+		myStats.dofs = rowcount;
+
 		myRhs = Vector::Zero(rowcount);
 		mySolution = Vector::Zero(rowcount);
 		myGuess = Vector::Zero(rowcount);
 	}
 
-	// Insert element item into sparse vector. Duplicates are allowed and will be summed together
+	// Insert element item into sparse vector. Duplicates are allowed and will be summed together.
+	// Safe to call from multiple threads.
 	void addElement(unsigned row, unsigned col, SolverReal val)
 	{
-		myMatrix.push_back(Eigen::Triplet<SolverReal>(row, col, val));
+		myMatrix.local().push_back(Eigen::Triplet<SolverReal>(row, col, val));
 	}
 
-	// Adds value to RHS. It's safe to assume that it is initialized to zeros
+	// Adds value to RHS. It's safe to assume that it is initialized to zeros. Safe to call from
+	// multiple threads as long as each row is only built by one thread. The same holds for addGuess.
 	void addRhs(unsigned row, SolverReal val)
 	{
 		myRhs(row) += val;
@@ -70,27 +91,41 @@ public:
 	//Call to solve linear system
 	bool solveDirect()
 	{
-		Eigen::SparseMatrix<SolverReal> sparseMatrix(myRhs.rows(), myRhs.rows());
-		sparseMatrix.setFromTriplets(myMatrix.begin(), myMatrix.end());
+		resetStats();
+
+		Timer timer;
+		Eigen::SparseMatrix<SolverReal> sparseMatrix = buildMatrix();
 
 		sparseMatrix.makeCompressed();
+		myStats.nonZeros = sparseMatrix.nonZeros();
+		myStats.assemblySeconds = timer.stop();
+
+		timer.reset();
 		Eigen::SparseLU<Eigen::SparseMatrix<SolverReal>> solver;
 
 		solver.compute(sparseMatrix);
+		myStats.preconditionerSeconds = timer.stop();
 
+		myStats.converged = false;
 		if (solver.info() != Eigen::Success) return false;
 		
+		timer.reset();
 		mySolution = solver.solve(myRhs);
+		myStats.solveSeconds = timer.stop();
+
 		if (solver.info() != Eigen::Success) return false;
 		
+		myStats.converged = true;
 		return true;
 	}
 
 	//Call to solve linear system
 	bool solveIterative(Real tolerance = 1E-5)
 	{
-		Eigen::SparseMatrix<SolverReal> sparseMatrix(myRhs.rows(), myRhs.rows());
-		sparseMatrix.setFromTriplets(myMatrix.begin(), myMatrix.end());
+		resetStats();
+
+		Timer timer;
+		Eigen::SparseMatrix<SolverReal> sparseMatrix = buildMatrix();
 
 		for (auto removeElement : myRemovedDOFs)
 		{
@@ -110,32 +145,46 @@ public:
 			myRhs[removeElement] = 0.;
 		}
 
+		myStats.nonZeros = sparseMatrix.nonZeros();
+		myStats.assemblySeconds = timer.stop();
+
+		timer.reset();
 		Eigen::ConjugateGradient<Eigen::SparseMatrix<SolverReal>, Eigen::Upper | Eigen::Lower> solver;
 		solver.compute(sparseMatrix);
+		myStats.preconditionerSeconds = timer.stop();
 
 		if (solver.info() != Eigen::Success)
 		{
+			myStats.converged = false;
 			std::cout << "Solve failed on build" << std::endl;
 			return false;
 		}
 
+		timer.reset();
 		solver.setTolerance(tolerance);
 		mySolution = solver.solveWithGuess(myRhs, myGuess);
 
-		if (solver.info() != Eigen::Success)
+		myStats.solveSeconds = timer.stop();
+		myStats.iterations = unsigned(solver.iterations());
+		myStats.residual = double(solver.error());
+		myStats.converged = solver.info() == Eigen::Success;
+
+		if (!myStats.converged)
 		{
-			std::cout << "Solve failed to converge" << std::endl;
+			std::cout << "Solve failed to converge. Iterations: " << myStats.iterations << ", residual: " << myStats.residual << std::endl;
 			return false;
 		}
 
 		return true;
 	}
 
+	// Telemetry from the last solve
+	const SolverStats& stats() const { return myStats; }
+
 
 	bool isSymmetric()
 	{
-		Eigen::SparseMatrix<SolverReal> sparseMatrix(myRhs.rows(), myRhs.rows());
-		sparseMatrix.setFromTriplets(myMatrix.begin(), myMatrix.end());
+		Eigen::SparseMatrix<SolverReal> sparseMatrix = buildMatrix();
 		sparseMatrix.makeCompressed();
 
 		for (int k = 0; k < sparseMatrix.outerSize(); ++k)
@@ -154,8 +203,7 @@ public:
 
 	bool isFinite()
 	{
-		Eigen::SparseMatrix<SolverReal> sparseMatrix(myRhs.rows(), myRhs.rows());
-		sparseMatrix.setFromTriplets(myMatrix.begin(), myMatrix.end());
+		Eigen::SparseMatrix<SolverReal> sparseMatrix = buildMatrix();
 		sparseMatrix.makeCompressed();
 
 		for (int k = 0; k < sparseMatrix.outerSize(); ++k)
@@ -170,8 +218,7 @@ public:
 
 	void printMatrix(std::string filename) const
 	{
-		Eigen::SparseMatrix<SolverReal> sparseMatrix(myRhs.rows(), myRhs.rows());
-		sparseMatrix.setFromTriplets(myMatrix.begin(), myMatrix.end());
+		Eigen::SparseMatrix<SolverReal> sparseMatrix = buildMatrix();
 		sparseMatrix.makeCompressed();
 
 		std::ofstream writer(filename);
@@ -189,11 +236,62 @@ public:
 	}
 
 private:
+
+	void resetStats()
+	{
+		SolverStats stats;
+		stats.solver = myStats.solver;
+		stats.dofs = unsigned(myRhs.rows());
+		myStats = stats;
+	}
+
+	// Merge the per-thread triplet lists into a single sparse matrix. The thread-local lists come in
+	// no particular order and setFromTriplets sums duplicates in the order it sees them, so the
+	// triplets are bucketed by row with a counting sort and each row is sorted by column and value.
+	// Duplicates are then summed in the same order however the rows were split across threads.
+	Eigen::SparseMatrix<SolverReal> buildMatrix() const
+	{
+		unsigned rowCount = unsigned(myRhs.rows());
+		std::vector<std::size_t> rowStart(rowCount + 1, 0);
+
+		for (const auto& localMatrix : myMatrix)
+			for (const auto& triplet : localMatrix)
+				++rowStart[triplet.row() + 1];
+
+		for (unsigned row = 0; row < rowCount; ++row)
+			rowStart[row + 1] += rowStart[row];
+
+		std::vector<Eigen::Triplet<SolverReal>> triplets(rowStart[rowCount]);
+		std::vector<std::size_t> nextSlot(rowStart.begin(), rowStart.end() - 1);
+
+		for (const auto& localMatrix : myMatrix)
+			for (const auto& triplet : localMatrix)
+				triplets[nextSlot[triplet.row()]++] = triplet;
+
+		auto isBefore = [](const Eigen::Triplet<SolverReal>& left, const Eigen::Triplet<SolverReal>& right)
+		{
+			return left.col() < right.col() || (left.col() == right.col() && left.value() < right.value());
+		};
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, rowCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned row = range.begin(); row != range.end(); ++row)
+				std::sort(triplets.begin() + rowStart[row], triplets.begin() + rowStart[row + 1], isBefore);
+		});
+
+		Eigen::SparseMatrix<SolverReal> sparseMatrix(myRhs.rows(), myRhs.rows());
+		sparseMatrix.setFromTriplets(triplets.begin(), triplets.end());
+
+		return sparseMatrix;
+	}
+
 	Vector myRhs, mySolution, myGuess;
 
-	std::vector<Eigen::Triplet<SolverReal>> myMatrix;
+	tbb::enumerable_thread_specific<std::vector<Eigen::Triplet<SolverReal>>> myMatrix;
 
 	std::vector<unsigned> myRemovedDOFs;
+
+	SolverStats myStats;
 };
 
 #endif
\ No newline at end of file
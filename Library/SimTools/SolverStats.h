@@ -0,0 +1,66 @@
+#ifndef LIBRARY_SOLVERSTATS_H
+#define LIBRARY_SOLVERSTATS_H
+
+#include <cstddef>
+#include <ostream>
+
+#include "Common.h"
+
+///////////////////////////////////
+//
+// SolverStats.h
+// Ryan Goldade 2017
+//
+// Telemetry for one linear solve: the
+// system size, how long it took to build
+// the system and the preconditioner, and
+// how the iterative solve went. The
+// solvers keep the stats of their last
+// solve so a simulator can log them
+// every timestep.
+//
+////////////////////////////////////
+
+struct SolverStats
+{
+	// Class that ran the solve. A literal so copying the stats doesn't allocate.
+	const char* solver = "";
+
+	unsigned dofs = 0;
+
+	// Stored non-zeros, or the stencil entries for matrix-free solves
+	std::size_t nonZeros = 0;
+
+	double assemblySeconds = 0;
+
+	// Preconditioner set up, or the factorization for direct solves
+	double preconditionerSeconds = 0;
+
+	double solveSeconds = 0;
+
+	unsigned iterations = 0;
+
+	// Relative residual |b - Ax| / |b| at exit
+	double residual = 0;
+
+	bool converged = true;
+
+	double secondsPerIteration() const { return iterations > 0 ? solveSeconds / double(iterations) : 0; }
+
+	// Single line JSON object so a log of stats can be read back one solve per line
+	void writeJSON(std::ostream& stream) const
+	{
+		stream << "{\"solver\": \"" << solver << "\""
+				<< ", \"dofs\": " << dofs
+				<< ", \"nonzeros\": " << nonZeros
+				<< ", \"assembly_seconds\": " << assemblySeconds
+				<< ", \"preconditioner_seconds\": " << preconditionerSeconds
+				<< ", \"solve_seconds\": " << solveSeconds
+				<< ", \"iterations\": " << iterations
+				<< ", \"seconds_per_iteration\": " << secondsPerIteration()
+				<< ", \"residual\": " << residual
+				<< ", \"converged\": " << (converged ? "true" : "false") << "}";
+	}
+};
+
+#endif
@@ -1,16 +1,31 @@
+#include <algorithm>
 #include <iostream>
+#include <numeric>
+
+#include "tbb/tbb.h"
 
 #include "ViscositySolver.h"
 
-#include "Solver.h"
+#include "BufferUtilities.h"
+#include "CompactIndex.h"
+#include "ConjugateGradient.h"
+#include "Profiler.h"
+#include "Timer.h"
 #include "VectorGrid.h"
 
+// Bound to a const reference by UniformGrid::resize so it needs a definition
+constexpr int ViscositySolver::UNSOLVED;
+
 void ViscositySolver::solve(const VectorGrid<Real>& faceVolumes,
-							ScalarGrid<Real>& centerVolumes,
-							ScalarGrid<Real>& nodeVolumes,
+							const ScalarGrid<Real>& centerVolumes,
+							const ScalarGrid<Real>& nodeVolumes,
 							const ScalarGrid<Real>& solidCenterVolumes,
 							const ScalarGrid<Real>& solidNodeVolumes)
 {
+	PROFILE_ZONE("ViscositySolver::solve");
+
+	Timer timer;
+
 	// Debug check that grids are the same
 	assert(myVelocity.isMatched(faceVolumes));
 	assert(mySurface.isMatched(centerVolumes));
@@ -18,7 +33,17 @@ void ViscositySolver::solve(const VectorGrid<Real>& faceVolumes,
 	assert(mySurface.size() + Vec2ui(1) == solidNodeVolumes.size());
 	assert(mySurface.size() + Vec2ui(1) == nodeVolumes.size());
 
-	VectorGrid<int> liquidFaces(mySurface.xform(), mySurface.size(), UNSOLVED, VectorGridSettings::SampleType::STAGGERED);
+	const ScalarGrid<Real>& viscosity = myBuffers.viscosity;
+	assert(viscosity.isMatched(centerVolumes));
+
+	VectorGrid<int>& liquidFaces = myBuffers.liquidFaces;
+	if (!liquidFaces.isMatched(faceVolumes))
+		liquidFaces = VectorGrid<int>(mySurface.xform(), mySurface.size(), UNSOLVED, VectorGridSettings::SampleType::STAGGERED);
+	else
+	{
+		for (unsigned axis : {0, 1})
+			liquidFaces.grid(axis).resize(liquidFaces.size(axis), UNSOLVED);
+	}
 
 	// Build solvable faces. Assumes the grid limits are solid boundaries and left out
 	// of the system.
@@ -32,7 +57,8 @@ void ViscositySolver::solve(const VectorGrid<Real>& faceVolumes,
 		Vec2ui start(0); ++start[axis];
 		Vec2ui end(size); --end[axis];
 
-		forEachVoxelRange(start, end, [&](const Vec2ui& face)
+		// Faces are numbered axis by axis so the y-faces continue on from the x-faces
+		liquidDOFCount += buildCompactIndex(liquidFaces.grid(axis), start, end, [&](const Vec2ui& face) -> bool
 		{
 			bool inSolve = false;
 
@@ -55,130 +81,545 @@ void ViscositySolver::solve(const VectorGrid<Real>& faceVolumes,
 			{
 				if (mySolidSurface.interp(liquidFaces.indexToWorld(Vec2R(face), axis)) <= 0.)
 					liquidFaces(face, axis) = SOLIDBOUNDARY;
-				else
-					liquidFaces(face, axis) = liquidDOFCount++;
+				else return true;
 			}
-		});
+
+			return false;
+		}, liquidDOFCount, myBuffers.rowStart);
 	}
 
-	// Build a single container of the viscosity weights (liquid volumes, gf weights, viscosity coefficients)
-	Real invDx2 = 1. / Util::sqr(mySurface.dx());
+	std::vector<Vec3ui>& liquidFaceList = myBuffers.liquidFaceList;
+	liquidFaceList.resize(liquidDOFCount);
+
+	for (unsigned axis : {0, 1})
 	{
-		forEachVoxelRange(Vec2ui(0), centerVolumes.size(), [&](const Vec2ui& cell)
+		Vec2ui size = liquidFaces.size(axis);
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
 		{
-			centerVolumes(cell) *= myDt * invDx2;
-			centerVolumes(cell) *= myViscosity(cell);
-			centerVolumes(cell) *= Util::clamp(solidCenterVolumes(cell), 0.01, 1.);
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < size[1]; ++j)
+				{
+					int faceIndex = liquidFaces(Vec2ui(i, j), axis);
+					if (faceIndex >= 0)
+						liquidFaceList[faceIndex] = Vec3ui(i, j, axis);
+				}
 		});
 	}
 
+	// Build a single container of the viscosity weights (liquid volumes, gf weights, viscosity coefficients)
+	Real invDx2 = 1. / Util::sqr(mySurface.dx());
+
+	ScalarGrid<Real>& centerWeights = myBuffers.centerWeights;
+	centerWeights = centerVolumes;
+	
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, centerWeights.size()[0]), [&](const tbb::blocked_range<unsigned> &range)
 	{
-		forEachVoxelRange(Vec2ui(0), nodeVolumes.size(), [&](const Vec2ui& node)
-		{
-			nodeVolumes(node) *= myDt * invDx2;
-			nodeVolumes(node) *= myViscosity.interp(nodeVolumes.indexToWorld(Vec2R(node)));
-			nodeVolumes(node) *= Util::clamp(solidNodeVolumes(node), 0.01, 1.);
-		});
-	}
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < centerWeights.size()[1]; ++j)
+			{
+				Vec2ui cell(i, j);
+				centerWeights(cell) *= myDt * invDx2;
+				centerWeights(cell) *= viscosity(cell);
+				centerWeights(cell) *= Util::clamp(solidCenterVolumes(cell), 0.01, 1.);
+			}
+	});
 
-	Solver<true> solver(liquidDOFCount, liquidDOFCount * 9);
+	ScalarGrid<Real>& nodeWeights = myBuffers.nodeWeights;
+	nodeWeights = nodeVolumes;
+	
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, nodeWeights.size()[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < nodeWeights.size()[1]; ++j)
+			{
+				Vec2ui node(i, j);
+				nodeWeights(node) *= myDt * invDx2;
+				nodeWeights(node) *= viscosity.interp(nodeWeights.indexToWorld(Vec2R(node)));
+				nodeWeights(node) *= Util::clamp(solidNodeVolumes(node), 0.01, 1.);
+			}
+	});
 
-	for (unsigned axis : {0, 1})
+	// The system is never assembled. Each row is rebuilt from the weights whenever it's needed
+	// by visiting the stencil of the face. Entries coupling to other unknowns are passed to
+	// addEntry(column, value) and entries coupling to solid faces are passed to
+	// addSolidEntry(value, solidVelocity) so they can be moved to the right hand side.
+	auto forEachStencilEntry = [&](const Vec2ui& face, unsigned axis, const auto& addEntry, const auto& addSolidEntry)
 	{
 		Vec2ui size = myVelocity.size(axis);
 
-		forEachVoxelRange(Vec2ui(0), size, [&](const Vec2ui& face)
+		// Control volume weight on the diagonal.
+		addEntry(unsigned(liquidFaces(face, axis)), faceVolumes(face, axis));
+
+		// Cell-centered stresses.
+		for (unsigned cellDirection : {0, 1})
 		{
-			int index = liquidFaces(face, axis);
-			if (index >= 0)
+			Vec2i cell = faceToCell(Vec2i(face), axis, cellDirection);
+
+			Real coeff = 2. * centerWeights(Vec2ui(cell));
+
+			Real centerSign = (cellDirection == 0) ? -1. : 1.;
+
+			for (unsigned faceDirection : {0, 1})
 			{
-				Real volume = faceVolumes(face, axis);
+				// Since we've assumed grid boundaries are static solids
+				// we don't have any solveable faces with adjacent cells
+				// out of the grid bounds. We can skip that check here.
 
-				// Build RHS with weight velocities
-				solver.addRhs(index, myVelocity(face, axis) * volume);
-				solver.addGuess(index, myVelocity(face, axis));
+				Vec2ui adjacentFace = cellToFace(Vec2ui(cell), axis, faceDirection);
 
-				// Add control volume weight on the diagonal.
-				solver.addElement(index, index, volume);
+				Real faceSign = (faceDirection == 0) ? -1. : 1.;
 
-				// Build cell-centered stresses.
-				for (unsigned cellDirection : {0, 1})
-				{
-					Vec2i cell = faceToCell(Vec2i(face), axis, cellDirection);
+				int faceIndex = liquidFaces(adjacentFace, axis);
+				if (faceIndex >= 0)
+					addEntry(unsigned(faceIndex), -centerSign * faceSign * coeff);
+				else if (faceIndex == SOLIDBOUNDARY)
+					addSolidEntry(-centerSign * faceSign * coeff, mySolidVelocity(adjacentFace, axis));
+			}
+		}
 
-					Real coeff = 2. * centerVolumes(Vec2ui(cell));
+		// Node stresses.
+		for (unsigned nodeDirection : {0, 1})
+		{
+			Vec2ui node = faceToNode(face, axis, nodeDirection);
 
-					Real centerSign = (cellDirection == 0) ? -1. : 1.;
+			Real nodeSign = (nodeDirection == 0) ? -1. : 1.;
 
-					for (unsigned faceDirection : {0, 1})
-					{
-						// Since we've assumed grid boundaries are static solids
-						// we don't have any solveable faces with adjacent cells
-						// out of the grid bounds. We can skip that check here.
+			Real coeff = nodeWeights(node);
 
-						Vec2ui adjacentFace = cellToFace(Vec2ui(cell), axis, faceDirection);
+			for (unsigned gradientAxis : {0, 1})
+				for (unsigned faceDirection : {0, 1})
+				{
+					Vec2i adjacentFace = nodeToFace(Vec2i(node), gradientAxis, faceDirection);
 
-						Real faceSign = (faceDirection == 0) ? -1. : 1.;
+					Real faceSign = faceDirection == 0 ? -1. : 1.;
+
+					if (adjacentFace[gradientAxis] >= 0 && adjacentFace[gradientAxis] < size[gradientAxis])
+					{
+						unsigned faceAxis = (gradientAxis + 1) % 2;
+						int faceIndex = liquidFaces(Vec2ui(adjacentFace), faceAxis);
 
-						int faceIndex = liquidFaces(adjacentFace, axis);
 						if (faceIndex >= 0)
-							solver.addElement(index, faceIndex, -centerSign * faceSign * coeff);
+							addEntry(unsigned(faceIndex), -nodeSign * faceSign * coeff);
 						else if (faceIndex == SOLIDBOUNDARY)
-							solver.addRhs(index, centerSign * faceSign * coeff * mySolidVelocity(adjacentFace, axis));
+							addSolidEntry(-nodeSign * faceSign * coeff, mySolidVelocity(Vec2ui(adjacentFace), faceAxis));
 					}
 				}
+		}
+	};
+
+	auto forEachDOF = [&](const auto& function)
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, liquidDOFCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned row = range.begin(); row != range.end(); ++row)
+				function(row, Vec2ui(liquidFaceList[row][0], liquidFaceList[row][1]), liquidFaceList[row][2]);
+		});
+	};
+
+	// Build RHS with weighted velocities and the solid boundary stresses. The current
+	// velocity is the initial guess.
+	// The stencil entries are counted along the way for the solver stats.
+	SolveVector& rhs = myBuffers.rhs;
+	SolveVector& solution = myBuffers.solution;
+	std::vector<unsigned>& rowEntryCount = myBuffers.rowEntryCount;
+
+	rhs.resize(liquidDOFCount);
+	solution.resize(liquidDOFCount);
+	rowEntryCount.resize(liquidDOFCount);
+
+	forEachDOF([&](unsigned row, const Vec2ui& face, unsigned axis)
+	{
+		double localRhs = myVelocity(face, axis) * faceVolumes(face, axis);
+		unsigned entryCount = 0;
+
+		forEachStencilEntry(face, axis, [&](unsigned, Real) { ++entryCount; },
+							[&](Real value, Real solidVelocity) { localRhs -= value * solidVelocity; });
+
+		rhs[row] = localRhs;
+		rowEntryCount[row] = entryCount;
+		solution[row] = myVelocity(face, axis);
+	});
+
+	//
+	// Matrix-free operator. The stencil rows above are equivalent to computing the viscous
+	// stresses at cell centers and nodes and then taking their divergence at the faces, so
+	// only the cells and nodes that touch a solved face need to be visited.
+	//
+
+	Vec2ui size = mySurface.size();
+
+	// Number the cells and nodes that touch a solved face
+	UniformGrid<int>& activeCellIndex = myBuffers.activeCellIndex;
+	UniformGrid<int>& activeNodeIndex = myBuffers.activeNodeIndex;
+
+	activeCellIndex.resize(size, -1);
+	activeNodeIndex.resize(size + Vec2ui(1), -1);
+
+	for (const Vec3ui& dof : liquidFaceList)
+	{
+		Vec2ui face(dof[0], dof[1]);
+		unsigned axis = dof[2];
+
+		for (unsigned direction : {0, 1})
+		{
+			activeCellIndex(Vec2ui(faceToCell(Vec2i(face), axis, direction))) = 0;
+			activeNodeIndex(faceToNode(face, axis, direction)) = 0;
+		}
+	}
+
+	std::vector<Vec2ui>& activeCells = myBuffers.activeCells;
+	std::vector<Vec2ui>& activeNodes = myBuffers.activeNodes;
+
+	activeCells.clear();
+	activeNodes.clear();
+
+	forEachVoxelRange(Vec2ui(0), activeCellIndex.size(), [&](const Vec2ui& cell)
+	{
+		if (activeCellIndex(cell) == 0)
+		{
+			activeCellIndex(cell) = int(activeCells.size());
+			activeCells.push_back(cell);
+		}
+	});
+
+	forEachVoxelRange(Vec2ui(0), activeNodeIndex.size(), [&](const Vec2ui& node)
+	{
+		if (activeNodeIndex(node) == 0)
+		{
+			activeNodeIndex(node) = int(activeNodes.size());
+			activeNodes.push_back(node);
+		}
+	});
+
+	// The stencils only depend on the weights so they're gathered once up front
+	using CellStencil = ViscositySolverBuffers::CellStencil;
+	using NodeStencil = ViscositySolverBuffers::NodeStencil;
+	using FaceStencil = ViscositySolverBuffers::FaceStencil;
+
+	std::vector<CellStencil>& cellStencils = myBuffers.cellStencils;
+	std::vector<NodeStencil>& nodeStencils = myBuffers.nodeStencils;
+	std::vector<FaceStencil>& faceStencils = myBuffers.faceStencils;
+
+	cellStencils.resize(activeCells.size());
+	nodeStencils.resize(activeNodes.size());
+	faceStencils.resize(liquidDOFCount);
+
+	Vec2ui faceSize[2] = { myVelocity.size(0), myVelocity.size(1) };
+
+	auto solvedFace = [&](const Vec2ui& face, unsigned axis) -> int
+	{
+		int index = liquidFaces(face, axis);
+		return index >= 0 ? index : -1;
+	};
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, unsigned(activeCells.size())), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned cellIndex = range.begin(); cellIndex != range.end(); ++cellIndex)
+		{
+			const Vec2ui& cell = activeCells[cellIndex];
+			CellStencil& stencil = cellStencils[cellIndex];
 
-				// Build node stresses.
-				for (unsigned nodeDirection : {0, 1})
+			stencil.coeff = 2. * centerWeights(cell);
+
+			for (unsigned axis : {0, 1})
+				for (unsigned direction : {0, 1})
+					stencil.faces[axis][direction] = solvedFace(cellToFace(cell, axis, direction), axis);
+		}
+	});
+
+	// Velocity samples beyond the grid don't contribute
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, unsigned(activeNodes.size())), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned nodeIndex = range.begin(); nodeIndex != range.end(); ++nodeIndex)
+		{
+			const Vec2ui& node = activeNodes[nodeIndex];
+			NodeStencil& stencil = nodeStencils[nodeIndex];
+
+			stencil.coeff = nodeWeights(node);
+
+			for (unsigned faceAxis : {0, 1})
+			{
+				unsigned gradientAxis = (faceAxis + 1) % 2;
+
+				stencil.faces[faceAxis][0] = -1;
+				stencil.faces[faceAxis][1] = -1;
+
+				if (node[gradientAxis] > 0)
 				{
-					Vec2ui node = faceToNode(face, axis, nodeDirection);
+					Vec2ui backwardFace = node; --backwardFace[gradientAxis];
+					stencil.faces[faceAxis][0] = solvedFace(backwardFace, faceAxis);
+				}
 
-					Real nodeSign = (nodeDirection == 0) ? -1. : 1.;
+				if (node[gradientAxis] < faceSize[faceAxis][gradientAxis])
+					stencil.faces[faceAxis][1] = solvedFace(node, faceAxis);
+			}
+		}
+	});
 
-					Real coeff = nodeVolumes(node);
+	// Solved faces are never on the grid boundary so both adjacent cells exist
+	forEachDOF([&](unsigned row, const Vec2ui& face, unsigned axis)
+	{
+		FaceStencil& stencil = faceStencils[row];
 
-					for (unsigned gradientAxis : {0, 1})
-						for (unsigned faceDirection : {0, 1})
-						{
-							Vec2i adjacentFace = nodeToFace(Vec2i(node), gradientAxis, faceDirection);
+		stencil.volume = faceVolumes(face, axis);
+
+		for (unsigned direction : {0, 1})
+		{
+			stencil.cellStresses[direction] = 2 * activeCellIndex(Vec2ui(faceToCell(Vec2i(face), axis, direction))) + axis;
+			stencil.nodes[direction] = activeNodeIndex(faceToNode(face, axis, direction));
+		}
+	});
+
+	std::vector<double>& cellStresses = myBuffers.cellStresses;
+	std::vector<double>& nodeStresses = myBuffers.nodeStresses;
+
+	cellStresses.resize(2 * activeCells.size());
+	nodeStresses.resize(activeNodes.size());
+
+	auto applyOperator = [&](const SolveVector& input, SolveVector& output)
+	{
+		auto faceValue = [&](int index) -> double { return index >= 0 ? input[index] : 0; };
+
+		// Normal stresses at cell centers
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, unsigned(cellStencils.size())), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned cellIndex = range.begin(); cellIndex != range.end(); ++cellIndex)
+			{
+				const CellStencil& stencil = cellStencils[cellIndex];
+
+				for (unsigned axis : {0, 1})
+					cellStresses[2 * cellIndex + axis] = stencil.coeff * (faceValue(stencil.faces[axis][1]) - faceValue(stencil.faces[axis][0]));
+			}
+		});
+
+		// Shear stresses at nodes
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, unsigned(nodeStencils.size())), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned nodeIndex = range.begin(); nodeIndex != range.end(); ++nodeIndex)
+			{
+				const NodeStencil& stencil = nodeStencils[nodeIndex];
+
+				nodeStresses[nodeIndex] = stencil.coeff * (faceValue(stencil.faces[0][1]) - faceValue(stencil.faces[0][0]) +
+															faceValue(stencil.faces[1][1]) - faceValue(stencil.faces[1][0]));
+			}
+		});
+
+		// Divergence of the stresses at the solved faces
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, liquidDOFCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned row = range.begin(); row != range.end(); ++row)
+			{
+				const FaceStencil& stencil = faceStencils[row];
+
+				output[row] = stencil.volume * input[row] +
+								cellStresses[stencil.cellStresses[0]] - cellStresses[stencil.cellStresses[1]] +
+								nodeStresses[stencil.nodes[0]] - nodeStresses[stencil.nodes[1]];
+			}
+		});
+	};
+
+	mySolverStats = SolverStats();
+	mySolverStats.solver = "ViscositySolver";
+	mySolverStats.dofs = liquidDOFCount;
+	mySolverStats.nonZeros = std::accumulate(rowEntryCount.begin(), rowEntryCount.end(), std::size_t(0));
+	mySolverStats.assemblySeconds = timer.stop();
+
+	timer.reset();
+
+	//
+	// Block Jacobi preconditioner. Faces are grouped by the PRECONDITIONERTILE^2 block of cells
+	// they belong to, which keeps the coupling between the x and y velocities at the nodes
+	// inside of each block. Every block is small enough to factor directly.
+	//
+
+	Vec2ui tileCount = (size + Vec2ui(PRECONDITIONERTILE - 1)) / PRECONDITIONERTILE;
+	unsigned blockCount = tileCount[0] * tileCount[1];
+
+	auto faceToBlock = [&](const Vec3ui& dof) -> unsigned
+	{
+		Vec2ui tile = Vec2ui(dof[0], dof[1]) / PRECONDITIONERTILE;
+		assert(tile[0] < tileCount[0] && tile[1] < tileCount[1]);
+		return tile[1] + tileCount[1] * tile[0];
+	};
+
+	// Bucket the unknowns by block and drop the empty blocks
+	std::vector<unsigned>& blockStart = myBuffers.blockStart;
+	std::vector<unsigned>& blockList = myBuffers.blockList;
+
+	blockStart.assign(blockCount + 1, 0);
+	blockList.resize(liquidDOFCount);
+
+	for (const Vec3ui& dof : liquidFaceList)
+		++blockStart[faceToBlock(dof) + 1];
+
+	for (unsigned block = 0; block < blockCount; ++block)
+		blockStart[block + 1] += blockStart[block];
+
+	{
+		std::vector<unsigned>& blockFill = myBuffers.blockFill;
+		blockFill.assign(blockStart.begin(), blockStart.end() - 1);
+		for (unsigned row = 0; row < liquidDOFCount; ++row)
+			blockList[blockFill[faceToBlock(liquidFaceList[row])]++] = row;
+	}
+
+	blockStart.erase(std::unique(blockStart.begin(), blockStart.end()), blockStart.end());
+	blockCount = unsigned(blockStart.size()) - 1;
+
+	// Each block stores its dense inverse. Applying the inverse is a small matrix-vector product
+	// which, unlike a triangular solve, doesn't serialize on the previous row.
+	std::vector<unsigned>& inverseStart = myBuffers.inverseStart;
+	reserveWithHeadroom(inverseStart, blockCount + 1);
+	inverseStart.assign(blockCount + 1, 0);
+	for (unsigned block = 0; block < blockCount; ++block)
+	{
+		unsigned blockSize = blockStart[block + 1] - blockStart[block];
+		inverseStart[block + 1] = inverseStart[block] + blockSize * blockSize;
+	}
 
-							Real faceSign = faceDirection == 0 ? -1. : 1.;
+	std::vector<double>& blockInverses = myBuffers.blockInverses;
+	blockInverses.resize(inverseStart.back());
 
-							if (adjacentFace[gradientAxis] >= 0 && adjacentFace[gradientAxis] < size[gradientAxis])
-							{
-								unsigned faceAxis = (gradientAxis + 1) % 2;
-								int faceIndex = liquidFaces(Vec2ui(adjacentFace), faceAxis);
+	static constexpr unsigned MAXBLOCKSIZE = 2 * PRECONDITIONERTILE * PRECONDITIONERTILE;
 
-								if (faceIndex >= 0)
-									solver.addElement(index, faceIndex, -nodeSign * faceSign * coeff);
-								else if (faceIndex == SOLIDBOUNDARY)
-									solver.addRhs(index, nodeSign * faceSign * coeff * mySolidVelocity(Vec2ui(adjacentFace), faceAxis));
-							}
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, blockCount), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		double blockMatrix[MAXBLOCKSIZE][MAXBLOCKSIZE];
+		double column[MAXBLOCKSIZE];
+
+		for (unsigned block = range.begin(); block != range.end(); ++block)
+		{
+			unsigned blockSize = blockStart[block + 1] - blockStart[block];
+			assert(blockSize > 0 && blockSize <= MAXBLOCKSIZE);
+
+			const unsigned* rows = &blockList[blockStart[block]];
+
+			for (unsigned localRow = 0; localRow < blockSize; ++localRow)
+			{
+				for (unsigned localCol = 0; localCol < blockSize; ++localCol)
+					blockMatrix[localRow][localCol] = 0;
+
+				const Vec3ui& dof = liquidFaceList[rows[localRow]];
+
+				forEachStencilEntry(Vec2ui(dof[0], dof[1]), dof[2], [&](unsigned column, Real value)
+				{
+					for (unsigned localCol = 0; localCol < blockSize; ++localCol)
+					{
+						if (rows[localCol] == column)
+						{
+							blockMatrix[localRow][localCol] += value;
+							break;
 						}
+					}
+				}, [](Real, Real) {});
+			}
+
+			// In-place Cholesky factorization into the lower triangle
+			for (unsigned localCol = 0; localCol < blockSize; ++localCol)
+			{
+				double diagonal = blockMatrix[localCol][localCol];
+				for (unsigned k = 0; k < localCol; ++k)
+					diagonal -= Util::sqr(blockMatrix[localCol][k]);
+
+				// The system is positive definite so this only guards against round-off
+				assert(diagonal > 0);
+				diagonal = std::sqrt(std::max(diagonal, 1E-12));
+				blockMatrix[localCol][localCol] = diagonal;
+
+				for (unsigned localRow = localCol + 1; localRow < blockSize; ++localRow)
+				{
+					double sum = blockMatrix[localRow][localCol];
+					for (unsigned k = 0; k < localCol; ++k)
+						sum -= blockMatrix[localRow][k] * blockMatrix[localCol][k];
+					blockMatrix[localRow][localCol] = sum / diagonal;
+				}
+			}
+
+			// Build the inverse one column at a time with forward and back substitution
+			double* inverse = &blockInverses[inverseStart[block]];
+
+			for (unsigned unitIndex = 0; unitIndex < blockSize; ++unitIndex)
+			{
+				for (unsigned localRow = 0; localRow < blockSize; ++localRow)
+				{
+					double sum = (localRow == unitIndex) ? 1. : 0.;
+					for (unsigned k = 0; k < localRow; ++k)
+						sum -= blockMatrix[localRow][k] * column[k];
+					column[localRow] = sum / blockMatrix[localRow][localRow];
+				}
+
+				for (unsigned localRow = blockSize; localRow-- > 0;)
+				{
+					double sum = column[localRow];
+					for (unsigned k = localRow + 1; k < blockSize; ++k)
+						sum -= blockMatrix[k][localRow] * column[k];
+					column[localRow] = sum / blockMatrix[localRow][localRow];
+				}
+
+				for (unsigned localRow = 0; localRow < blockSize; ++localRow)
+					inverse[localRow * blockSize + unitIndex] = column[localRow];
+			}
+		}
+	});
+
+	auto applyPreconditioner = [&](const SolveVector& input, SolveVector& output)
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, blockCount), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			double localValues[MAXBLOCKSIZE];
+
+			for (unsigned block = range.begin(); block != range.end(); ++block)
+			{
+				unsigned blockSize = blockStart[block + 1] - blockStart[block];
+				const unsigned* rows = &blockList[blockStart[block]];
+				const double* inverse = &blockInverses[inverseStart[block]];
+
+				for (unsigned localRow = 0; localRow < blockSize; ++localRow)
+					localValues[localRow] = input[rows[localRow]];
+
+				for (unsigned localRow = 0; localRow < blockSize; ++localRow)
+				{
+					double sum = 0;
+					for (unsigned k = 0; k < blockSize; ++k)
+						sum += inverse[localRow * blockSize + k] * localValues[k];
+					output[rows[localRow]] = sum;
 				}
 			}
 		});
-	}
+	};
 
-	bool solved = solver.solveIterative();
+	mySolverStats.preconditionerSeconds = timer.stop();
 
-	if (!solved)
+	unsigned maxIterations = myMaxIterations > 0 ? myMaxIterations : 2 * liquidDOFCount;
+
+	timer.reset();
+	ConjugateGradientResult result = solveConjugateGradient(applyOperator, applyPreconditioner, rhs, solution,
+															myTolerance, maxIterations, myBuffers.solverBuffers);
+
+	mySolverStats.solveSeconds = timer.stop();
+	mySolverStats.iterations = result.iterations;
+	mySolverStats.residual = result.residual;
+	mySolverStats.converged = result.converged;
+
+	if (!result.converged)
 	{
-		std::cout << "Viscosity failed to solve" << std::endl;
+		std::cout << "Viscosity failed to solve. Iterations: " << result.iterations << ", residual: " << result.residual << std::endl;
 		assert(false);
 	}
 
 	// Update velocity
+	forEachDOF([&](unsigned row, const Vec2ui& face, unsigned axis)
+	{
+		myVelocity(face, axis) = solution[row];
+	});
+
 	for (unsigned axis : {0, 1})
 	{
 		Vec2ui size = myVelocity.size(axis);
 
 		forEachVoxelRange(Vec2ui(0), size, [&](const Vec2ui& face)
 		{
-			int index = liquidFaces(face, axis);
-			if (index >= 0)
-				myVelocity(face, axis) = solver.solution(index);
-			else if (index == SOLIDBOUNDARY)
+			if (liquidFaces(face, axis) == SOLIDBOUNDARY)
 				myVelocity(face, axis) = mySolidVelocity(face, axis);
 		});
 	}
@@ -186,11 +627,14 @@ void ViscositySolver::solve(const VectorGrid<Real>& faceVolumes,
 
 void ViscositySolver::setViscosity(Real mu)
 {
-	myViscosity = ScalarGrid<Real>(mySurface.xform(), mySurface.size(), mu);
+	ScalarGrid<Real>& viscosity = myBuffers.viscosity;
+	if (!mySurface.isMatched(viscosity))
+		viscosity = ScalarGrid<Real>(mySurface.xform(), mySurface.size(), mu);
+	else viscosity.resize(viscosity.size(), mu);
 }
 
 void ViscositySolver::setViscosity(const ScalarGrid<Real>& mu)
 {
 	assert(mu.size() == mySurface.size());
-	myViscosity = mu;
+	myBuffers.viscosity = mu;
 }
\ No newline at end of file
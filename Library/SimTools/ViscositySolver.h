@@ -1,9 +1,14 @@
 #ifndef LIBRARY_VISCOSITYSOLVER_H
 #define LIBRARY_VISCOSITYSOLVER_H
 
+#include <memory>
+#include <vector>
+
+#include "ConjugateGradient.h"
 #include "LevelSet2D.h"
 #include "Renderer.h"
 #include "ScalarGrid.h"
+#include "SolverStats.h"
 #include "VectorGrid.h"
 
 ///////////////////////////////////
@@ -15,24 +20,117 @@
 // Uses ghost fluid weights for moving
 // collisions. Uses volume control
 // weights for the various tensor and
-// velocity sample positions.
+// velocity sample positions. The system
+// is solved matrix-free with a block
+// Jacobi preconditioned CG.
 //
 ////////////////////////////////////
 
+// Scratch for a viscosity solve. The solver itself only lives for one timestep, so a
+// simulator keeps these buffers around and hands them to every new solver to avoid
+// rebuilding the system's storage each time.
+struct ViscositySolverBuffers
+{
+	// A cell stress is the difference of the two faces along an axis. A node stress is the sum of
+	// the two face differences across the node. Faces outside of the solve are marked with -1.
+	struct CellStencil
+	{
+		Real coeff;
+		int faces[2][2];
+	};
+
+	struct NodeStencil
+	{
+		Real coeff;
+		int faces[2][2];
+	};
+
+	// Cell stresses are stored per axis so the face stencil points at the stress along its own axis
+	struct FaceStencil
+	{
+		Real volume;
+		unsigned cellStresses[2];
+		unsigned nodes[2];
+	};
+
+	ScalarGrid<Real> viscosity;
+	ScalarGrid<Real> centerWeights, nodeWeights;
+
+	VectorGrid<int> liquidFaces;
+	std::vector<unsigned> rowStart;
+	std::vector<Vec3ui> liquidFaceList;
+
+	UniformGrid<int> activeCellIndex, activeNodeIndex;
+	std::vector<Vec2ui> activeCells, activeNodes;
+
+	std::vector<CellStencil> cellStencils;
+	std::vector<NodeStencil> nodeStencils;
+	std::vector<FaceStencil> faceStencils;
+	std::vector<double> cellStresses, nodeStresses;
+
+	std::vector<unsigned> rowEntryCount;
+	std::vector<unsigned> blockStart, blockFill, blockList, inverseStart;
+	std::vector<double> blockInverses;
+
+	SolveVector rhs, solution;
+	ConjugateGradientBuffers solverBuffers;
+};
+
 class ViscositySolver
 {
 	static constexpr int UNSOLVED = -2;
 	static constexpr int SOLIDBOUNDARY = -1;
 
+	// Width in cells of the square blocks used by the preconditioner
+	static constexpr unsigned PRECONDITIONERTILE = 2;
+
 public:
 
 	ViscositySolver(Real dt, const LevelSet2D& surface, VectorGrid<Real>& velocity,
 					const LevelSet2D& solidSurface, const VectorGrid<Real>& solidVelocity)
-		: myDt(dt)
+		: ViscositySolver(dt, surface, velocity, solidSurface, solidVelocity, nullptr)
+		{}
+
+	// The solver works out of the caller's buffers, which must outlive it
+	ViscositySolver(Real dt, const LevelSet2D& surface, VectorGrid<Real>& velocity,
+					const LevelSet2D& solidSurface, const VectorGrid<Real>& solidVelocity,
+					ViscositySolverBuffers& buffers)
+		: ViscositySolver(dt, surface, velocity, solidSurface, solidVelocity, &buffers)
+		{}
+
+	void setViscosity(Real mu);
+	void setViscosity(const ScalarGrid<Real>& mu);
+
+	// Relative residual the solve must reach
+	void setTolerance(Real tolerance) { myTolerance = tolerance; }
+
+	// Zero allows twice as many iterations as there are unknowns
+	void setMaxIterations(unsigned maxIterations) { myMaxIterations = maxIterations; }
+
+	void solve(const VectorGrid<Real>& faceVolumes,
+				const ScalarGrid<Real>& centerVolumes,
+				const ScalarGrid<Real>& nodeVolumes,
+				const ScalarGrid<Real>& solidCenterVolumes,
+				const ScalarGrid<Real>& solidNodeVolumes);
+
+	// Telemetry from the last solve. Non-zeros count the entries of the matrix-free stencil.
+	const SolverStats& solverStats() const { return mySolverStats; }
+
+private:
+
+	// Without buffers from the caller the solver owns its own
+	ViscositySolver(Real dt, const LevelSet2D& surface, VectorGrid<Real>& velocity,
+					const LevelSet2D& solidSurface, const VectorGrid<Real>& solidVelocity,
+					ViscositySolverBuffers* buffers)
+		: myOwnedBuffers(buffers ? nullptr : new ViscositySolverBuffers)
+		, myBuffers(buffers ? *buffers : *myOwnedBuffers)
 		, myVelocity(velocity)
-		, mySurface(surface)
 		, mySolidVelocity(solidVelocity)
+		, mySurface(surface)
 		, mySolidSurface(solidSurface)
+		, myDt(dt)
+		, myTolerance(1E-5)
+		, myMaxIterations(0)
 		{
 			// For efficiency sake, this should only take in velocity on a staggered grid
 			// that matches the center sampled surface and collision
@@ -51,15 +149,8 @@ public:
 				mySolidVelocity.size(1)[1] - 1 == mySurface.size()[1]);
 		}
 
-	void setViscosity(Real mu);
-	void setViscosity(const ScalarGrid<Real>& mu);
-
-	void solve(const VectorGrid<Real>& faceVolumes,
-				ScalarGrid<Real>& centerVolumes,
-				ScalarGrid<Real>& nodeVolumes,
-				const ScalarGrid<Real>& solidCenterVolumes,
-				const ScalarGrid<Real>& solidNodeVolumes);
-private:
+	std::unique_ptr<ViscositySolverBuffers> myOwnedBuffers;
+	ViscositySolverBuffers& myBuffers;
 
 	VectorGrid<Real>& myVelocity;
 	const VectorGrid<Real>& mySolidVelocity;
@@ -67,9 +158,12 @@ private:
 	const LevelSet2D& mySurface;
 	const LevelSet2D& mySolidSurface;
 
-	ScalarGrid<Real> myViscosity;
-
 	Real myDt;
+
+	Real myTolerance;
+	unsigned myMaxIterations;
+
+	SolverStats mySolverStats;
 };
 
 #endif
\ No newline at end of file
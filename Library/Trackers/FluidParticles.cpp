@@ -1,6 +1,7 @@
 #include <random>
 
 #include "FluidParticles.h"
+#include "Profiler.h"
 
 static Vec2R randomizer(const Vec2ui& coord, unsigned count, Real seed)
 {
@@ -37,6 +38,8 @@ void FluidParticles::drawVelocity(Renderer& renderer, const Vec3f& colour, Real
 
 void FluidParticles::init(const LevelSet2D& surface)
 {
+	PROFILE_ZONE("FluidParticles::init");
+
 	myParticles.clear();
 
 	forEachVoxelRange(Vec2ui(0), surface.size(), [&](const Vec2ui& cell)
@@ -65,6 +68,8 @@ void FluidParticles::init(const LevelSet2D& surface)
 
 void FluidParticles::setVelocity(const VectorGrid<Real>& vel)
 {
+	PROFILE_ZONE("FluidParticles::setVelocity");
+
 	assert(myTrackVelocity);
 	myVelocity.resize(myParticles.size());
 
@@ -74,6 +79,8 @@ void FluidParticles::setVelocity(const VectorGrid<Real>& vel)
 
 void FluidParticles::applyVelocity(VectorGrid<Real>& velocity)
 {
+	PROFILE_ZONE("FluidParticles::applyVelocity");
+
 	assert(myTrackVelocity);
 	for (unsigned axis : {0, 1})
 	{
@@ -118,6 +125,8 @@ void FluidParticles::applyVelocity(VectorGrid<Real>& velocity)
 }
 void FluidParticles::incrementVelocity(VectorGrid<Real>& velocity)
 {
+	PROFILE_ZONE("FluidParticles::incrementVelocity");
+
 	assert(myVelocity.size() == myParticles.size() && myTrackVelocity);
 
 	unsigned particleCount = myParticles.size();
@@ -130,6 +139,8 @@ void FluidParticles::blendVelocity(const VectorGrid<Real>& oldVelocity,
 										const VectorGrid<Real>& newVelocity,
 										Real blend)
 {
+	PROFILE_ZONE("FluidParticles::blendVelocity");
+
 	assert(myVelocity.size() == myParticles.size() && myTrackVelocity);
 
 	for (unsigned particleIndex = 0; particleIndex < myParticles.size(); ++particleIndex)
@@ -175,6 +186,8 @@ LevelSet2D FluidParticles::surfaceParticles(const Transform& xform, const Vec2ui
 
 void FluidParticles::reseed(const LevelSet2D& surface, Real minDensity, Real maxDensity, const VectorGrid<Real>* velocity, Real seed)
 {
+	PROFILE_ZONE("FluidParticles::reseed");
+
 	myNewParticles.clear();
 
 	// Load up particles into grid cells
@@ -284,6 +297,8 @@ void FluidParticles::bumpParticles(const LevelSet2D& collision)
 
 void FluidParticles::advect(Real dt, const VectorGrid<Real>& vel, const IntegrationOrder order)
 {
+	PROFILE_ZONE("FluidParticles::advect");
+
 	auto velFunc = [vel](Real, const Vec2R& world_pos)
 	{
 		return vel.interp(world_pos);
@@ -292,4 +307,61 @@ void FluidParticles::advect(Real dt, const VectorGrid<Real>& vel, const Integrat
 	assert(dt >= 0);
 	for (auto& point : myParticles)
 		point = Integrator(dt, point, velFunc, order);
+}
+
+bool FluidParticles::writeSnapshot(const std::string& filename) const
+{
+	SnapshotHeader header;
+	header.kind = SnapshotSettings::Kind::PARTICLES;
+	header.valueBytes = sizeof(Vec2R);
+	header.parameters[0] = myParticleRadius;
+	header.parameters[1] = myParticleDensity;
+	header.parameters[2] = myOversampleRate;
+	header.parameters[3] = myTrackVelocity ? 1 : 0;
+
+	std::vector<SnapshotBlock> blocks;
+	blocks.push_back(SnapshotBlock{ myParticles.data(), Vec2ui(unsigned(myParticles.size()), 1) });
+
+	if (myTrackVelocity)
+	{
+		assert(myVelocity.size() == myParticles.size());
+		blocks.push_back(SnapshotBlock{ myVelocity.data(), Vec2ui(unsigned(myVelocity.size()), 1) });
+	}
+
+	return ::writeSnapshot(filename, header, blocks);
+}
+
+bool FluidParticles::readSnapshot(const std::string& filename)
+{
+	MappedSnapshot snapshot(filename);
+	if (!snapshot.isValid())
+		return false;
+
+	const SnapshotHeader& header = snapshot.header();
+	bool trackVelocity = header.parameters[3] != 0;
+
+	if (header.kind != SnapshotSettings::Kind::PARTICLES || header.valueBytes != sizeof(Vec2R) ||
+		header.blockCount != (trackVelocity ? 2 : 1))
+		return false;
+
+	// Every particle needs a velocity when they're tracked
+	if (snapshot.blockSize(0)[1] != 1 || (trackVelocity && !(snapshot.blockSize(1) == snapshot.blockSize(0))))
+		return false;
+
+	myParticleRadius = header.parameters[0];
+	myParticleDensity = unsigned(header.parameters[1]);
+	myOversampleRate = header.parameters[2];
+	myTrackVelocity = trackVelocity;
+
+	const Vec2R* positions = snapshot.block<Vec2R>(0);
+	myParticles.assign(positions, positions + snapshot.blockSize(0)[0]);
+
+	if (myTrackVelocity)
+	{
+		const Vec2R* velocities = snapshot.block<Vec2R>(1);
+		myVelocity.assign(velocities, velocities + snapshot.blockSize(1)[0]);
+	}
+	else myVelocity.clear();
+
+	return true;
 }
\ No newline at end of file
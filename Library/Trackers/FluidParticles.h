@@ -69,6 +69,11 @@ public:
 
 	void advect(Real dt, const VectorGrid<Real>& velocity, const IntegrationOrder order);
 
+	// Binary snapshot of the positions, velocities if they're tracked, and the seeding
+	// parameters (see GridSnapshot.h)
+	bool writeSnapshot(const std::string& filename) const;
+	bool readSnapshot(const std::string& filename);
+
 protected:
 	std::vector<Vec2R> myParticles, myNewParticles;
 	std::vector<Vec2R> myVelocity;
@@ -1,5 +1,6 @@
 #include "LevelSet2D.h"
 
+#include <algorithm>
 #include <limits>
 #include <utility>
 
@@ -8,6 +9,7 @@
 #include <Eigen/Dense>
 #include <Eigen/SVD>
 
+#include "Profiler.h"
 #include "VectorGrid.h"
 
 void LevelSet2D::drawGrid(Renderer& renderer) const
@@ -83,6 +85,8 @@ auto vecCompare = [](const Vec2ui &a, const Vec2ui &b) -> bool
 
 void LevelSet2D::reinitFIM()
 {
+	PROFILE_ZONE("LevelSet2D::reinitFIM");
+
 	UniformGrid<MarkedCells> reinitializedCells(size(), MarkedCells::UNVISITED);
 	
 	// Find the zero crossings, update their distances and flag as source cells
@@ -389,11 +393,16 @@ void LevelSet2D::reinit()
 
 	myPhiGrid = tempPhiGrid;
 
-	reinitFastMarching(reinitializedCells);
+	std::vector<std::pair<Vec2ui, Real>> marchingQueue;
+	reinitFastMarching(reinitializedCells, marchingQueue);
 }
 
-void LevelSet2D::init(const Mesh2D& initMesh, bool resize)
+void LevelSet2D::init(const Mesh2D& initMesh, bool resize, LevelSetBuffers& buffers)
 {
+	PROFILE_ZONE("LevelSet2D::init");
+
+	PROFILE_ZONE("LevelSet2D::reinit");
+
 	if (resize)
 	{
 		// Determine the bounding box of the mesh to build the underlying grids
@@ -421,8 +430,11 @@ void LevelSet2D::init(const Mesh2D& initMesh, bool resize)
 	// We want to track which cells in the level set contain valid distance information.
 	// The first pass will set cells close to the mesh as FINISHED. The following pass will do a 
 	// BFS to assign the remaining UNVISITED cells with the appropriate distances.
-	UniformGrid<MarkedCells> reinitializedCells(size(), MarkedCells::UNVISITED);
-	UniformGrid<int> meshParityCells(size(), 0);
+	UniformGrid<MarkedCells>& reinitializedCells = buffers.reinitializedCells;
+	reinitializedCells.resize(size(), MarkedCells::UNVISITED);
+
+	UniformGrid<int>& meshParityCells = buffers.meshParityCells;
+	meshParityCells.resize(size(), 0);
 
 	for (auto edge : initMesh.edges())
 	{
@@ -584,10 +596,10 @@ void LevelSet2D::init(const Mesh2D& initMesh, bool resize)
 			}
 	}
 
-	reinitFastMarching(reinitializedCells);
+	reinitFastMarching(reinitializedCells, buffers.marchingQueue);
 }
 
-void LevelSet2D::reinitFastMarching(UniformGrid<MarkedCells>& reinitializedCells)
+void LevelSet2D::reinitFastMarching(UniformGrid<MarkedCells>& reinitializedCells, std::vector<std::pair<Vec2ui, Real>>& marchingQueue)
 {
 	assert(reinitializedCells.size() == size());
 
@@ -615,10 +627,19 @@ void LevelSet2D::reinitFastMarching(UniformGrid<MarkedCells>& reinitializedCells
 		return U;
 	};
 
-	// Load up the BFS queue with the unvisited cells next to the finished ones
+	// Load up the BFS queue with the unvisited cells next to the finished ones. The queue is a heap
+	// kept in the caller's storage so it doesn't allocate once it has grown.
 	using Node = std::pair<Vec2ui, Real>;
 	auto cmp = [](const Node& a, const Node& b) -> bool { return fabs(a.second) > fabs(b.second); };
-	std::priority_queue<Node, std::vector<Node>, decltype(cmp)> phiCellQ(cmp);
+
+	std::vector<Node>& phiCellQ = marchingQueue;
+	phiCellQ.clear();
+
+	auto pushNode = [&](const Node& node)
+	{
+		phiCellQ.push_back(node);
+		std::push_heap(phiCellQ.begin(), phiCellQ.end(), cmp);
+	};
 
 	forEachVoxelRange(Vec2ui(0), size(), [&](const Vec2ui& cell)
 	{
@@ -639,7 +660,7 @@ void LevelSet2D::reinitFastMarching(UniformGrid<MarkedCells>& reinitializedCells
 						assert(udf >= 0);
 						Node node(Vec2ui(adjacentCell), udf);
 
-						phiCellQ.push(node);
+						pushNode(node);
 						reinitializedCells(Vec2ui(adjacentCell)) = MarkedCells::VISITED;
 					}
 				}
@@ -648,9 +669,10 @@ void LevelSet2D::reinitFastMarching(UniformGrid<MarkedCells>& reinitializedCells
 
 	while (!phiCellQ.empty())
 	{
-		Node localNode = phiCellQ.top();
+		Node localNode = phiCellQ.front();
 		Vec2ui localCell = localNode.first;
-		phiCellQ.pop();
+		std::pop_heap(phiCellQ.begin(), phiCellQ.end(), cmp);
+		phiCellQ.pop_back();
 
 		// Since you can't just update parts of the priority queue,
 		// it's possible that a cell has been solidified at a smaller distance
@@ -694,7 +716,7 @@ void LevelSet2D::reinitFastMarching(UniformGrid<MarkedCells>& reinitializedCells
 
 						Node node(Vec2ui(adjacentCell), udf);
 
-						phiCellQ.push(node);
+						pushNode(node);
 						reinitializedCells(Vec2ui(adjacentCell)) = MarkedCells::VISITED;
 					}
 				}
@@ -718,6 +740,8 @@ void LevelSet2D::reinitFastMarching(UniformGrid<MarkedCells>& reinitializedCells
 
 Mesh2D LevelSet2D::buildMSMesh() const
 {
+	PROFILE_ZONE("LevelSet2D::buildMSMesh");
+
 	std::vector<Vec2R> verts;
 	std::vector<Vec2ui> edges;
 		
@@ -775,21 +799,35 @@ Mesh2D LevelSet2D::buildMSMesh() const
 }
 
 // Extract a mesh representation of the interface using dual contouring
-Mesh2D LevelSet2D::buildDCMesh() const
+void LevelSet2D::buildDCMesh(Mesh2D& mesh, LevelSetBuffers& buffers) const
 {
-	std::vector<Vec2R> verts;
-	std::vector<Vec2ui> edges;
+	PROFILE_ZONE("LevelSet2D::buildDCMesh");
+
+	std::vector<Vec2R>& verts = buffers.vertices;
+	std::vector<Vec2ui>& edges = buffers.edges;
+
+	verts.clear();
+	edges.clear();
 	
 	// Create grid to store index to dual contouring point. Note that phi is
 	// center sampled so the DC grid must be node sampled and one cell shorter
 	// in each dimension
-	UniformGrid<unsigned> dcPointIndex(size() - Vec2ui(1), -1);
+	UniformGrid<unsigned>& dcPointIndex = buffers.dcPointIndex;
+	dcPointIndex.resize(size() - Vec2ui(1), -1);
+
+	// A cell has at most one crossing per face so the least squares system has a fixed upper size
+	// and lives on the stack
+	static constexpr int MAXQEFPOINTS = 4;
+
+	using QEFMatrix = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, MAXQEFPOINTS, 2>;
+	using QEFVector = Eigen::Matrix<double, Eigen::Dynamic, 1, 0, MAXQEFPOINTS, 1>;
 
 	// Run dual contouring loop
 	forEachVoxelRange(Vec2ui(0), dcPointIndex.size(), [&](const Vec2ui& cell)
 	{
-		std::vector<Vec2R> qefPoints;
-		std::vector<Vec2R> qefNormals;
+		Vec2R qefPoints[MAXQEFPOINTS];
+		Vec2R qefNormals[MAXQEFPOINTS];
+		unsigned qefCount = 0;
 
 		for (unsigned axis : {0, 1})
 			for (unsigned direction : {0, 1})
@@ -804,23 +842,23 @@ Mesh2D LevelSet2D::buildDCMesh() const
 				{
 					// Find interface point
 					Vec2R interfacePoint = interpolateInterface(backwardNode, forwardNode);
-					qefPoints.push_back(interfacePoint);
+					qefPoints[qefCount] = interfacePoint;
 
 					// Find associated surface normal
-					Vec2R surfaceNormal = normal(indexToWorld(interfacePoint));
-					qefNormals.push_back(surfaceNormal);
+					qefNormals[qefCount] = normal(indexToWorld(interfacePoint));
+					++qefCount;
 				}
 			}
 
-		if (qefPoints.size() > 0)
+		if (qefCount > 0)
 		{
-			Eigen::MatrixXd A(qefPoints.size(), 2);
-			Eigen::VectorXd b(qefPoints.size());
-			Eigen::VectorXd pointCOM = Eigen::VectorXd::Zero(2);
+			QEFMatrix A(qefCount, 2);
+			QEFVector b(qefCount);
+			Eigen::Vector2d pointCOM = Eigen::Vector2d::Zero();
 
-			assert(qefPoints.size() > 1);
+			assert(qefCount > 1);
 
-			for (unsigned pointIndex = 0; pointIndex < qefPoints.size(); ++pointIndex)
+			for (unsigned pointIndex = 0; pointIndex < qefCount; ++pointIndex)
 			{
 				A(pointIndex, 0) = qefNormals[pointIndex][0];
 				A(pointIndex, 1) = qefNormals[pointIndex][1];
@@ -831,12 +869,12 @@ Mesh2D LevelSet2D::buildDCMesh() const
 				pointCOM[1] += qefPoints[pointIndex][1];
 			}
 
-			pointCOM /= Real(qefPoints.size());
+			pointCOM /= Real(qefCount);
 
-			Eigen::JacobiSVD<Eigen::MatrixXd> svd(A, Eigen::ComputeThinU | Eigen::ComputeThinV);
+			Eigen::JacobiSVD<QEFMatrix> svd(A, Eigen::ComputeThinU | Eigen::ComputeThinV);
 			svd.setThreshold(1E-2);
 
-			Eigen::VectorXd dcPoint = pointCOM + svd.solve(b - A * pointCOM);
+			Eigen::Vector2d dcPoint = pointCOM + svd.solve(b - A * pointCOM);
 
 			Vec2R vecCOM(pointCOM[0], pointCOM[1]);
 
@@ -893,7 +931,7 @@ Mesh2D LevelSet2D::buildDCMesh() const
 		});
 	}
 
-	return Mesh2D(edges, verts);
+	mesh.reinitialize(edges, verts);
 }
 
 Vec2R LevelSet2D::interpolateInterface(const Vec2ui& startPoint, const Vec2ui& endPoint) const
@@ -917,4 +955,38 @@ void LevelSet2D::unionSurface(const LevelSet2D& unionPhi)
 	{
 		myPhiGrid(cell) = std::min(myPhiGrid(cell), unionPhi.interp(indexToWorld(Vec2R(cell))));
 	});
+}
+
+bool LevelSet2D::writeSnapshot(const std::string& filename) const
+{
+	SnapshotHeader header;
+	header.kind = SnapshotSettings::Kind::LEVELSET;
+	header.sampleType = uint32_t(myPhiGrid.sampleType());
+	header.borderType = uint32_t(myPhiGrid.borderType());
+	header.valueBytes = sizeof(Real);
+	header.gridSize[0] = size()[0];
+	header.gridSize[1] = size()[1];
+	header.setXform(xform());
+	header.parameters[0] = myNarrowBand;
+	header.parameters[1] = myIsInverted ? 1 : 0;
+
+	return ::writeSnapshot(filename, header, { SnapshotBlock{ myPhiGrid.data(), myPhiGrid.size() } });
+}
+
+bool LevelSet2D::readSnapshot(const std::string& filename)
+{
+	MappedSnapshot snapshot(filename);
+	if (!snapshot.isValid() || snapshot.header().kind != SnapshotSettings::Kind::LEVELSET)
+		return false;
+
+	if (!myPhiGrid.readSnapshot(snapshot))
+		return false;
+
+	myNarrowBand = snapshot.header().parameters[0];
+	myIsInverted = snapshot.header().parameters[1] != 0;
+
+	// Matches the constructors so a default constructed level set can be read into
+	exactinit();
+
+	return true;
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #ifndef LIBRARY_LEVELSET2D_H
 #define LIBRARY_LEVELSET2D_H
 
+#include <utility>
+#include <vector>
+
 #include "AdvectField.h"
 #include "Common.h"
 
@@ -28,6 +31,22 @@
 //
 ////////////////////////////////////
 
+// Scratch for rebuilding a level set from its own surface. A simulator that
+// redistances every timestep keeps one of these around so the mesh, the
+// redistancing grids and the fast marching queue keep their storage.
+struct LevelSetBuffers
+{
+	Mesh2D mesh;
+
+	std::vector<Vec2R> vertices;
+	std::vector<Vec2ui> edges;
+	UniformGrid<unsigned> dcPointIndex;
+
+	UniformGrid<MarkedCells> reinitializedCells;
+	UniformGrid<int> meshParityCells;
+	std::vector<std::pair<Vec2ui, Real>> marchingQueue;
+};
+
 class LevelSet2D
 {
 public:
@@ -44,16 +63,32 @@ public:
 		exactinit();
 	}
 
-	void init(const Mesh2D& init_mesh, bool resize = true);
+	void init(const Mesh2D& init_mesh, bool resize = true)
+	{
+		LevelSetBuffers buffers;
+		init(init_mesh, resize, buffers);
+	}
+
+	void init(const Mesh2D& init_mesh, bool resize, LevelSetBuffers& buffers);
 	
 	void reinit();
 	void reinitFIM();
 	void reinitMesh(bool useMarchingSquares = false)
 	{
-		Mesh2D tempMesh;
-		if (useMarchingSquares) tempMesh = buildMSMesh();
-		else tempMesh = buildDCMesh();
-		init(tempMesh, false);
+		LevelSetBuffers buffers;
+		if (useMarchingSquares)
+		{
+			buffers.mesh = buildMSMesh();
+			init(buffers.mesh, false, buffers);
+		}
+		else reinitMesh(buffers);
+	}
+
+	// Rebuilds the distance field from its dual contouring surface using the buffers' storage
+	void reinitMesh(LevelSetBuffers& buffers)
+	{
+		buildDCMesh(buffers.mesh, buffers);
+		init(buffers.mesh, false, buffers);
 	}
 
 	bool isMatched(const LevelSet2D& grid) const
@@ -72,12 +107,26 @@ public:
 
 	void unionSurface(const LevelSet2D& unionPhi);
 
+	// Binary snapshot of the distance field, narrow band and inversion (see GridSnapshot.h)
+	bool writeSnapshot(const std::string& filename) const;
+	bool readSnapshot(const std::string& filename);
+
 	// Assume negative ambient outside distance
 	bool inverted() const { return myIsInverted; }
 	void setInverted() { myIsInverted = true; }
 
 	Mesh2D buildMSMesh() const;
-	Mesh2D buildDCMesh() const;
+	Mesh2D buildDCMesh() const
+	{
+		Mesh2D mesh;
+		LevelSetBuffers buffers;
+		buildDCMesh(mesh, buffers);
+		return mesh;
+	}
+
+	// Builds the dual contouring surface into mesh, reusing its storage and the buffers' vertex
+	// and edge lists. The mesh may be the buffers' own.
+	void buildDCMesh(Mesh2D& mesh, LevelSetBuffers& buffers) const;
 
 	template<typename VelocityField>
 	void advect(Real dt, const VelocityField& vel, IntegrationOrder order);
@@ -94,7 +143,7 @@ public:
 	void clear() { myPhiGrid.clear(); }
 	void resize(const Vec2ui& size) { myPhiGrid.resize(size); }
 
-	Real narrowBand() { return myNarrowBand / dx(); }
+	Real narrowBand() const { return myNarrowBand / dx(); }
 
 	// There's no way to change the grid spacing inside the class.
 	// The best way is to build a new grid and sample this one
@@ -130,7 +179,7 @@ public:
 
 private:
 
-	void reinitFastMarching(UniformGrid<MarkedCells>& interfaceCells);
+	void reinitFastMarching(UniformGrid<MarkedCells>& interfaceCells, std::vector<std::pair<Vec2ui, Real>>& marchingQueue);
 	void reinitFastIterative(UniformGrid<MarkedCells>& interfaceCells);
 
 	Vec2R findSurfaceIndex(const Vec2R& indexPoint, unsigned iterationLimit = 10) const;
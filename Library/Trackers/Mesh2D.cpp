@@ -7,7 +7,7 @@ void Mesh2D::drawMesh(Renderer& renderer,
 	Real edgeWidth,
 	bool renderEdgeNormals,
 	bool renderVertices,
-	Vec3f vertexColour)
+	Vec3f vertexColour) const
 {
 	std::vector<Vec2R> startPoints;
 	std::vector<Vec2R> endPoints;
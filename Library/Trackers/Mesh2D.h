@@ -1,6 +1,7 @@
 #ifndef LIBRARY_MESH2D_H
 #define LIBRARY_MESH2D_H
 
+#include "BufferUtilities.h"
 #include "Common.h"
 #include "Integrator.h"
 #include "Renderer.h"
@@ -22,10 +23,10 @@
 class Vertex2D
 {
 public:
-	Vertex2D() : myPoint(Vec2R(0))
+	Vertex2D() : myPoint(Vec2R(0)), myValence(0)
 	{}
 
-	Vertex2D(const Vec2R& point) : myPoint(point)
+	Vertex2D(const Vec2R& point) : myPoint(point), myValence(0)
 	{}
 
 	const Vec2R& point() const
@@ -46,13 +47,18 @@ public:
 	// Get edge stored at the eidx position in the mEdges list
 	unsigned edge(unsigned index) const
 	{
-		assert(index < myEdges.size());
-		return myEdges[index];
+		assert(index < myValence);
+		return index < INLINEEDGES ? myInlineEdges[index] : myExtraEdges[index - INLINEEDGES];
 	}
 
 	void addEdge(unsigned index)
 	{
-		myEdges.push_back(index);
+		if (myValence < INLINEEDGES)
+			myInlineEdges[myValence] = index;
+		else
+			myExtraEdges.push_back(index);
+
+		++myValence;
 	}
 
 	// Search through the edge list for a matching edge
@@ -60,26 +66,35 @@ public:
 	// index with new_eidx.
 	bool replaceEdge(unsigned oldIndex, unsigned newIndex)
 	{
-		auto result = std::find(myEdges.begin(), myEdges.end(), oldIndex);
-
-		if (result == myEdges.end()) return false;
-		else
-			*result = newIndex;
+		for (unsigned edgeIndex = 0; edgeIndex < myValence; ++edgeIndex)
+		{
+			unsigned& edge = edgeIndex < INLINEEDGES ? myInlineEdges[edgeIndex] : myExtraEdges[edgeIndex - INLINEEDGES];
+			if (edge == oldIndex)
+			{
+				edge = newIndex;
+				return true;
+			}
+		}
 
-		return true;
+		return false;
 	}
 
 	// Search through the edge list and return true if 
 	// there is an edge index that matches eidx
 	bool findEdge(unsigned index) const
 	{
-		auto result = std::find(myEdges.begin(), myEdges.end(), index);
-		return result != myEdges.end();
+		for (unsigned edgeIndex = 0; edgeIndex < myValence; ++edgeIndex)
+		{
+			if (edge(edgeIndex) == index)
+				return true;
+		}
+
+		return false;
 	}
 
 	unsigned valence() const
 	{
-		return myEdges.size();
+		return myValence;
 	}
 
 	template<typename T>
@@ -96,8 +111,16 @@ public:
 
 private:
 
+	// A vertex on a closed curve has two edges and a dual contouring vertex has at most four, so
+	// those are stored in place and only busier vertices spill onto the heap. Meshes rebuilt every
+	// timestep then don't allocate per vertex.
+	static constexpr unsigned INLINEEDGES = 4;
+
 	Vec2R myPoint;
-	std::vector<unsigned> myEdges;
+
+	unsigned myInlineEdges[INLINEEDGES] = {};
+	unsigned myValence;
+	std::vector<unsigned> myExtraEdges;
 };
 
 class Edge2D
@@ -192,14 +215,15 @@ public:
 		}
 	}
 
+	// Reuses the existing storage so rebuilding a mesh of a similar size doesn't allocate
 	void reinitialize(const std::vector<Vec2ui>& edges, const std::vector<Vec2R>& verts)
 	{
 		myEdges.clear();
-		myEdges.reserve(edges.size());
+		reserveWithHeadroom(myEdges, edges.size());
 		for (const auto& edge : edges) myEdges.push_back(Edge2D(edge));
 
 		myVertices.clear();
-		myVertices.reserve(verts.size());
+		reserveWithHeadroom(myVertices, verts.size());
 		for (const auto& vert : verts) myVertices.push_back(Vertex2D(vert));
 
 		// Update vertices to store adjacent edges in their edge lists
@@ -258,7 +282,7 @@ public:
 		return myVertices;
 	}
 
-	Vertex2D vertex(unsigned idx) const
+	const Vertex2D& vertex(unsigned idx) const
 	{
 		return myVertices[idx];
 	}
@@ -329,7 +353,7 @@ public:
 		Real edgeWidth = 1.,
 		bool doRenderEdgeNormals = false,
 		bool doRenderVerts = false,
-		Vec3f vertColour = Vec3f(0));
+		Vec3f vertColour = Vec3f(0)) const;
 
 	template<typename VelocityField>
 	void advect(Real dt, const VelocityField& vel, const IntegrationOrder order);
@@ -0,0 +1,174 @@
+#include "SparseLevelSet2D.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "tbb/tbb.h"
+
+#include "BufferUtilities.h"
+#include "Profiler.h"
+
+constexpr unsigned SparseLevelSet2D::TILESIZE;
+constexpr unsigned SparseLevelSet2D::TILESAMPLES;
+constexpr int SparseLevelSet2D::UNIFORMTILE;
+
+SparseLevelSet2D::SparseLevelSet2D(const Transform& xform, const Vec2ui& size, unsigned bandwidth, bool inverted)
+	: myNarrowBand(0)
+	, myIsInverted(false)
+{
+	// Going through a dense level set gives exactly the narrow band distance it would use
+	store(LevelSet2D(xform, size, bandwidth, inverted));
+}
+
+void SparseLevelSet2D::store(const LevelSet2D& surface)
+{
+	PROFILE_ZONE("SparseLevelSet2D::store");
+
+	if (!isMatched(surface) || myTileIndex.empty())
+	{
+		myXform = surface.xform();
+		mySize = surface.size();
+
+		Vec2ui tileGridSize = (mySize + Vec2ui(TILESIZE - 1)) / TILESIZE;
+		myTileIndex.resize(tileGridSize, UNIFORMTILE);
+		myTileValues.resize(tileGridSize, 0);
+	}
+
+	myNarrowBand = surface.narrowBand();
+	myIsInverted = surface.inverted();
+
+	const Vec2ui tileGridSize = myTileIndex.size();
+
+	auto tileEnd = [&](const Vec2ui& tile) { return min(tile * TILESIZE + Vec2ui(TILESIZE), mySize); };
+
+	// A tile is uniform if every sample has the same bits as the first. Comparing the sign as
+	// well keeps a negative zero from being stored as a positive one.
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, tileGridSize[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < tileGridSize[1]; ++j)
+			{
+				Vec2ui tile(i, j);
+				Vec2ui start = tile * TILESIZE;
+				Vec2ui end = tileEnd(tile);
+
+				Real value = surface(start);
+				bool isUniform = true;
+
+				for (unsigned ci = start[0]; ci < end[0] && isUniform; ++ci)
+					for (unsigned cj = start[1]; cj < end[1]; ++cj)
+					{
+						Real sample = surface(ci, cj);
+						if (sample != value || std::signbit(sample) != std::signbit(value))
+						{
+							isUniform = false;
+							break;
+						}
+					}
+
+				myTileIndex(tile) = isUniform ? UNIFORMTILE : 0;
+				myTileValues(tile) = value;
+			}
+	});
+
+	// Stored tiles are numbered in grid order so the layout doesn't depend on the thread count
+	unsigned storedTiles = 0;
+	forEachVoxelRange(Vec2ui(0), tileGridSize, [&](const Vec2ui& tile)
+	{
+		if (myTileIndex(tile) != UNIFORMTILE)
+			myTileIndex(tile) = int(storedTiles++);
+	});
+
+	reserveWithHeadroom(mySamples, storedTiles * TILESAMPLES);
+	mySamples.resize(storedTiles * TILESAMPLES);
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, tileGridSize[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < tileGridSize[1]; ++j)
+			{
+				Vec2ui tile(i, j);
+				int tileIndex = myTileIndex(tile);
+
+				if (tileIndex == UNIFORMTILE) continue;
+
+				Vec2ui start = tile * TILESIZE;
+				Vec2ui end = tileEnd(tile);
+
+				Real* samples = &mySamples[unsigned(tileIndex) * TILESAMPLES];
+
+				for (unsigned ci = start[0]; ci < end[0]; ++ci)
+					for (unsigned cj = start[1]; cj < end[1]; ++cj)
+						samples[(ci - start[0]) * TILESIZE + (cj - start[1])] = surface(ci, cj);
+			}
+	});
+}
+
+void SparseLevelSet2D::load(LevelSet2D& surface) const
+{
+	PROFILE_ZONE("SparseLevelSet2D::load");
+
+	assert(!myTileIndex.empty());
+
+	if (!isMatched(surface) || surface.narrowBand() != myNarrowBand || surface.inverted() != myIsInverted)
+		surface = LevelSet2D(myXform, mySize, unsigned(std::lround(myNarrowBand)), myIsInverted);
+
+	assert(surface.narrowBand() == myNarrowBand);
+
+	const Vec2ui tileGridSize = myTileIndex.size();
+
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, tileGridSize[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < tileGridSize[1]; ++j)
+			{
+				Vec2ui tile(i, j);
+				Vec2ui start = tile * TILESIZE;
+				Vec2ui end = min(start + Vec2ui(TILESIZE), mySize);
+
+				int tileIndex = myTileIndex(tile);
+
+				if (tileIndex == UNIFORMTILE)
+				{
+					Real value = myTileValues(tile);
+
+					for (unsigned ci = start[0]; ci < end[0]; ++ci)
+						for (unsigned cj = start[1]; cj < end[1]; ++cj)
+							surface(ci, cj) = value;
+				}
+				else
+				{
+					const Real* samples = &mySamples[unsigned(tileIndex) * TILESAMPLES];
+
+					for (unsigned ci = start[0]; ci < end[0]; ++ci)
+						for (unsigned cj = start[1]; cj < end[1]; ++cj)
+							surface(ci, cj) = samples[(ci - start[0]) * TILESIZE + (cj - start[1])];
+				}
+			}
+	});
+}
+
+Real SparseLevelSet2D::interp(const Vec2R& worldPoint) const
+{
+	// The same cell-centered offset, clamping and interpolation as the ScalarGrid in LevelSet2D
+	Vec2R indexPoint = myXform.worldToIndex(worldPoint) - Vec2R(.5);
+
+	for (unsigned axis : {0, 1})
+		indexPoint[axis] = (indexPoint[axis] < 0.) ? 0. : ((indexPoint[axis] > Real(mySize[axis] - 1)) ? Real(mySize[axis] - 1) : indexPoint[axis]);
+
+	Vec2R floorPoint = floor(indexPoint);
+
+	if (floorPoint[0] == Real(mySize[0] - 1)) --floorPoint[0];
+	if (floorPoint[1] == Real(mySize[1] - 1)) --floorPoint[1];
+
+	Vec2R dx = indexPoint - floorPoint;
+	dx = clamp(dx, Vec2R(0), Vec2R(1));
+
+	Real v00 = (*this)(Vec2ui(floorPoint[0], floorPoint[1]));
+	Real v10 = (*this)(Vec2ui(floorPoint[0] + 1, floorPoint[1]));
+
+	Real v01 = (*this)(Vec2ui(floorPoint[0], floorPoint[1] + 1));
+	Real v11 = (*this)(Vec2ui(floorPoint[0] + 1, floorPoint[1] + 1));
+
+	return Util::bilerp(v00, v10, v01, v11, dx[0], dx[1]);
+}
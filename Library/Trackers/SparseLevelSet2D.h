@@ -0,0 +1,116 @@
+#ifndef LIBRARY_SPARSELEVELSET2D_H
+#define LIBRARY_SPARSELEVELSET2D_H
+
+#include <vector>
+
+#include "Common.h"
+#include "LevelSet2D.h"
+#include "Transform.h"
+#include "UniformGrid.h"
+#include "Util.h"
+
+///////////////////////////////////
+//
+// SparseLevelSet2D.h/cpp
+// Ryan Goldade 2017
+//
+// Compact storage for a level set that
+// only changes inside its narrow band.
+// The grid is split into square tiles.
+// A tile whose samples are all the same
+// value, which is every tile outside of
+// the narrow band once the surface has
+// been redistanced, only keeps that value.
+// The other tiles keep all of their samples.
+// Storing and loading are exact.
+//
+// Meshing and redistancing are done on a
+// dense LevelSet2D, so a simulator with
+// many surfaces loads each one into the
+// same dense level set, works on it and
+// stores it back. Sample lookups and
+// interpolation read the tiles directly.
+//
+////////////////////////////////////
+
+class SparseLevelSet2D
+{
+public:
+	SparseLevelSet2D() : myNarrowBand(0), myIsInverted(false) {}
+
+	// Starts with every sample at the narrow band distance outside of the surface, or inside
+	// if the level set is inverted
+	SparseLevelSet2D(const Transform& xform, const Vec2ui& size, unsigned bandwidth, bool inverted = false);
+
+	// Copies surface into the tiles. The sample storage is kept from call to call so storing a
+	// surface of about the same size every timestep doesn't allocate.
+	void store(const LevelSet2D& surface);
+
+	// Expands the tiles into surface. The surface is rebuilt if it doesn't match the grid, narrow
+	// band or inversion, otherwise its storage is reused.
+	void load(LevelSet2D& surface) const;
+
+	bool isMatched(const LevelSet2D& surface) const
+	{
+		return surface.size() == mySize && surface.xform() == myXform;
+	}
+
+	Real operator()(const Vec2ui& cell) const
+	{
+		assert(cell[0] < mySize[0] && cell[1] < mySize[1]);
+
+		Vec2ui tile = cell / TILESIZE;
+		int tileIndex = myTileIndex(tile);
+
+		if (tileIndex == UNIFORMTILE)
+			return myTileValues(tile);
+
+		Vec2ui tileCell = cell - tile * TILESIZE;
+		return mySamples[unsigned(tileIndex) * TILESAMPLES + tileCell[0] * TILESIZE + tileCell[1]];
+	}
+
+	Real operator()(unsigned i, unsigned j) const { return (*this)(Vec2ui(i, j)); }
+
+	// Bi-linear interpolation that gives the same result as LevelSet2D::interp
+	Real interp(const Vec2R& worldPoint) const;
+
+	Real narrowBand() const { return myNarrowBand; }
+	bool inverted() const { return myIsInverted; }
+
+	Real dx() const { return myXform.dx(); }
+	Transform xform() const { return myXform; }
+	Vec2ui size() const { return mySize; }
+
+	unsigned tileCount() const { return myTileIndex.size()[0] * myTileIndex.size()[1]; }
+	unsigned storedTileCount() const { return unsigned(mySamples.size() / TILESAMPLES); }
+
+	// Bytes held by the tiles, including storage kept for later stores
+	std::size_t storageBytes() const
+	{
+		return tileCount() * (sizeof(int) + sizeof(Real)) + mySamples.capacity() * sizeof(Real);
+	}
+
+private:
+
+	static constexpr unsigned TILESIZE = 8;
+	static constexpr unsigned TILESAMPLES = TILESIZE * TILESIZE;
+	static constexpr int UNIFORMTILE = -1;
+
+	Transform myXform;
+	Vec2ui mySize;
+
+	// Narrow band in grid cells, as given by LevelSet2D::narrowBand
+	Real myNarrowBand;
+	bool myIsInverted;
+
+	// Index of each tile's samples in the sample list, or UNIFORMTILE if the tile's
+	// value is all that's kept
+	UniformGrid<int> myTileIndex;
+	UniformGrid<Real> myTileValues;
+
+	// Samples of the stored tiles, one after the other. Each tile is in the same x-major order as
+	// UniformGrid. Tiles that hang off the end of the grid have unused samples.
+	std::vector<Real> mySamples;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#include "tbb/tbb.h"
+
+#include "BenchmarkSuite.h"
+
+#include "ExecutionContext.h"
+#include "Reduction.h"
+#include "Timer.h"
+
+void BenchmarkSuite::add(const std::string& name, const Setup& setup)
+{
+	myNames.push_back(name);
+	mySetups.push_back(setup);
+}
+
+void BenchmarkSuite::printNames() const
+{
+	for (const std::string& name : myNames)
+		std::cout << name << std::endl;
+}
+
+std::vector<BenchmarkResult> BenchmarkSuite::run(const std::vector<unsigned>& resolutions,
+													const std::vector<unsigned>& threadCounts,
+													unsigned repetitions,
+													const std::string& filter) const
+{
+	assert(repetitions > 0);
+
+	std::vector<BenchmarkResult> results;
+
+	for (unsigned benchmark = 0; benchmark < myNames.size(); ++benchmark)
+	{
+		if (!filter.empty() && myNames[benchmark].find(filter) == std::string::npos)
+			continue;
+
+		for (unsigned resolution : resolutions)
+		{
+			// Inputs are built with every thread available
+			BenchmarkFixture fixture = mySetups[benchmark](resolution);
+			assert(fixture.run);
+
+			for (unsigned threads : threadCounts)
+			{
+				ExecutionContext context(threads);
+
+				std::vector<double> times(repetitions);
+				context.execute([&]()
+				{
+					// Warm up caches and the thread pool
+					if (fixture.reset) fixture.reset();
+					fixture.run();
+
+					for (unsigned repetition = 0; repetition < repetitions; ++repetition)
+					{
+						if (fixture.reset) fixture.reset();
+
+						Timer timer;
+						fixture.run();
+						times[repetition] = timer.stop();
+					}
+				});
+
+				std::sort(times.begin(), times.end());
+
+				BenchmarkResult result;
+				result.name = myNames[benchmark];
+				result.resolution = resolution;
+				result.threads = threads;
+				result.repetitions = repetitions;
+				result.minSeconds = times.front();
+				result.medianSeconds = (repetitions % 2 == 1) ? times[repetitions / 2] : .5 * (times[repetitions / 2 - 1] + times[repetitions / 2]);
+
+				double sum = 0;
+				for (double time : times) sum += time;
+				result.meanSeconds = sum / double(repetitions);
+
+				double variance = 0;
+				for (double time : times) variance += Util::sqr(time - result.meanSeconds);
+				result.stddevSeconds = repetitions > 1 ? std::sqrt(variance / double(repetitions - 1)) : 0;
+
+				result.itemsPerSecond = result.medianSeconds > 0 ? fixture.items / result.medianSeconds : 0;
+
+				std::cout << std::left << std::setw(40) << result.name << std::right
+							<< std::setw(6) << resolution << "^2"
+							<< std::setw(4) << threads << " threads"
+							<< std::setw(14) << std::fixed << std::setprecision(6) << result.medianSeconds << "s"
+							<< " (min " << result.minSeconds << "s)" << std::defaultfloat << std::endl;
+
+				results.push_back(result);
+			}
+		}
+	}
+
+	return results;
+}
+
+bool BenchmarkSuite::writeJSON(const std::string& filename, const std::vector<BenchmarkResult>& results)
+{
+	std::ofstream writer(filename);
+
+	if (!writer)
+	{
+		std::cerr << "Failed to write to file: " << filename << std::endl;
+		return false;
+	}
+
+	std::time_t now = std::time(nullptr);
+	char date[32];
+	std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+	writer << "{\n\"context\": {\"date\": \"" << date << "\""
+			<< ", \"hardware_threads\": " << tbb::this_task_arena::max_concurrency()
+#ifdef NDEBUG
+			<< ", \"build_type\": \"release\""
+#else
+			<< ", \"build_type\": \"debug\""
+#endif
+			<< ", \"reduction_mode\": \"" << (Reduction::mode() == ReductionMode::REPRODUCIBLE ? "reproducible" : "fast") << "\""
+			<< "},\n\"benchmarks\": [";
+
+	writer << std::setprecision(9);
+	for (unsigned resultIndex = 0; resultIndex < results.size(); ++resultIndex)
+	{
+		const BenchmarkResult& result = results[resultIndex];
+		writer << (resultIndex > 0 ? ",\n" : "\n");
+		writer << "{\"name\": \"" << result.name << "/" << result.resolution << "/threads:" << result.threads << "\""
+				<< ", \"benchmark\": \"" << result.name << "\""
+				<< ", \"resolution\": " << result.resolution
+				<< ", \"threads\": " << result.threads
+				<< ", \"repetitions\": " << result.repetitions
+				<< ", \"min_seconds\": " << result.minSeconds
+				<< ", \"median_seconds\": " << result.medianSeconds
+				<< ", \"mean_seconds\": " << result.meanSeconds
+				<< ", \"stddev_seconds\": " << result.stddevSeconds
+				<< ", \"items_per_second\": " << result.itemsPerSecond << "}";
+	}
+	writer << "\n]\n}\n";
+
+	return bool(writer);
+}
@@ -0,0 +1,83 @@
+#ifndef BENCHMARKS_BENCHMARKSUITE_H
+#define BENCHMARKS_BENCHMARKSUITE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+
+///////////////////////////////////
+//
+// BenchmarkSuite.h/cpp
+// Ryan Goldade 2017
+//
+// Small benchmark harness in the spirit
+// of Google Benchmark. Every benchmark
+// builds its inputs for a grid resolution
+// once (untimed) and hands back a fixture
+// whose run function is timed. The fixture
+// is run at every thread count, inside an
+// ExecutionContext with that many threads,
+// for a warm-up and then a fixed number of
+// repetitions. The inputs are built from
+// fixed meshes and seeds so runs are
+// comparable between builds.
+//
+// Results are written as JSON for
+// regression tracking.
+//
+////////////////////////////////////
+
+struct BenchmarkFixture
+{
+	// Untimed. Called before every repetition to restore anything run modifies.
+	std::function<void()> reset;
+
+	// The timed work
+	std::function<void()> run;
+
+	// Work items per run (e.g. cells or particles) to report throughput
+	double items = 0;
+};
+
+struct BenchmarkResult
+{
+	std::string name;
+	unsigned resolution;
+	unsigned threads;
+	unsigned repetitions;
+
+	double minSeconds;
+	double medianSeconds;
+	double meanSeconds;
+	double stddevSeconds;
+
+	// Items per second at the median time
+	double itemsPerSecond;
+};
+
+class BenchmarkSuite
+{
+public:
+	using Setup = std::function<BenchmarkFixture(unsigned resolution)>;
+
+	void add(const std::string& name, const Setup& setup);
+
+	void printNames() const;
+
+	// Runs every benchmark whose name contains the filter (all of them if it's empty)
+	std::vector<BenchmarkResult> run(const std::vector<unsigned>& resolutions,
+										const std::vector<unsigned>& threadCounts,
+										unsigned repetitions,
+										const std::string& filter = "") const;
+
+	static bool writeJSON(const std::string& filename, const std::vector<BenchmarkResult>& results);
+
+private:
+
+	std::vector<std::string> myNames;
+	std::vector<Setup> mySetups;
+};
+
+#endif
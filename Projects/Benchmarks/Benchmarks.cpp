@@ -0,0 +1,588 @@
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tbb/tbb.h"
+
+#include "AdvectField.h"
+#include "BenchmarkSuite.h"
+#include "Common.h"
+#include "CompactIndex.h"
+#include "ComputeWeights.h"
+#include "ExtrapolateField.h"
+#include "FluidParticles.h"
+#include "InitialConditions.h"
+#include "LevelSet2D.h"
+#include "Mesh2D.h"
+#include "PoissonStencil.h"
+#include "PressureProjection.h"
+#include "ProjectionWeights.h"
+#include "Reduction.h"
+#include "ScalarGrid.h"
+#include "TestVelocityFields.h"
+#include "Transform.h"
+#include "VectorGrid.h"
+#include "ViscositySolver.h"
+
+///////////////////////////////////
+//
+// Benchmarks.cpp
+// Ryan Goldade 2017
+//
+// Benchmarks for the grid, surface and
+// solver kernels that make up a timestep.
+// Every benchmark runs on the same scene:
+// a unit square domain with a disk of
+// liquid resting in a circular container
+// and the single vortex velocity field.
+// The resolution is the number of cells
+// across the domain.
+//
+// Usage: Benchmarks [--resolutions 256,512,1024,2048] [--threads 1,2,4,...]
+//						[--repetitions 5] [--filter name] [--output benchmarks.json] [--list]
+//						[--reproducible]
+//
+// The thread counts default to powers of
+// two up to the number of hardware threads.
+// Passing --reproducible runs with the
+// deterministic reductions.
+//
+////////////////////////////////////
+
+static constexpr unsigned NARROWBAND = 10;
+
+// Inputs shared by the benchmarks at one resolution. Built once and reused.
+struct BenchmarkScene
+{
+	BenchmarkScene(unsigned resolution)
+		: size(resolution)
+		, xform(1. / Real(resolution), Vec2R(0))
+	{
+		unsigned divisions = std::max(resolution, 64u);
+
+		liquidMesh = circleMesh(Vec2R(.5, .35), .25, divisions);
+		assert(liquidMesh.unitTest());
+
+		solidMesh = circleMesh(Vec2R(.5), .45, divisions);
+		solidMesh.reverse();
+		assert(solidMesh.unitTest());
+
+		liquidSurface = LevelSet2D(xform, size, NARROWBAND);
+		liquidSurface.init(liquidMesh, false);
+
+		solidSurface = LevelSet2D(xform, size, NARROWBAND);
+		solidSurface.setInverted();
+		solidSurface.init(solidMesh, false);
+
+		// Same extrapolation into the solid as EulerianLiquid
+		extrapolatedSurface = liquidSurface;
+		forEachVoxelRange(Vec2ui(0), size, [&](const Vec2ui& cell)
+		{
+			if (solidSurface(cell) <= 0)
+				extrapolatedSurface(cell) -= xform.dx();
+		});
+		extrapolatedSurface.reinitMesh();
+
+		// The vortex plus gravity so the pressure solve has real work to do
+		SingleVortexSim2D vortex;
+		velocity = VectorGrid<Real>(xform, size, VectorGridSettings::SampleType::STAGGERED);
+		for (unsigned axis : {0, 1})
+		{
+			forEachVoxelRange(Vec2ui(0), velocity.size(axis), [&](const Vec2ui& face)
+			{
+				Vec2R worldPoint = velocity.indexToWorld(Vec2R(face), axis);
+				velocity(face, axis) = vortex(0, worldPoint)[axis] - (axis == 1 ? 1. : 0.);
+			});
+		}
+
+		solidVelocity = VectorGrid<Real>(xform, size, VectorGridSettings::SampleType::STAGGERED);
+
+		field = ScalarGrid<Real>(xform, size);
+		forEachVoxelRange(Vec2ui(0), size, [&](const Vec2ui& cell)
+		{
+			Vec2R worldPoint = field.indexToWorld(Vec2R(cell));
+			field(cell) = std::sin(2. * Util::PI * worldPoint[0]) * std::cos(3. * Util::PI * worldPoint[1]);
+		});
+
+		weights.resize(xform, size);
+		weights.compute(extrapolatedSurface, solidSurface, true, true);
+	}
+
+	Vec2ui size;
+	Transform xform;
+
+	Mesh2D liquidMesh, solidMesh;
+	LevelSet2D liquidSurface, solidSurface, extrapolatedSurface;
+
+	VectorGrid<Real> velocity, solidVelocity;
+	ScalarGrid<Real> field;
+
+	ProjectionWeights weights;
+};
+
+static std::shared_ptr<const BenchmarkScene> buildScene(unsigned resolution)
+{
+	static std::map<unsigned, std::shared_ptr<const BenchmarkScene>> scenes;
+
+	auto& scene = scenes[resolution];
+	if (!scene)
+		scene = std::make_shared<const BenchmarkScene>(resolution);
+
+	return scene;
+}
+
+static double cellCount(const BenchmarkScene& scene)
+{
+	return double(scene.size[0]) * double(scene.size[1]);
+}
+
+// One sample point per cell, scattered with a fixed seed
+static std::vector<Vec2R> samplePoints(const BenchmarkScene& scene)
+{
+	std::mt19937 generator(0);
+	std::uniform_real_distribution<Real> distribution(0, 1);
+
+	std::vector<Vec2R> points(scene.size[0] * scene.size[1]);
+	for (Vec2R& point : points)
+	{
+		Real x = distribution(generator);
+		point = Vec2R(x, distribution(generator));
+	}
+
+	return points;
+}
+
+template<typename Interpolator>
+static BenchmarkFixture interpolationFixture(unsigned resolution, const Interpolator& interpolator)
+{
+	auto scene = buildScene(resolution);
+	auto points = std::make_shared<std::vector<Vec2R>>(samplePoints(*scene));
+	auto values = std::make_shared<std::vector<Real>>(points->size());
+
+	BenchmarkFixture fixture;
+	fixture.items = double(points->size());
+	fixture.run = [scene, points, values, interpolator]()
+	{
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, unsigned(points->size())), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned point = range.begin(); point != range.end(); ++point)
+				(*values)[point] = interpolator(scene->field, (*points)[point]);
+		});
+	};
+
+	return fixture;
+}
+
+static BenchmarkFixture advectionFixture(unsigned resolution, InterpolationOrder interpolation)
+{
+	auto scene = buildScene(resolution);
+	auto advectedField = std::make_shared<ScalarGrid<Real>>(scene->field);
+
+	BenchmarkFixture fixture;
+	fixture.items = cellCount(*scene);
+	fixture.run = [scene, advectedField, interpolation]()
+	{
+		auto velocityFunc = [&](Real, const Vec2R& pos) { return scene->velocity.interp(pos); };
+
+		AdvectField<ScalarGrid<Real>> advector(scene->field);
+		advector.advectField(1. / 30., *advectedField, velocityFunc, IntegrationOrder::RK3, interpolation);
+	};
+
+	return fixture;
+}
+
+// The surface scaled so its zero set is unchanged but it's no longer a distance field
+static BenchmarkFixture reinitFixture(unsigned resolution, bool useFastIterative)
+{
+	auto scene = buildScene(resolution);
+	auto distortedSurface = std::make_shared<LevelSet2D>(scene->liquidSurface);
+	forEachVoxelRange(Vec2ui(0), scene->size, [&](const Vec2ui& cell) { (*distortedSurface)(cell) *= 3.; });
+
+	auto surface = std::make_shared<LevelSet2D>(*distortedSurface);
+
+	BenchmarkFixture fixture;
+	fixture.items = cellCount(*scene);
+	fixture.reset = [distortedSurface, surface]() { *surface = *distortedSurface; };
+	fixture.run = [surface, useFastIterative]()
+	{
+		if (useFastIterative)
+			surface->reinitFIM();
+		else
+			surface->reinit();
+	};
+
+	return fixture;
+}
+
+static BenchmarkFixture extrapolationFixture(unsigned resolution, bool alongNormal)
+{
+	auto scene = buildScene(resolution);
+
+	// Faces inside the liquid are known. Everything else is zeroed and filled in.
+	auto mask = std::make_shared<VectorGrid<MarkedCells>>(scene->xform, scene->size, MarkedCells::UNVISITED, VectorGridSettings::SampleType::STAGGERED);
+	auto startVelocity = std::make_shared<VectorGrid<Real>>(scene->velocity);
+
+	for (unsigned axis : {0, 1})
+	{
+		forEachVoxelRange(Vec2ui(0), mask->size(axis), [&](const Vec2ui& face)
+		{
+			if (scene->liquidSurface.interp(mask->indexToWorld(Vec2R(face), axis)) <= 0)
+				(*mask)(face, axis) = MarkedCells::FINISHED;
+			else
+				(*startVelocity)(face, axis) = 0;
+		});
+	}
+
+	auto velocity = std::make_shared<VectorGrid<Real>>(*startVelocity);
+
+	BenchmarkFixture fixture;
+	fixture.items = cellCount(*scene);
+	fixture.reset = [startVelocity, velocity]() { *velocity = *startVelocity; };
+	fixture.run = [scene, mask, velocity, alongNormal]()
+	{
+		ExtrapolateField<VectorGrid<Real>> extrapolator(*velocity);
+
+		// Bandwidths used by the liquid simulator at its default CFL
+		if (alongNormal)
+			extrapolator.extrapolateAlongNormal(*mask, scene->liquidSurface, 4.5);
+		else
+			extrapolator.extrapolate(*mask, 5);
+	};
+
+	return fixture;
+}
+
+// Inputs to the Poisson stencil kernels. The solved cells are the ones PressureProjection picks
+// and both vectors are zero outside of them.
+struct PoissonStencilInputs
+{
+	PoissonStencil stencil;
+	UniformGrid<double> rhs, solution, output;
+};
+
+static std::shared_ptr<PoissonStencilInputs> buildPoissonStencil(const BenchmarkScene& scene)
+{
+	const VectorGrid<Real>& cutCellWeights = scene.weights.cutCellWeights();
+
+	UniformGrid<int> cellIndex(scene.size, UNSOLVED);
+	buildCompactIndex(cellIndex, Vec2ui(0), scene.size, [&](const Vec2ui& cell) -> bool
+	{
+		if (scene.extrapolatedSurface(cell) > 0) return false;
+
+		for (unsigned axis : {0, 1})
+			for (unsigned direction : {0, 1})
+			{
+				if (cutCellWeights(cellToFace(cell, axis, direction), axis) > 0)
+					return true;
+			}
+
+		return false;
+	});
+
+	auto inputs = std::make_shared<PoissonStencilInputs>();
+	inputs->stencil.build(cellIndex, cutCellWeights, scene.weights.ghostFluidWeights());
+
+	inputs->rhs = UniformGrid<double>(scene.size, 0);
+	inputs->solution = UniformGrid<double>(scene.size, 0);
+	inputs->output = UniformGrid<double>(scene.size, 0);
+
+	forEachVoxelRange(Vec2ui(0), scene.size, [&](const Vec2ui& cell)
+	{
+		if (cellIndex(cell) >= 0)
+		{
+			inputs->rhs(cell) = scene.field(cell);
+			inputs->solution(cell) = .5 * scene.field(cell);
+		}
+	});
+
+	return inputs;
+}
+
+static std::shared_ptr<FluidParticles> buildParticles(const BenchmarkScene& scene)
+{
+	auto particles = std::make_shared<FluidParticles>(.5 * scene.xform.dx(), 4, 1., true);
+	particles->init(scene.liquidSurface);
+	particles->setVelocity(scene.velocity);
+	return particles;
+}
+
+static void addBenchmarks(BenchmarkSuite& suite)
+{
+	suite.add("ScalarGrid::interp", [](unsigned resolution)
+	{
+		return interpolationFixture(resolution, [](const ScalarGrid<Real>& grid, const Vec2R& point) { return grid.interp(point); });
+	});
+
+	suite.add("ScalarGrid::cubicInterp", [](unsigned resolution)
+	{
+		return interpolationFixture(resolution, [](const ScalarGrid<Real>& grid, const Vec2R& point) { return grid.cubicInterp(point, false, true); });
+	});
+
+	suite.add("AdvectField::linear", [](unsigned resolution)
+	{
+		return advectionFixture(resolution, InterpolationOrder::LINEAR);
+	});
+
+	suite.add("AdvectField::cubic", [](unsigned resolution)
+	{
+		return advectionFixture(resolution, InterpolationOrder::CUBIC);
+	});
+
+	suite.add("LevelSet2D::init", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto surface = std::make_shared<LevelSet2D>(scene->xform, scene->size, NARROWBAND);
+
+		BenchmarkFixture fixture;
+		fixture.items = cellCount(*scene);
+		fixture.run = [scene, surface]() { surface->init(scene->liquidMesh, false); };
+		return fixture;
+	});
+
+	suite.add("LevelSet2D::reinit", [](unsigned resolution)
+	{
+		return reinitFixture(resolution, false);
+	});
+
+	suite.add("LevelSet2D::reinitFIM", [](unsigned resolution)
+	{
+		return reinitFixture(resolution, true);
+	});
+
+	suite.add("LevelSet2D::buildDCMesh", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto mesh = std::make_shared<Mesh2D>();
+
+		BenchmarkFixture fixture;
+		fixture.items = cellCount(*scene);
+		fixture.run = [scene, mesh]() { *mesh = scene->liquidSurface.buildDCMesh(); };
+		return fixture;
+	});
+
+	suite.add("computeCutCellWeights", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto weights = std::make_shared<VectorGrid<Real>>();
+
+		BenchmarkFixture fixture;
+		fixture.items = cellCount(*scene);
+		fixture.run = [scene, weights]() { *weights = computeCutCellWeights(scene->solidSurface, true); };
+		return fixture;
+	});
+
+	suite.add("PressureProjection::project", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto projection = std::make_shared<PressureProjection>(scene->extrapolatedSurface, scene->velocity,
+																scene->solidSurface, scene->solidVelocity);
+
+		BenchmarkFixture fixture;
+		fixture.items = cellCount(*scene);
+		fixture.run = [scene, projection]()
+		{
+			projection->project(scene->weights.ghostFluidWeights(), scene->weights.cutCellWeights());
+		};
+		return fixture;
+	});
+
+	suite.add("PoissonStencil::apply", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto inputs = buildPoissonStencil(*scene);
+
+		BenchmarkFixture fixture;
+		fixture.items = cellCount(*scene);
+		fixture.run = [inputs]() { inputs->stencil.apply(inputs->solution, inputs->output); };
+		return fixture;
+	});
+
+	suite.add("PoissonStencil::residual", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto inputs = buildPoissonStencil(*scene);
+
+		BenchmarkFixture fixture;
+		fixture.items = cellCount(*scene);
+		fixture.run = [inputs]() { inputs->stencil.residual(inputs->rhs, inputs->solution, inputs->output); };
+		return fixture;
+	});
+
+	suite.add("PoissonStencil::weightedJacobi", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto inputs = buildPoissonStencil(*scene);
+
+		BenchmarkFixture fixture;
+		fixture.items = cellCount(*scene);
+		fixture.run = [inputs]() { inputs->stencil.weightedJacobi(inputs->rhs, inputs->solution, inputs->output); };
+		return fixture;
+	});
+
+	suite.add("PoissonStencil::redBlackGaussSeidel", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto inputs = buildPoissonStencil(*scene);
+		auto startSolution = std::make_shared<UniformGrid<double>>(inputs->solution);
+
+		BenchmarkFixture fixture;
+		fixture.items = cellCount(*scene);
+		fixture.reset = [inputs, startSolution]() { inputs->solution = *startSolution; };
+		fixture.run = [inputs]() { inputs->stencil.redBlackGaussSeidel(inputs->rhs, inputs->solution); };
+		return fixture;
+	});
+
+	suite.add("ViscositySolver::solve", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto velocity = std::make_shared<VectorGrid<Real>>(scene->velocity);
+
+		BenchmarkFixture fixture;
+		fixture.items = cellCount(*scene);
+		fixture.reset = [scene, velocity]() { *velocity = scene->velocity; };
+		fixture.run = [scene, velocity]()
+		{
+			ViscositySolver viscosity(1. / 30., scene->extrapolatedSurface, *velocity, scene->solidSurface, scene->solidVelocity);
+			viscosity.setViscosity(.1);
+
+			const ProjectionWeights& weights = scene->weights;
+			viscosity.solve(weights.faceVolumes(), weights.centerVolumes(), weights.nodeVolumes(),
+							weights.centerVolumes(), weights.nodeVolumes());
+		};
+		return fixture;
+	});
+
+	suite.add("ExtrapolateField::extrapolate", [](unsigned resolution)
+	{
+		return extrapolationFixture(resolution, false);
+	});
+
+	suite.add("ExtrapolateField::extrapolateAlongNormal", [](unsigned resolution)
+	{
+		return extrapolationFixture(resolution, true);
+	});
+
+	suite.add("FluidParticles::setVelocity", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto particles = buildParticles(*scene);
+
+		BenchmarkFixture fixture;
+		fixture.items = double(particles->particleCount());
+		fixture.run = [scene, particles]() { particles->setVelocity(scene->velocity); };
+		return fixture;
+	});
+
+	suite.add("FluidParticles::applyVelocity", [](unsigned resolution)
+	{
+		auto scene = buildScene(resolution);
+		auto particles = buildParticles(*scene);
+		auto velocity = std::make_shared<VectorGrid<Real>>(scene->velocity);
+
+		BenchmarkFixture fixture;
+		fixture.items = double(particles->particleCount());
+		fixture.reset = [scene, velocity]() { *velocity = scene->velocity; };
+		fixture.run = [particles, velocity]() { particles->applyVelocity(*velocity); };
+		return fixture;
+	});
+}
+
+static std::vector<unsigned> parseList(const std::string& list)
+{
+	std::vector<unsigned> values;
+
+	std::stringstream stream(list);
+	std::string value;
+	while (std::getline(stream, value, ','))
+	{
+		int parsedValue = std::atoi(value.c_str());
+		if (parsedValue > 0)
+			values.push_back(unsigned(parsedValue));
+	}
+
+	return values;
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<unsigned> resolutions = { 256, 512, 1024, 2048 };
+
+	std::vector<unsigned> threadCounts;
+	unsigned maxThreads = unsigned(tbb::this_task_arena::max_concurrency());
+	for (unsigned threads = 1; threads < maxThreads; threads *= 2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(maxThreads);
+
+	unsigned repetitions = 5;
+	std::string filter;
+	std::string outputFile("benchmarks.json");
+	bool doList = false;
+
+	for (int arg = 1; arg < argc; ++arg)
+	{
+		std::string option(argv[arg]);
+
+		if (option == "--list")
+		{
+			doList = true;
+			continue;
+		}
+		else if (option == "--reproducible")
+		{
+			Reduction::setMode(ReductionMode::REPRODUCIBLE);
+			continue;
+		}
+
+		if (arg + 1 >= argc)
+		{
+			std::cout << "Missing value for " << option << std::endl;
+			return 1;
+		}
+
+		std::string value(argv[++arg]);
+
+		if (option == "--resolutions")
+			resolutions = parseList(value);
+		else if (option == "--threads")
+			threadCounts = parseList(value);
+		else if (option == "--repetitions")
+			repetitions = unsigned(std::max(std::atoi(value.c_str()), 1));
+		else if (option == "--filter")
+			filter = value;
+		else if (option == "--output")
+			outputFile = value;
+		else
+		{
+			std::cout << "Usage: " << argv[0] << " [--resolutions 256,512,1024,2048] [--threads 1,2,4] [--repetitions 5]"
+						<< " [--filter name] [--output benchmarks.json] [--list] [--reproducible]" << std::endl;
+			return 1;
+		}
+	}
+
+	if (resolutions.empty() || threadCounts.empty())
+	{
+		std::cout << "Resolutions and thread counts must be positive" << std::endl;
+		return 1;
+	}
+
+	BenchmarkSuite suite;
+	addBenchmarks(suite);
+
+	if (doList)
+	{
+		suite.printNames();
+		return 0;
+	}
+
+	std::vector<BenchmarkResult> results = suite.run(resolutions, threadCounts, repetitions, filter);
+
+	if (!BenchmarkSuite::writeJSON(outputFile, results))
+		return 1;
+
+	std::cout << "Wrote " << results.size() << " results to " << outputFile << std::endl;
+}
@@ -0,0 +1,487 @@
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "EulerianLiquid.h"
+#include "EulerianSmoke.h"
+#include "ExecutionContext.h"
+#include "FrameExporter.h"
+#include "InitialConditions.h"
+#include "LevelSet2D.h"
+#include "Mesh2D.h"
+#include "MultiMaterialLiquid.h"
+#include "Profiler.h"
+#include "Renderer.h"
+#include "ScalarGrid.h"
+#include "SolverStats.h"
+#include "SubstepScheduler.h"
+
+///////////////////////////////////
+//
+// HeadlessRunner.cpp
+// Ryan Goldade 2017
+//
+// Batch runner for render nodes without
+// a display. Builds one of the scenes,
+// runs it for a fixed number of frames
+// and writes a PNG of every frame, drawn
+// by the CPU rasterizer, along with a
+// per-frame log to the output directory.
+// Every linear solve is logged as a line
+// of JSON in solvers.jsonl.
+// The simulators are stepped directly
+// instead of from a GLUT display callback
+// and frames are written by a FrameExporter
+// while the next frame is simulated.
+//
+// Usage: HeadlessRunner <liquid | smoke | bubbles> <resolution> <frames> <output directory>
+//							[writer threads] [grids] [--threads N] [--numa-node N] [--cpus LIST]
+//
+// The resolution is the number of cells
+// across the 5 unit tall domain. Passing
+// "grids" also writes the scene's scalar
+// grids as binary snapshots.
+//
+// The scene is built, simulated and drawn
+// in one ExecutionContext. --threads caps
+// its thread count, --numa-node binds it to
+// a NUMA node and --cpus pins it to a CPU
+// list (e.g. 0-15,32-47), so several runs
+// can share a node side by side.
+//
+// In a PROFILING build every frame also
+// gets a zone summary (frame_NNNN_profile.json)
+// and the whole run is written as a
+// Chrome trace to trace.json.
+//
+////////////////////////////////////
+
+static constexpr Real dt = 1. / 30.;
+
+class HeadlessScene
+{
+public:
+	virtual ~HeadlessScene() {}
+
+	virtual Real maxVelocityMagnitude() const = 0;
+
+	// Advance by dt, including forces and sources
+	virtual void step(Real dt, Renderer& renderer) = 0;
+
+	// Stats of the linear solves made during the last step
+	virtual const std::vector<SolverStats>& solverStats() const = 0;
+
+	// Copies what the frame shows for the exporter
+	virtual void snapshot(FrameSnapshot& frame) const = 0;
+
+	const Vec2R& bottomLeftCorner() const { return myBottomLeftCorner; }
+	const Vec2R& topRightCorner() const { return myTopRightCorner; }
+
+protected:
+	Vec2R myBottomLeftCorner, myTopRightCorner;
+};
+
+// Same set up as the LevelSetLiquid scene
+class LiquidScene : public HeadlessScene
+{
+public:
+	LiquidScene(Real dx)
+		: mySeedTime(0)
+	{
+		myTopRightCorner = Vec2R(2.5);
+		myBottomLeftCorner = Vec2R(-2.5);
+		myGridSize = Vec2ui((myTopRightCorner - myBottomLeftCorner) / dx);
+		myXform = Transform(dx, myBottomLeftCorner);
+		Vec2R center = .5 * (myTopRightCorner + myBottomLeftCorner);
+
+		Mesh2D liquidMesh = circleMesh(center - Vec2R(0, .65), 1, 40);
+		assert(liquidMesh.unitTest());
+
+		Mesh2D solidMesh = circleMesh(center, 2, 40);
+		solidMesh.reverse();
+		assert(solidMesh.unitTest());
+
+		LevelSet2D liquidSurface = LevelSet2D(myXform, myGridSize, 10);
+		liquidSurface.init(liquidMesh, false);
+
+		LevelSet2D solidSurface = LevelSet2D(myXform, myGridSize, 10);
+		solidSurface.setInverted();
+		solidSurface.init(solidMesh, false);
+
+		mySimulator = std::make_unique<EulerianLiquid>(myXform, myGridSize, 10);
+		mySimulator->unionLiquidSurface(liquidSurface);
+		mySimulator->setSolidSurface(solidSurface);
+	}
+
+	Real maxVelocityMagnitude() const override { return mySimulator->maxVelocityMagnitude(); }
+
+	void step(Real dt, Renderer& renderer) override
+	{
+		if (mySeedTime > 2.)
+		{
+			Vec2R center = myXform.offset() + Vec2R(myXform.dx()) * Vec2R(myGridSize / 2) + Vec2R(.8);
+			Mesh2D seedMesh = squareMesh(center, Vec2R(.5));
+
+			LevelSet2D seedSurface = LevelSet2D(myXform, myGridSize, 5);
+			seedSurface.init(seedMesh, false);
+			mySimulator->unionLiquidSurface(seedSurface);
+			mySeedTime = 0.;
+		}
+
+		mySimulator->addForce(dt, Vec2R(0., -9.8));
+
+		mySimulator->runTimestep(dt, renderer);
+
+		mySeedTime += dt;
+	}
+
+	const std::vector<SolverStats>& solverStats() const override { return mySimulator->stepSolverStats(); }
+
+	void snapshot(FrameSnapshot& frame) const override
+	{
+		frame.addSurface(mySimulator->liquidSurface(), Vec3f(0., 0., 1.));
+		frame.addSurface(mySimulator->solidSurface(), Vec3f(1., 0., 1.));
+	}
+
+private:
+	std::unique_ptr<EulerianLiquid> mySimulator;
+
+	Transform myXform;
+	Vec2ui myGridSize;
+	Real mySeedTime;
+};
+
+// Same set up as the RisingSmoke scene
+class SmokeScene : public HeadlessScene
+{
+public:
+	SmokeScene(Real dx)
+	{
+		Real boundaryPadding = 10.;
+
+		myTopRightCorner = Vec2R(2.5) + Vec2R(dx * boundaryPadding);
+		myBottomLeftCorner = Vec2R(-2.5) - Vec2R(dx * boundaryPadding);
+
+		Vec2R simulationSize = myTopRightCorner - myBottomLeftCorner;
+		Vec2ui gridSize(simulationSize / dx);
+		Transform xform(dx, myBottomLeftCorner);
+		Vec2R center = .5 * (myTopRightCorner + myBottomLeftCorner);
+
+		Mesh2D solidMesh = squareMesh(center, .5 * simulationSize - Vec2R(boundaryPadding * xform.dx()));
+		solidMesh.reverse();
+		assert(solidMesh.unitTest());
+
+		LevelSet2D solid = LevelSet2D(xform, gridSize, 10);
+		solid.setInverted();
+		solid.init(solidMesh, false);
+
+		Real ambientTemperature = 300;
+
+		mySimulator = std::make_unique<EulerianSmoke>(xform, gridSize, ambientTemperature);
+		mySimulator->setSolidSurface(solid);
+
+		Mesh2D sourceMesh = circleMesh(center - Vec2R(0, 2.), .25, 40);
+		LevelSet2D sourceVolume = LevelSet2D(xform, gridSize, 10);
+		sourceVolume.init(sourceMesh, false);
+
+		mySmokeDensity = ScalarGrid<Real>(xform, gridSize, 0);
+		mySmokeTemperature = ScalarGrid<Real>(xform, gridSize, ambientTemperature);
+
+		// Super sample the source volume to get a smooth volumetric representation
+		Real sampleDx = .5;
+		forEachVoxelRange(Vec2ui(0), gridSize, [&](const Vec2ui& cell)
+		{
+			if (sourceVolume.interp(sourceVolume.indexToWorld(Vec2R(cell))) < dx * 2.)
+			{
+				int insideVolumeCount = 0;
+				for (Real x = (Real(cell[0]) - .5) + (.5 * sampleDx); x < Real(cell[0]) + .5; x += sampleDx)
+					for (Real y = (Real(cell[1]) - .5) + (.5 * sampleDx); y < Real(cell[1]) + .5; y += sampleDx)
+					{
+						if (sourceVolume.interp(sourceVolume.indexToWorld(Vec2R(x, y))) <= 0.) ++insideVolumeCount;
+					}
+
+				if (insideVolumeCount > 0)
+				{
+					mySmokeDensity(cell) = .2 * Real(insideVolumeCount) * sampleDx * sampleDx;
+					mySmokeTemperature(cell) = 350 * Real(insideVolumeCount) * sampleDx * sampleDx;
+				}
+			}
+		});
+
+		mySimulator->setSmokeSource(mySmokeDensity, mySmokeTemperature);
+	}
+
+	Real maxVelocityMagnitude() const override { return mySimulator->maxVelocityMagnitude(); }
+
+	void step(Real dt, Renderer& renderer) override
+	{
+		mySimulator->runTimestep(dt, renderer);
+		mySimulator->setSmokeSource(mySmokeDensity, mySmokeTemperature);
+	}
+
+	const std::vector<SolverStats>& solverStats() const override { return mySimulator->stepSolverStats(); }
+
+	void snapshot(FrameSnapshot& frame) const override
+	{
+		frame.addGrid("density", mySimulator->smokeDensity(), Vec3f(1), Vec3f(0), 0, 1);
+		frame.addSurface(mySimulator->solidSurface(), Vec3f(1., 0., 1.));
+	}
+
+private:
+	std::unique_ptr<EulerianSmoke> mySimulator;
+
+	ScalarGrid<Real> mySmokeDensity, mySmokeTemperature;
+};
+
+// Same set up as the MultiMaterialBubbles scene
+class BubblesScene : public HeadlessScene
+{
+public:
+	BubblesScene(Real dx)
+	{
+		Real boundaryPadding = 10.;
+
+		myTopRightCorner = Vec2R(2.0, 2.5) + Vec2R(dx * boundaryPadding);
+		myBottomLeftCorner = Vec2R(-2.0, -2.5) - Vec2R(dx * boundaryPadding);
+
+		Vec2R simulationSize = myTopRightCorner - myBottomLeftCorner;
+		Vec2ui gridSize(simulationSize / dx);
+		Transform xform(dx, myBottomLeftCorner);
+		Vec2R center = .5 * (myTopRightCorner + myBottomLeftCorner);
+
+		Mesh2D solidMesh = squareMesh(center, .5 * simulationSize - Vec2R(boundaryPadding * xform.dx()));
+		solidMesh.reverse();
+		assert(solidMesh.unitTest());
+
+		LevelSet2D solidSurface = LevelSet2D(xform, gridSize, 10);
+		solidSurface.setInverted();
+		solidSurface.init(solidMesh, false);
+
+		Vec2R bubbleOffset(0, 1.);
+		Mesh2D bubbleMesh = circleMesh(center - bubbleOffset, .75, 40);
+
+		Real surfaceHeight = 1.;
+		Vec2R surfaceCenter(center[0], myTopRightCorner[1] - .5 * surfaceHeight - boundaryPadding * dx);
+		Mesh2D surfaceMesh = squareMesh(surfaceCenter, Vec2R(.5 * simulationSize[0] - boundaryPadding * dx, .5 * surfaceHeight));
+		bubbleMesh.insertMesh(surfaceMesh);
+
+		LevelSet2D bubbleSurface = LevelSet2D(xform, gridSize, 10);
+		bubbleSurface.init(bubbleMesh, false);
+		bubbleMesh.reverse();
+
+		Mesh2D liquidMesh = solidMesh;
+		liquidMesh.reverse();
+		liquidMesh.insertMesh(bubbleMesh);
+
+		LevelSet2D liquidSurface = LevelSet2D(xform, gridSize, 10);
+		liquidSurface.init(liquidMesh, false);
+
+		mySimulator = std::make_unique<MultiMaterialLiquid>(xform, gridSize, 2, 5);
+		mySimulator->setSolidSurface(solidSurface);
+		mySimulator->setMaterial(liquidSurface, 1000, 0);
+		mySimulator->setMaterial(bubbleSurface, 10000, 1);
+	}
+
+	Real maxVelocityMagnitude() const override { return mySimulator->maxVelocityMagnitude(); }
+
+	void step(Real dt, Renderer& renderer) override
+	{
+		for (unsigned material = 0; material < 2; ++material)
+			mySimulator->addForce(dt, material, Vec2R(0., -9.8));
+
+		mySimulator->runTimestep(dt, renderer);
+	}
+
+	const std::vector<SolverStats>& solverStats() const override { return mySimulator->stepSolverStats(); }
+
+	void snapshot(FrameSnapshot& frame) const override
+	{
+		frame.addSurface(mySimulator->materialSurface(0), Vec3f(0., 0., 1.));
+		frame.addSurface(mySimulator->solidSurface(), Vec3f(1., 0., 1.));
+	}
+
+private:
+	std::unique_ptr<MultiMaterialLiquid> mySimulator;
+};
+
+static std::unique_ptr<HeadlessScene> buildScene(const std::string& name, Real dx)
+{
+	if (name == "liquid")
+		return std::make_unique<LiquidScene>(dx);
+	else if (name == "smoke")
+		return std::make_unique<SmokeScene>(dx);
+	else if (name == "bubbles")
+		return std::make_unique<BubblesScene>(dx);
+
+	return nullptr;
+}
+
+int main(int argc, char** argv)
+{
+	const std::string usage = " <liquid | smoke | bubbles> <resolution> <frames> <output directory> [writer threads] [grids] [--threads N] [--numa-node N] [--cpus LIST]";
+
+	if (argc < 5)
+	{
+		std::cout << "Usage: " << argv[0] << usage << std::endl;
+		return 1;
+	}
+
+	std::string sceneName(argv[1]);
+	int resolution = std::atoi(argv[2]);
+	int frameCount = std::atoi(argv[3]);
+	std::string outputDirectory(argv[4]);
+	int writerCount = 2;
+	bool doWriteGrids = false;
+
+	int threadCount = 0;
+	int numaNode = -1;
+	std::vector<unsigned> cpus;
+
+	unsigned positional = 0;
+	for (int arg = 5; arg < argc; ++arg)
+	{
+		std::string option(argv[arg]);
+
+		if (option.compare(0, 2, "--") == 0)
+		{
+			if (arg + 1 >= argc)
+			{
+				std::cout << "Usage: " << argv[0] << usage << std::endl;
+				return 1;
+			}
+
+			std::string value(argv[++arg]);
+
+			bool isValid = true;
+
+			if (option == "--threads")
+				threadCount = std::atoi(value.c_str());
+			else if (option == "--numa-node")
+				numaNode = std::atoi(value.c_str());
+			else if (option == "--cpus")
+			{
+				cpus = ExecutionContext::parseCPUList(value);
+				isValid = !cpus.empty();
+			}
+			else isValid = false;
+
+			if (!isValid)
+			{
+				std::cout << "Usage: " << argv[0] << usage << std::endl;
+				return 1;
+			}
+		}
+		else if (positional == 0)
+		{
+			writerCount = std::atoi(option.c_str());
+			++positional;
+		}
+		else if (positional == 1)
+		{
+			doWriteGrids = option == "grids";
+			++positional;
+		}
+	}
+
+	if (resolution <= 0 || frameCount < 0 || writerCount <= 0 || threadCount < 0)
+	{
+		std::cout << "Resolution and writer threads must be positive and the frame and thread counts can't be negative" << std::endl;
+		return 1;
+	}
+
+	ExecutionContext context(unsigned(threadCount), numaNode, cpus);
+
+	std::cout << "Threads: " << context.threadCount();
+	if (context.numaNode() >= 0) std::cout << ", NUMA node: " << context.numaNode();
+	if (!context.cpus().empty()) std::cout << ", pinned to " << context.cpus().size() << " CPUs";
+	std::cout << std::endl;
+
+	Real dx = 5. / Real(resolution);
+
+	// Built inside the context so the grids are first touched by its threads
+	std::unique_ptr<HeadlessScene> scene = context.execute([&]() { return buildScene(sceneName, dx); });
+	if (!scene)
+	{
+		std::cout << "Unknown scene: " << sceneName << std::endl;
+		return 1;
+	}
+
+	std::ofstream frameLog(outputDirectory + "/frames.csv");
+	if (!frameLog)
+	{
+		std::cout << "Could not write to output directory: " << outputDirectory << std::endl;
+		return 1;
+	}
+
+	frameLog << "frame,substeps,seconds,max velocity" << std::endl;
+
+	std::ofstream solverLog(outputDirectory + "/solvers.jsonl");
+	if (!solverLog)
+	{
+		std::cout << "Could not write to output directory: " << outputDirectory << std::endl;
+		return 1;
+	}
+
+	Vec2R domainSize = scene->topRightCorner() - scene->bottomLeftCorner();
+
+	unsigned pixelHeight = 1000;
+	unsigned pixelWidth = unsigned(pixelHeight * domainSize[0] / domainSize[1]);
+
+	// Only used for the simulators' debug drawing
+	Renderer renderer(Vec2ui(pixelWidth, pixelHeight), scene->bottomLeftCorner(), domainSize[1]);
+
+	FrameExporter exporter(outputDirectory, Vec2ui(pixelWidth, pixelHeight), scene->bottomLeftCorner(), domainSize[1],
+							unsigned(writerCount), 2 * unsigned(writerCount), true, doWriteGrids, &context);
+
+	SubstepScheduler scheduler(dx);
+
+	std::vector<ProfileEvent> traceEvents;
+
+	for (int frame = 0; frame < frameCount; ++frame)
+	{
+		unsigned substep = 0;
+		unsigned substeps = scheduler.runFrame(dt, [&]() { return scene->maxVelocityMagnitude(); }, [&](Real localDt)
+		{
+			context.execute([&]() { scene->step(localDt, renderer); });
+
+			for (const SolverStats& stats : scene->solverStats())
+			{
+				solverLog << "{\"frame\": " << frame << ", \"substep\": " << substep << ", \"stats\": ";
+				stats.writeJSON(solverLog);
+				solverLog << "}\n";
+			}
+
+			++substep;
+		});
+
+		solverLog.flush();
+
+		renderer.clear();
+
+		auto snapshot = std::make_unique<FrameSnapshot>(frame);
+		context.execute([&]() { scene->snapshot(*snapshot); });
+		exporter.push(std::move(snapshot));
+
+		frameLog << frame << "," << substeps << "," << scheduler.frameSeconds() << "," << scene->maxVelocityMagnitude() << std::endl;
+
+		std::cout << "Frame " << frame << ": " << substeps << " substeps, " << scheduler.frameSeconds() << "s" << std::endl;
+
+		if (Profiler::isEnabled())
+		{
+			std::vector<ProfileEvent> frameEvents = Profiler::collect();
+			Profiler::writeSummary(exporter.framePrefix(frame) + "_profile.json", frame, frameEvents);
+			traceEvents.insert(traceEvents.end(), frameEvents.begin(), frameEvents.end());
+		}
+	}
+
+	if (Profiler::isEnabled())
+		Profiler::writeChromeTrace(outputDirectory + "/trace.json", traceEvents);
+
+	if (!exporter.finish())
+	{
+		std::cout << "Some frames failed to write" << std::endl;
+		return 1;
+	}
+}
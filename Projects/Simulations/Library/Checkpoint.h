@@ -0,0 +1,103 @@
+#ifndef SIMULATIONS_CHECKPOINT_H
+#define SIMULATIONS_CHECKPOINT_H
+
+#include <future>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Common.h"
+#include "GridSnapshot.h"
+
+///////////////////////////////////
+//
+// Checkpoint.h
+// Ryan Goldade 2017
+//
+// Helpers for the simulators' checkpoint
+// and restore methods. A checkpoint is a
+// set of snapshot files that share a
+// prefix: one per field and a state file
+// with the simulator's scalar settings
+// and the frame number. The state file
+// is written last so a checkpoint with a
+// readable state file is complete.
+//
+// The simulators copy their fields and
+// hand the copies to a CheckpointWriter,
+// which writes them on a separate thread
+// while the simulation keeps stepping.
+//
+////////////////////////////////////
+
+inline std::string checkpointFile(const std::string& prefix, const std::string& field)
+{
+	return prefix + "_" + field + ".snap";
+}
+
+// A list of values that doesn't fit a grid snapshot, e.g. a side table flattened into doubles
+inline bool writeCheckpointValues(const std::string& prefix, const std::string& field, const std::vector<double>& values)
+{
+	SnapshotHeader header;
+	header.kind = SnapshotSettings::Kind::VALUES;
+	header.valueBytes = sizeof(double);
+
+	return writeSnapshot(checkpointFile(prefix, field), header,
+							{ SnapshotBlock{ values.data(), Vec2ui(unsigned(values.size()), 1) } });
+}
+
+inline bool readCheckpointValues(const std::string& prefix, const std::string& field, std::vector<double>& values)
+{
+	MappedSnapshot snapshot(checkpointFile(prefix, field));
+	if (!snapshot.isValid())
+		return false;
+
+	const SnapshotHeader& header = snapshot.header();
+	if (header.kind != SnapshotSettings::Kind::VALUES || header.valueBytes != sizeof(double) || header.blockCount != 1)
+		return false;
+
+	const double* block = snapshot.block<double>(0);
+	values.assign(block, block + snapshot.blockSize(0)[0]);
+	return true;
+}
+
+inline bool writeCheckpointState(const std::string& prefix, const std::vector<double>& values)
+{
+	return writeCheckpointValues(prefix, "state", values);
+}
+
+inline bool readCheckpointState(const std::string& prefix, std::vector<double>& values)
+{
+	return readCheckpointValues(prefix, "state", values);
+}
+
+// Runs one checkpoint write at a time on a background thread
+class CheckpointWriter
+{
+public:
+	~CheckpointWriter() { finish(); }
+
+	// The write function must own everything it writes. Waits for the previous write
+	// first and returns false if that one failed.
+	template<typename WriteFunction>
+	bool write(WriteFunction&& writeFunction)
+	{
+		bool previousWritten = finish();
+		myPendingWrite = std::async(std::launch::async, std::forward<WriteFunction>(writeFunction));
+		return previousWritten;
+	}
+
+	// Blocks until the pending write is done. Returns false if it failed.
+	bool finish()
+	{
+		if (!myPendingWrite.valid())
+			return true;
+
+		return myPendingWrite.get();
+	}
+
+private:
+	std::future<bool> myPendingWrite;
+};
+
+#endif
@@ -4,7 +4,8 @@
 
 #include "ComputeWeights.h"
 #include "ExtrapolateField.h"
-#include "PressureProjection.h"
+#include "HeapAllocations.h"
+#include "Profiler.h"
 #include "Timer.h"
 #include "ViscositySolver.h"
 
@@ -52,6 +53,8 @@ void EulerianLiquid::setLiquidSurface(const LevelSet2D& surface)
 
 void EulerianLiquid::setLiquidVelocity(const VectorGrid<Real>& velocity)
 {
+	myMaxVelocityValid = false;
+
 	for (auto axis : { 0,1 })
 	{
 		Vec2ui size = myLiquidVelocity.size(axis);
@@ -80,6 +83,8 @@ void EulerianLiquid::setSolidVelocity(const VectorGrid<Real>& solidVelocity)
 
 void EulerianLiquid::unionLiquidSurface(const LevelSet2D& addedLiquidSurface)
 {
+	myMaxVelocityValid = false;
+
 	// Need to zero out velocity in this added region as it could get extrapolated values
 	for (auto axis : { 0,1 })
 	{
@@ -93,12 +98,14 @@ void EulerianLiquid::unionLiquidSurface(const LevelSet2D& addedLiquidSurface)
 
 	// Combine surfaces
 	myLiquidSurface.unionSurface(addedLiquidSurface);
-	myLiquidSurface.reinitMesh();
+	myLiquidSurface.reinitMesh(myWorkspace.levelSetBuffers());
 }
 
 template<typename ForceSampler>
 void EulerianLiquid::addForce(Real dt, const ForceSampler& force)
 {
+	myMaxVelocityValid = false;
+
 	for (auto axis : { 0,1 })
 	{
 		forEachVoxelRange(Vec2ui(0), myLiquidVelocity.size(axis), [&](const Vec2ui& face)
@@ -117,11 +124,16 @@ void EulerianLiquid::addForce(Real dt, const Vec2R& force)
 void EulerianLiquid::advectLiquidSurface(Real dt, IntegrationOrder integrator)
 {
 	auto velocityFunc = [&](Real, const Vec2R& pos) { return myLiquidVelocity.interp(pos);  };
-	Mesh2D localMesh = myLiquidSurface.buildDCMesh();
+
+	// The mesh is built in the workspace so its storage is reused every timestep
+	LevelSetBuffers& surfaceBuffers = myWorkspace.levelSetBuffers();
+	Mesh2D& localMesh = surfaceBuffers.mesh;
+
+	myLiquidSurface.buildDCMesh(localMesh, surfaceBuffers);
 	localMesh.advect(dt, velocityFunc, integrator);
 	assert(localMesh.unitTest());
 
-	myLiquidSurface.init(localMesh, false);
+	myLiquidSurface.init(localMesh, false, surfaceBuffers);
 
 	// Remove solid regions from liquid surface
 	forEachVoxelRange(Vec2ui(0), myLiquidSurface.size(), [&](const Vec2ui& cell)
@@ -129,7 +141,7 @@ void EulerianLiquid::advectLiquidSurface(Real dt, IntegrationOrder integrator)
 		myLiquidSurface(cell) = std::max(myLiquidSurface(cell), -mySolidSurface(cell));
 	});
 
-	myLiquidSurface.reinitMesh();
+	myLiquidSurface.reinitMesh(surfaceBuffers);
 }
 
 void EulerianLiquid::advectViscosity(Real dt, IntegrationOrder integrator, InterpolationOrder interpolator)
@@ -137,8 +149,9 @@ void EulerianLiquid::advectViscosity(Real dt, IntegrationOrder integrator, Inter
 	auto velocityFunc = [&](Real, const Vec2R& pos) { return myLiquidVelocity.interp(pos); };
 
 	AdvectField<ScalarGrid<Real>> advector(myViscosity);
-	ScalarGrid<Real> tempViscosity(myViscosity.xform(), myViscosity.size());
-	
+	ScalarGrid<Real>& tempViscosity = myWorkspace.centerGrid();
+	assert(tempViscosity.isMatched(myViscosity));
+
 	advector.advectField(dt, tempViscosity, velocityFunc, integrator, interpolator);
 	std::swap(tempViscosity, myViscosity);
 }
@@ -147,24 +160,33 @@ void EulerianLiquid::advectLiquidVelocity(Real dt, IntegrationOrder integrator,
 {
 	auto velocityFunc = [&](Real, const Vec2R& pos) { return myLiquidVelocity.interp(pos); };
 
-	VectorGrid<Real> tempVelocity(myLiquidVelocity.xform(), myLiquidVelocity.gridSize(), VectorGridSettings::SampleType::STAGGERED);
+	VectorGrid<Real>& tempVelocity = myWorkspace.faceGrid();
+	assert(tempVelocity.isMatched(myLiquidVelocity));
 
-	for (auto axis : { 0,1 })
-	{
-		AdvectField<ScalarGrid<Real>> advector(myLiquidVelocity.grid(axis));
-		advector.advectField(dt, tempVelocity.grid(axis), velocityFunc, integrator, interpolator);
-	}
+	// Advection is the last change to the velocity in a timestep so the CFL speed is gathered here
+	myMaxVelocity = advectStaggeredVelocity(dt, myLiquidVelocity, tempVelocity, velocityFunc, integrator, interpolator);
 
 	std::swap(myLiquidVelocity, tempVelocity);
+
+	myMaxVelocityValid = true;
 }
 
 void EulerianLiquid::runTimestep(Real dt, Renderer& debugRenderer)
 {
+	PROFILE_ZONE("EulerianLiquid::runTimestep");
+
 	std::cout << "\nStarting simulation loop\n" << std::endl;
 
 	Timer simTimer;
 
-	LevelSet2D extrapolatedSurface = myLiquidSurface;
+	unsigned long long startGridAllocations = gridAllocationCount();
+	unsigned long long startHeapAllocations = heapAllocationCount();
+
+	myStepSolverStats.clear();
+
+	// Copying into the workspace surface reuses its storage
+	LevelSet2D& extrapolatedSurface = myWorkspace.surface();
+	extrapolatedSurface = myLiquidSurface;
 
 	Real dx = extrapolatedSurface.dx();
 	forEachVoxelRange(Vec2ui(0), extrapolatedSurface.size(), [&](const Vec2ui& cell)
@@ -173,64 +195,70 @@ void EulerianLiquid::runTimestep(Real dt, Renderer& debugRenderer)
 			extrapolatedSurface(cell) -= dx;
 	});
 
-	extrapolatedSurface.reinitMesh();
+	extrapolatedSurface.reinitMesh(myWorkspace.levelSetBuffers());
 
 	std::cout << "  Extrapolate into solids: " << simTimer.stop() << "s" << std::endl;
 	simTimer.reset();
 
-	// Compute weights for both liquid-solid side and air-liquid side
-	VectorGrid<Real> ghostFluidWeights = computeGhostFluidWeights(extrapolatedSurface);
-	VectorGrid<Real> cutCellWeights = computeCutCellWeights(mySolidSurface, true);
+	// Compute weights for both liquid-solid side and air-liquid side. The liquid volumes
+	// for the viscosity solve are built in the same pass.
+	ProjectionWeights& weights = myWorkspace.weights();
+	weights.compute(extrapolatedSurface, mySolidSurface, true, myDoSolveViscosity);
+
+	const VectorGrid<Real>& ghostFluidWeights = weights.ghostFluidWeights();
+	const VectorGrid<Real>& cutCellWeights = weights.cutCellWeights();
 
 	std::cout << "  Compute weights: " << simTimer.stop() << "s" << std::endl;
 	
 	simTimer.reset();
 
-	// Initialize and call pressure projection
-	PressureProjection projectdivergence(extrapolatedSurface, myLiquidVelocity, mySolidSurface, mySolidVelocity);
+	// Call pressure projection
+	PressureProjection& projectdivergence = *myPressureProjection;
 
-	projectdivergence.project(ghostFluidWeights, cutCellWeights);
+	bool isProjected = projectdivergence.project(ghostFluidWeights, cutCellWeights);
+	myStepSolverStats.push_back(projectdivergence.solverStats());
 	
-	// Update velocity field
-	projectdivergence.applySolution(myLiquidVelocity, ghostFluidWeights);
+	// Update velocity field. A failed solve leaves the velocity unprojected rather than applying zero pressure.
+	if (isProjected)
+		projectdivergence.applySolution(myLiquidVelocity, ghostFluidWeights);
+	else
+		std::cout << "  Velocity left unprojected" << std::endl;
 
-	VectorGrid<MarkedCells> valid(extrapolatedSurface.xform(), extrapolatedSurface.size(), MarkedCells::UNVISITED, VectorGridSettings::SampleType::STAGGERED);
+	VectorGrid<MarkedCells>& valid = myWorkspace.validFaces();
 	
 	if (myDoSolveViscosity)
 	{
 		std::cout << "  Solve for pressure: " << simTimer.stop() << "s" << std::endl;
 		simTimer.reset();
 		
-		unsigned samples = 3;
-
-		ScalarGrid<Real> centerAreas = computeSupersampledAreas(extrapolatedSurface, ScalarGridSettings::SampleType::CENTER, 3);
-		ScalarGrid<Real> nodeAreas = computeSupersampledAreas(extrapolatedSurface, ScalarGridSettings::SampleType::NODE, 3);
-		VectorGrid<Real> faceAreas = computeSupersampledFaceAreas(extrapolatedSurface, 3);
-		
-		ScalarGrid<Real> solidCenterAreas = computeSupersampledAreas(extrapolatedSurface, ScalarGridSettings::SampleType::CENTER, 3);
-		ScalarGrid<Real> solidNodeAreas = computeSupersampledAreas(extrapolatedSurface, ScalarGridSettings::SampleType::NODE, 3);
-
-		std::cout << "  Compute viscosity weights: " << simTimer.stop() << "s" << std::endl;
-		simTimer.reset();
-
-		ViscositySolver viscosity(dt, extrapolatedSurface, myLiquidVelocity, mySolidSurface, mySolidVelocity);
+		ViscositySolver viscosity(dt, extrapolatedSurface, myLiquidVelocity, mySolidSurface, mySolidVelocity,
+									myWorkspace.viscosityBuffers());
 
 		viscosity.setViscosity(myViscosity);
 
-		viscosity.solve(faceAreas, centerAreas, nodeAreas, solidCenterAreas, solidNodeAreas);
+		// The liquid surface is extrapolated into the solid so its volumes double as the solid volumes
+		viscosity.solve(weights.faceVolumes(),
+						weights.centerVolumes(),
+						weights.nodeVolumes(),
+						weights.centerVolumes(),
+						weights.nodeVolumes());
+
+		myStepSolverStats.push_back(viscosity.solverStats());
 
 		std::cout << "  Solve for viscosity: " << simTimer.stop() << "s" << std::endl;
 		simTimer.reset();
 
-		// Initialize and call pressure projection		
-		PressureProjection projectdivergence2(extrapolatedSurface, myLiquidVelocity, mySolidSurface, mySolidVelocity);
-
-		projectdivergence2.project(ghostFluidWeights, cutCellWeights);
+		// Call pressure projection again on the viscous velocity
+		isProjected = projectdivergence.project(ghostFluidWeights, cutCellWeights);
+		myStepSolverStats.push_back(projectdivergence.solverStats());
 
 		// Update velocity field
-		projectdivergence2.applySolution(myLiquidVelocity, ghostFluidWeights);
+		if (isProjected)
+			projectdivergence.applySolution(myLiquidVelocity, ghostFluidWeights);
+		else
+			std::cout << "  Velocity left unprojected" << std::endl;
 
-		projectdivergence2.applyValid(valid);
+		projectdivergence.applyValid(valid);
 
 		std::cout << "  Solve for pressure after viscosity: " << simTimer.stop() << "s" << std::endl;
 		
@@ -245,12 +273,9 @@ void EulerianLiquid::runTimestep(Real dt, Renderer& debugRenderer)
 	    simTimer.reset();
 	}
 
-	// Extrapolate velocity
-	for (unsigned axis : {0, 1})
-	{
-		ExtrapolateField<ScalarGrid<Real>> extrapolator(myLiquidVelocity.grid(axis));
-		extrapolator.extrapolate(valid.grid(axis), 1.5 * myCFL);
-	}
+	// Extrapolate velocity along the surface normal
+	ExtrapolateField<VectorGrid<Real>> extrapolator(myLiquidVelocity, myWorkspace.extrapolationBuffers());
+	extrapolator.extrapolateAlongNormal(valid, extrapolatedSurface, 1.5 * myCFL);
 
 	std::cout << "  Extrapolate velocity: " << simTimer.stop() << "s" << std::endl;
 	simTimer.reset();
@@ -262,4 +287,84 @@ void EulerianLiquid::runTimestep(Real dt, Renderer& debugRenderer)
 		advectViscosity(dt, IntegrationOrder::FORWARDEULER);
 
 	std::cout << "  Advect simulation: " << simTimer.stop() << "s" << std::endl;
+
+	myStepGridAllocations = gridAllocationCount() - startGridAllocations;
+	myStepHeapAllocations = heapAllocationCount() - startHeapAllocations;
+
+	std::cout << "  Grid allocations: " << myStepGridAllocations << std::endl;
+	if (isCountingHeapAllocations())
+		std::cout << "  Heap allocations: " << myStepHeapAllocations << std::endl;
+}
+
+bool EulerianLiquid::checkpoint(const std::string& prefix, unsigned frame)
+{
+	// The copies are owned by the write so the simulation can keep stepping while they go to disk
+	std::vector<double> state = { double(frame), myDoSolveViscosity ? 1. : 0., double(myCFL), double(mySurfaceTensionScale) };
+
+	return myCheckpointWriter.write([prefix, state, doSolveViscosity = myDoSolveViscosity,
+										liquidVelocity = myLiquidVelocity, solidVelocity = mySolidVelocity,
+										liquidSurface = myLiquidSurface, solidSurface = mySolidSurface,
+										viscosity = myViscosity]()
+	{
+		bool written = liquidVelocity.writeSnapshot(checkpointFile(prefix, "liquidVelocity"));
+		written &= solidVelocity.writeSnapshot(checkpointFile(prefix, "solidVelocity"));
+		written &= liquidSurface.writeSnapshot(checkpointFile(prefix, "liquidSurface"));
+		written &= solidSurface.writeSnapshot(checkpointFile(prefix, "solidSurface"));
+
+		if (doSolveViscosity)
+			written &= viscosity.writeSnapshot(checkpointFile(prefix, "viscosity"));
+
+		// Written last so that a readable state file marks a complete checkpoint
+		if (written)
+			written &= writeCheckpointState(prefix, state);
+
+		return written;
+	});
+}
+
+bool EulerianLiquid::restore(const std::string& prefix, unsigned& frame)
+{
+	finishCheckpoint();
+
+	std::vector<double> state;
+	if (!readCheckpointState(prefix, state) || state.size() != 4)
+		return false;
+
+	bool doSolveViscosity = state[1] != 0;
+
+	VectorGrid<Real> liquidVelocity, solidVelocity;
+	LevelSet2D liquidSurface, solidSurface;
+	ScalarGrid<Real> viscosity;
+
+	if (!liquidVelocity.readSnapshot(checkpointFile(prefix, "liquidVelocity")) ||
+		!solidVelocity.readSnapshot(checkpointFile(prefix, "solidVelocity")) ||
+		!liquidSurface.readSnapshot(checkpointFile(prefix, "liquidSurface")) ||
+		!solidSurface.readSnapshot(checkpointFile(prefix, "solidSurface")))
+		return false;
+
+	if (doSolveViscosity && !viscosity.readSnapshot(checkpointFile(prefix, "viscosity")))
+		return false;
+
+	if (!liquidVelocity.isMatched(myLiquidVelocity) || !solidVelocity.isMatched(mySolidVelocity) ||
+		!liquidSurface.isMatched(myLiquidSurface) || !solidSurface.isMatched(mySolidSurface))
+		return false;
+
+	// Assigned in place because the pressure projection holds references to these fields
+	myLiquidVelocity = liquidVelocity;
+	mySolidVelocity = solidVelocity;
+	myLiquidSurface = liquidSurface;
+	mySolidSurface = solidSurface;
+
+	myDoSolveViscosity = doSolveViscosity;
+	if (myDoSolveViscosity)
+		myViscosity = viscosity;
+
+	// The CFL sets the extrapolation distance so it has to match the run that wrote the checkpoint
+	myCFL = Real(state[2]);
+	mySurfaceTensionScale = Real(state[3]);
+
+	myMaxVelocityValid = false;
+
+	frame = unsigned(state[0]);
+	return true;
 }
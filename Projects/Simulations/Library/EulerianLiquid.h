@@ -1,14 +1,19 @@
 #ifndef SIMULATIONS_EULERIANLIQUID_H
 #define SIMULATIONS_EULERIANLIQUID_H
 
+#include <memory>
 #include <vector>
 
 #include "AdvectField.h"
+#include "Checkpoint.h"
 #include "Common.h"
 #include "ExtrapolateField.h"
 #include "Integrator.h"
 #include "LevelSet2D.h"
+#include "PressureProjection.h"
 #include "ScalarGrid.h"
+#include "SimulationWorkspace.h"
+#include "SolverStats.h"
 #include "Transform.h"
 #include "VectorGrid.h"
 
@@ -28,8 +33,13 @@ class EulerianLiquid
 {
 public:
 	EulerianLiquid(const Transform& xform, Vec2ui size, Real cfl = 5.)
-		: myXform(xform)
+		: myStepGridAllocations(0)
+		, myStepHeapAllocations(0)
+		, myMaxVelocity(0)
+		, myMaxVelocityValid(false)
+		, myXform(xform)
 		, myDoSolveViscosity(false)
+		, mySurfaceTensionScale(0)
 		, myCFL(cfl)
 	{
 		myLiquidVelocity = VectorGrid<Real>(myXform, size, VectorGridSettings::SampleType::STAGGERED);
@@ -37,8 +47,19 @@ public:
 
 		myLiquidSurface = LevelSet2D(myXform, size, myCFL);
 		mySolidSurface = LevelSet2D(myXform, size, myCFL);
+
+		myWorkspace.resize(myXform, size);
+
+		// The projection holds references to the simulation fields and the workspace surface,
+		// all of which live as long as the simulator, so it can be reused every timestep.
+		myPressureProjection.reset(new PressureProjection(myWorkspace.surface(), myLiquidVelocity,
+															mySolidSurface, mySolidVelocity));
 	}
 
+	// The pressure projection holds references to this simulator's own fields
+	EulerianLiquid(const EulerianLiquid&) = delete;
+	EulerianLiquid& operator=(const EulerianLiquid&) = delete;
+
 	void setSolidSurface(const LevelSet2D& solidSurface);
 	void setSolidVelocity(const VectorGrid<Real>& solidVelocity);
 	void setLiquidSurface(const LevelSet2D& liquidSurface);
@@ -71,9 +92,45 @@ public:
 	// Perform pressure project, viscosity solver, extrapolation, surface and velocity advection
 	void runTimestep(Real dt, Renderer& debugRenderer);
 
-	// Useful for CFL
-	Real maxVelocityMagnitude() { return myLiquidVelocity.maxMagnitude(); }
+	// Useful for CFL. The magnitude is cached after velocity advection and only recomputed
+	// if the velocity was changed since.
+	Real maxVelocityMagnitude() const
+	{
+		if (!myMaxVelocityValid)
+		{
+			myMaxVelocity = myLiquidVelocity.maxMagnitude();
+			myMaxVelocityValid = true;
+		}
+
+		return myMaxVelocity;
+	}
+
+	// Number of grid allocations made during the last call to runTimestep
+	unsigned long long stepGridAllocations() const { return myStepGridAllocations; }
+
+	// Number of heap allocations made during the last call to runTimestep. Only counted in
+	// executables that replace operator new (see HeapAllocations.h), otherwise it's zero.
+	unsigned long long stepHeapAllocations() const { return myStepHeapAllocations; }
+
+	// Stats of every linear solve made during the last call to runTimestep, in solve order
+	const std::vector<SolverStats>& stepSolverStats() const { return myStepSolverStats; }
+
+	// Copies the simulation state and writes it to files starting with prefix on a background
+	// thread so the simulation can keep stepping. Returns false if the previous checkpoint failed.
+	bool checkpoint(const std::string& prefix, unsigned frame);
+
+	// Blocks until the last checkpoint is on disk. Returns false if it failed.
+	bool finishCheckpoint() { return myCheckpointWriter.finish(); }
+
+	// Restores a checkpoint written by a simulator with the same grid, including the CFL and
+	// surface tension settings it was built with. With REPRODUCIBLE sums (see Reduction.h)
+	// stepping from the restored state matches the run that wrote it bit for bit at any thread
+	// count. FAST sums can differ in the last bits from run to run, restored or not.
+	bool restore(const std::string& prefix, unsigned& frame);
 	
+	const LevelSet2D& liquidSurface() const { return myLiquidSurface; }
+	const LevelSet2D& solidSurface() const { return mySolidSurface; }
+
 	// Rendering tools
 	void drawGrid(Renderer& renderer) const;
 
@@ -90,6 +147,19 @@ private:
 	LevelSet2D myLiquidSurface, mySolidSurface;
 	ScalarGrid<Real> myViscosity;
 
+	// Per-timestep temporaries (including the pressure and viscosity weights) are
+	// rebuilt every timestep into the same buffers
+	SimulationWorkspace myWorkspace;
+	std::unique_ptr<PressureProjection> myPressureProjection;
+
+	unsigned long long myStepGridAllocations, myStepHeapAllocations;
+	std::vector<SolverStats> myStepSolverStats;
+
+	mutable Real myMaxVelocity;
+	mutable bool myMaxVelocityValid;
+
+	CheckpointWriter myCheckpointWriter;
+
 	Transform myXform;
 
 	bool myDoSolveViscosity;
@@ -5,6 +5,7 @@
 #include "ComputeWeights.h"
 #include "ExtrapolateField.h"
 #include "PressureProjection.h"
+#include "Profiler.h"
 #include "Timer.h"
 
 void EulerianSmoke::drawGrid(Renderer& renderer) const
@@ -14,7 +15,7 @@ void EulerianSmoke::drawGrid(Renderer& renderer) const
 
 void EulerianSmoke::drawFluidDensity(Renderer& renderer, Real maxDensity)
 {
-	mySmokeDensity.drawVolumetric(renderer, Vec3f(1), Vec3f(0), 0, maxDensity);
+	mySmokeDensity.drawColourMap(renderer, Vec3f(1), Vec3f(0), 0, maxDensity);
 }
 
 void EulerianSmoke::drawFluidVelocity(Renderer& renderer, Real length) const
@@ -64,6 +65,8 @@ void EulerianSmoke::setFluidVelocity(const VectorGrid<Real>& velocity)
 {
 	assert(velocity.isMatched(myFluidVelocity));
 
+	myMaxVelocityValid = false;
+
 	for (auto axis : { 0,1 })
 	{
 		Vec2ui size = myFluidVelocity.size(axis);
@@ -124,20 +127,22 @@ void EulerianSmoke::advectFluidVelocity(Real dt, const InterpolationOrder& order
 	
 	VectorGrid<Real> tempVelocity(myFluidVelocity.xform(), myFluidVelocity.gridSize(), 0, VectorGridSettings::SampleType::STAGGERED);
 
-	for (auto axis : { 0,1 })
-	{
-		AdvectField<ScalarGrid<Real>> advector(myFluidVelocity.grid(axis));
-
-		advector.advectField(dt, tempVelocity.grid(axis), velocityFunc, IntegrationOrder::RK3, order);
-	}
+	// Advection is the last change to the velocity in a timestep so the CFL speed is gathered here
+	myMaxVelocity = advectStaggeredVelocity(dt, myFluidVelocity, tempVelocity, velocityFunc, IntegrationOrder::RK3, order);
 
 	std::swap(myFluidVelocity, tempVelocity);
+
+	myMaxVelocityValid = true;
 }
 
 void EulerianSmoke::runTimestep(Real dt, Renderer& renderer)
 {
+	PROFILE_ZONE("EulerianSmoke::runTimestep");
+
 	std::cout << "\nStarting simulation loop\n" << std::endl;
 
+	myStepSolverStats.clear();
+
 	Timer simTimer;
 
 	//
@@ -147,6 +152,8 @@ void EulerianSmoke::runTimestep(Real dt, Renderer& renderer)
 	Real alpha = 1.;
 	Real beta = 1.;
 
+	myMaxVelocityValid = false;
+
 	forEachVoxelRange(Vec2ui(0), myFluidVelocity.size(1), [&](const Vec2ui& face)
 	{
 		// Average density and temperature values at velocity face
@@ -185,10 +192,14 @@ void EulerianSmoke::runTimestep(Real dt, Renderer& renderer)
 	PressureProjection projectdivergence(dummySurface, myFluidVelocity, mySolidSurface, mySolidVelocity);
 	
 	// TODO: handle moving boundaries.
-	projectdivergence.project(ghostFluidWeights, cutCellWeights);
-
-	// Update velocity field
-	projectdivergence.applySolution(myFluidVelocity, ghostFluidWeights);
+	bool isProjected = projectdivergence.project(ghostFluidWeights, cutCellWeights);
+	myStepSolverStats.push_back(projectdivergence.solverStats());
+
+	// Update velocity field. A failed solve leaves the velocity unprojected rather than applying zero pressure.
+	if (isProjected)
+		projectdivergence.applySolution(myFluidVelocity, ghostFluidWeights);
+	else
+		std::cout << "Velocity left unprojected" << std::endl;
 	
 	std::cout << "Pressure projection: " << simTimer.stop() << "s" << std::endl;
 
@@ -203,4 +214,66 @@ void EulerianSmoke::runTimestep(Real dt, Renderer& renderer)
 	advectFluidVelocity(dt, InterpolationOrder::LINEAR);
 
 	std::cout << "Advection: " << simTimer.stop() << "s" << std::endl;
+}
+
+bool EulerianSmoke::checkpoint(const std::string& prefix, unsigned frame)
+{
+	// The copies are owned by the write so the simulation can keep stepping while they go to disk
+	std::vector<double> state = { double(frame), myAmbientTemperature };
+
+	return myCheckpointWriter.write([prefix, state,
+										fluidVelocity = myFluidVelocity, solidVelocity = mySolidVelocity,
+										solidSurface = mySolidSurface, smokeDensity = mySmokeDensity,
+										smokeTemperature = mySmokeTemperature]()
+	{
+		bool written = fluidVelocity.writeSnapshot(checkpointFile(prefix, "fluidVelocity"));
+		written &= solidVelocity.writeSnapshot(checkpointFile(prefix, "solidVelocity"));
+		written &= solidSurface.writeSnapshot(checkpointFile(prefix, "solidSurface"));
+		written &= smokeDensity.writeSnapshot(checkpointFile(prefix, "smokeDensity"));
+		written &= smokeTemperature.writeSnapshot(checkpointFile(prefix, "smokeTemperature"));
+
+		// Written last so that a readable state file marks a complete checkpoint
+		if (written)
+			written &= writeCheckpointState(prefix, state);
+
+		return written;
+	});
+}
+
+bool EulerianSmoke::restore(const std::string& prefix, unsigned& frame)
+{
+	finishCheckpoint();
+
+	std::vector<double> state;
+	if (!readCheckpointState(prefix, state) || state.size() != 2)
+		return false;
+
+	VectorGrid<Real> fluidVelocity, solidVelocity;
+	LevelSet2D solidSurface;
+	ScalarGrid<Real> smokeDensity, smokeTemperature;
+
+	if (!fluidVelocity.readSnapshot(checkpointFile(prefix, "fluidVelocity")) ||
+		!solidVelocity.readSnapshot(checkpointFile(prefix, "solidVelocity")) ||
+		!solidSurface.readSnapshot(checkpointFile(prefix, "solidSurface")) ||
+		!smokeDensity.readSnapshot(checkpointFile(prefix, "smokeDensity")) ||
+		!smokeTemperature.readSnapshot(checkpointFile(prefix, "smokeTemperature")))
+		return false;
+
+	if (!fluidVelocity.isMatched(myFluidVelocity) || !solidVelocity.isMatched(mySolidVelocity) ||
+		!solidSurface.isMatched(mySolidSurface) || !smokeDensity.isMatched(mySmokeDensity) ||
+		!smokeTemperature.isMatched(mySmokeTemperature))
+		return false;
+
+	myFluidVelocity = fluidVelocity;
+	mySolidVelocity = solidVelocity;
+	mySolidSurface = solidSurface;
+	mySmokeDensity = smokeDensity;
+	mySmokeTemperature = smokeTemperature;
+
+	myAmbientTemperature = state[1];
+
+	myMaxVelocityValid = false;
+
+	frame = unsigned(state[0]);
+	return true;
 }
\ No newline at end of file
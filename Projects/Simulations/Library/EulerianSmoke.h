@@ -4,11 +4,13 @@
 #include <vector>
 
 #include "AdvectField.h"
+#include "Checkpoint.h"
 #include "Common.h"
 #include "ExtrapolateField.h"
 #include "Integrator.h"
 #include "LevelSet2D.h"
 #include "ScalarGrid.h"
+#include "SolverStats.h"
 #include "Transform.h"
 #include "VectorGrid.h"
 
@@ -29,6 +31,7 @@ class EulerianSmoke
 public:
 	EulerianSmoke(const Transform& xform, Vec2ui size, Real ambienttemp = 300)
 		: myXform(xform), myAmbientTemperature(ambienttemp)
+		, myMaxVelocity(0), myMaxVelocityValid(false)
 	{
 		myFluidVelocity = VectorGrid<Real>(myXform, size, VectorGridSettings::SampleType::STAGGERED);
 		mySolidVelocity = VectorGrid<Real>(myXform, size, 0., VectorGridSettings::SampleType::STAGGERED);
@@ -52,8 +55,36 @@ public:
 	// Perform pressure project, viscosity solver, extrapolation, surface and velocity advection
 	void runTimestep(Real dt, Renderer& renderer);
 
-	// Useful for CFL
-	Real maxVelocityMagnitude() { return myFluidVelocity.maxMagnitude(); }
+	// Useful for CFL. The magnitude is cached after velocity advection and only recomputed
+	// if the velocity was changed since.
+	Real maxVelocityMagnitude() const
+	{
+		if (!myMaxVelocityValid)
+		{
+			myMaxVelocity = myFluidVelocity.maxMagnitude();
+			myMaxVelocityValid = true;
+		}
+
+		return myMaxVelocity;
+	}
+
+	// Stats of every linear solve made during the last call to runTimestep, in solve order
+	const std::vector<SolverStats>& stepSolverStats() const { return myStepSolverStats; }
+
+	// Copies the simulation state and writes it to files starting with prefix on a background
+	// thread so the simulation can keep stepping. Returns false if the previous checkpoint failed.
+	bool checkpoint(const std::string& prefix, unsigned frame);
+
+	// Blocks until the last checkpoint is on disk. Returns false if it failed.
+	bool finishCheckpoint() { return myCheckpointWriter.finish(); }
+
+	// Restores a checkpoint written by a simulator with the same grid. With REPRODUCIBLE sums
+	// (see Reduction.h) stepping from the restored state matches the run that wrote it bit for
+	// bit at any thread count.
+	bool restore(const std::string& prefix, unsigned& frame);
+
+	const ScalarGrid<Real>& smokeDensity() const { return mySmokeDensity; }
+	const LevelSet2D& solidSurface() const { return mySolidSurface; }
 
 	// Rendering tools
 	void drawGrid(Renderer& renderer) const;
@@ -72,6 +103,13 @@ private:
 
 	Real myAmbientTemperature;
 
+	mutable Real myMaxVelocity;
+	mutable bool myMaxVelocityValid;
+
+	std::vector<SolverStats> myStepSolverStats;
+
+	CheckpointWriter myCheckpointWriter;
+
 	Transform myXform;
 };
 
@@ -0,0 +1,178 @@
+#include "FrameExporter.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <utility>
+
+void FrameSnapshot::addSurface(const Mesh2D& surface, const Vec3f& colour, Real lineWidth)
+{
+	mySurfaces.push_back(surface);
+	mySurfaceColours.push_back(colour);
+	mySurfaceWidths.push_back(lineWidth);
+}
+
+void FrameSnapshot::addSurface(const LevelSet2D& surface, const Vec3f& colour, Real lineWidth)
+{
+	addSurface(surface.buildMSMesh(), colour, lineWidth);
+}
+
+void FrameSnapshot::addParticles(const std::vector<Vec2R>& particles, const Vec3f& colour, Real size)
+{
+	myParticles.push_back(particles);
+	myParticleColours.push_back(colour);
+	myParticleSizes.push_back(size);
+}
+
+void FrameSnapshot::addGrid(const std::string& name, const ScalarGrid<Real>& grid,
+							const Vec3f& minColour, const Vec3f& maxColour, Real minVal, Real maxVal)
+{
+	myGridNames.push_back(name);
+	myGrids.push_back(grid);
+	myGridMinColours.push_back(minColour);
+	myGridMaxColours.push_back(maxColour);
+	myGridRanges.push_back(Vec2R(minVal, maxVal));
+}
+
+void FrameSnapshot::draw(Renderer& renderer) const
+{
+	for (unsigned grid = 0; grid < myGrids.size(); ++grid)
+		myGrids[grid].drawColourMap(renderer, myGridMinColours[grid], myGridMaxColours[grid], myGridRanges[grid][0], myGridRanges[grid][1]);
+
+	for (unsigned surface = 0; surface < mySurfaces.size(); ++surface)
+		mySurfaces[surface].drawMesh(renderer, mySurfaceColours[surface], mySurfaceWidths[surface]);
+
+	for (unsigned particles = 0; particles < myParticles.size(); ++particles)
+		renderer.addPoints(myParticles[particles], myParticleColours[particles], myParticleSizes[particles]);
+}
+
+bool FrameSnapshot::writeGrids(const std::string& prefix) const
+{
+	bool success = true;
+	for (unsigned grid = 0; grid < myGrids.size(); ++grid)
+		success &= myGrids[grid].writeSnapshot(prefix + "_" + myGridNames[grid] + ".snap");
+
+	return success;
+}
+
+FrameExporter::FrameExporter(const std::string& outputDirectory, const Vec2ui& imageSize,
+								const Vec2R& screenOrigin, Real screenHeight,
+								unsigned writerCount, unsigned queueCapacity,
+								bool doWriteImages, bool doWriteGrids,
+								ExecutionContext* context)
+	: myOutputDirectory(outputDirectory)
+	, myImageSize(imageSize)
+	, myScreenOrigin(screenOrigin)
+	, myScreenHeight(screenHeight)
+	, myQueueCapacity(std::max(queueCapacity, 1u))
+	, myDoWriteImages(doWriteImages)
+	, myDoWriteGrids(doWriteGrids)
+	, myContext(context)
+	, myActiveWrites(0)
+	, myHaveWritesFailed(false)
+	, myIsStopping(false)
+{
+	writerCount = std::max(writerCount, 1u);
+	for (unsigned writer = 0; writer < writerCount; ++writer)
+		myWriters.emplace_back([this]() { writeFrames(); });
+}
+
+FrameExporter::~FrameExporter()
+{
+	{
+		std::lock_guard<std::mutex> lock(myMutex);
+		myIsStopping = true;
+	}
+
+	myQueueChanged.notify_all();
+
+	for (std::thread& writer : myWriters)
+		writer.join();
+}
+
+void FrameExporter::push(std::unique_ptr<const FrameSnapshot> snapshot)
+{
+	assert(snapshot);
+
+	std::unique_lock<std::mutex> lock(myMutex);
+	myQueueChanged.wait(lock, [&]() { return myQueue.size() < myQueueCapacity; });
+	myQueue.push_back(std::move(snapshot));
+	lock.unlock();
+
+	myQueueChanged.notify_all();
+}
+
+bool FrameExporter::finish()
+{
+	std::unique_lock<std::mutex> lock(myMutex);
+	myWritesFinished.wait(lock, [&]() { return myQueue.empty() && myActiveWrites == 0; });
+
+	bool success = !myHaveWritesFailed;
+	myHaveWritesFailed = false;
+	return success;
+}
+
+std::string FrameExporter::framePrefix(unsigned frame) const
+{
+	std::ostringstream prefix;
+	prefix << myOutputDirectory << "/frame_" << std::setw(4) << std::setfill('0') << frame;
+	return prefix.str();
+}
+
+void FrameExporter::writeFrames()
+{
+	while (true)
+	{
+		std::unique_ptr<const FrameSnapshot> snapshot;
+
+		{
+			std::unique_lock<std::mutex> lock(myMutex);
+			myQueueChanged.wait(lock, [&]() { return !myQueue.empty() || myIsStopping; });
+
+			// The queue is drained before stopping so no pushed frame is lost
+			if (myQueue.empty())
+				return;
+
+			snapshot = std::move(myQueue.front());
+			myQueue.pop_front();
+			++myActiveWrites;
+		}
+
+		// Room in the queue for the simulation thread
+		myQueueChanged.notify_all();
+
+		bool success;
+		if (myContext)
+			success = myContext->execute([&]() { return writeFrame(*snapshot); });
+		else
+			success = writeFrame(*snapshot);
+
+		snapshot.reset();
+
+		{
+			std::lock_guard<std::mutex> lock(myMutex);
+			--myActiveWrites;
+			if (!success) myHaveWritesFailed = true;
+		}
+
+		myWritesFinished.notify_all();
+	}
+}
+
+bool FrameExporter::writeFrame(const FrameSnapshot& snapshot) const
+{
+	std::string prefix = framePrefix(snapshot.frame());
+	bool success = true;
+
+	if (myDoWriteImages)
+	{
+		Renderer renderer(myImageSize, myScreenOrigin, myScreenHeight);
+		snapshot.draw(renderer);
+		success &= renderer.printRasterImage(prefix + ".png");
+	}
+
+	if (myDoWriteGrids)
+		success &= snapshot.writeGrids(prefix);
+
+	return success;
+}
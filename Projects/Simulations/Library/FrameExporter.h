@@ -0,0 +1,145 @@
+#ifndef SIMULATIONS_FRAMEEXPORTER_H
+#define SIMULATIONS_FRAMEEXPORTER_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Common.h"
+#include "ExecutionContext.h"
+#include "LevelSet2D.h"
+#include "Mesh2D.h"
+#include "Renderer.h"
+#include "ScalarGrid.h"
+
+///////////////////////////////////
+//
+// FrameExporter.h/cpp
+// Ryan Goldade 2017
+//
+// Asynchronous frame output. The
+// simulation thread copies what a frame
+// shows (surface meshes, particles and
+// scalar grids) into a FrameSnapshot and
+// pushes it to a FrameExporter. A pool
+// of writer threads draws each snapshot
+// into an offscreen Renderer, rasterizes
+// it to a PNG and optionally writes the
+// grids as binary snapshots, while the
+// simulation moves on to the next frame.
+//
+// The queue is bounded so a simulation
+// that outruns the disk blocks instead
+// of piling up frames in memory. Given
+// the simulation's ExecutionContext, the
+// writers rasterize on its threads rather
+// than on every thread of the machine.
+//
+////////////////////////////////////
+
+class FrameSnapshot
+{
+public:
+	FrameSnapshot(unsigned frame) : myFrame(frame) {}
+
+	unsigned frame() const { return myFrame; }
+
+	void addSurface(const Mesh2D& surface, const Vec3f& colour = Vec3f(0), Real lineWidth = 1);
+
+	// Meshes the level set with marching squares, like LevelSet2D::drawSurface
+	void addSurface(const LevelSet2D& surface, const Vec3f& colour = Vec3f(0), Real lineWidth = 1);
+
+	void addParticles(const std::vector<Vec2R>& particles, const Vec3f& colour = Vec3f(1, 0, 0), Real size = 1);
+
+	// The grid is drawn as a colour map and written as <name>.snap when the exporter writes grids
+	void addGrid(const std::string& name, const ScalarGrid<Real>& grid,
+					const Vec3f& minColour, const Vec3f& maxColour, Real minVal, Real maxVal);
+
+	// Grids are drawn first, then surfaces and particles
+	void draw(Renderer& renderer) const;
+
+	// Writes every grid to <prefix>_<name>.snap. Returns false if any write failed.
+	bool writeGrids(const std::string& prefix) const;
+
+private:
+
+	unsigned myFrame;
+
+	std::vector<Mesh2D> mySurfaces;
+	std::vector<Vec3f> mySurfaceColours;
+	std::vector<Real> mySurfaceWidths;
+
+	std::vector<std::vector<Vec2R>> myParticles;
+	std::vector<Vec3f> myParticleColours;
+	std::vector<Real> myParticleSizes;
+
+	std::vector<std::string> myGridNames;
+	std::vector<ScalarGrid<Real>> myGrids;
+	std::vector<Vec3f> myGridMinColours, myGridMaxColours;
+	std::vector<Vec2R> myGridRanges;
+};
+
+class FrameExporter
+{
+public:
+	// Frames are written to <output directory>/frame_NNNN.png (and frame_NNNN_<grid>.snap) with
+	// the given view. At most queueCapacity snapshots wait to be written at a time. The context,
+	// if given, must outlive the exporter.
+	FrameExporter(const std::string& outputDirectory, const Vec2ui& imageSize,
+					const Vec2R& screenOrigin, Real screenHeight,
+					unsigned writerCount = 2, unsigned queueCapacity = 4,
+					bool doWriteImages = true, bool doWriteGrids = false,
+					ExecutionContext* context = nullptr);
+
+	// Writes out everything still in the queue before the writers stop
+	~FrameExporter();
+
+	FrameExporter(const FrameExporter&) = delete;
+	FrameExporter& operator=(const FrameExporter&) = delete;
+
+	// Hands the snapshot to the writers. Blocks only while the queue is full.
+	void push(std::unique_ptr<const FrameSnapshot> snapshot);
+
+	// Blocks until every pushed frame is written. Returns false if any write failed since
+	// the last call.
+	bool finish();
+
+	std::string framePrefix(unsigned frame) const;
+
+private:
+
+	void writeFrames();
+
+	bool writeFrame(const FrameSnapshot& snapshot) const;
+
+	std::string myOutputDirectory;
+
+	Vec2ui myImageSize;
+	Vec2R myScreenOrigin;
+	Real myScreenHeight;
+
+	unsigned myQueueCapacity;
+	bool myDoWriteImages, myDoWriteGrids;
+
+	ExecutionContext* myContext;
+
+	std::deque<std::unique_ptr<const FrameSnapshot>> myQueue;
+
+	// Frames popped from the queue that are still being written
+	unsigned myActiveWrites;
+
+	bool myHaveWritesFailed;
+	bool myIsStopping;
+
+	std::mutex myMutex;
+	std::condition_variable myQueueChanged;
+	std::condition_variable myWritesFinished;
+
+	std::vector<std::thread> myWriters;
+};
+
+#endif
@@ -0,0 +1,478 @@
+#ifndef SIMULATIONS_MATERIALFACEVALUES_H
+#define SIMULATIONS_MATERIALFACEVALUES_H
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "tbb/tbb.h"
+
+#include "BufferUtilities.h"
+#include "Common.h"
+#include "ScalarGrid.h"
+#include "Transform.h"
+#include "VectorGrid.h"
+
+///////////////////////////////////
+//
+// MaterialFaceValues.h
+// Ryan Goldade 2017
+//
+// A value per material on the faces of a
+// staggered grid, without a grid per
+// material. Every face is owned by one
+// material (the caller keeps the labels)
+// and one shared grid holds the owner's
+// value. A face only carries values for
+// other materials close to an interface,
+// where there are one or two of them, so
+// those go in a side table sorted by face
+// and then material. The owner of a face
+// never has an entry in the table.
+//
+////////////////////////////////////
+
+class MaterialFaceValues
+{
+public:
+	struct Entry
+	{
+		// Face key (see faceKey)
+		unsigned face;
+		unsigned material;
+		Real value;
+
+		bool operator<(const Entry& entry) const
+		{
+			return face < entry.face || (face == entry.face && material < entry.material);
+		}
+	};
+
+	MaterialFaceValues() : myAxisOffset(0), myRowStarts(1, 0) {}
+
+	MaterialFaceValues(const Transform& xform, const Vec2ui& size)
+		: myOwnerValues(xform, size, 0, VectorGridSettings::SampleType::STAGGERED)
+		, myAxisOffset(myOwnerValues.size(0)[0] * myOwnerValues.size(0)[1])
+		, myRowStarts(myOwnerValues.size(0)[0] + myOwnerValues.size(1)[0] + 1, 0)
+	{}
+
+	Real& ownerValue(const Vec2ui& face, unsigned axis) { return myOwnerValues(face, axis); }
+	Real ownerValue(const Vec2ui& face, unsigned axis) const { return myOwnerValues(face, axis); }
+
+	VectorGrid<Real>& ownerValues() { return myOwnerValues; }
+	const VectorGrid<Real>& ownerValues() const { return myOwnerValues; }
+
+	// Entry values can be changed in place but entries must not be added or moved
+	std::vector<Entry>& entries() { return myEntries; }
+	const std::vector<Entry>& entries() const { return myEntries; }
+
+	// Replaces the table. The entries must be sorted and must not hold the owner of a face.
+	void setEntries(const std::vector<Entry>& entries)
+	{
+		assert(std::is_sorted(entries.begin(), entries.end()));
+		myEntries = entries;
+		buildRowStarts();
+	}
+
+	// Orders faces by axis and then in grid storage order
+	unsigned faceKey(const Vec2ui& face, unsigned axis) const
+	{
+		return axis == 0 ? myOwnerValues.grid(0).flatten(face) : myAxisOffset + myOwnerValues.grid(1).flatten(face);
+	}
+
+	void keyToFace(unsigned key, Vec2ui& face, unsigned& axis) const
+	{
+		axis = key < myAxisOffset ? 0 : 1;
+		face = myOwnerValues.grid(axis).unflatten(axis == 0 ? key : key - myAxisOffset);
+	}
+
+	// The entries of a face as a [begin, end) range
+	std::pair<const Entry*, const Entry*> faceEntries(const Vec2ui& face, unsigned axis) const
+	{
+		return keyEntries(faceKey(face, axis));
+	}
+
+	// A material's value at a face. Materials that don't own the face and have no entry are zero.
+	Real value(const VectorGrid<int>& owners, const Vec2ui& face, unsigned axis, unsigned material) const
+	{
+		if (owners(face, axis) == int(material))
+			return myOwnerValues(face, axis);
+
+		return entryValue(faceEntries(face, axis), material);
+	}
+
+	// Bilinearly interpolates a material's values on one axis at a world space point. The result is
+	// the same as a clamped staggered grid that holds the material's values and zero elsewhere.
+	Real interp(const VectorGrid<int>& owners, const Vec2R& worldPoint, unsigned axis, unsigned material) const;
+
+	Vec2R interp(const VectorGrid<int>& owners, const Vec2R& worldPoint, unsigned material) const
+	{
+		return Vec2R(interp(owners, worldPoint, 0, material), interp(owners, worldPoint, 1, material));
+	}
+
+	// Whether a material owns the face or has an entry there
+	bool hasValue(const VectorGrid<int>& owners, const Vec2ui& face, unsigned axis, unsigned material) const
+	{
+		if (owners(face, axis) == int(material))
+			return true;
+
+		auto range = faceEntries(face, axis);
+		return std::any_of(range.first, range.second, [&](const Entry& entry) { return entry.material == material; });
+	}
+
+	// Calls func(material, value) for the owner of a face and every material with an entry there,
+	// in material order. The non-const version passes the values by reference so they can be changed.
+	template<typename Func>
+	void forEachMaterial(const VectorGrid<int>& owners, const Vec2ui& face, unsigned axis, const Func& func) const
+	{
+		forEachMaterial(*this, owners, face, axis, func);
+	}
+
+	template<typename Func>
+	void forEachMaterial(const VectorGrid<int>& owners, const Vec2ui& face, unsigned axis, const Func& func)
+	{
+		forEachMaterial(*this, owners, face, axis, func);
+	}
+
+	// Sets a material's value at a face, adding an entry if needed. This shifts the table so it's
+	// only meant for the odd face and it's not thread safe.
+	void setValue(const VectorGrid<int>& owners, const Vec2ui& face, unsigned axis, unsigned material, Real value)
+	{
+		if (owners(face, axis) == int(material))
+		{
+			myOwnerValues(face, axis) = value;
+			return;
+		}
+
+		Entry entry{ faceKey(face, axis), material, value };
+		auto location = std::lower_bound(myEntries.begin(), myEntries.end(), entry);
+
+		if (location != myEntries.end() && location->face == entry.face && location->material == material)
+			location->value = value;
+		else
+		{
+			myEntries.insert(location, entry);
+
+			for (unsigned row = keyRow(entry.face) + 1; row < myRowStarts.size(); ++row)
+				++myRowStarts[row];
+		}
+	}
+
+	// Writes one material's values into field and zero everywhere else
+	void scatter(const VectorGrid<int>& owners, unsigned material, VectorGrid<Real>& field) const;
+
+	// Gathering rebuilds the table one material at a time from a field of that material's values.
+	// The owned faces are written straight into the shared grid. That's safe between scatters of the
+	// remaining materials because each material only touches the faces it owns. The entries taken
+	// from the fields only replace the table in finishGather.
+	void beginGather() { myGatheredEntries.clear(); }
+
+	// A face that the material doesn't own gets an entry if keep(face, axis, value) is true
+	template<typename Keep>
+	void gather(const VectorGrid<int>& owners, unsigned material, const VectorGrid<Real>& field, const Keep& keep);
+
+	void finishGather()
+	{
+		tbb::parallel_sort(myGatheredEntries.begin(), myGatheredEntries.end());
+		std::swap(myEntries, myGatheredEntries);
+		buildRowStarts();
+	}
+
+	// Replaces the values with new ones on the faces that source holds, under the same owners.
+	// value(face, axis, material) gives the new value for the owner of every face and for every
+	// entry in source. An entry is only kept if keep(face, axis, value) is true. Unlike gather this
+	// only visits the grid once, however many materials there are.
+	template<typename Value, typename Keep>
+	void assign(const VectorGrid<int>& owners, const MaterialFaceValues& source, const Value& value, const Keep& keep);
+
+	// Moves values between the shared grid and the table after the face owners change.
+	// isSupported(face, axis, material) tells whether a material that doesn't own a face keeps
+	// a value there. Entries of unsupported materials are dropped and supported materials that
+	// had no value get a zero entry.
+	template<typename Support>
+	void relabel(const VectorGrid<int>& oldOwners, const VectorGrid<int>& newOwners, unsigned materialCount, const Support& isSupported);
+
+	// Bytes held by the shared grid and the table, including storage kept for later steps
+	std::size_t storageBytes() const
+	{
+		std::size_t faceCount = myOwnerValues.size(0)[0] * myOwnerValues.size(0)[1] +
+								myOwnerValues.size(1)[0] * myOwnerValues.size(1)[1];
+
+		return faceCount * sizeof(Real) + (myEntries.capacity() + myGatheredEntries.capacity()) * sizeof(Entry) +
+				myRowStarts.capacity() * sizeof(unsigned);
+	}
+
+private:
+
+	// Faces are keyed row by row, so a row of either axis is a contiguous run of keys
+	unsigned keyRow(unsigned key) const
+	{
+		return key < myAxisOffset ? key / myOwnerValues.size(0)[1] : myOwnerValues.size(0)[0] + (key - myAxisOffset) / myOwnerValues.size(1)[1];
+	}
+
+	void buildRowStarts()
+	{
+		// Count the entries in each row and then turn the counts into offsets
+		std::fill(myRowStarts.begin(), myRowStarts.end(), 0);
+
+		for (const Entry& entry : myEntries)
+			++myRowStarts[keyRow(entry.face) + 1];
+
+		for (std::size_t row = 1; row < myRowStarts.size(); ++row)
+			myRowStarts[row] += myRowStarts[row - 1];
+	}
+
+	// Only the entries of the face's row are searched
+	std::pair<const Entry*, const Entry*> keyEntries(unsigned key) const
+	{
+		auto compareFace = [](const Entry& entry, unsigned key) { return entry.face < key; };
+
+		unsigned row = keyRow(key);
+		const Entry* begin = myEntries.data() + myRowStarts[row];
+		const Entry* end = myEntries.data() + myRowStarts[row + 1];
+
+		const Entry* first = std::lower_bound(begin, end, key, compareFace);
+
+		const Entry* last = first;
+		while (last != end && last->face == key) ++last;
+
+		return std::make_pair(first, last);
+	}
+
+	template<typename Values, typename Func>
+	static void forEachMaterial(Values& values, const VectorGrid<int>& owners, const Vec2ui& face, unsigned axis, const Func& func)
+	{
+		unsigned key = values.faceKey(face, axis);
+		auto range = values.keyEntries(key);
+
+		// Entries of a face are contiguous so the const range can be turned back into the table's own
+		auto entry = values.myEntries.begin() + (range.first - values.myEntries.data());
+		auto end = entry + (range.second - range.first);
+
+		unsigned owner = unsigned(owners(face, axis));
+
+		for (; entry != end && entry->material < owner; ++entry)
+			func(entry->material, entry->value);
+
+		func(owner, values.myOwnerValues(face, axis));
+
+		for (; entry != end; ++entry)
+			func(entry->material, entry->value);
+	}
+
+	static Real entryValue(const std::pair<const Entry*, const Entry*>& range, unsigned material)
+	{
+		for (const Entry* entry = range.first; entry != range.second; ++entry)
+		{
+			if (entry->material == material)
+				return entry->value;
+		}
+
+		return 0;
+	}
+
+	VectorGrid<Real> myOwnerValues;
+	unsigned myAxisOffset;
+
+	std::vector<Entry> myEntries;
+
+	// Where each row of faces starts in the table, in key order, so a lookup only searches its row
+	std::vector<unsigned> myRowStarts;
+
+	// Scratch for rebuilding the table, kept so the storage carries over between steps
+	std::vector<Entry> myGatheredEntries;
+	tbb::enumerable_thread_specific<std::vector<Entry>> myLocalEntries;
+};
+
+inline void MaterialFaceValues::scatter(const VectorGrid<int>& owners, unsigned material, VectorGrid<Real>& field) const
+{
+	assert(field.size(0) == myOwnerValues.size(0) && field.size(1) == myOwnerValues.size(1));
+
+	for (unsigned axis : {0, 1})
+	{
+		Vec2ui size = field.size(axis);
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < size[1]; ++j)
+				{
+					Vec2ui face(i, j);
+					field(face, axis) = owners(face, axis) == int(material) ? myOwnerValues(face, axis) : 0;
+				}
+		});
+	}
+
+	tbb::parallel_for(tbb::blocked_range<std::size_t>(0, myEntries.size()), [&](const tbb::blocked_range<std::size_t> &range)
+	{
+		for (std::size_t entryIndex = range.begin(); entryIndex != range.end(); ++entryIndex)
+		{
+			const Entry& entry = myEntries[entryIndex];
+			if (entry.material != material) continue;
+
+			Vec2ui face; unsigned axis;
+			keyToFace(entry.face, face, axis);
+			field(face, axis) = entry.value;
+		}
+	});
+}
+
+template<typename Keep>
+void MaterialFaceValues::gather(const VectorGrid<int>& owners, unsigned material, const VectorGrid<Real>& field, const Keep& keep)
+{
+	assert(field.size(0) == myOwnerValues.size(0) && field.size(1) == myOwnerValues.size(1));
+
+	for (unsigned axis : {0, 1})
+	{
+		Vec2ui size = field.size(axis);
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			std::vector<Entry>& localEntries = myLocalEntries.local();
+
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < size[1]; ++j)
+				{
+					Vec2ui face(i, j);
+					Real value = field(face, axis);
+
+					if (owners(face, axis) == int(material))
+						myOwnerValues(face, axis) = value;
+					else if (keep(face, axis, value))
+						localEntries.push_back(Entry{ faceKey(face, axis), material, value });
+				}
+		});
+	}
+
+	gatherLocalLists(myLocalEntries, myGatheredEntries);
+}
+
+inline Real MaterialFaceValues::interp(const VectorGrid<int>& owners, const Vec2R& worldPoint, unsigned axis, unsigned material) const
+{
+	const ScalarGrid<Real>& grid = myOwnerValues.grid(axis);
+	assert(grid.borderType() == ScalarGridSettings::BorderType::CLAMP);
+
+	// Follows ScalarGrid::interp and interpLocal step for step so the two match exactly
+	Vec2ui size = grid.size();
+	Vec2R indexPoint = grid.worldToIndex(worldPoint);
+
+	indexPoint[0] = (indexPoint[0] < 0.) ? 0. : ((indexPoint[0] > Real(size[0] - 1)) ? Real(size[0] - 1) : indexPoint[0]);
+	indexPoint[1] = (indexPoint[1] < 0.) ? 0. : ((indexPoint[1] > Real(size[1] - 1)) ? Real(size[1] - 1) : indexPoint[1]);
+
+	Vec2R floorPoint = floor(indexPoint);
+
+	if (floorPoint[0] == Real(size[0] - 1)) --floorPoint[0];
+	if (floorPoint[1] == Real(size[1] - 1)) --floorPoint[1];
+
+	Vec2R dx = indexPoint - Vec2R(floorPoint);
+	dx = clamp(dx, Vec2R(0), Vec2R(1));
+
+	Real v00 = value(owners, Vec2ui(floorPoint[0], floorPoint[1]), axis, material);
+	Real v10 = value(owners, Vec2ui(floorPoint[0] + 1, floorPoint[1]), axis, material);
+
+	Real v01 = value(owners, Vec2ui(floorPoint[0], floorPoint[1] + 1), axis, material);
+	Real v11 = value(owners, Vec2ui(floorPoint[0] + 1, floorPoint[1] + 1), axis, material);
+
+	return Util::bilerp(v00, v10, v01, v11, dx[0], dx[1]);
+}
+
+template<typename Value, typename Keep>
+void MaterialFaceValues::assign(const VectorGrid<int>& owners, const MaterialFaceValues& source, const Value& value, const Keep& keep)
+{
+	assert(&source != this && source.myOwnerValues.isMatched(myOwnerValues));
+
+	for (unsigned axis : {0, 1})
+	{
+		Vec2ui size = myOwnerValues.size(axis);
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < size[1]; ++j)
+				{
+					Vec2ui face(i, j);
+					myOwnerValues(face, axis) = value(face, axis, unsigned(owners(face, axis)));
+				}
+		});
+	}
+
+	// Each source entry is updated in its own slot so the table stays sorted. The ones that
+	// aren't kept are squeezed out afterwards.
+	const std::vector<Entry>& sourceEntries = source.myEntries;
+
+	reserveWithHeadroom(myGatheredEntries, sourceEntries.size());
+	myGatheredEntries.resize(sourceEntries.size());
+
+	tbb::parallel_for(tbb::blocked_range<std::size_t>(0, sourceEntries.size()), [&](const tbb::blocked_range<std::size_t> &range)
+	{
+		for (std::size_t entryIndex = range.begin(); entryIndex != range.end(); ++entryIndex)
+		{
+			const Entry& entry = sourceEntries[entryIndex];
+
+			Vec2ui face; unsigned axis;
+			keyToFace(entry.face, face, axis);
+
+			assert(owners(face, axis) != int(entry.material));
+			myGatheredEntries[entryIndex] = Entry{ entry.face, entry.material, value(face, axis, entry.material) };
+		}
+	});
+
+	auto isDropped = [&](const Entry& entry)
+	{
+		Vec2ui face; unsigned axis;
+		keyToFace(entry.face, face, axis);
+		return !keep(face, axis, entry.value);
+	};
+
+	myGatheredEntries.erase(std::remove_if(myGatheredEntries.begin(), myGatheredEntries.end(), isDropped), myGatheredEntries.end());
+	std::swap(myEntries, myGatheredEntries);
+	buildRowStarts();
+}
+
+template<typename Support>
+void MaterialFaceValues::relabel(const VectorGrid<int>& oldOwners, const VectorGrid<int>& newOwners, unsigned materialCount, const Support& isSupported)
+{
+	myGatheredEntries.clear();
+
+	for (unsigned axis : {0, 1})
+	{
+		Vec2ui size = myOwnerValues.size(axis);
+
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			std::vector<Entry>& localEntries = myLocalEntries.local();
+
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < size[1]; ++j)
+				{
+					Vec2ui face(i, j);
+					unsigned key = faceKey(face, axis);
+
+					// Each face is only visited once so its owner value can be read and replaced here
+					int oldOwner = oldOwners(face, axis);
+					int newOwner = newOwners(face, axis);
+					Real oldOwnerValue = myOwnerValues(face, axis);
+
+					auto oldEntries = keyEntries(key);
+
+					auto oldValue = [&](unsigned material)
+					{
+						return int(material) == oldOwner ? oldOwnerValue : entryValue(oldEntries, material);
+					};
+
+					for (unsigned material = 0; material < materialCount; ++material)
+					{
+						if (int(material) == newOwner)
+							myOwnerValues(face, axis) = oldValue(material);
+						else if (isSupported(face, axis, material))
+							localEntries.push_back(Entry{ key, material, oldValue(material) });
+					}
+				}
+		});
+	}
+
+	gatherLocalLists(myLocalEntries, myGatheredEntries);
+	finishGather();
+}
+
+#endif
@@ -1,18 +1,28 @@
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+#include "tbb/tbb.h"
+
 #include "MultiMaterialLiquid.h"
 
 #include "ComputeWeights.h"
 #include "ExtrapolateField.h"
 #include "MultiMaterialPressureProjection.h"
+#include "Profiler.h"
 #include "Timer.h"
 
 void MultiMaterialLiquid::drawMaterialSurface(Renderer& renderer, unsigned material)
 {
-	myFluidSurfaces[material].drawSurface(renderer, Vec3f(0., 0., 1.0));
+	myFluidSurfaces[material].load(myScratchSurface);
+	myScratchSurface.drawSurface(renderer, Vec3f(0., 0., 1.0));
 }
 
 void MultiMaterialLiquid::drawMaterialVelocity(Renderer& renderer, Real length, unsigned material) const
 {
-	myFluidVelocities[material].drawSamplePointVectors(renderer, Vec3f(0), myFluidVelocities[material].dx() * length);
+	VectorGrid<Real> velocity(myXform, myGridSize, VectorGridSettings::SampleType::STAGGERED);
+	myFluidVelocities.scatter(myFaceMaterials, material, velocity);
+	velocity.drawSamplePointVectors(renderer, Vec3f(0), velocity.dx() * length);
 }
 
 void MultiMaterialLiquid::drawSolidSurface(Renderer &renderer)
@@ -23,16 +33,31 @@ void MultiMaterialLiquid::drawSolidSurface(Renderer &renderer)
 template<typename ForceSampler>
 void MultiMaterialLiquid::addForce(const Real dt, const unsigned material, const ForceSampler& force)
 {
+	myMaxVelocityValid = false;
+
 	for (auto axis : { 0,1 })
     {
-		Vec2ui size = myFluidVelocities[material].size(axis);
+		Vec2ui size = myFaceMaterials.size(axis);
 
 		forEachVoxelRange(Vec2ui(0), size, [&](const Vec2ui& face)
 		{
-			Vec2R worldPosition = myFluidVelocities[material].indexToWorld(Vec2R(face), axis);
-			myFluidVelocities[material](face, axis) += dt * force(worldPosition, axis);
+			if (myFaceMaterials(face, axis) != int(material)) return;
+
+			Vec2R worldPosition = myFaceMaterials.indexToWorld(Vec2R(face), axis);
+			myFluidVelocities.ownerValue(face, axis) += dt * force(worldPosition, axis);
 		});
     }
+
+	for (MaterialFaceValues::Entry& entry : myFluidVelocities.entries())
+	{
+		if (entry.material != material) continue;
+
+		Vec2ui face; unsigned axis;
+		myFluidVelocities.keyToFace(entry.face, face, axis);
+
+		Vec2R worldPosition = myFaceMaterials.indexToWorld(Vec2R(face), axis);
+		entry.value += dt * force(worldPosition, axis);
+	}
 }
 
 void MultiMaterialLiquid::addForce(const Real dt, const unsigned material, const Vec2R& force)
@@ -40,70 +65,224 @@ void MultiMaterialLiquid::addForce(const Real dt, const unsigned material, const
     addForce(dt, material, [&](Vec2R, unsigned axis) { return force[axis]; });
 }
 
-void MultiMaterialLiquid::advectFluidVelocities(Real dt, IntegrationOrder integrator, InterpolationOrder interpolator)
+void MultiMaterialLiquid::setMaterial(const LevelSet2D &surface, const VectorGrid<Real> &velocity,
+										const Real density, const unsigned material)
 {
-    VectorGrid<Real> localVelocity;
-    for (unsigned material = 0; material < myMaterialCount; ++material)
-    {
-		auto velocityFunc = [&](Real, const Vec2R& point)
-		{
-			return myFluidVelocities[material].interp(point);
-		};
+	setMaterial(surface, density, material);
 
-		localVelocity = VectorGrid<Real>(myFluidVelocities[material].xform(), myFluidVelocities[material].gridSize(), VectorGridSettings::SampleType::STAGGERED);
+	assert(velocity.isMatched(myFluidVelocities.ownerValues()));
+	myMaxVelocityValid = false;
 
-		for (auto axis : { 0,1 })
+	for (auto axis : { 0,1 })
+	{
+		forEachVoxelRange(Vec2ui(0), velocity.size(axis), [&](const Vec2ui& face)
 		{
-			AdvectField<ScalarGrid<Real>> advector(myFluidVelocities[material].grid(axis));
-			advector.advectField(dt, localVelocity.grid(axis), velocityFunc, integrator, interpolator);
-		}
+			if (myFaceMaterials(face, axis) == int(material))
+				myFluidVelocities.ownerValue(face, axis) = velocity(face, axis);
+		});
+	}
 
-		std::swap(myFluidVelocities[material], localVelocity);
-    }
+	for (MaterialFaceValues::Entry& entry : myFluidVelocities.entries())
+	{
+		if (entry.material != material) continue;
+
+		Vec2ui face; unsigned axis;
+		myFluidVelocities.keyToFace(entry.face, face, axis);
+		entry.value = velocity(face, axis);
+	}
 }
 
-void MultiMaterialLiquid::advectFluidSurfaces(Real dt, IntegrationOrder integrator)
+void MultiMaterialLiquid::advectFluidVelocities(Real dt, IntegrationOrder integrator)
 {
-    for (unsigned material = 0; material < myMaterialCount; ++material)
-    {
+	// A face is traced back through the extrapolated velocity of the material it's advected for.
+	// That matches advecting a dense grid of the material's velocity, without visiting every
+	// face for every material.
+	auto advectFace = [&](const Vec2ui& face, unsigned axis, unsigned material)
+	{
 		auto velocityFunc = [&](Real, const Vec2R& point)
 		{
-			return myFluidVelocities[material].interp(point);
+			return myExtrapolatedVelocities.interp(myFaceMaterials, point, material);
 		};
 
-		Mesh2D localMesh = myFluidSurfaces[material].buildMSMesh();
-		localMesh.advect(dt, velocityFunc, integrator);
-		myFluidSurfaces[material].init(localMesh, false);
-    }
+		Vec2R point = Integrator(-dt, myFaceMaterials.indexToWorld(Vec2R(face), axis), velocityFunc, integrator);
+		return myExtrapolatedVelocities.interp(myFaceMaterials, point, axis, material);
+	};
 
-	// Fix possible overlaps between the materials.
-	forEachVoxelRange(Vec2ui(0), myGridSize, [&](const Vec2ui& cell)
+	// Faces the material doesn't own keep every non-zero velocity until the surfaces have
+	// settled and relabelFaces trims them to the material's support
+	myFluidVelocities.assign(myFaceMaterials, myExtrapolatedVelocities, advectFace, [](const Vec2ui&, unsigned, Real value) { return value != 0; });
+}
+
+void MultiMaterialLiquid::advectFluidSurface(Real dt, unsigned material, IntegrationOrder integrator)
+{
+	auto velocityFunc = [&](Real, const Vec2R& point)
 	{
-		Real firstMin = std::min(myFluidSurfaces[0](cell), mySolidSurface(cell));
-		Real secondMin = std::max(myFluidSurfaces[0](cell), mySolidSurface(cell));
+		return myScratchVelocity.interp(point);
+	};
 
-		if (myMaterialCount > 1)
-		{
-			for (unsigned material = 1; material < myMaterialCount; ++material)
+	myFluidSurfaces[material].load(myScratchSurface);
+
+	Mesh2D localMesh = myScratchSurface.buildMSMesh();
+	localMesh.advect(dt, velocityFunc, integrator);
+	myScratchSurface.init(localMesh, false, mySurfaceBuffers);
+
+	myFluidSurfaces[material].store(myScratchSurface);
+}
+
+void MultiMaterialLiquid::resolveSurfaceOverlaps()
+{
+	// Fix possible overlaps between the materials. Every shift is found before any surface changes.
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, myGridSize[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < myGridSize[1]; ++j)
 			{
-				Real localMin = myFluidSurfaces[material](cell);
-				if (localMin < firstMin)
+				Vec2ui cell(i, j);
+
+				Real firstMin = std::min(myFluidSurfaces[0](cell), mySolidSurface(cell));
+				Real secondMin = std::max(myFluidSurfaces[0](cell), mySolidSurface(cell));
+
+				for (unsigned material = 1; material < myMaterialCount; ++material)
 				{
-					secondMin = firstMin;
-					firstMin = localMin;
+					Real localMin = myFluidSurfaces[material](cell);
+					if (localMin < firstMin)
+					{
+						secondMin = firstMin;
+						firstMin = localMin;
+					}
+					else secondMin = std::min(localMin, secondMin);
 				}
-				else secondMin = std::min(localMin, secondMin);
+
+				myOverlapShift(cell) = .5 * (firstMin + secondMin);
 			}
-		}
+	});
+
+	for (unsigned material = 0; material < myMaterialCount; ++material)
+	{
+		myFluidSurfaces[material].load(myScratchSurface);
+
+		forEachVoxelRange(Vec2ui(0), myGridSize, [&](const Vec2ui& cell)
+		{
+			myScratchSurface(cell) -= myOverlapShift(cell);
+		});
+
+		myScratchSurface.reinitMesh(mySurfaceBuffers);
+		myFluidSurfaces[material].store(myScratchSurface);
+	}
 
-		Real avgSDF = .5 * (firstMin + secondMin);
+	relabelFaces();
+}
+
+void MultiMaterialLiquid::computeFaceMaterials(VectorGrid<int>& faceMaterials) const
+{
+	for (auto axis : { 0,1 })
+	{
+		Vec2ui size = faceMaterials.size(axis);
 
-		for (unsigned material = 0; material < myMaterialCount; ++material)
-			myFluidSurfaces[material](cell) -= avgSDF;
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < size[1]; ++j)
+				{
+					Vec2ui face(i, j);
+					Vec2R worldPosition = faceMaterials.indexToWorld(Vec2R(face), axis);
+
+					int faceMaterial = 0;
+					Real minDistance = myFluidSurfaces[0].interp(worldPosition);
+
+					for (unsigned material = 1; material < myMaterialCount; ++material)
+					{
+						Real distance = myFluidSurfaces[material].interp(worldPosition);
+						if (distance < minDistance)
+						{
+							minDistance = distance;
+							faceMaterial = material;
+						}
+					}
+
+					faceMaterials(face, axis) = faceMaterial;
+				}
+		});
+	}
+}
+
+void MultiMaterialLiquid::relabelFaces()
+{
+	computeFaceMaterials(myScratchFaceMaterials);
+
+	Real supportDistance = VELOCITYSUPPORT * myXform.dx();
+
+	myFluidVelocities.relabel(myFaceMaterials, myScratchFaceMaterials, myMaterialCount,
+		[&](const Vec2ui& face, unsigned axis, unsigned material)
+	{
+		return myFluidSurfaces[material].interp(myFaceMaterials.indexToWorld(Vec2R(face), axis)) < supportDistance;
 	});
 
+	std::swap(myFaceMaterials, myScratchFaceMaterials);
+}
+
+Real MultiMaterialLiquid::computeMaxVelocityMagnitude() const
+{
+	// A material's speed in a cell is averaged over the cell's faces in the same order as
+	// VectorGrid::maxMagnitude, with zero on faces where the material has no value. Only the
+	// materials with a value on one of the faces are checked, each once per cell.
+	const unsigned MAXCELLMATERIALS = 8;
+
+	Real maxMagnitude2 = tbb::parallel_reduce(tbb::blocked_range<unsigned>(0, myGridSize[0]), std::numeric_limits<Real>::min(),
+		[&](const tbb::blocked_range<unsigned>& range, Real max) -> Real
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < myGridSize[1]; ++j)
+			{
+				Vec2ui cell(i, j);
+
+				unsigned cellMaterials[MAXCELLMATERIALS];
+				unsigned cellMaterialCount = 0;
+
+				auto checkMaterial = [&](unsigned material, Real)
+				{
+					if (std::find(cellMaterials, cellMaterials + cellMaterialCount, material) != cellMaterials + cellMaterialCount)
+						return;
+
+					// Past the limit a material may be checked twice, which doesn't change the max
+					if (cellMaterialCount < MAXCELLMATERIALS)
+						cellMaterials[cellMaterialCount++] = material;
+
+					Vec2R avgVec(0);
+
+					for (unsigned axis : {0, 1})
+						for (unsigned direction : {0, 1})
+						{
+							Vec2ui face = cellToFace(cell, axis, direction);
+							avgVec[axis] += .5 * myFluidVelocities.value(myFaceMaterials, face, axis, material);
+						}
+
+					Real tempmag2 = mag2(avgVec);
+					if (max < tempmag2) max = tempmag2;
+				};
+
+				for (unsigned axis : {0, 1})
+					for (unsigned direction : {0, 1})
+						myFluidVelocities.forEachMaterial(myFaceMaterials, cellToFace(cell, axis, direction), axis, checkMaterial);
+			}
+
+		return max;
+	},
+		[](Real a, Real b) -> Real { return std::max(a, b); });
+
+	return sqrt(maxMagnitude2);
+}
+
+std::size_t MultiMaterialLiquid::materialStorageBytes() const
+{
+	std::size_t bytes = myFluidVelocities.storageBytes();
+	bytes += myFaceMaterials.size(0)[0] * myFaceMaterials.size(0)[1] * sizeof(int);
+	bytes += myFaceMaterials.size(1)[0] * myFaceMaterials.size(1)[1] * sizeof(int);
+
 	for (unsigned material = 0; material < myMaterialCount; ++material)
-		myFluidSurfaces[material].reinitMesh();
+		bytes += myFluidSurfaces[material].storageBytes() + myExtrapolatedSurfaces[material].storageBytes();
+
+	return bytes + myMaterialWeights.storageBytes() + myExtrapolatedVelocities.storageBytes();
 }
 
 void MultiMaterialLiquid::setSolidSurface(const LevelSet2D &solidSurface)
@@ -118,166 +297,359 @@ void MultiMaterialLiquid::setSolidSurface(const LevelSet2D &solidSurface)
 
 void MultiMaterialLiquid::runTimestep(Real dt, Renderer& renderer)
 {
+	PROFILE_ZONE("MultiMaterialLiquid::runTimestep");
+
 	std::cout << "\nStarting simulation loop\n" << std::endl;
 
+	myStepSolverStats.clear();
+
 	Timer simTimer;
 
 	//
-	// Extrapolate materials into solids
+	// Extrapolate materials into solids and compute their cut-cell weights, which are the fraction
+	// of each edge inside the material. The materials take turns in the scratch surface.
 	//
 
-	std::vector<LevelSet2D> extrapolatedSurfaces(myMaterialCount);
-
-	for (unsigned material = 0; material < myMaterialCount; ++material)
-		extrapolatedSurfaces[material] = myFluidSurfaces[material];
+	VectorGrid<Real> solidCutCellWeights = computeCutCellWeights(mySolidSurface);
 
 	Real dx = mySolidSurface.dx();
-	forEachVoxelRange(Vec2ui(0), myGridSize, [&](const Vec2ui& cell)
+
+	myMaterialWeights.beginGather();
+
+	for (unsigned material = 0; material < myMaterialCount; ++material)
 	{
-		for (unsigned material = 0; material < myMaterialCount; ++material)
+		myFluidSurfaces[material].load(myScratchSurface);
+
+		forEachVoxelRange(Vec2ui(0), myGridSize, [&](const Vec2ui& cell)
 		{
 			if (mySolidSurface(cell) <= 0. ||
 				(mySolidSurface(cell) <= dx && myFluidSurfaces[material](cell) <= 0))
-				extrapolatedSurfaces[material](cell) -= dx;
-		}
-	});
+				myScratchSurface(cell) -= dx;
+		});
 
-	for (unsigned material = 0; material < myMaterialCount; ++material)
-		extrapolatedSurfaces[material].reinitMesh();
+		myScratchSurface.reinitMesh(mySurfaceBuffers);
+		myExtrapolatedSurfaces[material].store(myScratchSurface);
 
-	//for (unsigned material = 0; material < myMaterialCount; ++material)
-	//	extrapolatedSurfaces[material].drawSurface(renderer);
+		computeCutCellWeights(myScratchSurface, myScratchVelocity);
+		myMaterialWeights.gather(myFaceMaterials, material, myScratchVelocity, [](const Vec2ui&, unsigned, Real weight) { return weight > 0; });
+	}
 
-	std::cout << "  Extrapolate into solids: " << simTimer.stop() << "s" << std::endl;
-	
-	simTimer.reset();
+	myMaterialWeights.finishGather();
 
 	//
-	// Compute cut-cell weights for each material. Compute fraction of
-	// edge inside the material. After, normalize the weights to sum to
-	// one.
+	// Normalize the weights to sum to one, removing the solid boundary contribution first. Each face
+	// only touches its own weights so the faces are spread across threads. A face that can't be fixed
+	// is flagged and reported once the threads are done.
 	//
 
-	VectorGrid<Real> solidCutCellWeights = computeCutCellWeights(mySolidSurface);
+	std::atomic<bool> hasZeroWeightFaces(false);
 
-	std::vector<VectorGrid<Real>> materialCutCellWeights(myMaterialCount);
+	// Weights set on face-aligned surfaces. They may need new side table entries so they're set after the threads are done.
+	tbb::enumerable_thread_specific<std::vector<MaterialFaceValues::Entry>> parallelFaceAlignedWeights;
 
-	for (unsigned material = 0; material < myMaterialCount; ++material)
-		materialCutCellWeights[material] = computeCutCellWeights(extrapolatedSurfaces[material]);
-
-	// Now normalize the weights, removing the solid boundary contribution first.
 	for (auto axis : { 0,1 })
 	{
-		forEachVoxelRange(Vec2ui(0), myFluidVelocities[0].size(axis), [&](const Vec2ui& face)
-		{
-			Real weight = 1;
-			weight -= solidCutCellWeights(face, axis);
-			weight = Util::clamp(weight, 0., weight);
-
-			if (weight > 0)
-			{
-				Real accumulatedWeight = 0;
-				for (unsigned material = 0; material < myMaterialCount; ++material)
-					accumulatedWeight += materialCutCellWeights[material](face, axis);
+		Vec2ui size = myFaceMaterials.size(axis);
 
-				if (accumulatedWeight > 0)
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < size[1]; ++j)
 				{
-					weight /= accumulatedWeight;
-
-					for (unsigned material = 0; material < myMaterialCount; ++material)
-						materialCutCellWeights[material](face, axis) *= weight;
+					Vec2ui face(i, j);
+
+					Real weight = 1;
+					weight -= solidCutCellWeights(face, axis);
+					weight = Util::clamp(weight, 0., weight);
+
+					if (weight > 0)
+					{
+						Real accumulatedWeight = 0;
+						myMaterialWeights.forEachMaterial(myFaceMaterials, face, axis, [&](unsigned, Real materialWeight)
+						{
+							accumulatedWeight += materialWeight;
+						});
+
+						if (accumulatedWeight > 0)
+						{
+							weight /= accumulatedWeight;
+
+							myMaterialWeights.forEachMaterial(myFaceMaterials, face, axis, [&](unsigned, Real& materialWeight)
+							{
+								materialWeight *= weight;
+							});
+						}
+					}
+					else
+					{
+						myMaterialWeights.forEachMaterial(myFaceMaterials, face, axis, [&](unsigned, Real& materialWeight)
+						{
+							materialWeight = 0;
+						});
+					}
+
+					// Debug check
+					Real totalWeight = solidCutCellWeights(face, axis);
+
+					myMaterialWeights.forEachMaterial(myFaceMaterials, face, axis, [&](unsigned, Real materialWeight)
+					{
+						totalWeight += materialWeight;
+					});
+
+					if (!Util::isEqual(totalWeight, 1.))
+					{
+						// If there is a zero total weight it is likely due to a fluid-fluid boundary
+						// falling exactly across a grid face. There should never be a zero weight
+						// along a fluid-solid boundary.
+
+						// Only the first face-aligned surface is kept so a count is all that's needed for the rest
+						unsigned faceAlignedSurfaceCount = 0;
+						unsigned firstFaceAlignedSurface = 0;
+
+						unsigned otherAxis = (axis + 1) % 2;
+
+						Vec2R offset(0); offset[otherAxis] = .5;
+
+						for (unsigned material = 0; material < myMaterialCount; ++material)
+						{
+							Vec2R pos0 = myFaceMaterials.indexToWorld(Vec2R(face) - offset, axis);
+							Vec2R pos1 = myFaceMaterials.indexToWorld(Vec2R(face) + offset, axis);
+
+							Real weight = lengthFraction(myFluidSurfaces[material].interp(pos0), myFluidSurfaces[material].interp(pos1));
+
+							if (weight == 0)
+							{
+								if (faceAlignedSurfaceCount == 0)
+									firstFaceAlignedSurface = material;
+								++faceAlignedSurfaceCount;
+							}
+						}
+
+						if (faceAlignedSurfaceCount > 1)
+							parallelFaceAlignedWeights.local().push_back(MaterialFaceValues::Entry{ myMaterialWeights.faceKey(face, axis), firstFaceAlignedSurface, 1. });
+						else
+							hasZeroWeightFaces = true;
+					}
 				}
-			}
-			else
-			{
-				for (unsigned material = 0; material < myMaterialCount; ++material)
-					materialCutCellWeights[material](face, axis) = 0;
-			}
-
-			// Debug check
-			Real totalWeight = solidCutCellWeights(face, axis);
-
-			for (unsigned material = 0; material < myMaterialCount; ++material)
-				totalWeight += materialCutCellWeights[material](face, axis);
-
-			if (!Util::isEqual(totalWeight, 1.))
-			{
-				// If there is a zero total weight it is likely due to a fluid-fluid boundary
-				// falling exactly across a grid face. There should never be a zero weight
-				// along a fluid-solid boundary.
+		});
+	}
 
-				std::vector<unsigned> faceAlignedSurfaces;
+	for (const std::vector<MaterialFaceValues::Entry>& faceAlignedWeights : parallelFaceAlignedWeights)
+		for (const MaterialFaceValues::Entry& entry : faceAlignedWeights)
+		{
+			Vec2ui face; unsigned axis;
+			myMaterialWeights.keyToFace(entry.face, face, axis);
+			myMaterialWeights.setValue(myFaceMaterials, face, axis, entry.material, entry.value);
+		}
 
-				unsigned otherAxis = (axis + 1) % 2;
+	if (hasZeroWeightFaces)
+	{
+		std::cout << "Zero weight problems!!" << std::endl;
+		assert(false);
+	}
 
-				Vec2R offset(0); offset[otherAxis] = .5;
+	// Every material with a weight on a face needs its velocity there. That holds as long as
+	// VELOCITYSUPPORT covers every face a material can reach.
+	std::atomic<bool> hasUnsupportedWeights(false);
 
-				for (unsigned material = 0; material < myMaterialCount; ++material)
-				{
-					Vec2R pos0 = materialCutCellWeights[material].indexToWorld(Vec2R(face) - offset, axis);
-					Vec2R pos1 = materialCutCellWeights[material].indexToWorld(Vec2R(face) + offset, axis);
+	const std::vector<MaterialFaceValues::Entry>& weightEntries = myMaterialWeights.entries();
 
-					Real weight = lengthFraction(myFluidSurfaces[material].interp(pos0), myFluidSurfaces[material].interp(pos1));
+	tbb::parallel_for(tbb::blocked_range<std::size_t>(0, weightEntries.size()), [&](const tbb::blocked_range<std::size_t> &range)
+	{
+		for (std::size_t entryIndex = range.begin(); entryIndex != range.end(); ++entryIndex)
+		{
+			const MaterialFaceValues::Entry& entry = weightEntries[entryIndex];
+			if (!(entry.value > 0)) continue;
 
-					if (weight == 0)
-						faceAlignedSurfaces.push_back(material);
-				}
+			Vec2ui face; unsigned axis;
+			myMaterialWeights.keyToFace(entry.face, face, axis);
 
-				if (!(faceAlignedSurfaces.size() > 1))
-				{
-					std::cout << "Zero weight problems!!" << std::endl;
-					exit(-1);
-				}
-				assert(faceAlignedSurfaces.size() > 1);
+			if (!myFluidVelocities.hasValue(myFaceMaterials, face, axis, entry.material))
+				hasUnsupportedWeights = true;
+		}
+	});
 
-				materialCutCellWeights[faceAlignedSurfaces[0]](face, axis) = 1.;
-			}
-		});
+	if (hasUnsupportedWeights)
+	{
+		std::cout << "Material weights outside of the velocity support!!" << std::endl;
+		assert(false);
 	}
 
-	std::cout << "  Compute cut-cell weights: " << simTimer.stop() << "s" << std::endl;
+	std::cout << "  Extrapolate into solids and compute cut-cell weights: " << simTimer.stop() << "s" << std::endl;
 	simTimer.reset();
 
 	//
 	// Solve for pressure for each material to return their velocities to an incompressible state
 	//
 
-	MultiMaterialPressureProjection pressureSolver(extrapolatedSurfaces, myFluidVelocities, myFluidDensities, mySolidSurface);
+	MultiMaterialPressureProjection pressureSolver(myExtrapolatedSurfaces, myFaceMaterials, myFluidVelocities, myFluidDensities, mySolidSurface, myPressureBuffers);
 
-	pressureSolver.project(materialCutCellWeights, solidCutCellWeights);
-	pressureSolver.applySolution(myFluidVelocities, materialCutCellWeights);
+	pressureSolver.project(myMaterialWeights, solidCutCellWeights);
+	myStepSolverStats.push_back(pressureSolver.solverStats());
+	pressureSolver.applySolution(myFluidVelocities, myMaterialWeights);
 
 	std::cout << "  Solve for multi-material pressure: " << simTimer.stop() << "s" << std::endl;
+	std::cout << "    Iterations: " << pressureSolver.solveResult().iterations << ", residual: " << pressureSolver.solveResult().residual << std::endl;
 
 	simTimer.reset();
 
 	//
-	// Build a list of valid faces for each material so we can extrapolate with.
+	// Extrapolate each material's velocity from the faces it covers and advect the material's surface
+	// with it. The materials take turns in the scratch velocity and their extrapolated velocities are
+	// gathered into a shared grid and side table. All of the velocities are then advected together.
 	//
 
+	myExtrapolatedVelocities.beginGather();
+
 	for (unsigned material = 0; material < myMaterialCount; ++material)
 	{
-		VectorGrid<MarkedCells> valid(myXform, myGridSize, MarkedCells::UNVISITED, VectorGridSettings::SampleType::STAGGERED);
+		myFluidVelocities.scatter(myFaceMaterials, material, myScratchVelocity);
 
+		// Build a list of valid faces so we can extrapolate with
 		for (auto axis : { 0,1 })
 		{
-			forEachVoxelRange(Vec2ui(0), myFluidVelocities[material].size(axis), [&](const Vec2ui& face)
+			Vec2ui size = myValidFaces.size(axis);
+
+			tbb::parallel_for(tbb::blocked_range<unsigned>(0, size[0]), [&](const tbb::blocked_range<unsigned> &range)
 			{
-				if (materialCutCellWeights[material](face, axis) > 0.)
-					valid(face, axis) = MarkedCells::FINISHED;
+				for (unsigned i = range.begin(); i != range.end(); ++i)
+					for (unsigned j = 0; j < size[1]; ++j)
+					{
+						Vec2ui face(i, j);
+						bool isOwnedAndCovered = myFaceMaterials(face, axis) == int(material) && myMaterialWeights.ownerValue(face, axis) > 0.;
+						myValidFaces(face, axis) = isOwnedAndCovered ? MarkedCells::FINISHED : MarkedCells::UNVISITED;
+					}
 			});
+		}
+
+		for (const MaterialFaceValues::Entry& entry : myMaterialWeights.entries())
+		{
+			if (entry.material != material || !(entry.value > 0.)) continue;
 
-			// Extrapolate velocity
-			ExtrapolateField<ScalarGrid<Real>> extrapolator(myFluidVelocities[material].grid(axis));
-			extrapolator.extrapolate(valid.grid(axis), 5);
+			Vec2ui face; unsigned axis;
+			myMaterialWeights.keyToFace(entry.face, face, axis);
+			myValidFaces(face, axis) = MarkedCells::FINISHED;
 		}
+
+		ExtrapolateField<VectorGrid<Real>> extrapolator(myScratchVelocity, myExtrapolationBuffers);
+		extrapolator.extrapolate(myValidFaces, 5);
+
+		advectFluidSurface(dt, material, IntegrationOrder::RK3);
+
+		// The extrapolation reaches a few cells past the material, so that's all the side table keeps
+		myExtrapolatedVelocities.gather(myFaceMaterials, material, myScratchVelocity, [](const Vec2ui&, unsigned, Real value) { return value != 0; });
 	}
 
-	std::cout << "  Extrapolate velocity: " << simTimer.stop() << "s" << std::endl;
-	simTimer.reset();
-    
-	advectFluidSurfaces(dt, IntegrationOrder::RK3);
+	myExtrapolatedVelocities.finishGather();
+
 	advectFluidVelocities(dt, IntegrationOrder::RK3);
 
-	std::cout << "  Advect simulation: " << simTimer.stop() << "s" << std::endl;
+	// Advection is the last change to the velocity in a timestep so the CFL speed is taken here
+	myMaxVelocity = computeMaxVelocityMagnitude();
+	myMaxVelocityValid = true;
+
+	resolveSurfaceOverlaps();
+
+	std::cout << "  Extrapolate and advect simulation: " << simTimer.stop() << "s" << std::endl;
+}
+
+bool MultiMaterialLiquid::checkpoint(const std::string& prefix, unsigned frame)
+{
+	// The copies are owned by the write so the simulation can keep stepping while they go to disk
+	std::vector<double> state = { double(frame), double(myInitializedMaterialsCount) };
+	state.insert(state.end(), myFluidDensities.begin(), myFluidDensities.end());
+
+	// The side table is flattened into (face, material, value) triples. Face keys and
+	// material indices are exact in a double.
+	std::vector<double> velocityEntries;
+	velocityEntries.reserve(3 * myFluidVelocities.entries().size());
+
+	for (const MaterialFaceValues::Entry& entry : myFluidVelocities.entries())
+	{
+		velocityEntries.push_back(double(entry.face));
+		velocityEntries.push_back(double(entry.material));
+		velocityEntries.push_back(double(entry.value));
+	}
+
+	return myCheckpointWriter.write([prefix, state, velocityEntries, fluidVelocity = myFluidVelocities.ownerValues(),
+										fluidSurfaces = myFluidSurfaces, solidSurface = mySolidSurface]()
+	{
+		bool written = fluidVelocity.writeSnapshot(checkpointFile(prefix, "fluidVelocity"));
+		written &= writeCheckpointValues(prefix, "fluidVelocityEntries", velocityEntries);
+		written &= solidSurface.writeSnapshot(checkpointFile(prefix, "solidSurface"));
+
+		// The surfaces are expanded here so the simulation thread only copies the tiles
+		LevelSet2D fluidSurface;
+		for (unsigned material = 0; material < fluidSurfaces.size(); ++material)
+		{
+			fluidSurfaces[material].load(fluidSurface);
+			written &= fluidSurface.writeSnapshot(checkpointFile(prefix, "fluidSurface" + std::to_string(material)));
+		}
+
+		// Written last so that a readable state file marks a complete checkpoint
+		if (written)
+			written &= writeCheckpointState(prefix, state);
+
+		return written;
+	});
+}
+
+bool MultiMaterialLiquid::restore(const std::string& prefix, unsigned& frame)
+{
+	finishCheckpoint();
+
+	std::vector<double> state, velocityEntries;
+	if (!readCheckpointState(prefix, state) || state.size() != 2 + myMaterialCount)
+		return false;
+
+	VectorGrid<Real> fluidVelocity;
+	LevelSet2D solidSurface;
+	std::vector<LevelSet2D> fluidSurfaces(myMaterialCount);
+
+	if (!fluidVelocity.readSnapshot(checkpointFile(prefix, "fluidVelocity")) ||
+		!readCheckpointValues(prefix, "fluidVelocityEntries", velocityEntries) ||
+		!solidSurface.readSnapshot(checkpointFile(prefix, "solidSurface")))
+		return false;
+
+	if (!fluidVelocity.isMatched(myFluidVelocities.ownerValues()) || !solidSurface.isMatched(mySolidSurface) ||
+		velocityEntries.size() % 3 != 0)
+		return false;
+
+	for (unsigned material = 0; material < myMaterialCount; ++material)
+	{
+		if (!fluidSurfaces[material].readSnapshot(checkpointFile(prefix, "fluidSurface" + std::to_string(material))) ||
+			!myFluidSurfaces[material].isMatched(fluidSurfaces[material]))
+			return false;
+	}
+
+	std::vector<MaterialFaceValues::Entry> entries(velocityEntries.size() / 3);
+	for (std::size_t entryIndex = 0; entryIndex < entries.size(); ++entryIndex)
+	{
+		entries[entryIndex].face = unsigned(velocityEntries[3 * entryIndex]);
+		entries[entryIndex].material = unsigned(velocityEntries[3 * entryIndex + 1]);
+		entries[entryIndex].value = Real(velocityEntries[3 * entryIndex + 2]);
+
+		if (entries[entryIndex].material >= myMaterialCount ||
+			(entryIndex > 0 && !(entries[entryIndex - 1] < entries[entryIndex])))
+			return false;
+	}
+
+	myFluidVelocities.ownerValues() = fluidVelocity;
+	myFluidVelocities.setEntries(entries);
+	mySolidSurface = solidSurface;
+
+	for (unsigned material = 0; material < myMaterialCount; ++material)
+		myFluidSurfaces[material].store(fluidSurfaces[material]);
+
+	myInitializedMaterialsCount = unsigned(state[1]);
+	myFluidDensities.assign(state.begin() + 2, state.end());
+
+	// The face labels are a function of the surfaces so they're rebuilt instead of stored. The
+	// velocities were written with the same labels so they don't move.
+	computeFaceMaterials(myFaceMaterials);
+
+	myMaxVelocityValid = false;
+
+	frame = unsigned(state[0]);
+	return true;
 }
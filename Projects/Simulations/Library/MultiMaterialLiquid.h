@@ -1,12 +1,19 @@
 #ifndef SIMULATIONS_MULTIMATERIALLIQUID_H
 #define SIMULATIONS_MULTIMATERIALLIQUID_H
 
+#include <vector>
+
 #include "AdvectField.h"
+#include "Checkpoint.h"
 #include "Common.h"
+#include "ConjugateGradient.h"
 #include "ExtrapolateField.h"
 #include "Integrator.h"
 #include "LevelSet2D.h"
+#include "MaterialFaceValues.h"
 #include "ScalarGrid.h"
+#include "SolverStats.h"
+#include "SparseLevelSet2D.h"
 #include "Transform.h"
 #include "VectorGrid.h"
 
@@ -20,6 +27,20 @@
 // Handles velocity, surface, viscosity field advection,
 // pressure projection, viscosity and velocity extrapolation.
 //
+// Every material has its own velocity and surface but
+// neither is stored as a full grid per material. Each face
+// is owned by the material whose surface is lowest there
+// and one shared grid holds the owner's velocity. The other
+// materials only keep a velocity on faces within
+// VELOCITYSUPPORT cells of their surface, which is every
+// face they can cover in the next timestep, in a side table.
+// Surfaces are stored as sparse narrow band tiles.
+// Extrapolation and surface advection work on one material
+// at a time in dense scratch fields that are shared by all
+// of the materials. Velocity advection then runs once over
+// the shared grid and once over the side table, so it
+// doesn't repeat for every material.
+//
 ////////////////////////////////////
 
 class MultiMaterialLiquid
@@ -30,19 +51,27 @@ public:
 		, myGridSize(size)
 		, myMaterialCount(materials)
 		, myInitializedMaterialsCount(0)
+		, myMaxVelocity(0)
+		, myMaxVelocityValid(false)
 	{
 		assert(myMaterialCount > 1);
-		myFluidVelocities.resize(myMaterialCount);
-		myFluidSurfaces.resize(myMaterialCount);
 		myFluidDensities.resize(myMaterialCount);
 
-		for (unsigned i = 0; i < myMaterialCount; ++i)
-			myFluidVelocities[i] = VectorGrid<Real>(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
-	
-		for (unsigned i = 0; i < myMaterialCount; ++i)
-			myFluidSurfaces[i] = LevelSet2D(xform, size, narrowBand);
+		myFluidVelocities = MaterialFaceValues(xform, size);
+		myFaceMaterials = VectorGrid<int>(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+
+		myFluidSurfaces.assign(myMaterialCount, SparseLevelSet2D(xform, size, unsigned(narrowBand)));
+		myExtrapolatedSurfaces.resize(myMaterialCount);
 
 		mySolidSurface = LevelSet2D(myXform, size, narrowBand);
+
+		myMaterialWeights = MaterialFaceValues(xform, size);
+		myExtrapolatedVelocities = MaterialFaceValues(xform, size);
+		myScratchSurface = LevelSet2D(xform, size, narrowBand);
+		myScratchVelocity = VectorGrid<Real>(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+		myValidFaces = VectorGrid<MarkedCells>(xform, size, MarkedCells::UNVISITED, VectorGridSettings::SampleType::STAGGERED);
+		myScratchFaceMaterials = VectorGrid<int>(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+		myOverlapShift = ScalarGrid<Real>(xform, size, 0);
 	}
 
 	template<typename ForceSampler>
@@ -50,54 +79,101 @@ public:
 
 	void addForce(const Real dt, const unsigned material, const Vec2R& force);
 
-	void advectFluidSurfaces(Real dt, IntegrationOrder integrator = IntegrationOrder::FORWARDEULER);
-	void advectFluidVelocities(Real dt, IntegrationOrder integrator = IntegrationOrder::RK3, InterpolationOrder interpolator = InterpolationOrder::LINEAR);
-
 	// Perform pressure project, viscosity solver, extrapolation, surface and velocity advection
 	void runTimestep(Real dt, Renderer& renderer);
 
-	// Useful for CFL
+	// Useful for CFL. The largest magnitude over all materials is cached after velocity advection
+	// and only recomputed if a velocity was changed since.
 	Real maxVelocityMagnitude() const
 	{
-		Real maxVelocity = 0;
-		for (int i = 0; i < myMaterialCount; ++i)
-			maxVelocity = std::max(maxVelocity, myFluidVelocities[i].maxMagnitude());
-		return maxVelocity;
+		if (!myMaxVelocityValid)
+		{
+			myMaxVelocity = computeMaxVelocityMagnitude();
+			myMaxVelocityValid = true;
+		}
+
+		return myMaxVelocity;
 	}
 
+	// Stats of every linear solve made during the last call to runTimestep, in solve order
+	const std::vector<SolverStats>& stepSolverStats() const { return myStepSolverStats; }
+
+	// Copies the simulation state and writes it to files starting with prefix on a background
+	// thread so the simulation can keep stepping. Returns false if the previous checkpoint failed.
+	bool checkpoint(const std::string& prefix, unsigned frame);
+
+	// Blocks until the last checkpoint is on disk. Returns false if it failed.
+	bool finishCheckpoint() { return myCheckpointWriter.finish(); }
+
+	// Restores a checkpoint written by a simulator with the same grid and material count. With
+	// REPRODUCIBLE sums (see Reduction.h) stepping from the restored state matches the run that
+	// wrote it bit for bit at any thread count.
+	bool restore(const std::string& prefix, unsigned& frame);
+
 	void setSolidSurface(const LevelSet2D& solidSurface);
 
 	void setMaterial(const LevelSet2D &surface, const Real density, const unsigned material)
 	{
 	    assert(material < myMaterialCount);
 
-	    assert(surface.isMatched(myFluidSurfaces[material]));
-	    myFluidSurfaces[material] = surface;
+	    assert(myFluidSurfaces[material].isMatched(surface));
+	    myFluidSurfaces[material].store(surface);
 	    myFluidDensities[material] = density;
+
+	    relabelFaces();
 	}
 
 	void setMaterial(const LevelSet2D &surface, const VectorGrid<Real> &velocity,
-						const Real density, const unsigned material)
+						const Real density, const unsigned material);
+
+	LevelSet2D materialSurface(unsigned material) const
 	{
-	    assert(material < myMaterialCount);
+		assert(material < myMaterialCount);
 
-	    assert(surface.isMatched(myFluidSurfaces[material]));
-	    myFluidSurfaces[material] = surface;
+		LevelSet2D surface;
+		myFluidSurfaces[material].load(surface);
+		return surface;
+	}
 
-	    assert(velocity.isMatched(myFluidVelocities[material]));
-	    myFluidVelocities[material] = velocity;
+	const LevelSet2D& solidSurface() const { return mySolidSurface; }
 
-	    myFluidDensities[material] = density;
-	}
+	// Bytes held by the velocities, weights and surfaces of the materials, including the side
+	// tables and tile storage kept for later timesteps. The dense scratch fields aren't included
+	// since their size doesn't depend on the material count.
+	std::size_t materialStorageBytes() const;
 
 	void drawMaterialSurface(Renderer &renderer, unsigned material);
 	void drawMaterialVelocity(Renderer &renderer, Real length, unsigned material) const;
 	void drawSolidSurface(Renderer &renderer);
 
+	// A material only keeps a velocity on faces it doesn't own within this many grid cells of its
+	// surface. A face with any part inside the material is well inside this distance.
+	static constexpr Real VELOCITYSUPPORT = 3;
+
 private:
 
-	std::vector<VectorGrid<Real>> myFluidVelocities;
-	std::vector<LevelSet2D> myFluidSurfaces;
+	// Advect one material's surface with its extrapolated velocity in the scratch velocity
+	void advectFluidSurface(Real dt, unsigned material, IntegrationOrder integrator);
+
+	// Advect every material's velocity from the extrapolated velocities. Each face is advected for
+	// its owner and each side table entry for its material.
+	void advectFluidVelocities(Real dt, IntegrationOrder integrator);
+
+	// Removes overlaps between the advected surfaces and redistances them
+	void resolveSurfaceOverlaps();
+
+	// Label every face with the material whose surface is closest to (or furthest inside at) the face
+	void computeFaceMaterials(VectorGrid<int>& faceMaterials) const;
+
+	// Relabels the faces after the surfaces have changed and moves the velocities to their new owners
+	void relabelFaces();
+
+	Real computeMaxVelocityMagnitude() const;
+
+	MaterialFaceValues myFluidVelocities;
+	VectorGrid<int> myFaceMaterials;
+
+	std::vector<SparseLevelSet2D> myFluidSurfaces;
 	std::vector<Real> myFluidDensities;
 
 	LevelSet2D mySolidSurface;
@@ -106,6 +182,30 @@ private:
 	const Transform myXform;
 	const unsigned myMaterialCount;
 	unsigned myInitializedMaterialsCount;
+
+	mutable Real myMaxVelocity;
+	mutable bool myMaxVelocityValid;
+
+	std::vector<SolverStats> myStepSolverStats;
+
+	// Timestep storage. None of it grows with the material count apart from the extrapolated
+	// surfaces, which are sparse, and the side tables of the weights and extrapolated velocities.
+	std::vector<SparseLevelSet2D> myExtrapolatedSurfaces;
+	MaterialFaceValues myMaterialWeights, myExtrapolatedVelocities;
+
+	LevelSet2D myScratchSurface;
+	LevelSetBuffers mySurfaceBuffers;
+
+	VectorGrid<Real> myScratchVelocity;
+	VectorGrid<MarkedCells> myValidFaces;
+	ExtrapolationBuffers myExtrapolationBuffers;
+
+	ConjugateGradientBuffers myPressureBuffers;
+
+	VectorGrid<int> myScratchFaceMaterials;
+	ScalarGrid<Real> myOverlapShift;
+
+	CheckpointWriter myCheckpointWriter;
 };
 
 #endif
\ No newline at end of file
@@ -1,28 +1,36 @@
+#include <iostream>
 #include <limits>
 
+#include "tbb/tbb.h"
+
 #include "MultiMaterialPressureProjection.h"
-#include "Solver.h"
+
+#include "CompactIndex.h"
+#include "GridPoissonSolver.h"
+#include "Profiler.h"
+#include "Timer.h"
 
 void MultiMaterialPressureProjection::drawPressure(Renderer &renderer) const
 {
 	myPressure.drawSupersampledValues(renderer, .5, 3, 1);
 }
 
-void MultiMaterialPressureProjection::project(const std::vector<VectorGrid<Real>> &materialCutCellWeights,
+void MultiMaterialPressureProjection::project(const MaterialFaceValues &materialCutCellWeights,
 												const VectorGrid<Real> &collisionCutCellWeights)
 {
-    assert(materialCutCellWeights.size() == mySurfaceList.size());
-	for (unsigned material = 0; material < myMaterialsCount; ++material)
-		assert(materialCutCellWeights[material].isMatched(myVelocityList[material]));
+	PROFILE_ZONE("MultiMaterialPressureProjection::project");
+
+	Timer assemblyTimer;
 
-    const Vec2ui gridSize = mySurfaceList[0].size();
+	assert(materialCutCellWeights.ownerValues().isMatched(myVelocity.ownerValues()));
+
+    const Vec2ui gridSize = mySolidSurface.size();
 
     myMaterialLabels = UniformGrid<int>(mySolidSurface.size(), UNSOLVED);
     mySolverIndex = UniformGrid<int>(mySolidSurface.size(), UNSOLVED);
 
     // Determine which material a voxel falls into
-    int liquidDOFCount = 0;
-    forEachVoxelRange(Vec2ui(0), gridSize, [&](const Vec2ui &cell)
+    int liquidDOFCount = buildCompactIndex(mySolverIndex, [&](const Vec2ui &cell) -> bool
     {
 		// Check if the cell has as solid cut-cell weight that is less than unity.
 		bool isLiquidCell = false;
@@ -44,173 +52,167 @@ void MultiMaterialPressureProjection::project(const std::vector<VectorGrid<Real>
 			Real minDistance = std::numeric_limits<Real>::max();
 			int minMaterial = -1;
 
-			for (unsigned material = 0; material < myMaterialsCount; ++material)
-			{
-				bool validMaterial = false;
+			// Find the material with the lowest SDF value among those with a non-zero
+			// material fraction on one of the faces. This could be outside of a material
+			// if the cell is partially inside a solid. Ties go to the lowest material.
+			for (auto axis : { 0,1 })
+				for (auto direction : { 0,1 })
+				{
+					Vec2ui face = cellToFace(cell, axis, direction);
 
-				// Check if the cell has a non-zero material fraction on one
-				// of the faces.
-				for (auto axis : { 0,1 })
-					for (auto direction : { 0,1 })
+					materialCutCellWeights.forEachMaterial(myFaceMaterials, face, axis, [&](unsigned material, Real weight)
 					{
-						Vec2ui face = cellToFace(cell, axis, direction);
-
-						if (materialCutCellWeights[material](face, axis) > 0.)
+						if (weight > 0.)
 						{
-							validMaterial = true;
-							break;
-						}
-					}
+							Real sdf = mySurfaceList[material](cell);
 
-				// Find the material with the lowest SDF value. This could be outside
-				// of a material if the cell is partially inside a solid.
-				if (validMaterial)
-				{
-					Real sdf = mySurfaceList[material](cell);
-
-					if (sdf < minDistance)
-					{
-						minMaterial = material;
-						minDistance = sdf;
-					}
+							if (sdf < minDistance || (sdf == minDistance && int(material) < minMaterial))
+							{
+								minMaterial = material;
+								minDistance = sdf;
+							}
+						}
+					});
 				}
-			}
 
 			assert(minMaterial >= 0);
 
 			if (minDistance > 0) assert(mySolidSurface(cell) <= 0);
 
-			mySolverIndex(cell) = liquidDOFCount++;
 			myMaterialLabels(cell) = minMaterial;
 
+			return true;
 		}
 		else
 			assert(mySolidSurface(cell) <= 0);
+
+		return false;
     });
 
-    Solver<true> solver(liquidDOFCount, liquidDOFCount * 5);
+    GridPoissonSolver solver(mySolverIndex, liquidDOFCount);
 
-    forEachVoxelRange(Vec2ui(0), gridSize, [&](const Vec2ui& cell)
-    {
-		int row = mySolverIndex(cell);
+	// Rows are spread across threads and each row is only built by one thread.
+	tbb::parallel_for(tbb::blocked_range<unsigned>(0, gridSize[0]), [&](const tbb::blocked_range<unsigned> &range)
+	{
+		for (unsigned i = range.begin(); i != range.end(); ++i)
+			for (unsigned j = 0; j < gridSize[1]; ++j)
+			{
+				Vec2ui cell(i, j);
 
-		if (row >= 0)
-		{
-			// Build RHS divergence contribution per material.
-			double divergence = 0;
+				int row = mySolverIndex(cell);
 
-			for (auto axis : { 0,1 })
-				for (auto direction : { 0,1 })
+				if (row >= 0)
 				{
-					Vec2ui face = cellToFace(cell, axis, direction);
+					// Build RHS divergence per material.
+					double divergence = 0;
 
-					for (unsigned material = 0; material < myMaterialsCount; ++material)
-					{
-						double weight = materialCutCellWeights[material](face, axis);
-
-						if (weight > 0.)
+					for (auto axis : { 0,1 })
+						for (auto direction : { 0,1 })
 						{
-							// We have a negative sign in the forward direction because
-							// we're actually solving with a -1 leading ceofficient.
-							double sign = (direction == 0) ? 1 : -1;
-							divergence += sign * weight * myVelocityList[material](face, axis);
+							Vec2ui face = cellToFace(cell, axis, direction);
+
+							materialCutCellWeights.forEachMaterial(myFaceMaterials, face, axis, [&](unsigned material, Real weight)
+							{
+								if (weight > 0.)
+								{
+									// We have a negative sign in the forward direction because
+									// we're actually solving with a -1 leading ceofficient.
+									double sign = (direction == 0) ? 1 : -1;
+									divergence += sign * weight * myVelocity.value(myFaceMaterials, face, axis, material);
+								}
+							});
 						}
-					}
-				}
-
-			assert(std::isfinite(divergence));
-			solver.addRhs(row, divergence);
 
-			// Build A matrix row
-			double diagonal = 0;
+					assert(std::isfinite(divergence));
+					solver.addRhs(row, divergence);
 
-			int material = myMaterialLabels(cell);
-			assert(material >= 0 && material < myMaterialsCount);
+					// Build A matrix row
+					double diagonal = 0;
 
-			double phi = mySurfaceList[material](cell);
-			for (auto axis : { 0,1 })
-				for (auto direction : { 0,1 })
-				{
-					Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
+					int material = myMaterialLabels(cell);
+					assert(material >= 0 && material < myMaterialsCount);
 
-					// Bounds check. If out-of-bounds, treat like a stationary grid-aligned solid.
-					if (adjacentCell[axis] < 0 || adjacentCell[axis] >= gridSize[axis]) continue;
+					double phi = mySurfaceList[material](cell);
+					for (auto axis : { 0,1 })
+						for (auto direction : { 0,1 })
+						{
+							Vec2i adjacentCell = cellToCell(Vec2i(cell), axis, direction);
 
-					Vec2ui face = cellToFace(cell, axis, direction);
+							// Bounds check. If out-of-bounds, treat like a stationary grid-aligned solid.
+							if (adjacentCell[axis] < 0 || adjacentCell[axis] >= int(gridSize[axis])) continue;
 
-					int adjacentRow = mySolverIndex(Vec2ui(adjacentCell));
+							Vec2ui face = cellToFace(cell, axis, direction);
 
-					double collisionWeight = collisionCutCellWeights(face, axis);
+							double collisionWeight = collisionCutCellWeights(face, axis);
 
-					if (collisionWeight == 1.)
-						continue;
+							if (collisionWeight == 1.)
+								continue;
 
-					assert(adjacentRow >= 0);
+							assert(mySolverIndex(Vec2ui(adjacentCell)) >= 0);
 
-					// The cut-cell weight for a pressure gradient is only the inverse of
-					// the solid weights. This is due to the contribution from each
-					// material across the face using the same pressure gradient term.
+							// The cut-cell weight for a pressure gradient is only the inverse of
+							// the solid weights. This is due to the contribution from each
+							// material across the face using the same pressure gradient term.
 
-					double weight = 1. - collisionWeight;
+							double weight = 1. - collisionWeight;
 
-					int adjacentMaterial = myMaterialLabels(Vec2ui(adjacentCell));
+							int adjacentMaterial = myMaterialLabels(Vec2ui(adjacentCell));
 
-					assert(adjacentMaterial >= 0 && adjacentMaterial < myMaterialsCount);
+							assert(adjacentMaterial >= 0 && adjacentMaterial < myMaterialsCount);
 
-					double density;
-					if (adjacentMaterial != material)
-					{
-						double adjacentPhi = mySurfaceList[adjacentMaterial](Vec2ui(adjacentCell));
+							double density;
+							if (adjacentMaterial != material)
+							{
+								double adjacentPhi = mySurfaceList[adjacentMaterial](Vec2ui(adjacentCell));
 
-						double theta;
-						if (direction == 0)
-							theta = fabs(adjacentPhi) / (fabs(adjacentPhi) + fabs(phi));
-						else
-							theta = fabs(phi) / (fabs(phi) + fabs(adjacentPhi));
+								double theta;
+								if (direction == 0)
+									theta = fabs(adjacentPhi) / (fabs(adjacentPhi) + fabs(phi));
+								else
+									theta = fabs(phi) / (fabs(phi) + fabs(adjacentPhi));
 
-						theta = Util::clamp(theta, MINTHETA, 1.);
+								theta = Util::clamp(theta, MINTHETA, 1.);
 
-						// Build interpolated density
-						if (direction == 0)
-							density = theta * myDensityList[adjacentMaterial] + (1. - theta) * myDensityList[material];
-						else
-							density = (1. - theta) * myDensityList[adjacentMaterial] + theta * myDensityList[material];
+								// Build interpolated density
+								if (direction == 0)
+									density = theta * myDensityList[adjacentMaterial] + (1. - theta) * myDensityList[material];
+								else
+									density = (1. - theta) * myDensityList[adjacentMaterial] + theta * myDensityList[material];
 
-						assert(std::isfinite(density));
-						assert(!Util::isEqual(density, 0.));
+								assert(std::isfinite(density));
+								assert(!Util::isEqual(density, 0.));
 				
-					}
-					else density = myDensityList[material];
+							}
+							else density = myDensityList[material];
 
-					weight /= density;
+							weight /= density;
 
-					solver.addElement(row, adjacentRow, -weight);
-					diagonal += weight;
+							// The coupling is shared by both cells so it's only stored by the lower one
+							if (direction == 1)
+								solver.setCoupling(row, axis, -weight);
+							diagonal += weight;
+						}
+					solver.addDiagonal(row, diagonal);
 				}
-			solver.addElement(row, row, diagonal);
-		}
-    });
-
-	// Project out null space
-	double avgRHS = 0;
-	for (int row = 0; row < liquidDOFCount; ++row)
-		avgRHS += solver.rhs(row);
-
-	avgRHS /= double(liquidDOFCount);
-
-	for (int row = 0; row < liquidDOFCount; ++row)
-		solver.addRhs(row, -avgRHS);
+			}
+	});
 
 	assert(solver.isSymmetric());
 	assert(solver.isFinite());
 
-    bool result = solver.solveDirect();
+	Real assemblySeconds = assemblyTimer.stop();
 
-    if (!result)
-    {
-		std::cout << "Pressure projection failed to solve" << std::endl;
-		return;
-    }
+	// The domain is closed so the pressure is only defined up to a constant
+	solver.setTolerance(myTolerance);
+	solver.setMaxIterations(myMaxIterations);
+	mySolveResult = solver.solve(mySolverBuffers, true);
+
+	mySolverStats = solver.stats();
+	mySolverStats.solver = "MultiMaterialPressureProjection";
+	mySolverStats.assemblySeconds = assemblySeconds;
+
+	if (!mySolveResult.converged)
+		std::cout << "Pressure projection failed to solve. Iterations: " << mySolveResult.iterations << ", residual: " << mySolveResult.residual << std::endl;
 
     // Load solution into pressure grid
     forEachVoxelRange(Vec2ui(0), gridSize, [&](const Vec2ui& cell)
@@ -228,7 +230,7 @@ void MultiMaterialPressureProjection::project(const std::vector<VectorGrid<Real>
 			Vec2i backward_cell = faceToCell(Vec2i(face), axis, 0);
 			Vec2i forward_cell = faceToCell(Vec2i(face), axis, 1);
 
-			if (backward_cell[axis] < 0 || forward_cell[axis] >= gridSize[axis])
+			if (backward_cell[axis] < 0 || forward_cell[axis] >= int(gridSize[axis]))
 				return;
 
 			if ((collisionCutCellWeights(face, axis) < 1.) &&
@@ -241,74 +243,91 @@ void MultiMaterialPressureProjection::project(const std::vector<VectorGrid<Real>
     }
 }
 
-void MultiMaterialPressureProjection::applySolution(std::vector<VectorGrid<Real>> &velocity,
-													const std::vector<VectorGrid<Real>> &materialCutCellWeights) const
+Real MultiMaterialPressureProjection::faceGradient(const Vec2ui &face, unsigned axis) const
 {
-    for (unsigned material = 0; material < myMaterialsCount; ++material)
-		assert(myVelocityList[material].isMatched(velocity[material]));
-
-    for (unsigned axis = 0; axis < 2; ++axis)
-    {
-		Vec2ui velSize = velocity[0].size(axis);
-
-		forEachVoxelRange(Vec2ui(0), velSize, [&](const Vec2ui& face)
-		{
-			if (myValid(face, axis) > 0)
-			{
-				Real theta = 0;
-				Real phi = 0;
-				Real sampleDensity[2];
-				int materials[2];
-
-				Real gradient = 0;
-				for (auto direction : { 0,1 })
-				{
-					Vec2i cell = faceToCell(Vec2i(face), axis, direction);
-					int material = myMaterialLabels(Vec2ui(cell));
-					materials[direction] = material;
-					assert(mySolverIndex(Vec2ui(cell)) >= 0);
-
-					phi += fabs(mySurfaceList[material](Vec2ui(cell)));
-
-					if (direction == 0) theta = phi;
+	assert(myValid(face, axis) > 0);
+
+	Real theta = 0;
+	Real phi = 0;
+	Real sampleDensity[2];
+	int materials[2];
+
+	Real gradient = 0;
+	for (auto direction : { 0,1 })
+	{
+		Vec2i cell = faceToCell(Vec2i(face), axis, direction);
+		int material = myMaterialLabels(Vec2ui(cell));
+		materials[direction] = material;
+		assert(mySolverIndex(Vec2ui(cell)) >= 0);
+
+		phi += fabs(mySurfaceList[material](Vec2ui(cell)));
+
+		if (direction == 0) theta = phi;
+
+		sampleDensity[direction] = myDensityList[material];
+
+		Real sign = (direction == 0) ? -1 : 1;
+		gradient += sign * myPressure(Vec2ui(cell));
+	}
+
+	Real density;
+	if (materials[0] == materials[1])
+	{
+		assert(sampleDensity[0] == sampleDensity[1]);
+		density = sampleDensity[0];
+		theta = 1;
+	}
+	else
+	{
+		theta /= phi;
+		theta = Util::clamp(theta, MINTHETA, 1.);
+
+		density = theta * sampleDensity[0] + (1. - theta) * sampleDensity[1];
+	}
+
+	return gradient / density;
+}
 
-					sampleDensity[direction] = myDensityList[material];
+void MultiMaterialPressureProjection::applySolution(MaterialFaceValues &velocity, const MaterialFaceValues &materialCutCellWeights) const
+{
+	assert(velocity.ownerValues().isMatched(myVelocity.ownerValues()));
+	assert(materialCutCellWeights.ownerValues().isMatched(myVelocity.ownerValues()));
+
+	// Every face and every entry is updated independently so both are spread across threads
+	auto updateVelocity = [&](const Vec2ui& face, unsigned axis, unsigned material, Real& value)
+	{
+		if (myValid(face, axis) > 0 && materialCutCellWeights.value(myFaceMaterials, face, axis, material) > 0.)
+			value -= faceGradient(face, axis);
+		else
+			value = 0;
+	};
 
-					Real sign = (direction == 0) ? -1 : 1;
-					gradient += sign * myPressure(Vec2ui(cell));
-				}
+	for (unsigned axis = 0; axis < 2; ++axis)
+	{
+		Vec2ui velSize = velocity.ownerValues().size(axis);
 
-				Real density;
-				if (materials[0] == materials[1])
+		tbb::parallel_for(tbb::blocked_range<unsigned>(0, velSize[0]), [&](const tbb::blocked_range<unsigned> &range)
+		{
+			for (unsigned i = range.begin(); i != range.end(); ++i)
+				for (unsigned j = 0; j < velSize[1]; ++j)
 				{
-					assert(sampleDensity[0] == sampleDensity[1]);
-					density = sampleDensity[0];
-					theta = 1;
+					Vec2ui face(i, j);
+					updateVelocity(face, axis, unsigned(myFaceMaterials(face, axis)), velocity.ownerValue(face, axis));
 				}
-				else
-				{
-					theta /= phi;
-					theta = Util::clamp(theta, MINTHETA, 1.);
+		});
+	}
 
-					density = theta * sampleDensity[0] + (1. - theta) * sampleDensity[1];
-				}
+	std::vector<MaterialFaceValues::Entry>& entries = velocity.entries();
 
-				gradient /= density;
+	tbb::parallel_for(tbb::blocked_range<std::size_t>(0, entries.size()), [&](const tbb::blocked_range<std::size_t> &range)
+	{
+		for (std::size_t entryIndex = range.begin(); entryIndex != range.end(); ++entryIndex)
+		{
+			MaterialFaceValues::Entry& entry = entries[entryIndex];
 
-				// Update every material's velocity with a non-zero face weight.
-				for (unsigned material = 0; material < myMaterialsCount; ++material)
-				{
-					if (materialCutCellWeights[material](face, axis) > 0.)
-						velocity[material](face, axis) -= gradient;
-					else
-						velocity[material](face, axis) = 0;
-				}
-			}
-			else
-			{
-				for (unsigned material = 0; material < myMaterialsCount; ++material)
-					velocity[material](face, axis) = 0;
-			}
-		});
-    }
-}
\ No newline at end of file
+			Vec2ui face; unsigned axis;
+			velocity.keyToFace(entry.face, face, axis);
+			updateVelocity(face, axis, entry.material, entry.value);
+		}
+	});
+}
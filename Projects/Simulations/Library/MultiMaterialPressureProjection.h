@@ -2,9 +2,13 @@
 #define SIMULATIONS_MULTIMATERIALPRESSUREPROJECTION_H
 
 #include "Common.h"
+#include "ConjugateGradient.h"
 #include "LevelSet2D.h"
+#include "MaterialFaceValues.h"
 #include "Renderer.h"
 #include "ScalarGrid.h"
+#include "SolverStats.h"
+#include "SparseLevelSet2D.h"
 #include "UniformGrid.h"
 #include "VectorGrid.h"
 
@@ -13,6 +17,14 @@
 // MultiMaterialPressureProjection.h/cpp
 // Ryan Goldade 2017
 //
+// Variable density pressure solve across
+// all materials. Every material keeps its
+// own face velocities and cut-cell weights
+// (see MaterialFaceValues) while sharing
+// the pressure gradient across a face. The
+// system is solved with MIC(0)
+// preconditioned CG.
+//
 ////////////////////////////////////
 
 static constexpr int UNSOLVED = -1;
@@ -20,47 +32,66 @@ static constexpr int UNSOLVED = -1;
 class MultiMaterialPressureProjection
 {
 public:
-    MultiMaterialPressureProjection(const std::vector<LevelSet2D> &surface,
-				    const std::vector<VectorGrid<Real>> &velocity,
+    // The velocities and the cut-cell weights given to project share the face owners in faceMaterials.
+    // The solve works out of the caller's buffers, which must outlive the projection.
+    MultiMaterialPressureProjection(const std::vector<SparseLevelSet2D> &surface,
+				    const VectorGrid<int> &faceMaterials,
+				    const MaterialFaceValues &velocity,
 				    const std::vector<Real> &density,
-				    const LevelSet2D &collision)
+				    const LevelSet2D &collision,
+				    ConjugateGradientBuffers &solverBuffers)
     : mySurfaceList(surface)
-    , myVelocityList(velocity)
+    , myFaceMaterials(faceMaterials)
+    , myVelocity(velocity)
     , myDensityList(density)
     , mySolidSurface(collision)
+    , mySolverBuffers(solverBuffers)
     , myMaterialsCount(surface.size())
+    , myTolerance(1E-6)
+    , myMaxIterations(0)
+    , mySolveResult{ true, 0, 0 }
     {
-		assert(mySurfaceList.size() == myVelocityList.size() &&
-			mySurfaceList.size() == myDensityList.size());
+		assert(mySurfaceList.size() == myDensityList.size());
 
-		for (unsigned material = 1; material < myMaterialsCount; ++material)
-		{
-			assert(mySurfaceList[material - 1].isMatched(mySurfaceList[material]));
-			assert(myVelocityList[material - 1].isMatched(myVelocityList[material]));
-		}
+		for (unsigned material = 0; material < myMaterialsCount; ++material)
+			assert(mySurfaceList[material].isMatched(mySolidSurface));
 
-		// Since every surface and every velocity field is matched, we only need to compare
-		// on pair of fields to make sure the two sets are matched.
+		// Since every surface is matched, we only need to compare the velocity
+		// field against the solid surface.
 
-		assert(myVelocityList[0].size(0)[0] - 1 == mySurfaceList[0].size()[0] &&
-				myVelocityList[0].size(0)[1] == mySurfaceList[0].size()[1] &&
-				myVelocityList[0].size(1)[0] == mySurfaceList[0].size()[0] &&
-				myVelocityList[0].size(1)[1] - 1 == mySurfaceList[0].size()[1]);
+		assert(myVelocity.ownerValues().size(0)[0] - 1 == mySolidSurface.size()[0] &&
+				myVelocity.ownerValues().size(0)[1] == mySolidSurface.size()[1] &&
+				myVelocity.ownerValues().size(1)[0] == mySolidSurface.size()[0] &&
+				myVelocity.ownerValues().size(1)[1] - 1 == mySolidSurface.size()[1]);
 
-		assert(mySurfaceList[0].isMatched(mySolidSurface));
+		assert(myFaceMaterials.size(0) == myVelocity.ownerValues().size(0) &&
+				myFaceMaterials.size(1) == myVelocity.ownerValues().size(1));
 
 		myPressure = ScalarGrid<Real>(mySolidSurface.xform(), mySolidSurface.size(), 0);
 		myValid = VectorGrid<Real>(mySolidSurface.xform(), mySolidSurface.size(), 0, VectorGridSettings::SampleType::STAGGERED);
     }
 
-    void project(const std::vector<VectorGrid<Real>> &materialCutCellWeights,
+    void project(const MaterialFaceValues &materialCutCellWeights,
 					const VectorGrid<Real> &collisionCutCellWeights);
 
-    void applySolution(std::vector<VectorGrid<Real>> &velocity,
-						const std::vector<VectorGrid<Real>> &materialCutCellWeights) const;
+    // Removes the pressure gradient from every material with a non-zero weight on a face. The
+    // velocities of the other materials on the face are zeroed.
+    void applySolution(MaterialFaceValues &velocity, const MaterialFaceValues &materialCutCellWeights) const;
 
 	void drawPressure(Renderer &renderer) const;
 
+	// Relative residual the pressure solve must reach
+	void setTolerance(Real tolerance) { myTolerance = tolerance; }
+
+	// Zero allows twice as many iterations as there are unknowns
+	void setMaxIterations(unsigned maxIterations) { myMaxIterations = maxIterations; }
+
+	// Iterations and residual of the last solve
+	const ConjugateGradientResult& solveResult() const { return mySolveResult; }
+
+	// Timings and system size of the last solve
+	const SolverStats& solverStats() const { return mySolverStats; }
+
 private:
 
     ScalarGrid<Real> myPressure;
@@ -69,12 +100,23 @@ private:
     UniformGrid<int> myMaterialLabels;
     UniformGrid<int> mySolverIndex;
 
-    const std::vector<LevelSet2D> &mySurfaceList;
-    const std::vector<VectorGrid<Real>> &myVelocityList;
+    // Density weighted pressure difference across a valid face
+    Real faceGradient(const Vec2ui &face, unsigned axis) const;
+
+    const std::vector<SparseLevelSet2D> &mySurfaceList;
+    const VectorGrid<int> &myFaceMaterials;
+    const MaterialFaceValues &myVelocity;
     const std::vector<Real> &myDensityList;
 
     const LevelSet2D &mySolidSurface;
     const unsigned myMaterialsCount;
+
+    ConjugateGradientBuffers &mySolverBuffers;
+
+    Real myTolerance;
+    unsigned myMaxIterations;
+    ConjugateGradientResult mySolveResult;
+	SolverStats mySolverStats;
 };
 
 #endif
\ No newline at end of file
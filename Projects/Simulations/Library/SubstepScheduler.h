@@ -0,0 +1,113 @@
+#ifndef SIMULATIONS_SUBSTEPSCHEDULER_H
+#define SIMULATIONS_SUBSTEPSCHEDULER_H
+
+#include <iostream>
+#include <vector>
+
+#include "Common.h"
+#include "Timer.h"
+
+///////////////////////////////////
+//
+// SubstepScheduler.h
+// Ryan Goldade 2017
+//
+// Splits a frame into substeps that
+// satisfy a CFL condition. The speed is
+// queried from the simulator before each
+// substep, which is cheap because the
+// simulators cache their max velocity
+// after advection. Every substep is
+// timed so callers can report where the
+// frame went.
+//
+////////////////////////////////////
+
+struct SubstepTiming
+{
+	Real dt;
+	// Max velocity magnitude used to pick the substep
+	Real speed;
+	// Wall clock time spent in the substep
+	Real seconds;
+};
+
+class SubstepScheduler
+{
+public:
+	// The CFL number is the number of grid cells a sample is allowed to travel in one substep
+	SubstepScheduler(Real dx, Real cfl = 3.)
+		: myDx(dx)
+		, myCFL(cfl)
+	{}
+
+	void setCFL(Real cfl) { myCFL = cfl; }
+
+	// Largest substep that covers at most the remaining frame time and respects the CFL condition
+	Real substepSize(Real remainingTime, Real speed) const
+	{
+		assert(remainingTime >= 0);
+
+		if (speed > 1E-6)
+		{
+			Real cflDt = myCFL * myDx / speed;
+			if (remainingTime > cflDt)
+				return cflDt;
+		}
+
+		return remainingTime;
+	}
+
+	// Advance a frame of length frameDt. speed() returns the simulation's current max velocity
+	// and step(dt) advances the simulation (forces, sources and the timestep itself) by dt.
+	// Returns the number of substeps taken.
+	template<typename SpeedFunctor, typename StepFunctor>
+	unsigned runFrame(Real frameDt, const SpeedFunctor& speed, const StepFunctor& step)
+	{
+		myTimings.clear();
+
+		Real frameTime = 0;
+		while (frameTime < frameDt)
+		{
+			Real currentSpeed = speed();
+			Real localDt = substepSize(frameDt - frameTime, currentSpeed);
+
+			Timer substepTimer;
+			step(localDt);
+
+			myTimings.push_back(SubstepTiming{ localDt, currentSpeed, substepTimer.stop() });
+
+			frameTime += localDt;
+		}
+
+		return unsigned(myTimings.size());
+	}
+
+	// Timings of the substeps taken by the last frame
+	const std::vector<SubstepTiming>& timings() const { return myTimings; }
+
+	Real frameSeconds() const
+	{
+		Real seconds = 0;
+		for (const SubstepTiming& timing : myTimings)
+			seconds += timing.seconds;
+		return seconds;
+	}
+
+	void printTimings() const
+	{
+		for (unsigned substep = 0; substep < myTimings.size(); ++substep)
+		{
+			const SubstepTiming& timing = myTimings[substep];
+			std::cout << "  Substep " << substep << ": dt " << timing.dt << ", speed " << timing.speed << ", " << timing.seconds << "s" << std::endl;
+		}
+	}
+
+private:
+
+	Real myDx, myCFL;
+
+	std::vector<SubstepTiming> myTimings;
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include "LevelSet2D.h"
 #include "Mesh2D.h"
 #include "Renderer.h"
+#include "SubstepScheduler.h"
 
 static std::unique_ptr<Renderer> renderer;
 static std::unique_ptr<EulerianLiquid> simulator;
@@ -25,27 +26,12 @@ void display()
 {
 	if (runSimulation || runSingleStep)
 	{
-		Real frameTime = 0.;
 		std::cout << "\nStart of frame: " << frameCount << ". Timestep: " << dt << std::endl;
 
-		while (frameTime < dt)
-		{
-			// Set CFL condition
-			Real speed = simulator->maxVelocityMagnitude();
-			
-			Real localDt = dt - frameTime;
-			assert(localDt >= 0);
-
-			if (speed > 1E-6)
-			{
-				Real cflDt = 3. * xform.dx() / speed;
-				if (localDt > cflDt)
-				{
-					localDt = cflDt;
-					std::cout << "\n  Throttling frame with substep: " << localDt << "\n" << std::endl;
-				}			
-			}
+		SubstepScheduler scheduler(xform.dx());
 
+		scheduler.runFrame(dt, [&]() { return simulator->maxVelocityMagnitude(); }, [&](Real localDt)
+		{
 			if (seedTime > 2.)
 			{
 				Vec2R center = xform.offset() + Vec2R(xform.dx()) * Vec2R(gridSize / 2) + Vec2R(.8);
@@ -62,10 +48,9 @@ void display()
 			simulator->runTimestep(localDt, *renderer);
 
 			seedTime += localDt;
-			
-			// Store accumulated substep times
-			frameTime += localDt;
-		}
+		});
+
+		scheduler.printTimings();
 
 		++frameCount;
 		runSingleStep = false;
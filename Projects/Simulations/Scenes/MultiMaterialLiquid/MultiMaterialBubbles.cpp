@@ -8,6 +8,7 @@
 #include "MultiMaterialLiquid.h"
 #include "Renderer.h"
 #include "ScalarGrid.h"
+#include "SubstepScheduler.h"
 
 std::unique_ptr<MultiMaterialLiquid> multiMaterialSimulator;
 std::unique_ptr<Renderer> renderer;
@@ -30,35 +31,19 @@ void display()
 {
     if (runSimulation || runSingleStep)
     {
-		Real frameTime = 0.;
 		std::cout << "\nStart of frame: " << frameCount << ". Timestep: " << dt << std::endl;
 
-		while (frameTime < dt)
-		{
-			// Set CFL condition
-			Real speed = multiMaterialSimulator->maxVelocityMagnitude();
-
-			Real localDt = dt - frameTime;
-			assert(localDt >= 0);
-
-			if (speed > 1E-6)
-			{
-				Real cflDt = 3. * xform.dx() / speed;
-				if (localDt > cflDt)
-				{
-					localDt = cflDt;
-					std::cout << "\n  Throttling frame with substep: " << localDt << "\n" << std::endl;
-				}
-			}
+		SubstepScheduler scheduler(xform.dx());
 
+		scheduler.runFrame(dt, [&]() { return multiMaterialSimulator->maxVelocityMagnitude(); }, [&](Real localDt)
+		{
 			for (int material = 0; material < liquidMaterialCount; ++material)
 				multiMaterialSimulator->addForce(localDt, material, Vec2R(0., -9.8));
 
 			multiMaterialSimulator->runTimestep(localDt, *renderer);
+		});
 
-			// Store accumulated substep times
-			frameTime += localDt;
-		}
+		scheduler.printTimings();
 
 		++frameCount;
 
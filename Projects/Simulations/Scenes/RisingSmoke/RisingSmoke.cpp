@@ -8,6 +8,7 @@
 #include "Mesh2D.h"
 #include "Renderer.h"
 #include "ScalarGrid.h"
+#include "SubstepScheduler.h"
 
 static std::unique_ptr<Renderer> renderer;
 static std::unique_ptr<EulerianSmoke> simulator;
@@ -28,37 +29,19 @@ void display()
 {
 	if (runSimulation || runSingleStep)
 	{
-		Real frameTime = 0.;
 		std::cout << "\n\nStart of frame: " << frameCount << ". Timestep: " << dt << "\n" << std::endl;
 
-		int substep = 0;
-		while (frameTime < dt)
-		{
-			// Set CFL condition
-			Real speed = simulator->maxVelocityMagnitude();
-
-			Real localDt = dt - frameTime;
-			assert(localDt >= 0);
-
-			if (speed > 1E-6)
-			{
-				Real cflDt = 3. * smokeDensity.dx() / speed;
-				if (localDt > cflDt)
-				{
-					localDt = cflDt;
-					std::cout << "\n  Throttling frame with substep: " << localDt << "\n" << std::endl;
-				}
-			}
+		SubstepScheduler scheduler(smokeDensity.dx());
 
+		scheduler.runFrame(dt, [&]() { return simulator->maxVelocityMagnitude(); }, [&](Real localDt)
+		{
 			simulator->runTimestep(localDt, *renderer);
 
 			// Add smoke density and temperature source to simulation frame
 			simulator->setSmokeSource(smokeDensity, smokeTemperature);
+		});
 
-			frameTime += localDt;
-
-			++substep;
-		}
+		scheduler.printTimings();
 
 		std::cout << "\n\nEnd of frame: " << frameCount << "\n" << std::endl;
 
@@ -7,6 +7,7 @@
 #include "LevelSet2D.h"
 #include "Mesh2D.h"
 #include "Renderer.h"
+#include "SubstepScheduler.h"
 #include "TestVelocityFields.h"
 
 static std::unique_ptr<Renderer> renderer;
@@ -34,27 +35,12 @@ void display()
 {
 	if (runSimulation || runSingleStep)
 	{
-		Real frameTime = 0.;
 		std::cout << "\nStart of frame: " << frameCount << ". Timestep: " << dt << std::endl;
 
-		while (frameTime < dt)
-		{
-			// Set CFL condition
-			Real speed = simulator->maxVelocityMagnitude();
-
-			Real localDt = dt - frameTime;
-			assert(localDt >= 0);
-
-			if (speed > 1E-6)
-			{
-				Real cflDt = 3. * xform.dx() / speed;
-				if (localDt > cflDt)
-				{
-					localDt = cflDt;
-					std::cout << "\n  Throttling frame with substep: " << localDt << "\n" << std::endl;
-				}
-			}
+		SubstepScheduler scheduler(xform.dx());
 
+		scheduler.runFrame(dt, [&]() { return simulator->maxVelocityMagnitude(); }, [&](Real localDt)
+		{
 			// Add gravity
 			simulator->addForce(localDt, Vec2R(0., -9.8));
 
@@ -93,9 +79,9 @@ void display()
 			simulator->runTimestep(localDt, *renderer);
 
 			simulator->unionLiquidSurface(seedLiquidSurface);
+		});
 
-			frameTime += localDt;
-		}
+		scheduler.printTimings();
 
 		runSingleStep = false;
 		isDisplayDirty = true;
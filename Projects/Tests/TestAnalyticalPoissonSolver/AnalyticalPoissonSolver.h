@@ -19,6 +19,7 @@ public:
 		myPoissonGrid = ScalarGrid<Real>(myXform, size, 0);
 	}
 
+	// Returns the infinity-norm error of the numerical solution or -1 if the solve failed
 	template<typename RHS, typename Solution>
 	Real solve(const RHS& rhsFunction, const Solution& solutionFunction);
 
@@ -1,12 +1,50 @@
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include <string>
+
+#include "Eigen/Core"
+#include "tbb/tbb.h"
 
 #include "AnalyticalPoissonSolver.h"
 
 #include "Common.h"
 #include "Integrator.h"
+#include "Timer.h"
+
+// Solves the Poisson problem at doubling resolutions and checks that the
+// L-infinity error falls at second order. Returns non-zero on failure so it
+// can run under CTest.
+//
+// Usage: TestAnalyticalPoissonSolver [--threads N] [--levels N]
+
+static constexpr Real EXPECTEDORDER = 2.;
+static constexpr Real ORDERTOLERANCE = .2;
 
 int main(int argc, char** argv)
 {
+	unsigned threads = unsigned(tbb::this_task_arena::max_concurrency());
+	unsigned levels = 4;
+
+	for (int arg = 1; arg + 1 < argc; arg += 2)
+	{
+		std::string option(argv[arg]);
+		int value = std::atoi(argv[arg + 1]);
+
+		if (option == "--threads" && value > 0)
+			threads = unsigned(value);
+		else if (option == "--levels" && value > 1)
+			levels = unsigned(value);
+		else
+		{
+			std::cout << "Usage: " << argv[0] << " [--threads N] [--levels N]" << std::endl;
+			return 1;
+		}
+	}
+
+	tbb::global_control threadLimit(tbb::global_control::max_allowed_parallelism, threads);
+	Eigen::setNbThreads(int(threads));
+
 	auto rhs = [](const Vec2R& pos) -> Real
 	{
 		return 2. * std::exp(-pos[0] - pos[1]);
@@ -17,19 +55,48 @@ int main(int argc, char** argv)
 		return std::exp(-pos[0] - pos[1]);
 	};
 
+	std::cout << "Threads: " << threads << std::endl;
+
+	bool passed = true;
+	Real previousError = 0;
+
 	unsigned baseGrid = 32;
-	unsigned maxBaseGrid = baseGrid * pow(2,4);
-	
-	for (; baseGrid < maxBaseGrid; baseGrid *= 2)
+	for (unsigned level = 0; level < levels; ++level, baseGrid *= 2)
 	{
 		Real dx = Util::PI / Real(baseGrid);
 		Vec2R origin(0);
 		Vec2ui size(round(Util::PI / dx));
 		Transform xform(dx, origin);
 
+		Timer timer;
+
 		AnalyticalPoissonSolver solver(xform, size);
 		Real error = solver.solve(rhs, solution);
 
-		std::cout << "L-infinity error at " << baseGrid << "^2: " << error << std::endl;
+		Real seconds = timer.stop();
+
+		std::cout << "L-infinity error at " << baseGrid << "^2: " << error << ", wall time: " << seconds << "s";
+
+		if (error < 0)
+			passed = false;
+		else if (level > 0)
+		{
+			Real order = std::log2(previousError / error);
+			std::cout << ", order: " << order;
+
+			if (!(order >= EXPECTEDORDER - ORDERTOLERANCE))
+				passed = false;
+		}
+
+		std::cout << std::endl;
+
+		previousError = error;
 	}
+
+	if (passed)
+		std::cout << "Passed" << std::endl;
+	else
+		std::cout << "Failed: the solve failed or converged slower than order " << EXPECTEDORDER - ORDERTOLERANCE << std::endl;
+
+	return passed ? 0 : 1;
 }
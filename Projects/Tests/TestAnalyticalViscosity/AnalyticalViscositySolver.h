@@ -35,7 +35,7 @@ public:
 		myVelocityIndex = VectorGrid<int>(xform, size, UNASSIGNED, VectorGridSettings::SampleType::STAGGERED);
 	}
 
-	// Returns the infinity-norm error of the numerical solution
+	// Returns the infinity-norm error of the numerical solution or -1 if the solve failed
 	template<typename Initial, typename Solution, typename Viscosity>
 	Real solve(const Initial& initial, const Solution& solution, const Viscosity& viscosity,
 				const Real dt);
@@ -158,6 +158,12 @@ Real AnalyticalViscositySolver::solve(const Initial& initialFunction,
 
 	bool solved = solver.solveDirect();
 
+	if (!solved)
+	{
+		std::cout << "Analytical viscosity test failed to solve" << std::endl;
+		return -1;
+	}
+
 	Real error = 0;
 
 	for (auto axis : { 0,1 })
@@ -0,0 +1,299 @@
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tbb/tbb.h"
+
+#include "Common.h"
+#include "EulerianLiquid.h"
+#include "EulerianSmoke.h"
+#include "ExecutionContext.h"
+#include "InitialConditions.h"
+#include "LevelSet2D.h"
+#include "MultiMaterialLiquid.h"
+#include "Reduction.h"
+#include "Renderer.h"
+#include "Transform.h"
+
+// Checks that each simulator continues bit for bit after a checkpoint is restored
+// when sums are REPRODUCIBLE. A run on two threads writes a checkpoint part way
+// through and keeps going. Fresh simulators restore it on one, two and four
+// threads and run to the same step. Their surfaces (or smoke density) and max
+// velocity must match the uninterrupted run exactly. Returns non-zero on
+// failure so it can run under CTest.
+
+static constexpr unsigned CHECKPOINTSTEP = 10;
+static constexpr unsigned TOTALSTEPS = 20;
+static constexpr unsigned WRITERTHREADS = 2;
+static constexpr unsigned MAXTHREADS = 4;
+
+static void appendGrid(std::vector<Real>& state, const LevelSet2D& surface)
+{
+	forEachVoxelRange(Vec2ui(0), surface.size(), [&](const Vec2ui& cell) { state.push_back(surface(cell)); });
+}
+
+static void appendGrid(std::vector<Real>& state, const ScalarGrid<Real>& grid)
+{
+	forEachVoxelRange(Vec2ui(0), grid.size(), [&](const Vec2ui& cell) { state.push_back(grid(cell)); });
+}
+
+// build() makes a simulator in its starting state, step(simulator, dt, renderer) advances it one
+// timestep and state(simulator) flattens the fields to compare.
+template<typename Build, typename Step, typename State>
+static bool checkRestart(const std::string& name, const Build& build, const Step& step, const State& state)
+{
+	const std::string prefix = "checkpointRestart_" + name;
+	const Real dt = 1. / 60.;
+
+	Renderer renderer(Vec2ui(10), Vec2R(0), 1);
+
+	std::vector<Real> expectedState;
+	bool written = false;
+
+	{
+		ExecutionContext context(WRITERTHREADS);
+		context.execute([&]()
+		{
+			auto simulator = build();
+
+			for (unsigned stepIndex = 0; stepIndex < TOTALSTEPS; ++stepIndex)
+			{
+				if (stepIndex == CHECKPOINTSTEP)
+				{
+					simulator->checkpoint(prefix, stepIndex);
+					written = simulator->finishCheckpoint();
+				}
+
+				step(*simulator, dt, renderer);
+			}
+
+			expectedState = state(*simulator);
+		});
+	}
+
+	if (!written)
+	{
+		std::cout << name << ": checkpoint was not written" << std::endl;
+		return false;
+	}
+
+	bool passed = true;
+
+	for (unsigned threadCount = 1; threadCount <= MAXTHREADS; threadCount *= 2)
+	{
+		ExecutionContext context(threadCount);
+		context.execute([&]()
+		{
+			auto simulator = build();
+
+			unsigned frame = 0;
+			if (!simulator->restore(prefix, frame) || frame != CHECKPOINTSTEP)
+			{
+				std::cout << name << ": restore failed on " << threadCount << " threads" << std::endl;
+				passed = false;
+				return;
+			}
+
+			for (unsigned stepIndex = CHECKPOINTSTEP; stepIndex < TOTALSTEPS; ++stepIndex)
+				step(*simulator, dt, renderer);
+
+			std::vector<Real> restoredState = state(*simulator);
+
+			if (restoredState.size() != expectedState.size() ||
+				std::memcmp(restoredState.data(), expectedState.data(), expectedState.size() * sizeof(Real)) != 0)
+			{
+				std::cout << name << ": restored run on " << threadCount << " threads doesn't match the run that wrote the checkpoint" << std::endl;
+				passed = false;
+			}
+		});
+	}
+
+	return passed;
+}
+
+static bool checkLiquid(bool solveViscosity)
+{
+	Vec2R topRightCorner(2.5);
+	Vec2R bottomLeftCorner(-2.5);
+	Real dx = 5. / 48.;
+	Vec2ui gridSize((topRightCorner - bottomLeftCorner) / dx);
+	Transform xform(dx, bottomLeftCorner);
+	Vec2R center = .5 * (topRightCorner + bottomLeftCorner);
+
+	Mesh2D liquidMesh = circleMesh(center - Vec2R(0, .65), 1, 40);
+	Mesh2D solidMesh = circleMesh(center, 2, 40);
+	solidMesh.reverse();
+
+	LevelSet2D liquidSurface(xform, gridSize, 10);
+	liquidSurface.init(liquidMesh, false);
+
+	LevelSet2D solidSurface(xform, gridSize, 10);
+	solidSurface.setInverted();
+	solidSurface.init(solidMesh, false);
+
+	auto build = [&]()
+	{
+		auto simulator = std::make_unique<EulerianLiquid>(xform, gridSize, 10);
+		simulator->unionLiquidSurface(liquidSurface);
+		simulator->setSolidSurface(solidSurface);
+		if (solveViscosity) simulator->setViscosity(1.);
+		return simulator;
+	};
+
+	auto step = [](EulerianLiquid& simulator, Real dt, Renderer& renderer)
+	{
+		simulator.addForce(dt, Vec2R(0, -9.8));
+		simulator.runTimestep(dt, renderer);
+	};
+
+	auto state = [](const EulerianLiquid& simulator)
+	{
+		std::vector<Real> state;
+		appendGrid(state, simulator.liquidSurface());
+		state.push_back(simulator.maxVelocityMagnitude());
+		return state;
+	};
+
+	return checkRestart(solveViscosity ? "viscousLiquid" : "liquid", build, step, state);
+}
+
+static bool checkSmoke()
+{
+	Vec2R topRightCorner(2.5);
+	Vec2R bottomLeftCorner(-2.5);
+	Real dx = 5. / 48.;
+	Vec2ui gridSize((topRightCorner - bottomLeftCorner) / dx);
+	Transform xform(dx, bottomLeftCorner);
+	Vec2R center = .5 * (topRightCorner + bottomLeftCorner);
+
+	Mesh2D solidMesh = squareMesh(center, Vec2R(2.));
+	solidMesh.reverse();
+
+	LevelSet2D solidSurface(xform, gridSize, 10);
+	solidSurface.setInverted();
+	solidSurface.init(solidMesh, false);
+
+	Mesh2D sourceMesh = circleMesh(center - Vec2R(0, 1.), .5, 40);
+	LevelSet2D sourceSurface(xform, gridSize, 10);
+	sourceSurface.init(sourceMesh, false);
+
+	Real ambientTemperature = 300;
+
+	ScalarGrid<Real> sourceDensity(xform, gridSize, 0);
+	ScalarGrid<Real> sourceTemperature(xform, gridSize, ambientTemperature);
+
+	forEachVoxelRange(Vec2ui(0), gridSize, [&](const Vec2ui& cell)
+	{
+		if (sourceSurface(cell) <= 0.)
+		{
+			sourceDensity(cell) = .2;
+			sourceTemperature(cell) = 350;
+		}
+	});
+
+	auto build = [&]()
+	{
+		auto simulator = std::make_unique<EulerianSmoke>(xform, gridSize, ambientTemperature);
+		simulator->setSolidSurface(solidSurface);
+		simulator->setSmokeSource(sourceDensity, sourceTemperature);
+		return simulator;
+	};
+
+	auto step = [&](EulerianSmoke& simulator, Real dt, Renderer& renderer)
+	{
+		simulator.runTimestep(dt, renderer);
+		simulator.setSmokeSource(sourceDensity, sourceTemperature);
+	};
+
+	auto state = [](const EulerianSmoke& simulator)
+	{
+		std::vector<Real> state;
+		appendGrid(state, simulator.smokeDensity());
+		state.push_back(simulator.maxVelocityMagnitude());
+		return state;
+	};
+
+	return checkRestart("smoke", build, step, state);
+}
+
+static bool checkMultiMaterial()
+{
+	Vec2R topRightCorner(2.5);
+	Vec2R bottomLeftCorner(-2.5);
+	Real dx = 5. / 48.;
+	Vec2ui gridSize((topRightCorner - bottomLeftCorner) / dx);
+	Transform xform(dx, bottomLeftCorner);
+	Vec2R center = .5 * (topRightCorner + bottomLeftCorner);
+
+	Mesh2D solidMesh = squareMesh(center, Vec2R(2.));
+	solidMesh.reverse();
+
+	LevelSet2D solidSurface(xform, gridSize, 10);
+	solidSurface.setInverted();
+	solidSurface.init(solidMesh, false);
+
+	Mesh2D bubbleMesh = circleMesh(center - Vec2R(0, 1.), .75, 40);
+
+	LevelSet2D bubbleSurface(xform, gridSize, 10);
+	bubbleSurface.init(bubbleMesh, false);
+	bubbleMesh.reverse();
+
+	Mesh2D liquidMesh = solidMesh;
+	liquidMesh.reverse();
+	liquidMesh.insertMesh(bubbleMesh);
+
+	LevelSet2D liquidSurface(xform, gridSize, 10);
+	liquidSurface.init(liquidMesh, false);
+
+	auto build = [&]()
+	{
+		auto simulator = std::make_unique<MultiMaterialLiquid>(xform, gridSize, 2, 5);
+		simulator->setSolidSurface(solidSurface);
+		simulator->setMaterial(liquidSurface, 1000, 0);
+		simulator->setMaterial(bubbleSurface, 100, 1);
+		return simulator;
+	};
+
+	auto step = [](MultiMaterialLiquid& simulator, Real dt, Renderer& renderer)
+	{
+		for (unsigned material = 0; material < 2; ++material)
+			simulator.addForce(dt, material, Vec2R(0., -9.8));
+
+		simulator.runTimestep(dt, renderer);
+	};
+
+	auto state = [](const MultiMaterialLiquid& simulator)
+	{
+		std::vector<Real> state;
+		for (unsigned material = 0; material < 2; ++material)
+			appendGrid(state, simulator.materialSurface(material));
+		state.push_back(simulator.maxVelocityMagnitude());
+		return state;
+	};
+
+	return checkRestart("multiMaterial", build, step, state);
+}
+
+int main()
+{
+	// Lets the contexts have more threads than the machine so the thread counts differ everywhere
+	tbb::global_control parallelism(tbb::global_control::max_allowed_parallelism, MAXTHREADS);
+
+	Reduction::setMode(ReductionMode::REPRODUCIBLE);
+
+	bool passed = checkLiquid(false);
+	passed = checkLiquid(true) && passed;
+	passed = checkSmoke() && passed;
+	passed = checkMultiMaterial() && passed;
+
+	if (!passed)
+	{
+		std::cout << "Failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "Passed" << std::endl;
+	return 0;
+}
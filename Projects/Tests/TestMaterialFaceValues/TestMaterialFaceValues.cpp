@@ -0,0 +1,300 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "MaterialFaceValues.h"
+#include "Transform.h"
+#include "VectorGrid.h"
+
+// Checks MaterialFaceValues against a dense staggered grid per material. Every
+// face belongs to one of three materials in a patchwork of blocks, and each
+// material also has values on a few faces around its blocks. Gathering the
+// dense grids into the shared grid and side table and scattering them back has
+// to give the same values exactly, as do the lookups, interpolation, setValue,
+// assign and relabel. Returns non-zero on failure so it can run under CTest.
+
+static constexpr unsigned MATERIALCOUNT = 3;
+
+static bool check(bool condition, const std::string& message)
+{
+	if (!condition)
+		std::cout << "  " << message << std::endl;
+
+	return condition;
+}
+
+template<typename Func>
+static void forEachFace(const VectorGrid<Real>& grid, const Func& func)
+{
+	for (unsigned axis : {0, 1})
+		forEachVoxelRange(Vec2ui(0), grid.size(axis), [&](const Vec2ui& face) { func(face, axis); });
+}
+
+static bool isSameField(const VectorGrid<Real>& field, const VectorGrid<Real>& expected)
+{
+	bool isSame = true;
+	forEachFace(expected, [&](const Vec2ui& face, unsigned axis)
+	{
+		if (field(face, axis) != expected(face, axis)) isSame = false;
+	});
+
+	return isSame;
+}
+
+static bool isConsistent(const MaterialFaceValues& values, const VectorGrid<int>& owners)
+{
+	const std::vector<MaterialFaceValues::Entry>& entries = values.entries();
+
+	if (!std::is_sorted(entries.begin(), entries.end()))
+		return false;
+
+	for (const MaterialFaceValues::Entry& entry : entries)
+	{
+		Vec2ui face; unsigned axis;
+		values.keyToFace(entry.face, face, axis);
+
+		if (values.faceKey(face, axis) != entry.face || owners(face, axis) == int(entry.material))
+			return false;
+	}
+
+	return true;
+}
+
+// Scatters every material and compares them to the dense fields
+static bool matchesFields(const MaterialFaceValues& values, const VectorGrid<int>& owners, const std::vector<VectorGrid<Real>>& fields)
+{
+	bool matches = true;
+
+	for (unsigned material = 0; material < MATERIALCOUNT; ++material)
+	{
+		VectorGrid<Real> scattered(fields[material].xform(), fields[material].gridSize(), 1, VectorGridSettings::SampleType::STAGGERED);
+		values.scatter(owners, material, scattered);
+		matches &= isSameField(scattered, fields[material]);
+
+		forEachFace(fields[material], [&](const Vec2ui& face, unsigned axis)
+		{
+			Real expected = fields[material](face, axis);
+			if (values.value(owners, face, axis, material) != expected) matches = false;
+
+			// Materials that aren't on a face have nothing there, so a zero is the only gap allowed
+			if (!values.hasValue(owners, face, axis, material) && expected != 0) matches = false;
+		});
+	}
+
+	return matches;
+}
+
+int main()
+{
+	Real dx = .1;
+	Vec2ui size(13, 11);
+	Transform xform(dx, Vec2R(-.3, .2));
+
+	// Blocks of 4x3 faces cycle through the materials
+	auto blockOwner = [](const Vec2ui& face, int shift) { return int((face[0] / 4 + face[1] / 3 + shift) % MATERIALCOUNT); };
+
+	VectorGrid<int> owners(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+	VectorGrid<int> shiftedOwners(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+
+	for (unsigned axis : {0, 1})
+		forEachVoxelRange(Vec2ui(0), owners.size(axis), [&](const Vec2ui& face)
+		{
+			owners(face, axis) = blockOwner(face, 0);
+			shiftedOwners(face, axis) = blockOwner(face + Vec2ui(1, 0), 1);
+		});
+
+	// A material has a value on the faces it owns and on the faces next to them along the
+	// second axis. Values are distinct and non-zero.
+	auto isNearOwnedFace = [&](const Vec2ui& face, unsigned axis, unsigned material)
+	{
+		Vec2ui faceSize = owners.size(axis);
+		for (int offset = -1; offset <= 1; ++offset)
+		{
+			int j = int(face[1]) + offset;
+			if (j >= 0 && j < int(faceSize[1]) && owners(Vec2ui(face[0], j), axis) == int(material))
+				return true;
+		}
+
+		return false;
+	};
+
+	std::vector<VectorGrid<Real>> fields(MATERIALCOUNT, VectorGrid<Real>(xform, size, 0, VectorGridSettings::SampleType::STAGGERED));
+
+	for (unsigned material = 0; material < MATERIALCOUNT; ++material)
+		forEachFace(fields[material], [&](const Vec2ui& face, unsigned axis)
+		{
+			if (isNearOwnedFace(face, axis, material))
+				fields[material](face, axis) = 1. + material + .01 * face[0] + .001 * face[1] + .1 * axis;
+		});
+
+	bool passed = true;
+
+	//
+	// Gather the dense fields and scatter them back
+	//
+
+	std::cout << "Gather and scatter" << std::endl;
+
+	MaterialFaceValues values(xform, size);
+
+	values.beginGather();
+	for (unsigned material = 0; material < MATERIALCOUNT; ++material)
+		values.gather(owners, material, fields[material], [](const Vec2ui&, unsigned, Real value) { return value != 0; });
+	values.finishGather();
+
+	passed &= check(!values.entries().empty(), "no side table entries were gathered");
+	passed &= check(isConsistent(values, owners), "the side table isn't sorted or holds a face's owner");
+	passed &= check(matchesFields(values, owners, fields), "scattered values don't match the gathered fields");
+
+	// Each face visits its owner and its entries once, in material order
+	bool visitsInOrder = true;
+	forEachFace(fields[0], [&](const Vec2ui& face, unsigned axis)
+	{
+		std::vector<unsigned> visited;
+		values.forEachMaterial(owners, face, axis, [&](unsigned material, Real value)
+		{
+			if (value != fields[material](face, axis)) visitsInOrder = false;
+			visited.push_back(material);
+		});
+
+		std::vector<unsigned> expected;
+		for (unsigned material = 0; material < MATERIALCOUNT; ++material)
+		{
+			if (owners(face, axis) == int(material) || fields[material](face, axis) != 0)
+				expected.push_back(material);
+		}
+
+		if (visited != expected) visitsInOrder = false;
+	});
+
+	passed &= check(visitsInOrder, "forEachMaterial doesn't visit the face's materials in order");
+
+	//
+	// Interpolation matches a clamped dense grid, including past the edges of the grid
+	//
+
+	std::cout << "Interpolation" << std::endl;
+
+	bool interpolationMatches = true;
+	for (unsigned material = 0; material < MATERIALCOUNT; ++material)
+		for (unsigned i = 0; i < 3 * (size[0] + 4); ++i)
+			for (unsigned j = 0; j < 3 * (size[1] + 4); ++j)
+			{
+				Vec2R worldPoint = xform.indexToWorld(Vec2R(Real(i) / 3. - 2. + .01, Real(j) / 3. - 2. + .02));
+
+				Vec2R sample = values.interp(owners, worldPoint, material);
+				Vec2R expected = fields[material].interp(worldPoint);
+
+				if (sample[0] != expected[0] || sample[1] != expected[1]) interpolationMatches = false;
+			}
+
+	passed &= check(interpolationMatches, "interpolation doesn't match the dense fields");
+
+	//
+	// setValue adds or updates an entry and leaves everything else alone
+	//
+
+	std::cout << "Set value" << std::endl;
+
+	{
+		MaterialFaceValues setValues = values;
+		std::vector<VectorGrid<Real>> setFields = fields;
+
+		// Owner values and entries on both axes. Entries that don't exist yet are inserted, which
+		// moves the table under every row after them.
+		std::vector<std::pair<Vec2ui, unsigned>> faces = { { Vec2ui(1, 1), 0 }, { Vec2ui(2, 1), 1 }, { Vec2ui(5, 4), 0 }, { Vec2ui(7, 7), 1 } };
+
+		for (unsigned faceIndex = 0; faceIndex < faces.size(); ++faceIndex)
+		{
+			Vec2ui face = faces[faceIndex].first;
+			unsigned axis = faces[faceIndex].second;
+			unsigned material = (unsigned(owners(face, axis)) + faceIndex) % MATERIALCOUNT;
+
+			Real value = -5. - faceIndex;
+			setValues.setValue(owners, face, axis, material, value);
+			setFields[material](face, axis) = value;
+		}
+
+		passed &= check(isConsistent(setValues, owners), "setValue left the table unsorted");
+		passed &= check(matchesFields(setValues, owners, setFields), "setValue changed the wrong values");
+	}
+
+	//
+	// assign gives every value on the same faces a new value and drops rejected entries
+	//
+
+	std::cout << "Assign" << std::endl;
+
+	{
+		auto newValue = [&](const Vec2ui& face, unsigned axis, unsigned material) -> Real
+		{
+			// Every third face of the last material goes to zero and isn't kept
+			if (material == MATERIALCOUNT - 1 && (face[0] + face[1]) % 3 == 0)
+				return 0;
+
+			return 2. * values.value(owners, face, axis, material) + 1.;
+		};
+
+		MaterialFaceValues assignedValues(xform, size);
+		assignedValues.assign(owners, values, newValue, [](const Vec2ui&, unsigned, Real value) { return value != 0; });
+
+		std::vector<VectorGrid<Real>> assignedFields = fields;
+		for (unsigned material = 0; material < MATERIALCOUNT; ++material)
+			forEachFace(fields[material], [&](const Vec2ui& face, unsigned axis)
+			{
+				if (owners(face, axis) == int(material) || fields[material](face, axis) != 0)
+					assignedFields[material](face, axis) = newValue(face, axis, material);
+			});
+
+		passed &= check(assignedValues.entries().size() < values.entries().size(), "assign didn't drop any entries");
+		passed &= check(isConsistent(assignedValues, owners), "assign left the table unsorted");
+		passed &= check(matchesFields(assignedValues, owners, assignedFields), "assigned values don't match");
+	}
+
+	//
+	// Relabelling moves values to the new owners, keeps supported values and drops the rest
+	//
+
+	std::cout << "Relabel" << std::endl;
+
+	{
+		auto isSupported = [&](const Vec2ui& face, unsigned axis, unsigned material)
+		{
+			return isNearOwnedFace(face, axis, material) || face[0] % 2 == 0;
+		};
+
+		MaterialFaceValues relabelledValues = values;
+		relabelledValues.relabel(owners, shiftedOwners, MATERIALCOUNT, isSupported);
+
+		std::vector<VectorGrid<Real>> relabelledFields = fields;
+		for (unsigned material = 0; material < MATERIALCOUNT; ++material)
+			forEachFace(fields[material], [&](const Vec2ui& face, unsigned axis)
+			{
+				if (!(shiftedOwners(face, axis) == int(material) || isSupported(face, axis, material)))
+					relabelledFields[material](face, axis) = 0;
+			});
+
+		passed &= check(isConsistent(relabelledValues, shiftedOwners), "relabel left the table unsorted or holding an owner");
+		passed &= check(matchesFields(relabelledValues, shiftedOwners, relabelledFields), "relabelled values don't match");
+
+		// A supported material with no value before gets an explicit zero
+		bool hasZeroEntries = std::any_of(relabelledValues.entries().begin(), relabelledValues.entries().end(),
+											[](const MaterialFaceValues::Entry& entry) { return entry.value == 0; });
+		passed &= check(hasZeroEntries, "relabel didn't add entries for newly supported materials");
+
+		// Relabelling back to the original owners with the original support restores the gather
+		relabelledValues.relabel(shiftedOwners, owners, MATERIALCOUNT, isNearOwnedFace);
+		passed &= check(matchesFields(relabelledValues, owners, fields), "relabelling back didn't restore the values");
+	}
+
+	if (!passed)
+	{
+		std::cout << "Failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "Passed" << std::endl;
+	return 0;
+}
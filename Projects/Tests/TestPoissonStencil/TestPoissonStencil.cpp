@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+
+#include "Eigen/Sparse"
+#include "tbb/tbb.h"
+
+#include "Common.h"
+#include "InitialConditions.h"
+#include "LevelSet2D.h"
+#include "PoissonStencil.h"
+#include "PressureProjection.h"
+#include "ProjectionWeights.h"
+#include "Transform.h"
+#include "UniformGrid.h"
+#include "VectorGrid.h"
+
+// Checks the matrix-free PoissonStencil kernels against the system assembled
+// by PressureProjection for a liquid blob resting against a curved solid wall,
+// so the stencil sees cut-cell weights, ghost fluid weights and cells outside
+// of the solve. The grid isn't square and isn't a multiple of the red-black
+// block height so the block edges are exercised. Returns non-zero on failure
+// so it can run under CTest.
+//
+// Usage: TestPoissonStencil [--threads N]
+
+static constexpr double TOLERANCE = 1E-12;
+
+using SparseMatrix = Eigen::SparseMatrix<double, Eigen::RowMajor>;
+
+// Largest difference between a grid and a reference vector over the solved cells, relative to the
+// largest reference value. Unsolved cells must be exactly zero in the grid.
+static double relativeError(const UniformGrid<double>& grid, const Eigen::VectorXd& reference, const UniformGrid<int>& cellIndex)
+{
+	double error = 0;
+	double scale = std::max(reference.lpNorm<Eigen::Infinity>(), 1E-300);
+
+	forEachVoxelRange(Vec2ui(0), cellIndex.size(), [&](const Vec2ui& cell)
+	{
+		int row = cellIndex(cell);
+		if (row >= 0)
+			error = std::max(error, std::fabs(grid(cell) - reference[row]) / scale);
+		else if (grid(cell) != 0)
+			error = std::numeric_limits<double>::infinity();
+	});
+
+	return error;
+}
+
+static Eigen::VectorXd toVector(const UniformGrid<double>& grid, const UniformGrid<int>& cellIndex, unsigned rows)
+{
+	Eigen::VectorXd vector(rows);
+
+	forEachVoxelRange(Vec2ui(0), cellIndex.size(), [&](const Vec2ui& cell)
+	{
+		int row = cellIndex(cell);
+		if (row >= 0) vector[row] = grid(cell);
+	});
+
+	return vector;
+}
+
+// Relaxes every cell of one colour in turn, straight from the assembled matrix. Cells of one
+// colour don't couple so the order within a colour doesn't matter.
+static void relaxColour(const SparseMatrix& matrix, const Eigen::VectorXd& rhs, Eigen::VectorXd& solution,
+						const UniformGrid<int>& cellIndex, unsigned colour)
+{
+	forEachVoxelRange(Vec2ui(0), cellIndex.size(), [&](const Vec2ui& cell)
+	{
+		int row = cellIndex(cell);
+		if (row < 0 || (cell[0] + cell[1]) % 2 != colour) return;
+
+		double diagonal = 0;
+		double sum = rhs[row];
+
+		for (SparseMatrix::InnerIterator entry(matrix, row); entry; ++entry)
+		{
+			if (entry.col() == row)
+				diagonal = entry.value();
+			else
+				sum -= entry.value() * solution[entry.col()];
+		}
+
+		solution[row] = sum / diagonal;
+	});
+}
+
+int main(int argc, char** argv)
+{
+	unsigned threads = unsigned(tbb::this_task_arena::max_concurrency());
+
+	for (int arg = 1; arg + 1 < argc; arg += 2)
+	{
+		std::string option(argv[arg]);
+		int value = std::atoi(argv[arg + 1]);
+
+		if (option == "--threads" && value > 0)
+			threads = unsigned(value);
+		else
+		{
+			std::cout << "Usage: " << argv[0] << " [--threads N]" << std::endl;
+			return 1;
+		}
+	}
+
+	tbb::global_control threadLimit(tbb::global_control::max_allowed_parallelism, threads);
+
+	std::cout << "Threads: " << threads << std::endl;
+
+	Vec2R bottomLeftCorner(-2.5, -2.2);
+	Real dx = 5. / 70.;
+	Vec2ui size(70, 63);
+	Transform xform(dx, bottomLeftCorner);
+
+	// The liquid reaches past the wall so it picks up cut cells along its bottom
+	Mesh2D liquidMesh = circleMesh(Vec2R(.3, -1.2), 1, 40);
+	Mesh2D solidMesh = circleMesh(Vec2R(0), 2, 40);
+	solidMesh.reverse();
+
+	LevelSet2D liquidSurface(xform, size, 10);
+	liquidSurface.init(liquidMesh, false);
+
+	LevelSet2D solidSurface(xform, size, 10);
+	solidSurface.setInverted();
+	solidSurface.init(solidMesh, false);
+
+	// Extend the liquid into the solid like the simulators do before the projection
+	forEachVoxelRange(Vec2ui(0), size, [&](const Vec2ui& cell)
+	{
+		if (solidSurface(cell) <= 0)
+			liquidSurface(cell) -= dx;
+	});
+
+	ProjectionWeights weights(xform, size);
+	weights.compute(liquidSurface, solidSurface, true, false);
+
+	std::mt19937 generator(1);
+	std::uniform_real_distribution<double> distribution(-1, 1);
+
+	VectorGrid<Real> liquidVelocity(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+	VectorGrid<Real> solidVelocity(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+
+	for (unsigned axis : {0, 1})
+		forEachVoxelRange(Vec2ui(0), liquidVelocity.size(axis), [&](const Vec2ui& face)
+		{
+			liquidVelocity(face, axis) = distribution(generator);
+			solidVelocity(face, axis) = .1 * distribution(generator);
+		});
+
+	PressureProjection projection(liquidSurface, liquidVelocity, solidSurface, solidVelocity);
+	projection.project(weights.ghostFluidWeights(), weights.cutCellWeights());
+
+	const UniformGrid<int>& cellIndex = projection.cellIndex();
+	SparseMatrix matrix = projection.assembledMatrix();
+	unsigned rows = unsigned(matrix.rows());
+
+	std::cout << "Solved cells: " << rows << " of " << size[0] * size[1] << std::endl;
+
+	PoissonStencil stencil(cellIndex, weights.cutCellWeights(), weights.ghostFluidWeights());
+
+	// Random input and right-hand side that are zero outside of the solve
+	UniformGrid<double> x(size, 0), b(size, 0);
+	forEachVoxelRange(Vec2ui(0), size, [&](const Vec2ui& cell)
+	{
+		if (cellIndex(cell) >= 0)
+		{
+			x(cell) = distribution(generator);
+			b(cell) = distribution(generator);
+		}
+	});
+
+	Eigen::VectorXd xVector = toVector(x, cellIndex, rows);
+	Eigen::VectorXd bVector = toVector(b, cellIndex, rows);
+	Eigen::VectorXd diagonal = matrix.diagonal();
+
+	bool passed = true;
+
+	auto check = [&](const std::string& name, double error)
+	{
+		bool isPassing = error < TOLERANCE;
+		std::cout << name << " relative error: " << error << (isPassing ? "" : " (failed)") << std::endl;
+		passed = passed && isPassing;
+	};
+
+	UniformGrid<double> output(size, 0);
+
+	stencil.apply(x, output);
+	check("Apply", relativeError(output, matrix * xVector, cellIndex));
+
+	Eigen::VectorXd residual = bVector - matrix * xVector;
+	double norm2 = stencil.residual(b, x, output);
+	check("Residual", relativeError(output, residual, cellIndex));
+	check("Residual norm", std::fabs(norm2 - residual.squaredNorm()) / residual.squaredNorm());
+
+	double omega = 2. / 3.;
+	stencil.weightedJacobi(b, x, output, omega);
+	check("Weighted Jacobi", relativeError(output, xVector + omega * residual.cwiseQuotient(diagonal), cellIndex));
+
+	// A forward sweep followed by a reverse sweep against a plain red, black, black, red relaxation
+	UniformGrid<double> relaxed = x;
+	stencil.redBlackGaussSeidel(b, relaxed);
+	stencil.redBlackGaussSeidel(b, relaxed, true);
+
+	Eigen::VectorXd reference = xVector;
+	relaxColour(matrix, bVector, reference, cellIndex, 0);
+	relaxColour(matrix, bVector, reference, cellIndex, 1);
+	relaxColour(matrix, bVector, reference, cellIndex, 1);
+	relaxColour(matrix, bVector, reference, cellIndex, 0);
+
+	check("Red-black Gauss-Seidel", relativeError(relaxed, reference, cellIndex));
+
+	if (passed)
+		std::cout << "Passed" << std::endl;
+	else
+		std::cout << "Failed: the stencil doesn't match the assembled pressure system" << std::endl;
+
+	return passed ? 0 : 1;
+}
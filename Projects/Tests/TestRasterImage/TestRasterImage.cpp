@@ -0,0 +1,352 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "RasterImage.h"
+
+// Checks the CPU rasterizer and the image writers. A triangle, a line and a
+// point are drawn on a white image and the pixels they cover are compared with
+// the coverage worked out by hand. Drawing in two bands of rows has to give the
+// same image as drawing in one. The PPM and PNG files are then parsed byte by
+// byte:
+// - the PPM header and pixels;
+// - the PNG signature, IHDR and chunk CRCs;
+// - the stored deflate block lengths and the Adler-32 of the pixel rows.
+// The checksums are computed here independently of the writer. Returns non-zero
+// on failure so it can run under CTest.
+
+static const Vec3f RED(1, 0, 0);
+
+static bool check(bool condition, const std::string& message)
+{
+	if (!condition)
+		std::cout << "  " << message << std::endl;
+
+	return condition;
+}
+
+static std::vector<unsigned char> readBytes(const std::string& filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	return std::vector<unsigned char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static bool isWhite(const RasterImage& image, unsigned x, unsigned y)
+{
+	const unsigned char* pixel = image.data() + 4 * (x + image.width() * y);
+	return pixel[0] == 255 && pixel[1] == 255 && pixel[2] == 255;
+}
+
+static bool isRed(const RasterImage& image, unsigned x, unsigned y)
+{
+	const unsigned char* pixel = image.data() + 4 * (x + image.width() * y);
+	return pixel[0] == 255 && pixel[1] == 0 && pixel[2] == 0;
+}
+
+// Pixels that are neither the background nor the full colour, i.e. anti-aliased edges
+static bool isPartial(const RasterImage& image, unsigned x, unsigned y)
+{
+	return !isWhite(image, x, y) && !isRed(image, x, y);
+}
+
+static bool isSameImage(const RasterImage& image, const RasterImage& expected)
+{
+	return image.width() == expected.width() && image.height() == expected.height() &&
+			std::equal(image.data(), image.data() + 4 * image.width() * image.height(), expected.data());
+}
+
+// Draws the primitive over all of the rows at once and again in two bands, which must agree
+template<typename Draw>
+static RasterImage drawInBands(unsigned size, const Draw& draw, bool& bandsMatch)
+{
+	RasterImage image(size, size);
+	draw(image, 0, size);
+
+	RasterImage bandedImage(size, size);
+	draw(bandedImage, 0, size / 2 + 1);
+	draw(bandedImage, size / 2 + 1, size);
+
+	bandsMatch = isSameImage(bandedImage, image);
+	return image;
+}
+
+static bool checkRasterizer()
+{
+	static constexpr unsigned SIZE = 20;
+	bool passed = true;
+
+	std::cout << "Triangle" << std::endl;
+
+	{
+		// Right triangle whose legs run along x = 2 and y = 2 and whose hypotenuse is x + y = 20.
+		// A pixel is filled when its center is inside or on an edge.
+		bool bandsMatch;
+		RasterImage image = drawInBands(SIZE, [](RasterImage& image, unsigned rowBegin, unsigned rowEnd)
+		{
+			image.fillTriangle(Vec2R(2, 2), Vec2R(18, 2), Vec2R(2, 18), RED, rowBegin, rowEnd);
+		}, bandsMatch);
+
+		passed &= check(bandsMatch, "drawing the triangle in bands changed the image");
+
+		bool coverageMatches = true;
+		for (unsigned x = 0; x < SIZE; ++x)
+			for (unsigned y = 0; y < SIZE; ++y)
+			{
+				bool isInside = x >= 2 && y >= 2 && x + y + 1 <= 20;
+				if (isInside ? !isRed(image, x, y) : !isWhite(image, x, y))
+					coverageMatches = false;
+			}
+
+		passed &= check(coverageMatches, "the triangle doesn't cover the pixels whose centers are inside of it");
+
+		// The winding doesn't matter
+		RasterImage reversedImage(SIZE, SIZE);
+		reversedImage.fillTriangle(Vec2R(2, 18), Vec2R(18, 2), Vec2R(2, 2), RED, 0, SIZE);
+		passed &= check(isSameImage(reversedImage, image), "reversing the triangle changed its coverage");
+	}
+
+	std::cout << "Line" << std::endl;
+
+	{
+		// Two pixel wide horizontal line along y = 10. Coverage falls off over one pixel past the
+		// half width so rows 9 and 10 are fully covered and rows 8 and 11 are not touched.
+		bool bandsMatch;
+		RasterImage image = drawInBands(SIZE, [](RasterImage& image, unsigned rowBegin, unsigned rowEnd)
+		{
+			image.drawLine(Vec2R(2, 10), Vec2R(18, 10), RED, 2, rowBegin, rowEnd);
+		}, bandsMatch);
+
+		passed &= check(bandsMatch, "drawing the line in bands changed the image");
+
+		bool coverageMatches = true;
+		for (unsigned x = 0; x < SIZE; ++x)
+			for (unsigned y = 0; y < SIZE; ++y)
+			{
+				bool isCovered = (y == 9 || y == 10) && x >= 2 && x <= 17;
+				bool isCap = (y == 9 || y == 10) && (x == 1 || x == 18);
+
+				if (isCovered && !isRed(image, x, y)) coverageMatches = false;
+				else if (isCap && !isPartial(image, x, y)) coverageMatches = false;
+				else if (!isCovered && !isCap && !isWhite(image, x, y)) coverageMatches = false;
+			}
+
+		passed &= check(coverageMatches, "the line doesn't cover the expected pixels");
+	}
+
+	std::cout << "Point" << std::endl;
+
+	{
+		// Three pixel disc centered on pixel (10, 10). Coverage falls off between one and two pixels
+		// from the center.
+		bool bandsMatch;
+		RasterImage image = drawInBands(SIZE, [](RasterImage& image, unsigned rowBegin, unsigned rowEnd)
+		{
+			image.drawPoint(Vec2R(10.5, 10.5), RED, 3, rowBegin, rowEnd);
+		}, bandsMatch);
+
+		passed &= check(bandsMatch, "drawing the point in bands changed the image");
+
+		bool coverageMatches = true;
+		for (unsigned x = 0; x < SIZE; ++x)
+			for (unsigned y = 0; y < SIZE; ++y)
+			{
+				int offsetX = int(x) - 10, offsetY = int(y) - 10;
+				int distance2 = offsetX * offsetX + offsetY * offsetY;
+
+				if (distance2 <= 1 && !isRed(image, x, y)) coverageMatches = false;
+				else if (distance2 == 2 && !isPartial(image, x, y)) coverageMatches = false;
+				else if (distance2 >= 4 && !isWhite(image, x, y)) coverageMatches = false;
+			}
+
+		passed &= check(coverageMatches, "the point doesn't cover the expected pixels");
+	}
+
+	return passed;
+}
+
+// Independent bitwise CRC-32 as used by PNG
+static uint32_t referenceCRC(const unsigned char* data, std::size_t length)
+{
+	uint32_t crc = 0xFFFFFFFFu;
+	for (std::size_t index = 0; index < length; ++index)
+	{
+		crc ^= data[index];
+		for (unsigned bit = 0; bit < 8; ++bit)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+	}
+	return ~crc;
+}
+
+static uint32_t referenceAdler(const std::vector<unsigned char>& data)
+{
+	uint32_t a = 1, b = 0;
+	for (unsigned char value : data)
+	{
+		a = (a + value) % 65521;
+		b = (b + a) % 65521;
+	}
+	return (b << 16) | a;
+}
+
+static uint32_t readBigEndian(const unsigned char* data)
+{
+	return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+}
+
+static bool checkWriters()
+{
+	// Wide enough that the pixel rows need more than one stored deflate block
+	static constexpr unsigned WIDTH = 203;
+	static constexpr unsigned HEIGHT = 97;
+
+	RasterImage image(WIDTH, HEIGHT);
+	for (unsigned x = 0; x < WIDTH; ++x)
+		for (unsigned y = 0; y < HEIGHT; ++y)
+			image.setPixel(x, y, Vec3f(float(x) / WIDTH, float(y) / HEIGHT, float((x * 7 + y * 3) % 11) / 10.f));
+
+	bool passed = true;
+
+	std::cout << "PPM" << std::endl;
+
+	{
+		passed &= check(image.write("rasterImage.ppm"), "the PPM wasn't written");
+
+		std::vector<unsigned char> bytes = readBytes("rasterImage.ppm");
+		std::string header = "P6\n" + std::to_string(WIDTH) + " " + std::to_string(HEIGHT) + "\n255\n";
+
+		bool isValid = bytes.size() == header.size() + 3 * WIDTH * HEIGHT && std::equal(header.begin(), header.end(), bytes.begin());
+		passed &= check(isValid, "the PPM header or size is wrong");
+
+		bool pixelsMatch = isValid;
+		for (unsigned pixel = 0; pixel < WIDTH * HEIGHT && isValid; ++pixel)
+			for (unsigned channel = 0; channel < 3; ++channel)
+			{
+				if (bytes[header.size() + 3 * pixel + channel] != image.data()[4 * pixel + channel])
+					pixelsMatch = false;
+			}
+
+		passed &= check(pixelsMatch, "the PPM pixels don't match the image");
+	}
+
+	std::cout << "PNG" << std::endl;
+
+	{
+		passed &= check(image.write("rasterImage.png"), "the PNG wasn't written");
+
+		std::vector<unsigned char> bytes = readBytes("rasterImage.png");
+
+		static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		bool isValid = bytes.size() > 8 && std::equal(signature, signature + 8, bytes.begin());
+		passed &= check(isValid, "the PNG signature is wrong");
+
+		// Walk the chunks and check every CRC
+		struct Chunk { std::string type; std::vector<unsigned char> data; };
+		std::vector<Chunk> chunks;
+
+		std::size_t offset = 8;
+		while (isValid && offset + 12 <= bytes.size())
+		{
+			uint32_t length = readBigEndian(&bytes[offset]);
+			if (offset + 12 + length > bytes.size())
+			{
+				isValid = false;
+				break;
+			}
+
+			const unsigned char* typeAndData = &bytes[offset + 4];
+			if (readBigEndian(typeAndData + 4 + length) != referenceCRC(typeAndData, 4 + length))
+				isValid = false;
+
+			chunks.push_back(Chunk{ std::string(typeAndData, typeAndData + 4), std::vector<unsigned char>(typeAndData + 4, typeAndData + 4 + length) });
+			offset += 12 + length;
+		}
+
+		isValid &= offset == bytes.size();
+		passed &= check(isValid, "the PNG chunks don't line up or a CRC is wrong");
+
+		isValid &= chunks.size() == 3 && chunks[0].type == "IHDR" && chunks[1].type == "IDAT" && chunks[2].type == "IEND" && chunks[2].data.empty();
+		passed &= check(isValid, "the PNG isn't IHDR, IDAT, IEND");
+
+		if (isValid)
+		{
+			const std::vector<unsigned char>& header = chunks[0].data;
+			bool isHeaderValid = header.size() == 13 && readBigEndian(&header[0]) == WIDTH && readBigEndian(&header[4]) == HEIGHT &&
+									header[8] == 8 && header[9] == 6 && header[10] == 0 && header[11] == 0 && header[12] == 0;
+			passed &= check(isHeaderValid, "the IHDR doesn't describe an 8 bit RGBA image of the right size");
+
+			// zlib header, stored deflate blocks and the Adler-32 of the uncompressed data
+			const std::vector<unsigned char>& stream = chunks[1].data;
+			bool isStreamValid = stream.size() >= 6 && stream[0] == 0x78 && (stream[0] * 256 + stream[1]) % 31 == 0;
+
+			std::vector<unsigned char> raw;
+			unsigned blockCount = 0;
+			std::size_t position = 2;
+			bool isFinal = false;
+
+			while (isStreamValid && !isFinal && position + 5 <= stream.size())
+			{
+				isFinal = (stream[position] & 1) != 0;
+
+				// Stored blocks have a block type of zero
+				isStreamValid &= (stream[position] >> 1) == 0;
+
+				unsigned length = stream[position + 1] | (unsigned(stream[position + 2]) << 8);
+				unsigned complement = stream[position + 3] | (unsigned(stream[position + 4]) << 8);
+				isStreamValid &= (length ^ 0xFFFF) == complement;
+
+				position += 5;
+				if (position + length > stream.size())
+				{
+					isStreamValid = false;
+					break;
+				}
+
+				raw.insert(raw.end(), stream.begin() + position, stream.begin() + position + length);
+				position += length;
+				++blockCount;
+			}
+
+			isStreamValid &= isFinal && position + 4 == stream.size();
+			passed &= check(isStreamValid, "the deflate stream isn't a run of stored blocks ending in the final block");
+			passed &= check(blockCount > 1, "the image didn't need more than one stored block");
+
+			passed &= check(isStreamValid && readBigEndian(&stream[position]) == referenceAdler(raw), "the Adler-32 is wrong");
+
+			// Every row is a zero filter byte followed by the RGBA pixels
+			bool rowsMatch = raw.size() == (4 * WIDTH + 1) * HEIGHT;
+			for (unsigned y = 0; y < HEIGHT && rowsMatch; ++y)
+			{
+				const unsigned char* row = &raw[(4 * WIDTH + 1) * y];
+				rowsMatch = row[0] == 0 && std::equal(row + 1, row + 1 + 4 * WIDTH, image.data() + 4 * WIDTH * y);
+			}
+
+			passed &= check(rowsMatch, "the PNG rows don't match the image");
+		}
+	}
+
+	std::remove("rasterImage.ppm");
+	std::remove("rasterImage.png");
+
+	return passed;
+}
+
+int main()
+{
+	bool passed = checkRasterizer();
+	passed = checkWriters() && passed;
+
+	if (!passed)
+	{
+		std::cout << "Failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "Passed" << std::endl;
+	return 0;
+}
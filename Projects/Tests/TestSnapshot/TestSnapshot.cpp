@@ -0,0 +1,283 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "FluidParticles.h"
+#include "GridSnapshot.h"
+#include "InitialConditions.h"
+#include "LevelSet2D.h"
+#include "ScalarGrid.h"
+#include "Transform.h"
+#include "VectorGrid.h"
+
+// Checks the binary snapshots round trip. Each grid, level set and particle set
+// is written, mapped to check the header and raw blocks, and read back into a
+// fresh object that must match the original bit for bit. Writing the read
+// object again has to give the same file. Truncated and corrupted files must be
+// rejected and leave the object they're read into untouched. Returns non-zero
+// on failure so it can run under CTest.
+
+static bool check(bool condition, const std::string& message)
+{
+	if (!condition)
+		std::cout << "  " << message << std::endl;
+
+	return condition;
+}
+
+static std::vector<char> readBytes(const std::string& filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static void writeBytes(const std::string& filename, const std::vector<char>& bytes)
+{
+	std::ofstream file(filename, std::ios::binary);
+	file.write(bytes.data(), bytes.size());
+}
+
+// Writes a copy of a snapshot with the header changed by edit
+template<typename Edit>
+static void writeEditedHeader(const std::string& filename, const std::string& editedFilename, const Edit& edit)
+{
+	std::vector<char> bytes = readBytes(filename);
+
+	SnapshotHeader header;
+	std::memcpy(&header, bytes.data(), sizeof(SnapshotHeader));
+	edit(header);
+	std::memcpy(bytes.data(), &header, sizeof(SnapshotHeader));
+
+	writeBytes(editedFilename, bytes);
+}
+
+template<typename T>
+static bool isSameGrid(const ScalarGrid<T>& grid, const ScalarGrid<T>& expected)
+{
+	if (!(grid.size() == expected.size()) || grid.xform() != expected.xform() || grid.sampleType() != expected.sampleType() ||
+		grid.borderType() != expected.borderType())
+		return false;
+
+	return std::memcmp(grid.data(), expected.data(), sizeof(T) * expected.size()[0] * expected.size()[1]) == 0;
+}
+
+// The header and blocks of a mapped snapshot match the grid it was written from
+template<typename T>
+static bool matchesMapping(const MappedSnapshot& snapshot, unsigned block, const ScalarGrid<T>& grid)
+{
+	const SnapshotHeader& header = snapshot.header();
+
+	if (header.blockOffset[block] % SnapshotSettings::ALIGNMENT != 0 || !(snapshot.blockSize(block) == grid.size()) ||
+		header.xform() != grid.xform() || !(ScalarGrid<T>::sampleSize(Vec2ui(header.gridSize[0], header.gridSize[1]), grid.sampleType()) == grid.size()))
+		return false;
+
+	return std::memcmp(snapshot.block<T>(block), grid.data(), snapshot.blockBytes(block)) == 0;
+}
+
+static bool checkScalarGrid()
+{
+	std::cout << "Scalar grid" << std::endl;
+
+	Transform xform(.1, Vec2R(-.5, .25));
+	ScalarGrid<Real> grid(xform, Vec2ui(17, 9), 0, ScalarGridSettings::SampleType::NODE, ScalarGridSettings::BorderType::ZERO);
+
+	forEachVoxelRange(Vec2ui(0), grid.size(), [&](const Vec2ui& node) { grid(node) = std::sin(Real(node[0])) + .1 * Real(node[1]); });
+
+	bool passed = check(grid.writeSnapshot("snapshot_scalar.snap"), "the grid wasn't written");
+
+	{
+		MappedSnapshot snapshot("snapshot_scalar.snap");
+		passed &= check(snapshot.isValid() && snapshot.header().kind == SnapshotSettings::Kind::SCALARGRID &&
+						snapshot.header().blockCount == 1, "the mapped header doesn't describe a scalar grid");
+		passed &= check(snapshot.isValid() && matchesMapping(snapshot, 0, grid), "the mapped block doesn't match the grid");
+	}
+
+	ScalarGrid<Real> readGrid;
+	passed &= check(readGrid.readSnapshot("snapshot_scalar.snap") && isSameGrid(readGrid, grid), "the read grid doesn't match");
+
+	passed &= check(readGrid.writeSnapshot("snapshot_scalar_again.snap") &&
+					readBytes("snapshot_scalar_again.snap") == readBytes("snapshot_scalar.snap"), "writing the read grid gives a different file");
+
+	// Rejected files leave the grid as it was
+	ScalarGrid<Real> untouchedGrid = grid;
+
+	std::vector<char> bytes = readBytes("snapshot_scalar.snap");
+	bytes.resize(bytes.size() - 8);
+	writeBytes("snapshot_scalar_bad.snap", bytes);
+	passed &= check(!untouchedGrid.readSnapshot("snapshot_scalar_bad.snap"), "a truncated file was read");
+
+	writeEditedHeader("snapshot_scalar.snap", "snapshot_scalar_bad.snap", [](SnapshotHeader& header) { header.sampleType = 7; });
+	passed &= check(!untouchedGrid.readSnapshot("snapshot_scalar_bad.snap"), "an unknown sample type was read");
+
+	writeEditedHeader("snapshot_scalar.snap", "snapshot_scalar_bad.snap", [](SnapshotHeader& header) { header.borderType = 9; });
+	passed &= check(!untouchedGrid.readSnapshot("snapshot_scalar_bad.snap"), "an unknown border type was read");
+
+	// A block that doesn't fit the grid it claims to be
+	writeEditedHeader("snapshot_scalar.snap", "snapshot_scalar_bad.snap", [](SnapshotHeader& header) { header.sampleType = uint32_t(ScalarGridSettings::SampleType::CENTER); });
+	passed &= check(!untouchedGrid.readSnapshot("snapshot_scalar_bad.snap"), "a block that doesn't match the sample type was read");
+
+	// Sizes large enough to overflow the block extent
+	writeEditedHeader("snapshot_scalar.snap", "snapshot_scalar_bad.snap", [](SnapshotHeader& header)
+	{
+		header.blockSize[0][0] = header.blockSize[0][1] = 0xFFFFFFFF;
+		header.valueBytes = 0xFFFFFFFF;
+	});
+	passed &= check(!MappedSnapshot("snapshot_scalar_bad.snap").isValid(), "a block extent that overflows was accepted");
+
+	passed &= check(isSameGrid(untouchedGrid, grid), "a rejected file changed the grid");
+
+	return passed;
+}
+
+static bool checkVectorGrid()
+{
+	std::cout << "Vector grid" << std::endl;
+
+	Transform xform(.2, Vec2R(1., -2.));
+	VectorGrid<Real> grid(xform, Vec2ui(11, 14), 0, VectorGridSettings::SampleType::STAGGERED);
+
+	for (unsigned axis : {0, 1})
+		forEachVoxelRange(Vec2ui(0), grid.size(axis), [&](const Vec2ui& face) { grid(face, axis) = Real(axis) + std::cos(Real(face[0] * 3 + face[1])); });
+
+	bool passed = check(grid.writeSnapshot("snapshot_vector.snap"), "the grid wasn't written");
+
+	{
+		MappedSnapshot snapshot("snapshot_vector.snap");
+		passed &= check(snapshot.isValid() && snapshot.header().kind == SnapshotSettings::Kind::VECTORGRID &&
+						snapshot.header().blockCount == 2, "the mapped header doesn't describe a vector grid");
+
+		for (unsigned axis : {0, 1})
+			passed &= check(snapshot.isValid() && matchesMapping(snapshot, axis, grid.grid(axis)), "a mapped block doesn't match the grid");
+	}
+
+	VectorGrid<Real> readGrid;
+	bool isRead = readGrid.readSnapshot("snapshot_vector.snap");
+	passed &= check(isRead && readGrid.sampleType() == grid.sampleType() && isSameGrid(readGrid.grid(0), grid.grid(0)) &&
+					isSameGrid(readGrid.grid(1), grid.grid(1)), "the read grid doesn't match");
+
+	passed &= check(readGrid.writeSnapshot("snapshot_vector_again.snap") &&
+					readBytes("snapshot_vector_again.snap") == readBytes("snapshot_vector.snap"), "writing the read grid gives a different file");
+
+	// Centered samples don't fit the face blocks
+	VectorGrid<Real> untouchedGrid = grid;
+
+	writeEditedHeader("snapshot_vector.snap", "snapshot_vector_bad.snap", [](SnapshotHeader& header) { header.sampleType = uint32_t(VectorGridSettings::SampleType::CENTER); });
+	passed &= check(!untouchedGrid.readSnapshot("snapshot_vector_bad.snap"), "a block that doesn't match the sample type was read");
+
+	writeEditedHeader("snapshot_vector.snap", "snapshot_vector_bad.snap", [](SnapshotHeader& header) { header.sampleType = 3; });
+	passed &= check(!untouchedGrid.readSnapshot("snapshot_vector_bad.snap"), "an unknown sample type was read");
+
+	passed &= check(untouchedGrid.sampleType() == grid.sampleType() && isSameGrid(untouchedGrid.grid(0), grid.grid(0)) &&
+					isSameGrid(untouchedGrid.grid(1), grid.grid(1)), "a rejected file changed the grid");
+
+	return passed;
+}
+
+static bool checkLevelSet()
+{
+	std::cout << "Level set" << std::endl;
+
+	Real dx = .05;
+	Vec2ui size(40, 30);
+	Transform xform(dx, Vec2R(0));
+
+	LevelSet2D surface(xform, size, 5);
+	surface.setInverted();
+	surface.init(circleMesh(.5 * dx * Vec2R(size), .4, 40), false);
+
+	bool passed = check(surface.writeSnapshot("snapshot_surface.snap"), "the surface wasn't written");
+
+	LevelSet2D readSurface;
+	bool isRead = readSurface.readSnapshot("snapshot_surface.snap");
+	passed &= check(isRead && readSurface.narrowBand() == surface.narrowBand() && readSurface.inverted() == surface.inverted() &&
+					readSurface.xform() == surface.xform() && readSurface.size() == surface.size(), "the read surface settings don't match");
+
+	bool samplesMatch = isRead;
+	forEachVoxelRange(Vec2ui(0), size, [&](const Vec2ui& cell)
+	{
+		if (isRead && readSurface(cell) != surface(cell)) samplesMatch = false;
+	});
+	passed &= check(samplesMatch, "the read surface doesn't match");
+
+	passed &= check(readSurface.writeSnapshot("snapshot_surface_again.snap") &&
+					readBytes("snapshot_surface_again.snap") == readBytes("snapshot_surface.snap"), "writing the read surface gives a different file");
+
+	return passed;
+}
+
+static bool checkParticles()
+{
+	std::cout << "Particles" << std::endl;
+
+	Real dx = .05;
+	Vec2ui size(40, 30);
+	Transform xform(dx, Vec2R(0));
+
+	LevelSet2D surface(xform, size, 5);
+	surface.init(circleMesh(.5 * dx * Vec2R(size), .5, 40), false);
+
+	VectorGrid<Real> velocity(xform, size, 0, VectorGridSettings::SampleType::STAGGERED);
+	for (unsigned axis : {0, 1})
+		forEachVoxelRange(Vec2ui(0), velocity.size(axis), [&](const Vec2ui& face) { velocity(face, axis) = Real(face[axis]) - Real(face[1 - axis]); });
+
+	FluidParticles particles(.5 * dx, 4, 1., true);
+	particles.init(surface);
+	particles.setVelocity(velocity);
+
+	bool passed = check(particles.particleCount() > 0, "no particles were seeded");
+	passed &= check(particles.writeSnapshot("snapshot_particles.snap"), "the particles weren't written");
+
+	{
+		MappedSnapshot snapshot("snapshot_particles.snap");
+		passed &= check(snapshot.isValid() && snapshot.header().blockCount == 2 &&
+						snapshot.blockSize(0) == Vec2ui(particles.particleCount(), 1) &&
+						std::memcmp(snapshot.block<Vec2R>(0), particles.getPositions().data(), snapshot.blockBytes(0)) == 0,
+						"the mapped positions don't match the particles");
+	}
+
+	FluidParticles readParticles;
+	bool isRead = readParticles.readSnapshot("snapshot_particles.snap");
+	passed &= check(isRead && readParticles.getPositions() == particles.getPositions(), "the read positions don't match");
+
+	// The velocities aren't exposed so they're compared through a second write
+	passed &= check(readParticles.writeSnapshot("snapshot_particles_again.snap") &&
+					readBytes("snapshot_particles_again.snap") == readBytes("snapshot_particles.snap"), "writing the read particles gives a different file");
+
+	// Fewer velocities than positions
+	writeEditedHeader("snapshot_particles.snap", "snapshot_particles_bad.snap", [](SnapshotHeader& header) { --header.blockSize[1][0]; });
+
+	FluidParticles untouchedParticles = readParticles;
+	passed &= check(!untouchedParticles.readSnapshot("snapshot_particles_bad.snap"), "a velocity count that doesn't match was read");
+	passed &= check(untouchedParticles.getPositions() == particles.getPositions(), "a rejected file changed the particles");
+
+	return passed;
+}
+
+int main()
+{
+	bool passed = checkScalarGrid();
+	passed = checkVectorGrid() && passed;
+	passed = checkLevelSet() && passed;
+	passed = checkParticles() && passed;
+
+	for (const char* filename : { "snapshot_scalar.snap", "snapshot_scalar_again.snap", "snapshot_scalar_bad.snap",
+									"snapshot_vector.snap", "snapshot_vector_again.snap", "snapshot_vector_bad.snap",
+									"snapshot_surface.snap", "snapshot_surface_again.snap",
+									"snapshot_particles.snap", "snapshot_particles_again.snap", "snapshot_particles_bad.snap" })
+		std::remove(filename);
+
+	if (!passed)
+	{
+		std::cout << "Failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "Passed" << std::endl;
+	return 0;
+}
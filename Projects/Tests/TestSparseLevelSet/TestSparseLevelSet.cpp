@@ -0,0 +1,153 @@
+#include <iostream>
+#include <string>
+
+#include "Common.h"
+#include "InitialConditions.h"
+#include "LevelSet2D.h"
+#include "SparseLevelSet2D.h"
+#include "Transform.h"
+
+// Checks that SparseLevelSet2D stores and loads a level set exactly, that it only
+// keeps samples for tiles that aren't uniform and that its lookups and
+// interpolation match the dense LevelSet2D bit for bit. The grid isn't a
+// multiple of the tile size so the tiles along the top and right hang off the
+// edge. Returns non-zero on failure so it can run under CTest.
+
+static constexpr unsigned TILESIZE = 8;
+
+static bool check(bool condition, const std::string& message)
+{
+	if (!condition)
+		std::cout << "  " << message << std::endl;
+
+	return condition;
+}
+
+static bool isSameSurface(const LevelSet2D& surface, const LevelSet2D& expected)
+{
+	if (!(surface.size() == expected.size()) || surface.narrowBand() != expected.narrowBand() ||
+		surface.inverted() != expected.inverted())
+		return false;
+
+	for (unsigned i = 0; i < expected.size()[0]; ++i)
+		for (unsigned j = 0; j < expected.size()[1]; ++j)
+		{
+			if (surface(i, j) != expected(i, j))
+				return false;
+		}
+
+	return true;
+}
+
+// Tiles whose samples are all the same value in the dense surface
+static unsigned countUniformTiles(const LevelSet2D& surface)
+{
+	Vec2ui size = surface.size();
+	Vec2ui tiles((size[0] + TILESIZE - 1) / TILESIZE, (size[1] + TILESIZE - 1) / TILESIZE);
+
+	unsigned uniformTiles = 0;
+
+	for (unsigned tileI = 0; tileI < tiles[0]; ++tileI)
+		for (unsigned tileJ = 0; tileJ < tiles[1]; ++tileJ)
+		{
+			Real value = surface(tileI * TILESIZE, tileJ * TILESIZE);
+			bool isUniform = true;
+
+			for (unsigned i = tileI * TILESIZE; i < std::min((tileI + 1) * TILESIZE, size[0]); ++i)
+				for (unsigned j = tileJ * TILESIZE; j < std::min((tileJ + 1) * TILESIZE, size[1]); ++j)
+				{
+					if (surface(i, j) != value)
+						isUniform = false;
+				}
+
+			if (isUniform) ++uniformTiles;
+		}
+
+	return uniformTiles;
+}
+
+static bool checkSurface(const std::string& name, const LevelSet2D& surface)
+{
+	std::cout << name << std::endl;
+
+	SparseLevelSet2D sparseSurface(surface.xform(), surface.size(), unsigned(surface.narrowBand()), surface.inverted());
+
+	bool passed = check(sparseSurface.storedTileCount() == 0, "a fresh level set stores tiles");
+
+	sparseSurface.store(surface);
+
+	// Load into a level set that doesn't match so it has to be rebuilt
+	LevelSet2D loadedSurface;
+	sparseSurface.load(loadedSurface);
+	passed &= check(isSameSurface(loadedSurface, surface), "a loaded surface doesn't match the stored one");
+
+	// Loading again reuses the storage and must overwrite every sample
+	forEachVoxelRange(Vec2ui(0), loadedSurface.size(), [&](const Vec2ui& cell) { loadedSurface(cell) = 0; });
+	sparseSurface.load(loadedSurface);
+	passed &= check(isSameSurface(loadedSurface, surface), "loading into a matched surface doesn't match the stored one");
+
+	unsigned uniformTiles = countUniformTiles(surface);
+	passed &= check(uniformTiles > 0 && sparseSurface.storedTileCount() < sparseSurface.tileCount(), "no tiles were collapsed");
+	passed &= check(sparseSurface.tileCount() - sparseSurface.storedTileCount() == uniformTiles,
+					"the collapsed tiles aren't the uniform ones");
+
+	bool samplesMatch = true;
+	forEachVoxelRange(Vec2ui(0), surface.size(), [&](const Vec2ui& cell)
+	{
+		if (sparseSurface(cell) != surface(cell)) samplesMatch = false;
+	});
+	passed &= check(samplesMatch, "sample lookups don't match the dense surface");
+
+	// Points on a finer lattice that runs a couple of cells past the grid on every side so the
+	// clamping at the border is covered too
+	bool interpolationMatches = true;
+	Real dx = surface.dx();
+	Vec2R origin = surface.indexToWorld(Vec2R(-2.5));
+	Vec2ui pointCount = 3 * (surface.size() + Vec2ui(5));
+
+	for (unsigned i = 0; i < pointCount[0]; ++i)
+		for (unsigned j = 0; j < pointCount[1]; ++j)
+		{
+			Vec2R worldPoint = origin + dx * Vec2R(Real(i) / 3. + .01, Real(j) / 3. + .02);
+			if (sparseSurface.interp(worldPoint) != surface.interp(worldPoint))
+				interpolationMatches = false;
+		}
+
+	passed &= check(interpolationMatches, "interpolation doesn't match the dense surface");
+
+	std::cout << "  Stored " << sparseSurface.storedTileCount() << " of " << sparseSurface.tileCount() << " tiles" << std::endl;
+
+	return passed;
+}
+
+int main()
+{
+	Real dx = .05;
+	Vec2ui size(45, 37);
+	Transform xform(dx, Vec2R(0));
+	Vec2R center = .5 * dx * Vec2R(size);
+
+	Mesh2D circle = circleMesh(center, .5, 40);
+
+	LevelSet2D circleSurface(xform, size, 5);
+	circleSurface.init(circle, false);
+
+	Mesh2D box = squareMesh(center, .5 * dx * Vec2R(size - Vec2ui(6)));
+	box.reverse();
+
+	LevelSet2D boxSurface(xform, size, 5);
+	boxSurface.setInverted();
+	boxSurface.init(box, false);
+
+	bool passed = checkSurface("Circle", circleSurface);
+	passed = checkSurface("Inverted box", boxSurface) && passed;
+
+	if (!passed)
+	{
+		std::cout << "Failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "Passed" << std::endl;
+	return 0;
+}
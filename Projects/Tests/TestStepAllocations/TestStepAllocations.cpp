@@ -0,0 +1,89 @@
+// Replaces the global operator new in this executable so every heap allocation
+// made by the library is counted. Defined before any include so it's set wherever
+// HeapAllocations.h is first pulled in.
+#define COUNT_HEAP_ALLOCATIONS
+
+#include <iostream>
+
+#include "Common.h"
+#include "EulerianLiquid.h"
+#include "HeapAllocations.h"
+#include "InitialConditions.h"
+#include "LevelSet2D.h"
+#include "Renderer.h"
+#include "Transform.h"
+
+// Drops a circle of liquid inside a circular container and checks that, once
+// the splash has settled and the workspace buffers have grown to fit it, a
+// timestep makes no heap allocations at all. Runs with and without viscosity.
+// Returns non-zero on failure so it can run under CTest.
+
+static constexpr unsigned WARMUPSTEPS = 100;
+static constexpr unsigned CHECKEDSTEPS = 100;
+
+static bool runScene(bool solveViscosity)
+{
+	Vec2R topRightCorner(2.5);
+	Vec2R bottomLeftCorner(-2.5);
+	Real dx = 5. / 64.;
+	Vec2ui gridSize((topRightCorner - bottomLeftCorner) / dx);
+	Transform xform(dx, bottomLeftCorner);
+	Vec2R center = .5 * (topRightCorner + bottomLeftCorner);
+
+	Mesh2D liquidMesh = circleMesh(center - Vec2R(0, .65), 1, 40);
+	Mesh2D solidMesh = circleMesh(center, 2, 40);
+	solidMesh.reverse();
+
+	LevelSet2D liquidSurface(xform, gridSize, 10);
+	liquidSurface.init(liquidMesh, false);
+
+	LevelSet2D solidSurface(xform, gridSize, 10);
+	solidSurface.setInverted();
+	solidSurface.init(solidMesh, false);
+
+	EulerianLiquid simulator(xform, gridSize, 10);
+	simulator.unionLiquidSurface(liquidSurface);
+	simulator.setSolidSurface(solidSurface);
+	if (solveViscosity) simulator.setViscosity(1.);
+
+	Renderer renderer(Vec2ui(10), bottomLeftCorner, topRightCorner[1] - bottomLeftCorner[1]);
+
+	Real dt = 1. / 60.;
+	bool passed = true;
+
+	for (unsigned step = 0; step < WARMUPSTEPS + CHECKEDSTEPS; ++step)
+	{
+		simulator.addForce(dt, Vec2R(0, -9.8));
+		simulator.runTimestep(dt, renderer);
+
+		if (step >= WARMUPSTEPS && simulator.stepHeapAllocations() > 0)
+		{
+			std::cout << (solveViscosity ? "Viscous" : "Inviscid") << " step " << step << " made "
+				<< simulator.stepHeapAllocations() << " heap allocations" << std::endl;
+			passed = false;
+		}
+	}
+
+	return passed;
+}
+
+int main()
+{
+	if (!isCountingHeapAllocations())
+	{
+		std::cout << "Heap allocations are not being counted" << std::endl;
+		return 1;
+	}
+
+	bool passed = runScene(false);
+	passed = runScene(true) && passed;
+
+	if (!passed)
+	{
+		std::cout << "Failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << "Passed" << std::endl;
+	return 0;
+}